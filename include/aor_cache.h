@@ -0,0 +1,125 @@
+/**
+ * @file aor_cache.h In-process cache of AoR records read from the store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef AOR_CACHE_H__
+#define AOR_CACHE_H__
+
+#include <stdint.h>
+#include <string>
+
+#include "sharded_lru_cache.h"
+#include "statistic.h"
+#include "counter.h"
+
+/// Sharded LRU cache of serialized AoR records, keyed by AoR ID and stamped
+/// with the CAS value the record had in the store.
+///
+/// Read-only lookups can be served from the cache for a short staleness
+/// window after the record was last read or written by this node, without
+/// going to the store.  After the window the record is read from the store
+/// again, and comparing its CAS with the cached CAS shows whether the
+/// cached copy had gone stale - the proportion of stale records is exported
+/// as a statistic to help tune the window.
+///
+/// The records are held in a ShardedLRUCache, so lookups for different AoRs
+/// rarely contend.
+class AoRCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param stat_prefix  - Prefix for the names of the statistics, to
+  ///                       distinguish caches for different stores.
+  /// @param max_entries  - Maximum number of records held.
+  /// @param staleness_ms - Time for which a record may be served from the
+  ///                       cache without reading it from the store.
+  /// @param lvc          - Statistics aggregator.
+  /// @param num_shards   - Number of independently locked shards.
+  AoRCache(const std::string& stat_prefix,
+           int max_entries,
+           int staleness_ms,
+           LastValueCache* lvc,
+           int num_shards = DEFAULT_NUM_SHARDS);
+
+  /// Look up a record.  Returns true if the cache holds a record for the
+  /// AoR that is within the staleness window.
+  bool get(const std::string& aor_id, std::string& data, uint64_t& cas);
+
+  /// Record data just read from the store.
+  void put_read(const std::string& aor_id,
+                const std::string& data,
+                uint64_t cas);
+
+  /// Record data just written to the store by this node.  The store does
+  /// not return the new CAS, so it is recorded as unknown.
+  void put_write(const std::string& aor_id, const std::string& data);
+
+  /// Remove any record for the AoR.
+  void invalidate(const std::string& aor_id);
+
+  /// Number of records held.
+  inline int size() { return _cache.size(); }
+
+  inline int staleness_ms() const { return _staleness_ms; }
+
+  static const int DEFAULT_NUM_SHARDS = 16;
+
+  /// CAS recorded for data written by this node.
+  static const uint64_t UNKNOWN_CAS = 0;
+
+private:
+  struct Record
+  {
+    std::string data;
+    uint64_t cas;
+  };
+
+  void put(const std::string& aor_id,
+           const std::string& data,
+           uint64_t cas,
+           bool from_read);
+
+  const int _staleness_ms;
+  ShardedLRUCache<Record> _cache;
+
+  // Statistics
+  StatisticCounter _hits_counter;
+  StatisticCounter _misses_counter;
+  StatisticCounter _revalidated_counter;
+  StatisticCounter _stale_counter;
+};
+
+#endif
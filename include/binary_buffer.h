@@ -0,0 +1,234 @@
+/**
+ * @file binary_buffer.h Compact binary encoding of integers and strings.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BINARY_BUFFER_H__
+#define BINARY_BUFFER_H__
+
+#include <stdint.h>
+#include <string>
+
+/// Appends values to a string in a compact binary encoding.
+///
+/// Unsigned integers are written as base-128 varints (least significant
+/// group first, with the top bit of each byte set if more bytes follow).
+/// Signed integers are zig-zag encoded first, so small negative values stay
+/// short.  Strings are written as a varint length followed by the bytes.
+///
+/// The caller should reserve space in the string up front so that encoding
+/// does not reallocate.
+class BinaryWriter
+{
+public:
+  BinaryWriter(std::string& buf) : _buf(buf) {}
+
+  inline void write_byte(uint8_t value)
+  {
+    _buf.push_back((char)value);
+  }
+
+  inline void write_bytes(const char* data, size_t len)
+  {
+    _buf.append(data, len);
+  }
+
+  inline void write_uint(uint64_t value)
+  {
+    char tmp[10];
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+      tmp[len++] = (char)((value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+    tmp[len++] = (char)value;
+    _buf.append(tmp, len);
+  }
+
+  inline void write_int(int64_t value)
+  {
+    write_uint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+  }
+
+  inline void write_string(const std::string& value)
+  {
+    write_uint(value.size());
+    _buf.append(value);
+  }
+
+  /// Upper bound on the encoded size of a string.
+  static inline size_t string_size(const std::string& value)
+  {
+    return value.size() + 5;
+  }
+
+  /// Upper bound on the encoded size of a 32-bit integer.
+  static const size_t INT_SIZE = 5;
+
+private:
+  std::string& _buf;
+};
+
+/// Reads values written by BinaryWriter from a buffer, in a single pass.
+///
+/// Reads past the end of the buffer, or of overlong values, fail and leave
+/// the reader in an error state, in which all further reads also fail.
+class BinaryReader
+{
+public:
+  BinaryReader(const char* data, size_t len) :
+    _pos(data),
+    _end(data + len),
+    _ok(true)
+  {
+  }
+
+  BinaryReader(const std::string& buf) :
+    _pos(buf.data()),
+    _end(buf.data() + buf.size()),
+    _ok(true)
+  {
+  }
+
+  /// Whether all reads so far have succeeded.
+  inline bool ok() const { return _ok; }
+
+  /// Number of bytes not yet read.
+  inline size_t remaining() const { return _ok ? (_end - _pos) : 0; }
+
+  inline bool read_byte(uint8_t& value)
+  {
+    if ((!_ok) || (_pos >= _end))
+    {
+      return fail();
+    }
+    value = (uint8_t)*_pos++;
+    return true;
+  }
+
+  inline bool read_uint(uint64_t& value)
+  {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      uint8_t byte;
+      if (!read_byte(byte))
+      {
+        return false;
+      }
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+      {
+        return true;
+      }
+    }
+    return fail();
+  }
+
+  inline bool read_int(int64_t& value)
+  {
+    uint64_t zigzag;
+    if (!read_uint(zigzag))
+    {
+      return false;
+    }
+    value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    return true;
+  }
+
+  /// Read a signed integer that must fit in an int.
+  inline bool read_int(int& value)
+  {
+    int64_t wide;
+    if ((!read_int(wide)) || (wide != (int)wide))
+    {
+      return fail();
+    }
+    value = (int)wide;
+    return true;
+  }
+
+  inline bool read_string(std::string& value)
+  {
+    uint64_t len;
+    if ((!read_uint(len)) || (len > (uint64_t)(_end - _pos)))
+    {
+      return fail();
+    }
+    value.assign(_pos, len);
+    _pos += len;
+    return true;
+  }
+
+  /// Read the number of elements in a list.  Every element takes at least
+  /// one byte, so counts larger than the rest of the buffer are rejected
+  /// before the caller allocates space for them.
+  inline bool read_count(uint64_t& count)
+  {
+    if ((!read_uint(count)) || (count > remaining()))
+    {
+      return fail();
+    }
+    return true;
+  }
+
+  /// Read a string without copying it.  The returned data points into the
+  /// buffer being read.
+  inline bool read_string(const char*& data, size_t& len)
+  {
+    uint64_t len64;
+    if ((!read_uint(len64)) || (len64 > (uint64_t)(_end - _pos)))
+    {
+      return fail();
+    }
+    data = _pos;
+    len = (size_t)len64;
+    _pos += len;
+    return true;
+  }
+
+private:
+  inline bool fail()
+  {
+    _ok = false;
+    return false;
+  }
+
+  const char* _pos;
+  const char* _end;
+  bool _ok;
+};
+
+#endif
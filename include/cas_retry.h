@@ -0,0 +1,136 @@
+/**
+ * @file cas_retry.h Retry policy and statistics for CAS updates.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CAS_RETRY_H__
+#define CAS_RETRY_H__
+
+#include <string>
+
+#include "statistic.h"
+#include "counter.h"
+#include "latency_histogram.h"
+
+/// Retry policy and statistics for a call site that updates a store record
+/// with a read-modify-write loop, retrying when the write fails because the
+/// record has been changed by someone else (a CAS failure).
+///
+/// Retrying in a tight loop lets a burst of updates to a busy record keep
+/// colliding, and with no limit a worker thread can spin indefinitely under
+/// contention.  Instead each retry waits for a random period up to an
+/// exponentially growing limit (capped at a configured maximum), and the
+/// update gives up after a configured number of retries so that the request
+/// can be rejected.
+///
+/// Usage, where update() is the read-modify-write:
+///
+///   CasRetry::Update retry(cas_retry);
+///   while ((!update()) && (retry.retry()));
+///   if (retry.exhausted()) { ... reject the request ... }
+///
+/// Only retry on a CAS failure - a failure to access the store isn't fixed
+/// by retrying, and should be reported as an error rather than contention.
+///
+/// The following statistics are reported for each call site:
+///
+/// -  <prefix>_cas_retries - histogram of the number of retries per update
+/// -  <prefix>_cas_conflicts - number of failed writes
+/// -  <prefix>_cas_exhausted - number of updates that ran out of retries.
+class CasRetry
+{
+public:
+  /// Constructor.
+  ///
+  /// @param stat_prefix    - Prefix for the statistics, naming the call site.
+  /// @param lvc            - Statistics aggregator.
+  /// @param max_retries    - Maximum number of retries for an update.
+  /// @param max_backoff_ms - Maximum time to wait before a retry.  Zero
+  ///                         retries immediately.
+  CasRetry(const std::string& stat_prefix,
+           LastValueCache* lvc,
+           int max_retries,
+           int max_backoff_ms);
+
+  /// Tracks the retries of a single update, recording them in the
+  /// statistics when it is destroyed.
+  class Update
+  {
+  public:
+    Update(CasRetry* cas_retry);
+    ~Update();
+
+    /// Called when a write fails.  Waits before the next attempt and returns
+    /// true, or returns false if the update has run out of retries.
+    bool retry();
+
+    /// Whether the update ran out of retries.
+    inline bool exhausted() const { return _exhausted; }
+
+    /// Number of retries so far.
+    inline int retries() const { return _retries; }
+
+  private:
+    CasRetry* _cas_retry;
+    int _retries;
+    bool _exhausted;
+  };
+
+  /// The longest time to wait before the specified retry (counting from
+  /// one), in microseconds.  The actual wait is a random time up to this.
+  int backoff_limit_us(int retry) const;
+
+  inline int max_retries() const { return _max_retries; }
+
+  /// The Retry-After value, in seconds, to send when rejecting a request
+  /// because its update ran out of retries.  This is the longest time an
+  /// update can spend backing off, rounded up to a whole number of seconds,
+  /// and is always at least one second so that the client doesn't retry
+  /// straight into the same contention.
+  int retry_after_secs() const;
+
+  /// The limit on the wait before the first retry.  This doubles for each
+  /// subsequent retry, up to the configured maximum.
+  static const int INITIAL_BACKOFF_US = 1000;
+
+private:
+  const int _max_retries;
+  const int _max_backoff_us;
+
+  StatisticHistogram _retries_histogram;
+  StatisticCounter _conflicts_counter;
+  StatisticCounter _exhausted_counter;
+};
+
+#endif
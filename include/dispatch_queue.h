@@ -0,0 +1,521 @@
+/**
+ * @file dispatch_queue.h Sharded priority queue used to dispatch received
+ * messages to worker threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef DISPATCH_QUEUE_H__
+#define DISPATCH_QUEUE_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include <vector>
+#include <deque>
+#include <atomic>
+
+/// Queue used to pass work from the transport threads to the worker threads.
+///
+/// The queue is split into a number of shards.  Producers pick the shard
+/// for each item (typically from a hash of the Call-ID, so that all the
+/// messages for a dialog are handled by the same worker) and each consumer
+/// services its own shard, so producers and consumers only contend with the
+/// other threads using the same shard.  If work stealing is enabled, a
+/// consumer that finds its own shard empty takes the oldest item from the
+/// shard of a busy consumer, so a single hot dialog cannot stall the
+/// messages queued behind it.
+///
+/// Each shard is further divided into priority lanes, with lane 0 the
+/// highest priority.  By default consumers drain the lanes in strict
+/// priority order.  If lane weights are given, consumers instead take up to
+/// weight[n] items from lane n in each round, so lower priority lanes are
+/// never starved completely.  Within a lane items are handled in FIFO order.
+///
+/// A queue with a single shard and a single lane behaves as a simple shared
+/// FIFO queue.
+///
+/// The queue may be given a maximum size (across all shards and lanes).
+/// Producers can then either fail immediately if the queue is full
+/// (push_noblock) or wait a bounded time for space (push with a timeout).
+/// The maximum is a soft limit - the plain push method always queues the
+/// item.
+template<class T>
+class DispatchQueue
+{
+public:
+  DispatchQueue(unsigned int num_shards = 1,
+                bool work_stealing = false,
+                int max_size = 0,
+                unsigned int num_lanes = 1,
+                const std::vector<int>& lane_weights = std::vector<int>(),
+                int steal_poll_ms = DEFAULT_STEAL_POLL_MS) :
+    _shards(),
+    _work_stealing(work_stealing && (num_shards > 1)),
+    _steal_poll_ms(steal_poll_ms),
+    _max_size(max_size),
+    _num_lanes((num_lanes > 0) ? num_lanes : 1),
+    _lane_weights(),
+    _size(0),
+    _space_waiters(0),
+    _terminated(false)
+  {
+    if (num_shards == 0)
+    {
+      num_shards = 1;
+    }
+
+    // Weights are only used if there is one for every lane, and they are all
+    // positive.  Otherwise the lanes are drained in strict priority order.
+    if (lane_weights.size() == _num_lanes)
+    {
+      _lane_weights = lane_weights;
+      for (unsigned int ii = 0; ii < _num_lanes; ++ii)
+      {
+        if (_lane_weights[ii] <= 0)
+        {
+          _lane_weights.clear();
+          break;
+        }
+      }
+    }
+
+    for (unsigned int ii = 0; ii < num_shards; ++ii)
+    {
+      _shards.push_back(new Shard(_num_lanes, _lane_weights));
+    }
+
+    _lane_sizes = new std::atomic<int>[_num_lanes];
+    for (unsigned int ii = 0; ii < _num_lanes; ++ii)
+    {
+      _lane_sizes[ii] = 0;
+    }
+
+    pthread_mutex_init(&_space_lock, NULL);
+    pthread_cond_init(&_space_cond, NULL);
+  }
+
+  ~DispatchQueue()
+  {
+    for (typename std::vector<Shard*>::iterator i = _shards.begin();
+         i != _shards.end();
+         ++i)
+    {
+      delete *i;
+    }
+
+    delete[] _lane_sizes;
+
+    pthread_cond_destroy(&_space_cond);
+    pthread_mutex_destroy(&_space_lock);
+  }
+
+  /// Number of shards in the queue.
+  inline unsigned int num_shards() const { return _shards.size(); }
+
+  /// Number of priority lanes in each shard.
+  inline unsigned int num_lanes() const { return _num_lanes; }
+
+  /// Whether the lanes are drained by weight rather than in strict priority
+  /// order.
+  inline bool weighted() const { return !_lane_weights.empty(); }
+
+  /// Total number of items queued across all shards.
+  inline int size() const { return _size.load(); }
+
+  /// Number of items queued on the specified lane across all shards.
+  inline int lane_size(unsigned int lane) const
+  {
+    return _lane_sizes[lane_index(lane)].load();
+  }
+
+  /// Maximum number of items that may be queued, or zero if the queue is
+  /// unbounded.
+  inline int max_size() const { return _max_size; }
+
+  /// Whether the queue has reached its maximum size.
+  inline bool full() const
+  {
+    return (_max_size > 0) && (_size.load() >= _max_size);
+  }
+
+  /// Number of items queued on the specified shard.
+  int shard_size(unsigned int shard)
+  {
+    Shard* s = _shards[shard % _shards.size()];
+    pthread_mutex_lock(&s->lock);
+    int size = s->count;
+    pthread_mutex_unlock(&s->lock);
+    return size;
+  }
+
+  /// Push an item on to the specified lane of the specified shard.  The
+  /// shard index is reduced modulo the number of shards, so callers can pass
+  /// a hash directly.  Lanes beyond the last are treated as the last
+  /// (lowest priority) lane.
+  void push(unsigned int shard, unsigned int lane, const T& item)
+  {
+    unsigned int index = shard % _shards.size();
+    Shard* s = _shards[index];
+    lane = lane_index(lane);
+
+    pthread_mutex_lock(&s->lock);
+    s->lanes[lane].push_back(item);
+    ++s->count;
+    ++_size;
+    ++_lane_sizes[lane];
+    bool owner_waiting = s->waiting;
+    bool backlogged = (s->count > 1);
+    pthread_mutex_unlock(&s->lock);
+
+    if (owner_waiting)
+    {
+      pthread_cond_signal(&s->cond);
+    }
+    else if ((_work_stealing) && (backlogged))
+    {
+      // The owner of this shard is busy and work is building up behind it,
+      // so wake an idle consumer (if there is one) to steal it.
+      wake_idle_consumer(index);
+    }
+  }
+
+  /// Push an item on to the specified shard and lane if the queue has space.
+  /// Returns false (without queuing the item) if the queue is full.
+  bool push_noblock(unsigned int shard, unsigned int lane, const T& item)
+  {
+    if (full())
+    {
+      return false;
+    }
+
+    push(shard, lane, item);
+    return true;
+  }
+
+  /// Push an item on to the specified shard and lane, waiting up to
+  /// timeout_ms for space if the queue is full.  Returns false (without
+  /// queuing the item) if the queue is still full after the timeout, or has
+  /// been terminated.
+  bool push(unsigned int shard, unsigned int lane, const T& item, int timeout_ms)
+  {
+    if (full())
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += timeout_ms / 1000;
+      ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec = ts.tv_nsec % 1000000000L;
+
+      pthread_mutex_lock(&_space_lock);
+      ++_space_waiters;
+      int rc = 0;
+      while ((full()) && (!_terminated) && (rc != ETIMEDOUT))
+      {
+        rc = pthread_cond_timedwait(&_space_cond, &_space_lock, &ts);
+      }
+      --_space_waiters;
+      pthread_mutex_unlock(&_space_lock);
+
+      if ((full()) || (_terminated))
+      {
+        return false;
+      }
+    }
+
+    push(shard, lane, item);
+    return true;
+  }
+
+  /// Pop an item for the consumer of the specified shard, blocking until
+  /// one is available.  Returns false if the queue has been terminated.
+  bool pop(unsigned int shard, T& item)
+  {
+    unsigned int index = shard % _shards.size();
+    Shard* s = _shards[index];
+
+    while (true)
+    {
+      pthread_mutex_lock(&s->lock);
+
+      if (_terminated)
+      {
+        pthread_mutex_unlock(&s->lock);
+        return false;
+      }
+
+      if (s->count > 0)
+      {
+        take(s, item);
+        pthread_mutex_unlock(&s->lock);
+        space_available();
+        return true;
+      }
+
+      pthread_mutex_unlock(&s->lock);
+
+      if ((_work_stealing) && (steal(index, item)))
+      {
+        space_available();
+        return true;
+      }
+
+      pthread_mutex_lock(&s->lock);
+      if ((s->count == 0) && (!_terminated))
+      {
+        s->waiting = true;
+        if (_work_stealing)
+        {
+          // Producers wake idle consumers when they see a backlog, but poll
+          // as well in case a wake-up raced with us going idle.
+          struct timespec ts;
+          clock_gettime(CLOCK_REALTIME, &ts);
+          ts.tv_nsec += (long)_steal_poll_ms * 1000000L;
+          ts.tv_sec += ts.tv_nsec / 1000000000L;
+          ts.tv_nsec = ts.tv_nsec % 1000000000L;
+          pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+        }
+        else
+        {
+          pthread_cond_wait(&s->cond, &s->lock);
+        }
+        s->waiting = false;
+      }
+      pthread_mutex_unlock(&s->lock);
+    }
+  }
+
+  /// Terminate the queue, waking all consumers.  Subsequent calls to pop
+  /// return false.
+  void terminate()
+  {
+    for (typename std::vector<Shard*>::iterator i = _shards.begin();
+         i != _shards.end();
+         ++i)
+    {
+      pthread_mutex_lock(&(*i)->lock);
+    }
+
+    _terminated = true;
+
+    for (typename std::vector<Shard*>::iterator i = _shards.begin();
+         i != _shards.end();
+         ++i)
+    {
+      pthread_cond_broadcast(&(*i)->cond);
+      pthread_mutex_unlock(&(*i)->lock);
+    }
+
+    // Release any producers waiting for space.
+    pthread_mutex_lock(&_space_lock);
+    pthread_cond_broadcast(&_space_cond);
+    pthread_mutex_unlock(&_space_lock);
+  }
+
+  static const int DEFAULT_STEAL_POLL_MS = 10;
+
+private:
+  struct Shard
+  {
+    Shard(unsigned int num_lanes, const std::vector<int>& weights) :
+      lanes(num_lanes),
+      credits(weights),
+      count(0),
+      waiting(false)
+    {
+      pthread_mutex_init(&lock, NULL);
+      pthread_cond_init(&cond, NULL);
+    }
+
+    ~Shard()
+    {
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&lock);
+    }
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<std::deque<T> > lanes;
+
+    /// Items left to take from each lane in the current round when the
+    /// lanes are weighted.  Empty if the lanes are drained in strict order.
+    std::vector<int> credits;
+
+    /// Total number of items on all the lanes.
+    int count;
+
+    /// Whether the consumer for this shard is blocked waiting for work.
+    /// Protected by the shard lock.
+    bool waiting;
+  };
+
+  inline unsigned int lane_index(unsigned int lane) const
+  {
+    return (lane < _num_lanes) ? lane : _num_lanes - 1;
+  }
+
+  /// Take the next item from a non-empty shard.  Must be called with the
+  /// shard lock held.
+  void take(Shard* s, T& item)
+  {
+    unsigned int lane = 0;
+
+    if (s->credits.empty())
+    {
+      // Strict priority, so take from the highest priority non-empty lane.
+      while (s->lanes[lane].empty())
+      {
+        ++lane;
+      }
+    }
+    else
+    {
+      // Take from the highest priority non-empty lane with credit left in
+      // this round.  If there isn't one, start a new round.
+      while ((lane < _num_lanes) &&
+             ((s->lanes[lane].empty()) || (s->credits[lane] <= 0)))
+      {
+        ++lane;
+      }
+
+      if (lane == _num_lanes)
+      {
+        s->credits = _lane_weights;
+        lane = 0;
+        while (s->lanes[lane].empty())
+        {
+          ++lane;
+        }
+      }
+
+      --s->credits[lane];
+    }
+
+    item = s->lanes[lane].front();
+    s->lanes[lane].pop_front();
+    --s->count;
+    --_size;
+    --_lane_sizes[lane];
+  }
+
+  /// Try to take the oldest item from the shard of another consumer.  Only
+  /// shards whose consumer is busy are eligible - an idle consumer will be
+  /// woken to process its own work.
+  bool steal(unsigned int thief, T& item)
+  {
+    unsigned int num_shards = _shards.size();
+
+    for (unsigned int ii = 1; ii < num_shards; ++ii)
+    {
+      Shard* victim = _shards[(thief + ii) % num_shards];
+
+      if (pthread_mutex_trylock(&victim->lock) != 0)
+      {
+        // Someone else is using this shard, so don't wait for it.
+        continue;
+      }
+
+      if ((!victim->waiting) && (victim->count > 0))
+      {
+        take(victim, item);
+        pthread_mutex_unlock(&victim->lock);
+        return true;
+      }
+
+      pthread_mutex_unlock(&victim->lock);
+    }
+
+    return false;
+  }
+
+  /// Called after an item has been removed from the queue to wake a
+  /// producer waiting for space.  This is a no-op unless the queue is
+  /// bounded and a producer is waiting.
+  void space_available()
+  {
+    if ((_space_waiters.load() > 0) && (!full()))
+    {
+      pthread_mutex_lock(&_space_lock);
+      pthread_cond_signal(&_space_cond);
+      pthread_mutex_unlock(&_space_lock);
+    }
+  }
+
+  /// Wake a consumer that is waiting for work, other than the consumer of
+  /// the specified shard.
+  void wake_idle_consumer(unsigned int busy)
+  {
+    unsigned int num_shards = _shards.size();
+
+    for (unsigned int ii = 1; ii < num_shards; ++ii)
+    {
+      Shard* s = _shards[(busy + ii) % num_shards];
+
+      if (pthread_mutex_trylock(&s->lock) != 0)
+      {
+        continue;
+      }
+
+      bool waiting = s->waiting;
+      pthread_mutex_unlock(&s->lock);
+
+      if (waiting)
+      {
+        pthread_cond_signal(&s->cond);
+        break;
+      }
+    }
+  }
+
+  std::vector<Shard*> _shards;
+  const bool _work_stealing;
+  const int _steal_poll_ms;
+  const int _max_size;
+  const unsigned int _num_lanes;
+  std::vector<int> _lane_weights;
+  std::atomic<int> _size;
+  std::atomic<int>* _lane_sizes;
+
+  /// Producers waiting for space in a full queue wait on this condition.
+  pthread_mutex_t _space_lock;
+  pthread_cond_t _space_cond;
+  std::atomic<int> _space_waiters;
+
+  /// Set under all the shard locks, so consumers see it consistently with
+  /// the state of their shard.
+  std::atomic<bool> _terminated;
+};
+
+#endif
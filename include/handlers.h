@@ -37,12 +37,20 @@
 #ifndef HANDLERS_H__
 #define HANDLERS_H__
 
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
 #include "httpstack.h"
 #include "chronosconnection.h"
+#include "local_chronos_connection.h"
 #include "hssconnection.h"
 #include "regstore.h"
 #include "sipresolver.h"
 #include "avstore.h"
+#include "sharded_worker_pool.h"
 
 /// Common factory for all handlers that deal with chronos timer pops. This is
 /// a subclass of ConfiguredHandlerFactory that requests HTTP flows to be
@@ -64,6 +72,27 @@ public:
   }
 };
 
+/// Callback for timers run by a LocalChronosConnection, which passes the
+/// timer's opaque data to the same handler that would have handled the
+/// timer pop from Chronos.  The callback holds its own copy of the
+/// handler's configuration.
+template<class H, class C>
+class LocalTimerCallback : public LocalChronosConnection::Callback
+{
+public:
+  LocalTimerCallback(const C& cfg) : _cfg(cfg) {}
+
+  virtual ~LocalTimerCallback() {}
+
+  void timer_pop(const std::string& opaque, SAS::TrailId trail)
+  {
+    H::handle_timer_pop(&_cfg, opaque, trail);
+  }
+
+private:
+  C _cfg;
+};
+
 class RegistrationTimeoutHandler : public HttpStack::Handler
 {
 public:
@@ -85,57 +114,136 @@ public:
 
   void run();
 
+  /// Handle a timer pop that didn't come through the HTTP stack.
+  static HTTPCode handle_timer_pop(const Config* cfg,
+                                   const std::string& opaque,
+                                   SAS::TrailId trail);
+
+  /// Remove the expired bindings from a batch of AoRs.
+  static void expire_bindings(const Config* cfg,
+                              const std::vector<std::string>& aor_ids,
+                              SAS::TrailId trail);
+
 protected:
   void handle_response();
   HTTPCode parse_response(std::string body);
-  RegStore::AoR* set_aor_data(RegStore* current_store,
-                              std::string aor_id,
-                              RegStore::AoR* previous_aor_data,
-                              RegStore* remote_store,
-                              bool update_chronos,
-                              bool& all_bindings_expired);
+  static HTTPCode parse_opaque(const std::string& body,
+                               std::string& aor_id,
+                               std::string& binding_id);
+  static bool set_aor_data(RegStore* current_store,
+                           const std::vector<std::string>& aor_ids,
+                           std::map<std::string, RegStore::AoR*>& aor_data,
+                           std::map<std::string, RegStore::AoR*>& previous_aor_data,
+                           RegStore* remote_store,
+                           bool update_chronos,
+                           std::set<std::string>& all_bindings_expired,
+                           SAS::TrailId trail);
 
 protected:
   const Config* _cfg;
   std::string _aor_id;
   std::string _binding_id;
+
+  /// The AoRs whose timers have popped.  A batch of timer pops may hold
+  /// several for the same AoR, but each AoR is only listed once.
+  std::vector<std::string> _aor_ids;
 };
 
+/// Handles deregistration requests from Homestead.  The AoRs in a request
+/// are split into batches, which are processed in parallel on the
+/// configured worker pool (if there is one).  Each batch holds AoRs that
+/// hash to the same worker thread, so updates to an AoR from different
+/// requests are made in the order the requests arrived.
 class DeregistrationHandler : public HttpStack::Handler
 {
 public:
   struct Config
   {
-    Config(RegStore* store, RegStore* remote_store, HSSConnection* hss, SIPResolver* sipresolver) :
-      _store(store), _remote_store(remote_store), _hss(hss), _sipresolver(sipresolver)
+    Config(RegStore* store, RegStore* remote_store, HSSConnection* hss, SIPResolver* sipresolver, ShardedWorkerPool* pool = NULL) :
+      _store(store), _remote_store(remote_store), _hss(hss), _sipresolver(sipresolver), _pool(pool)
       {}
     RegStore* _store;
     RegStore* _remote_store;
     HSSConnection* _hss;
     SIPResolver* _sipresolver;
+    ShardedWorkerPool* _pool;
   };
 
 
   DeregistrationHandler(HttpStack::Request& req,
                         const Config* cfg,
                         SAS::TrailId trail) :
-    HttpStack::Handler(req, trail), _cfg(cfg)
-  {};
+    HttpStack::Handler(req, trail),
+    _cfg(cfg),
+    _pending_batches(0),
+    _done_aors(0),
+    _total_aors(0),
+    _success(true)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+  };
+
+  virtual ~DeregistrationHandler()
+  {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
 
   void run();
   HTTPCode handle_request();
   HTTPCode parse_request(std::string body);
-  RegStore::AoR* set_aor_data(RegStore* current_store,
-                              std::string aor_id,
-                              std::string private_id,
-                              RegStore::AoR* previous_aor_data,
-                              RegStore* remote_store,
-                              bool is_primary);
+  bool process_batch(const std::vector<std::string>& aor_ids);
+  bool set_aor_data(RegStore* current_store,
+                    const std::vector<std::string>& aor_ids,
+                    std::map<std::string, RegStore::AoR*>& aor_data,
+                    std::map<std::string, RegStore::AoR*>& previous_aor_data,
+                    RegStore* remote_store,
+                    bool is_primary);
+  void remove_bindings(RegStore* current_store,
+                       RegStore::AoR* aor_data,
+                       const std::string& private_id,
+                       bool is_primary);
+
+  /// Maximum number of AoRs read and written together.
+  static const size_t BATCH_SIZE = 100;
+
+  /// Progress is logged each time this many AoRs have been processed.
+  static const size_t PROGRESS_INTERVAL = 1000;
 
 protected:
+  /// A batch of AoRs processed on the worker pool.
+  class Batch : public ShardedWorkerPool::Work
+  {
+  public:
+    Batch(DeregistrationHandler* handler, const std::vector<std::string>& aor_ids) :
+      _handler(handler), _aor_ids(aor_ids)
+    {}
+
+    void run()
+    {
+      _handler->batch_done(_aor_ids.size(), _handler->process_batch(_aor_ids));
+    }
+
+  private:
+    DeregistrationHandler* _handler;
+    std::vector<std::string> _aor_ids;
+  };
+
+  void batch_done(size_t num_aors, bool success);
+  const std::string& private_id(const std::string& aor_id) const;
+
   const Config* _cfg;
   std::map<std::string, std::string> _bindings;
   std::string _notify;
+
+  // Progress of the batches, protected by the lock.
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  size_t _pending_batches;
+  size_t _done_aors;
+  size_t _total_aors;
+  bool _success;
 };
 
 class AuthTimeoutHandler : public HttpStack::Handler
@@ -155,8 +263,23 @@ public:
   {};
 
   void run();
+
+  /// Handle a timer pop that didn't come through the HTTP stack.
+  static HTTPCode handle_timer_pop(const Config* cfg,
+                                   const std::string& opaque,
+                                   SAS::TrailId trail);
+
 protected:
   HTTPCode handle_response(std::string body);
+  static HTTPCode parse_opaque(const std::string& body,
+                               std::string& impi,
+                               std::string& impu,
+                               std::string& nonce);
+  static HTTPCode handle_timeout(const Config* cfg,
+                                 const std::string& impi,
+                                 const std::string& impu,
+                                 const std::string& nonce,
+                                 SAS::TrailId trail);
   const Config* _cfg;
   std::string _impi;
   std::string _impu;
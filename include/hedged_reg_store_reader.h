@@ -0,0 +1,179 @@
+/**
+ * @file hedged_reg_store_reader.h Hedged reads of registration records from
+ * the local and remote stores.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HEDGED_REG_STORE_READER_H__
+#define HEDGED_REG_STORE_READER_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <atomic>
+
+#include "regstore.h"
+#include "statistic.h"
+#include "counter.h"
+#include "latency_histogram.h"
+#include "sas.h"
+
+/// Reads the bindings for an AoR from the local store, falling back to the
+/// remote store, without waiting for a slow local read to complete before
+/// trying the remote.
+///
+/// The local read is made on one of a pool of reader threads.  If it hasn't
+/// returned within the configured percentile of recent local read
+/// latencies, the remote read is started as well, and the caller takes
+/// whichever read returns bindings first.  If the local read returns no
+/// bindings, the remote read is started straight away, as in an unhedged
+/// read.  If all the reader threads are busy the reads are made serially on
+/// the calling thread.
+///
+/// The following statistics are reported:
+///
+/// -  hedged_reads - remote reads started because the local read was slow
+/// -  hedged_read_wins - hedged reads whose result was used because they
+///    returned first.
+class HedgedRegStoreReader
+{
+public:
+  /// Constructor.
+  ///
+  /// @param local_store  - The local store.
+  /// @param remote_store - The remote store.
+  /// @param num_threads  - Number of reader threads.
+  /// @param percentile   - Percentile of local read latency after which the
+  ///                       remote read is started.
+  /// @param lvc          - Statistics aggregator.
+  HedgedRegStoreReader(RegStore* local_store,
+                       RegStore* remote_store,
+                       int num_threads,
+                       double percentile,
+                       LastValueCache* lvc);
+
+  /// Destructor.  Stops the reader threads.  Reads that haven't started are
+  /// completed as failures.
+  ~HedgedRegStoreReader();
+
+  /// Start the reader threads.
+  void start();
+
+  /// Get a view of the bindings for an AoR, allocated from the specified
+  /// pool.  The view holds the bindings from the local store if it has any,
+  /// and those from the remote store otherwise, unless the remote read
+  /// returned bindings first.  Returns false if the local read failed and
+  /// the remote read has not supplied the view.
+  bool get_aor_view(const std::string& aor_id,
+                    pj_pool_t* pool,
+                    RegStore::AoRView& view,
+                    SAS::TrailId trail);
+
+  /// How long to wait for a local read before starting the remote read.
+  inline uint64_t hedge_delay_us() const { return _hedge_delay_us.load(); }
+
+  /// Local reads are timed over this period, then the hedge delay is set
+  /// to the configured percentile of them.  Until enough reads have been
+  /// timed the default delay is used.
+  static const uint64_t DELAY_PERIOD_US = 5000000;
+  static const uint64_t MIN_DELAY_SAMPLES = 100;
+  static const uint64_t DEFAULT_DELAY_US = 5000;
+  static const uint64_t MIN_DELAY_US = 100;
+
+private:
+  enum Source
+  {
+    LOCAL = 0,
+    REMOTE = 1
+  };
+
+  /// State of a single hedged read, shared between the caller and the
+  /// reader threads.  Each read is made into its own pool, because the
+  /// losing read may still be running when the caller returns.
+  struct Read
+  {
+    std::string aor_id;
+    SAS::TrailId trail;
+    int refs;
+    pthread_cond_t cond;
+    bool started[2];
+    bool done[2];
+    bool found[2];
+    pj_pool_t* pools[2];
+    RegStore::AoRView views[2];
+  };
+
+  struct Task
+  {
+    Read* read;
+    Source source;
+  };
+
+  static int reader_thread(void* p);
+  void run();
+  void queue_read(Read* read, Source source);
+  void release(Read* read);
+  bool usable(Read* read, Source source);
+  void record_local_latency(uint64_t latency_us);
+  static uint64_t now_us();
+
+  RegStore* _stores[2];
+  const int _num_threads;
+  const double _percentile;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _work_cond;
+  bool _terminated;
+  int _idle_threads;
+  std::list<Task> _queue;
+
+  std::vector<pj_thread_t*> _threads;
+
+  /// Local read latencies in the current period.
+  LatencyHistogram _latencies;
+  std::atomic<uint64_t> _period_start_us;
+  std::atomic<uint64_t> _hedge_delay_us;
+
+  // Statistics
+  StatisticCounter _hedged_counter;
+  StatisticCounter _wins_counter;
+};
+
+#endif
@@ -49,6 +49,7 @@
 #include "sas.h"
 #include "accumulator.h"
 #include "load_monitor.h"
+#include "subscriber_profile_cache.h"
 
 /// @class HSSConnection
 ///
@@ -60,7 +61,8 @@ class HSSConnection
 public:
   HSSConnection(const std::string& server,
                 LoadMonitor *load_monitor,
-                LastValueCache *stats_aggregator);
+                LastValueCache *stats_aggregator,
+                SubscriberProfileCache *profile_cache = NULL);
   ~HSSConnection();
 
   HTTPCode get_auth_vector(const std::string& private_user_id,
@@ -105,6 +107,14 @@ public:
                                  SAS::TrailId trail);
   rapidxml::xml_document<>* parse_xml(std::string raw, const std::string& url);
 
+  /// The cache of subscriber data shared across transactions, or NULL if
+  /// the data is not cached.
+  inline SubscriberProfileCache* profile_cache() const { return _profile_cache; }
+
+  /// Drop any cached data for a public ID whose registration state has
+  /// changed without going through this connection.
+  void invalidate_profile(const std::string& public_user_identity);
+
   static const std::string REG;
   static const std::string CALL;
   static const std::string DEREG_USER;
@@ -121,7 +131,14 @@ private:
   virtual long get_xml_object(const std::string& path, rapidxml::xml_document<>*& root, SAS::TrailId trail);
   virtual long put_for_xml_object(const std::string& path, std::string body, rapidxml::xml_document<>*& root, SAS::TrailId trail);
 
+  void update_profile_cache(const std::string& public_user_identity,
+                            const std::string& type,
+                            const std::string& regstate,
+                            const std::map<std::string, Ifcs >& ifcs_map,
+                            const std::vector<std::string>& associated_uris);
+
   HttpConnection* _http;
+  SubscriberProfileCache* _profile_cache;
   StatisticAccumulator _latency_stat;
   StatisticAccumulator _digest_latency_stat;
   StatisticAccumulator _subscription_latency_stat;
@@ -0,0 +1,128 @@
+/**
+ * @file latency_histogram.h Log-linear latency histograms.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef LATENCY_HISTOGRAM_H__
+#define LATENCY_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+#include "statistic.h"
+
+/// Histogram of latency values, in the style of an HDR histogram.
+///
+/// Values are counted in buckets whose width grows with the value, so every
+/// value is recorded to within 1/SUB_BUCKETS of its true value whatever its
+/// magnitude.  Values below 2*SUB_BUCKETS are recorded exactly.  Recording a
+/// value is a single atomic increment, so the histogram may be updated from
+/// many threads at once.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram();
+
+  /// Record a value.
+  void record(uint_fast64_t value);
+
+  /// Number of values recorded.
+  uint_fast64_t count() const;
+
+  /// The value at the specified percentile (between 0 and 100) of the
+  /// values recorded, or zero if no values have been recorded.  The
+  /// highest value that falls in the same bucket is returned.
+  uint_fast64_t percentile(double percent) const;
+
+  /// Move all the values recorded in this histogram into another, leaving
+  /// this one empty.
+  void move_to(LatencyHistogram& other);
+
+  static const unsigned int SUB_BUCKET_BITS = 4;
+  static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+  /// Enough buckets to cover values up to 2^40 (about 12 days in
+  /// microseconds).  Larger values are counted in the last bucket.
+  static const unsigned int NUM_BUCKETS = (40 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static unsigned int bucket_index(uint_fast64_t value);
+  static uint_fast64_t bucket_value(unsigned int index);
+
+private:
+  std::atomic<uint_fast64_t> _buckets[NUM_BUCKETS];
+  std::atomic<uint_fast64_t> _count;
+};
+
+/// Latency histogram reported through the statistics interface.
+///
+/// Values are accumulated over a period, then the number of values and the
+/// 50th, 99th and 99.9th percentiles are reported and the histogram is
+/// cleared for the next period.
+class StatisticHistogram
+{
+public:
+  StatisticHistogram(std::string statname,
+                     LastValueCache* lvc,
+                     uint_fast64_t period_us = DEFAULT_PERIOD_US);
+
+  /// Record a value, reporting the last period's statistics first if it has
+  /// ended.
+  void record(uint_fast64_t value);
+
+  /// Report the statistics for the current period if it has ended, or
+  /// regardless if force is set.
+  void refresh(bool force = false);
+
+  /// Percentiles reported for the last period.
+  inline uint_fast64_t p50() const { return _p50.load(); }
+  inline uint_fast64_t p99() const { return _p99.load(); }
+  inline uint_fast64_t p999() const { return _p999.load(); }
+
+  static const uint_fast64_t DEFAULT_PERIOD_US = 5000000;
+
+private:
+  static uint_fast64_t now_us();
+
+  LatencyHistogram _current;
+  Statistic _statistic;
+  const uint_fast64_t _period_us;
+  std::atomic<uint_fast64_t> _period_start_us;
+  std::atomic<uint_fast64_t> _p50;
+  std::atomic<uint_fast64_t> _p99;
+  std::atomic<uint_fast64_t> _p999;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * @file local_chronos_connection.h In-process replacement for Chronos.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef LOCAL_CHRONOS_CONNECTION_H__
+#define LOCAL_CHRONOS_CONNECTION_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "chronosconnection.h"
+#include "timer_wheel.h"
+#include "dispatch_queue.h"
+#include "statistic.h"
+#include "counter.h"
+#include "accumulator.h"
+#include "latency_histogram.h"
+#include "sas.h"
+
+/// ChronosConnection that runs timers in this process rather than sending
+/// them to Chronos, for deployments without a Chronos cluster.
+///
+/// Timers are held on a hierarchical timer wheel which is advanced by a
+/// ticker thread.  Timers that pop are passed to a pool of threads that
+/// call the callback registered for the timer's callback URI, in place of
+/// the HTTP request Chronos would have sent.  Timers are not replicated, so
+/// they are lost if this process restarts.
+///
+/// The following statistics are reported:
+///
+/// -  local_timers - the number of running timers, sampled every second.
+/// -  local_timer_pops - timers that have popped.
+/// -  local_timer_lateness_us - how long after their due time timers are
+///    passed to their callback.
+class LocalChronosConnection : public ChronosConnection
+{
+public:
+  /// Callback for timers set with a particular callback URI.
+  class Callback
+  {
+  public:
+    virtual ~Callback() {}
+
+    /// Called on one of the pop threads when a timer pops, with the opaque
+    /// data it was set with.
+    virtual void timer_pop(const std::string& opaque, SAS::TrailId trail) = 0;
+  };
+
+  /// Constructor.
+  ///
+  /// @param num_threads - Number of threads calling the callbacks.
+  /// @param tick_ms     - Resolution of the timers.
+  /// @param lvc         - Statistics aggregator.
+  LocalChronosConnection(int num_threads,
+                         int tick_ms,
+                         LastValueCache* lvc);
+
+  /// Destructor.  Stops the threads if they are running, and deletes the
+  /// callbacks.
+  virtual ~LocalChronosConnection();
+
+  /// Register the callback for a callback URI.  The connection takes
+  /// ownership of the callback.  Must be called before start().
+  void register_callback(const std::string& callback_uri, Callback* callback);
+
+  /// Start the ticker and pop threads.
+  void start();
+
+  /// Stop the threads.  Timers that have popped but not been passed to
+  /// their callbacks are discarded.
+  void stop();
+
+  virtual HTTPCode send_post(std::string& post_identity,
+                             uint32_t timer_interval,
+                             const std::string& callback_uri,
+                             const std::string& opaque_data,
+                             SAS::TrailId trail);
+  virtual HTTPCode send_put(std::string& put_identity,
+                            uint32_t timer_interval,
+                            const std::string& callback_uri,
+                            const std::string& opaque_data,
+                            SAS::TrailId trail);
+  virtual HTTPCode send_delete(const std::string& delete_identity,
+                               SAS::TrailId trail);
+
+  /// Number of running timers.
+  size_t size();
+
+  static const int DEFAULT_THREADS = 4;
+  static const int DEFAULT_TICK_MS = 10;
+  static const uint64_t OCCUPANCY_PERIOD_MS = 1000;
+
+private:
+  static int ticker_thread(void* p);
+  static int pop_thread(void* p);
+  void tick();
+  void pop();
+  void dispatch(const TimerWheel::Timer& timer);
+  static uint64_t now_ms();
+  static uint64_t now_us();
+
+  const int _num_threads;
+  const int _tick_ms;
+
+  /// Prefix for the IDs of timers set by this process, so they can't clash
+  /// with IDs set before a restart that are still stored on bindings.
+  const std::string _id_prefix;
+  uint64_t _next_id;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _tick_cond;
+  bool _terminated;
+  TimerWheel _wheel;
+  uint64_t _last_sample_ms;
+
+  DispatchQueue<TimerWheel::Timer> _pops;
+  std::map<std::string, Callback*> _callbacks;
+
+  pj_thread_t* _ticker;
+  std::vector<pj_thread_t*> _threads;
+
+  // Statistics
+  StatisticAccumulator _occupancy_stat;
+  StatisticCounter _pops_counter;
+  StatisticHistogram _lateness_histogram;
+};
+
+#endif
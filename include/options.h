@@ -46,4 +46,9 @@ pj_status_t init_options();
 
 void destroy_options();
 
+/// Determines whether a received message is an OPTIONS poll that the
+/// OPTIONS module answers.  This only looks at the message, so is safe to
+/// call on transport threads.
+pj_bool_t is_local_options(pjsip_rx_data* rdata);
+
 #endif
@@ -0,0 +1,179 @@
+/**
+ * @file reg_store_replicator.h Background replication of registration
+ * records to a remote store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REG_STORE_REPLICATOR_H__
+#define REG_STORE_REPLICATOR_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "regstore.h"
+#include "cas_retry.h"
+#include "statistic.h"
+#include "counter.h"
+#include "latency_histogram.h"
+#include "sas.h"
+
+/// Replicates registration records to a (geo-redundant) remote store in the
+/// background, so that REGISTER and SUBSCRIBE processing doesn't wait for a
+/// write to the remote site.
+///
+/// Once an AoR has been written to the local store, a copy of it is queued,
+/// along with a copy of the AoR as it was read before the update, and a pool
+/// of replication threads applies the difference to the remote store.  Only
+/// the bindings and subscriptions that the update added, changed or removed
+/// are written, so anything held only in the remote store (for example, a
+/// binding created at the remote site that hasn't reached this one) is left
+/// alone.
+///
+/// -  If the AoR is updated again before the queued update has been written,
+///    the new copy replaces the queued one, but the original copy is kept,
+///    so the queued update covers both changes.
+/// -  If the queue is full the update is dropped, and the remote store is
+///    out of date for the bindings it changed until they are next updated.
+///
+/// Updates to the same AoR are never written concurrently, so they reach the
+/// remote store in order.
+///
+/// The following statistics are reported:
+///
+/// -  remote_replication_lag_us - histogram of the time from an AoR first
+///    being queued to it being written
+/// -  remote_replication_coalesced - updates that replaced a queued update
+/// -  remote_replication_dropped - updates dropped because the queue was full
+/// -  remote_replication_failed - updates that could not be written
+/// -  remote_replication_cas_* - retries of conflicting writes (see
+///    CasRetry).
+class RegStoreReplicator
+{
+public:
+  /// Constructor.
+  ///
+  /// @param store        - The remote store to write to.
+  /// @param num_threads  - Number of replication threads.
+  /// @param max_queue    - Maximum number of AoRs waiting to be written.
+  /// @param max_retries  - Maximum number of retries of a conflicting write.
+  /// @param max_backoff_ms - Maximum wait before retrying a conflicting
+  ///                       write.
+  /// @param lvc          - Statistics aggregator.
+  RegStoreReplicator(RegStore* store,
+                     int num_threads,
+                     int max_queue,
+                     int max_retries,
+                     int max_backoff_ms,
+                     LastValueCache* lvc);
+
+  /// Destructor.  Stops the replication threads, discarding any updates that
+  /// haven't been written.
+  ~RegStoreReplicator();
+
+  /// Start the replication threads.
+  void start();
+
+  /// Queue an update to an AoR to be written to the remote store.  The AoRs
+  /// are copied, so remain owned by the caller.
+  ///
+  /// @param aor_id       - The AoR that was updated.
+  /// @param aor_data     - The AoR as written to the local store.
+  /// @param original_aor_data - The AoR as read from the local store before
+  ///                       the update, or NULL if it was empty.
+  /// @param trail        - SAS trail for the update.
+  void replicate(const std::string& aor_id,
+                 RegStore::AoR* aor_data,
+                 RegStore::AoR* original_aor_data,
+                 SAS::TrailId trail);
+
+  /// Number of AoRs waiting to be written.
+  int queue_size();
+
+  /// Wait until all queued AoRs have been written.
+  void wait_idle();
+
+private:
+  struct Update
+  {
+    RegStore::AoR* aor_data;
+    RegStore::AoR* original_aor_data;
+    uint64_t queued_us;
+    SAS::TrailId trail;
+  };
+
+  static int replication_thread(void* p);
+  void run();
+  bool write(const std::string& aor_id, const Update& update);
+  static void apply_changes(RegStore::AoR* original_aor_data,
+                            RegStore::AoR* aor_data,
+                            RegStore::AoR* remote_aor_data);
+  static uint64_t now_us();
+
+  RegStore* _store;
+  const int _num_threads;
+  const unsigned int _max_queue;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _work_cond;
+  pthread_cond_t _idle_cond;
+  bool _terminated;
+
+  /// AoR IDs in the order they were queued, and the update queued for each.
+  std::list<std::string> _queue;
+  std::map<std::string, Update> _updates;
+
+  /// AoRs currently being written.
+  std::set<std::string> _in_flight;
+
+  std::vector<pj_thread_t*> _threads;
+
+  CasRetry _cas_retry;
+
+  // Statistics
+  StatisticHistogram _lag_histogram;
+  StatisticCounter _coalesced_counter;
+  StatisticCounter _dropped_counter;
+  StatisticCounter _failed_counter;
+};
+
+#endif
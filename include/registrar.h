@@ -43,6 +43,7 @@ extern "C" {
 }
 
 #include "regstore.h"
+#include "reg_store_replicator.h"
 #include "hssconnection.h"
 #include "chronosconnection.h"
 #include "analyticslogger.h"
@@ -56,11 +57,14 @@ void third_party_register_failed(const std::string& public_id,
 
 extern pj_status_t init_registrar(RegStore* registrar_store,
                                   RegStore* remote_reg_store,
+                                  RegStoreReplicator* remote_reg_store_replicator,
                                   HSSConnection* hss_connection,
                                   AnalyticsLogger* analytics_logger,
                                   ACRFactory* rfacr_factory,
                                   IfcHandler* ifchandler_ref,
-                                  int cfg_max_expires);
+                                  int cfg_max_expires,
+                                  int cfg_cas_max_retries,
+                                  int cfg_cas_max_backoff_ms);
 
 
 extern void destroy_registrar();
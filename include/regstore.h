@@ -38,15 +38,25 @@
 #ifndef REGSTORE_H__
 #define REGSTORE_H__
 
+extern "C" {
+#include <pjlib.h>
+}
+
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "store.h"
 #include "regstore.h"
 #include "chronosconnection.h"
+#include "aor_cache.h"
+#include "statistic.h"
+#include "counter.h"
+#include "latency_histogram.h"
 #include "sas.h"
 
 class RegStore
@@ -101,6 +111,9 @@ public:
 
       /// Whether this is an emergency registration.
       bool _emergency_registration;
+
+      bool operator==(const Binding& other) const;
+      inline bool operator!=(const Binding& other) const { return !(*this == other); }
     };
 
     /// @class RegStore::AoR::Subscription
@@ -135,6 +148,9 @@ public:
       /// The time (in seconds since the epoch) at which this subscription
       /// should expire.
       int _expires;
+
+      bool operator==(const Subscription& other) const;
+      inline bool operator!=(const Subscription& other) const { return !(*this == other); }
     };
 
     /// Default Constructor.
@@ -157,6 +173,8 @@ public:
 
     /// Retrieve a binding by Binding ID, creating an empty one if necessary.
     /// The created binding is completely empty, even the Contact URI field.
+    /// The binding's expiry time may only be changed through the returned
+    /// pointer until the AoR is next written to the store.
     Binding* get_binding(const std::string& binding_id);
 
     /// Removes any binding that had the given ID.  If there is no such binding,
@@ -164,6 +182,8 @@ public:
     void remove_binding(const std::string& binding_id);
 
     /// Retrieve a subscription by To tag, creating an empty one if necessary.
+    /// As for get_binding, the expiry time may only be changed through the
+    /// returned pointer until the AoR is next written to the store.
     Subscription* get_subscription(const std::string& to_tag);
 
     /// Remove a subscription for the specified To tag.  If there is no
@@ -192,6 +212,10 @@ public:
     /// receive every NOTIFY for the AoR.)
     int _notify_cseq;
 
+    /// The ID of the Chronos timer for this AoR when timers are set per AoR
+    /// (see TimerMode), otherwise empty.
+    std::string _timer_id;
+
   private:
     /// Map holding the bindings for a particular AoR indexed by binding ID.
     Bindings _bindings;
@@ -204,38 +228,363 @@ public:
     /// Zero for a new record that has not yet been written to a store.
     uint64_t _cas;
 
+    /// A binding or subscription record as read from a store that uses
+    /// per-binding records.
+    struct StoredRecord
+    {
+      uint64_t cas;
+      std::string data;
+    };
+    typedef std::map<std::string, StoredRecord> StoredRecords;
+
+    /// If the AoR was read from per-binding records, the index record and
+    /// its expiry time, and the binding and subscription records, as they
+    /// were read.  Used to write back only the records that have changed.
+    std::string _stored_index;
+    int _index_expires;
+    int _index_notify_cseq;
+    StoredRecords _stored_bindings;
+    StoredRecords _stored_subscriptions;
+
+    /// Bounds on the expiry times, as at the last time expired bindings and
+    /// subscriptions were removed (or as held in the store): no binding or
+    /// subscription expires before _earliest_expires, and no binding
+    /// expires after _latest_expires.  Zero if the bounds aren't known.
+    /// Only the binary format holds the bounds in the store, so an AoR
+    /// read from a record in the legacy format starts without them.
+    /// Bindings and subscriptions handed out by get_binding and
+    /// get_subscription since then may have been changed, so their IDs are
+    /// recorded and they are checked individually.
+    int _earliest_expires;
+    int _latest_expires;
+    std::set<std::string> _touched_bindings;
+    std::set<std::string> _touched_subscriptions;
+
+    /// Get the bounds on the expiry times, taking account of bindings and
+    /// subscriptions that may have been changed.  Returns false if the
+    /// bounds aren't known.
+    bool expiry_bounds(int& earliest, int& latest);
+
+    /// Set the bounds on the expiry times, once they have been worked out
+    /// from all the bindings and subscriptions.
+    void set_expiry_bounds(int earliest, int latest);
+
     /// Store code is allowed to manipulate bindings and subscriptions directly.
     friend class RegStore;
   };
 
+  /// @class RegStore::AoRView
+  ///
+  /// Read-only view of the bindings for an address of record, for callers
+  /// that don't modify the record.  Decoding a record into a view doesn't
+  /// create a Binding object or any std::strings - the bindings and their
+  /// strings are allocated from a pj_pool supplied by the caller (normally
+  /// the pool of the request being processed), so the view is valid for the
+  /// lifetime of that pool and is freed with it.  All strings are null
+  /// terminated.
+  class AoRView
+  {
+  public:
+    /// A single registered address.  See AoR::Binding for the meaning of
+    /// each field.
+    struct Binding
+    {
+      pj_str_t id;
+      pj_str_t uri;
+      pj_str_t cid;
+      int cseq;
+      int expires;
+      int priority;
+
+      /// Contact header parameters, as name/value pairs, so this holds
+      /// 2 * num_params strings.
+      unsigned num_params;
+      pj_str_t* params;
+
+      unsigned num_path_headers;
+      pj_str_t* path_headers;
+
+      pj_str_t timer_id;
+      pj_str_t private_id;
+      bool emergency_registration;
+    };
+
+    AoRView() : _notify_cseq(0), _cas(0), _num_bindings(0), _bindings(NULL) {}
+
+    inline unsigned num_bindings() const { return _num_bindings; }
+    inline const Binding& binding(unsigned index) const { return _bindings[index]; }
+
+    /// Make this a copy of another view, allocated from the specified pool,
+    /// so that it is independent of the pool the other view was read into.
+    void copy(const AoRView& other, pj_pool_t* pool);
+
+    int _notify_cseq;
+    uint64_t _cas;
+
+  private:
+    unsigned _num_bindings;
+    Binding* _bindings;
+
+    friend class RegStore;
+  };
+
+  /// How AoRs are laid out in the store.
+  ///
+  /// - SINGLE_RECORD holds each AoR in one record, so every update to the
+  ///   AoR rewrites the whole record.
+  /// - PER_BINDING_RECORDS holds a small index record for the AoR plus one
+  ///   record per binding and per subscription.  An update only writes the
+  ///   records that have changed, each with its own CAS, and only writes the
+  ///   index if bindings or subscriptions have been added or removed (or the
+  ///   index would expire before them, or the NOTIFY CSeq of an AoR with
+  ///   subscriptions has changed).  Refreshes of different bindings of a
+  ///   busy AoR therefore don't conflict.  A removed binding or subscription
+  ///   has its record overwritten, with its CAS, by an empty tombstone, so a
+  ///   concurrent refresh of it conflicts with the removal.  Reads cost a
+  ///   store operation per binding and subscription.
+  ///
+  /// Records in either layout can be read whichever layout is configured,
+  /// so changing the layout migrates each AoR the next time it is written.
+  enum Layout
+  {
+    SINGLE_RECORD,
+    PER_BINDING_RECORDS
+  };
+
+  /// How Chronos timers are used to expire bindings.
+  ///
+  /// - BINDING_TIMERS sets a timer for each binding, held in the binding's
+  ///   _timer_id, which pops when the binding expires.
+  /// - AOR_TIMERS sets a single timer for each AoR, held in the AoR's
+  ///   _timer_id, which pops when its first binding expires.  Each pop
+  ///   expires all the bindings that are due and resets the timer for the
+  ///   next, so refreshing an AoR costs one timer update however many
+  ///   bindings it has.
+  ///
+  /// Changing the mode migrates each AoR's timers the next time its timers
+  /// are updated - timers of the other kind are deleted and replaced.
+  enum TimerMode
+  {
+    BINDING_TIMERS,
+    AOR_TIMERS
+  };
+
+  /// The format single AoR records are written in.
+  ///
+  /// - LEGACY_FORMAT is the original stream-based format, which can be read
+  ///   by all versions of Sprout.  It doesn't hold the AoR's own timer, so
+  ///   can't be used with AOR_TIMERS.
+  /// - BINARY_FORMAT is smaller and quicker to encode and decode, but can
+  ///   only be read by this version of Sprout or later.  It should only be
+  ///   enabled once every node sharing the store has been upgraded.  It also
+  ///   holds the AoR's earliest and latest expiry times, so expired bindings
+  ///   can be skipped without checking each one after every read.
+  ///
+  /// Records in either format can be read whichever format is configured.
+  /// Per-binding records are always written in the binary format.
+  enum Format
+  {
+    LEGACY_FORMAT,
+    BINARY_FORMAT
+  };
+
   /// Provides the interface to the data store. This is responsible for
   /// updating and getting information from the underlying data store. The
   /// classes that call this class are responsible for retrying the get/set
   /// functions in case of failure.
   class Connector
   {
-    Connector(Store* data_store);
+    Connector(Store* data_store,
+              AoRCache* cache,
+              Layout layout,
+              LastValueCache* lvc,
+              const std::string& stat_prefix,
+              size_t compress_threshold,
+              Format format);
 
     ~Connector();
 
     AoR* get_aor_data(const std::string& aor_id, SAS::TrailId trail);
 
-    bool set_aor_data(const std::string& aor_id,
-                      AoR* aor_data,
-                      int expiry,
+    /// Read several AoRs.  The store has no multi-get, so the reads are
+    /// issued back to back, but as a single blocking call.
+    bool get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                            std::map<std::string, AoR*>& aor_data,
+                            SAS::TrailId trail);
+
+    Store::Status set_aor_data(const std::string& aor_id,
+                               AoR* aor_data,
+                               int expiry,
+                               SAS::TrailId trail);
+
+    bool get_aor_view(const std::string& aor_id,
+                      pj_pool_t* pool,
+                      AoRView& view,
                       SAS::TrailId trail);
 
     std::string serialize_aor(AoR* aor_data);
     AoR* deserialize_aor(const std::string& s);
 
+    /// Read and write AoRs held as per-binding records.  The index record
+    /// is held under the AoR ID, and the binding and subscription records
+    /// under keys derived from it.
+    AoR* get_indexed_aor(const std::string& aor_id,
+                         const std::string& index,
+                         uint64_t cas,
+                         SAS::TrailId trail);
+    Store::Status set_indexed_aor(const std::string& aor_id,
+                                  AoR* aor_data,
+                                  int expiry,
+                                  SAS::TrailId trail);
+    std::string serialize_index(AoR* aor_data, int notify_cseq, int index_expires);
+
+    /// A record written by set_indexed_aor, and the record it replaced (if
+    /// it was one read with the AoR), so that the write can be undone if the
+    /// update as a whole fails.
+    struct WrittenRecord
+    {
+      std::string key;
+      std::string data;
+      const AoR::StoredRecord* original;
+      int expiry;
+    };
+    Store::Status set_indexed_record(const std::string& key,
+                                     const std::string& data,
+                                     uint64_t cas,
+                                     int expiry,
+                                     const AoR::StoredRecord* original,
+                                     std::vector<WrittenRecord>& written,
+                                     SAS::TrailId trail);
+    void undo_indexed_records(const std::vector<WrittenRecord>& written,
+                              SAS::TrailId trail);
+    static uint64_t indexed_version(AoR* aor_data);
+    static bool is_index_record(const std::string& s);
+    static std::string record_key(const std::string& aor_id,
+                                  char type,
+                                  const std::string& id);
+
+    /// Get the CAS of a record, or zero if there is no such record.
+    uint64_t get_cas(const std::string& key, SAS::TrailId trail);
+
+    /// Write a single record to the store, counting the write and
+    /// compressing the record if it is large.
+    Store::Status set_record(const std::string& key,
+                             const std::string& data,
+                             uint64_t cas,
+                             int expiry,
+                             SAS::TrailId trail);
+
+    /// Read a single record from the store, decompressing it if necessary.
+    Store::Status get_record(const std::string& key,
+                             std::string& data,
+                             uint64_t& cas,
+                             SAS::TrailId trail);
+
+    /// Compress a record, keeping its header but with COMPRESSED_FLAG set
+    /// in it.  Returns the record unchanged if it doesn't get smaller.
+    std::string compress_record(const std::string& s);
+
+    /// Decompress a record, if it is compressed.  Returns false if the
+    /// record is compressed but can't be decompressed.
+    bool decompress_record(std::string& s);
+
+    static bool is_compressed(const std::string& s);
+
+    /// Decode a serialized AoR into a view allocated from the pool.
+    void decode_aor_view(const std::string& s, pj_pool_t* pool, AoRView& view);
+
+    /// Serialize and deserialize an AoR in the original stream-based
+    /// format, which has no header.  Records in this format may have been
+    /// written by older versions of Sprout, and are the only ones they can
+    /// read.
+    std::string serialize_legacy_aor(AoR* aor_data);
+    AoR* deserialize_legacy_aor(const std::string& s);
+
+    /// Whether a record starts with one of the binary format headers.
+    static bool has_binary_header(const std::string& s);
+
+    /// Serialized AoRs start with a magic number and the format version.
+    /// The last byte has the top bit set, so a legacy record (which starts
+    /// with a non-negative binding count) never matches the header.
+    static const char FORMAT_MAGIC[3];
+    static const int FORMAT_VERSION = 1;
+    static const size_t FORMAT_HEADER_LEN = 4;
+
+    /// Magic numbers for the index, binding and subscription records used
+    /// by the per-binding layout.  These share the format version and
+    /// header length of whole AoR records.
+    static const char INDEX_MAGIC[3];
+    static const char BINDING_MAGIC[3];
+    static const char SUBSCRIPTION_MAGIC[3];
+
+    /// Set in the format version byte of a record whose contents (after the
+    /// header) are compressed.  The header is followed by the length of the
+    /// uncompressed contents and the contents compressed with zlib.
+    static const uint8_t COMPRESSED_FLAG = 0x40;
+
+    /// Largest uncompressed size accepted for a compressed record.  This is
+    /// well above memcached's default 1MB item size limit, so only a corrupt
+    /// length exceeds it.
+    static const size_t MAX_RECORD_SIZE = 16 * 1024 * 1024;
+
+    /// The index record is kept for this long beyond the latest binding
+    /// expiry, so that refreshing a binding only rewrites the index about
+    /// once in this period, not on every refresh.
+    static const int INDEX_EXPIRY_SLACK = 600;
+
     Store* _data_store;
 
+    /// Cache of records read from and written to the store, or NULL if
+    /// records are not cached.
+    AoRCache* _cache;
+
+    Layout _layout;
+
+    /// Counts of record writes, and of writes rejected because the record
+    /// had been changed by someone else, or NULL if statistics are not
+    /// being reported.
+    StatisticCounter* _writes_counter;
+    StatisticCounter* _conflicts_counter;
+
+    /// Records of at least this many bytes are compressed when they are
+    /// written, or zero if records are not compressed.  Records in the
+    /// legacy format are never compressed.
+    size_t _compress_threshold;
+
+    Format _format;
+
+    /// Compressed size of records as a percentage of their original size,
+    /// and time taken to compress and decompress them in microseconds, or
+    /// NULL if statistics are not being reported.
+    StatisticHistogram* _compression_ratio;
+    StatisticHistogram* _compress_us;
+    StatisticHistogram* _decompress_us;
+
     /// RegStore is the only class that can use Connector
     friend class RegStore;
   };
 
-  /// Constructor.
-  RegStore(Store* data_store, ChronosConnection* chronos_connection);
+  /// Constructor.  If a cache is supplied, get_aor_view may serve records
+  /// from it rather than reading them from the store.  The cache is not
+  /// owned by the RegStore.  If a statistics aggregator is supplied, the
+  /// number of record writes and write conflicts are reported as
+  /// <stat_prefix>_writes and <stat_prefix>_write_conflicts.  If a
+  /// compression threshold is supplied, records of at least that many bytes
+  /// are compressed, and the compression ratio and time taken are reported
+  /// as <stat_prefix>_compression_ratio, <stat_prefix>_compress_us and
+  /// <stat_prefix>_decompress_us.  Compressed records can't be read by
+  /// older versions of Sprout.  The timer mode determines whether Chronos
+  /// timers are set per binding or per AoR, and the format whether single
+  /// records are written in the legacy or binary format.
+  RegStore(Store* data_store,
+           ChronosConnection* chronos_connection,
+           AoRCache* cache = NULL,
+           Layout layout = SINGLE_RECORD,
+           LastValueCache* lvc = NULL,
+           const std::string& stat_prefix = "reg_store",
+           size_t compress_threshold = 0,
+           TimerMode timer_mode = BINDING_TIMERS,
+           Format format = LEGACY_FORMAT);
 
   /// Destructor.
   ~RegStore();
@@ -246,6 +595,28 @@ public:
   /// by caller and must be freed with delete.
   AoR* get_aor_data(const std::string& aor_id, SAS::TrailId trail);
 
+  /// Get the data for several addresses of record in one batch, for example
+  /// the members of an implicit registration set.  An entry is added to
+  /// aor_data for each AoR ID, holding the data (owned by the caller) or
+  /// NULL in case of error.  AoRs that already have an entry in aor_data
+  /// are not read again, so after a failed set_aor_data_multi the caller
+  /// can delete and erase the rejected AoRs and call this again with the
+  /// same IDs.  Returns false if any AoR couldn't be read.
+  bool get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                          std::map<std::string, AoR*>& aor_data,
+                          SAS::TrailId trail);
+
+  /// Get a read-only view of the unexpired bindings for a particular
+  /// address of record, allocated from the specified pool.  Unlike
+  /// get_aor_data this does not send NOTIFYs for or delete the timers of
+  /// expired bindings - the bindings are simply left out of the view.  If
+  /// the RegStore has a cache, the view may be up to the cache's staleness
+  /// window out of date.  Returns false in case of error.
+  bool get_aor_view(const std::string& aor_id,
+                    pj_pool_t* pool,
+                    AoRView& view,
+                    SAS::TrailId trail);
+
   /// Update the data for a particular address of record.  Writes the data
   /// atomically.  If the underlying data has changed since it was last
   /// read, the update is rejected and this returns false; if the update
@@ -253,14 +624,46 @@ public:
   bool set_aor_data(const std::string& aor_id, AoR* data, bool update_timers, SAS::TrailId trail);
   bool set_aor_data(const std::string& aor_id, AoR* data, bool update_timers, SAS::TrailId trail, bool& all_bindings_expired);
 
+  /// As set_aor_data, but returns the status of the write, so that callers
+  /// retrying on a CAS failure can tell a rejected update (DATA_CONTENTION)
+  /// from a failure to access the store (ERROR), which retrying won't fix.
+  Store::Status try_set_aor_data(const std::string& aor_id,
+                                 AoR* data,
+                                 bool update_timers,
+                                 SAS::TrailId trail,
+                                 bool& all_bindings_expired);
+
+  /// Update the data for several addresses of record in one batch.  Each
+  /// AoR is written atomically as in set_aor_data, and NULL entries are
+  /// skipped.  The IDs of AoRs whose update was rejected because they had
+  /// changed are added to rejected, and should be read again and retried.
+  /// The IDs of AoRs that couldn't be written because of a store error are
+  /// added to failed, and shouldn't be retried.  The IDs of AoRs that no
+  /// longer have any bindings are added to all_bindings_expired.  Returns
+  /// true if every update succeeded.
+  bool set_aor_data_multi(const std::map<std::string, AoR*>& aor_data,
+                          bool update_timers,
+                          SAS::TrailId trail,
+                          std::set<std::string>& rejected,
+                          std::set<std::string>& failed,
+                          std::set<std::string>& all_bindings_expired);
+
   // Send a SIP NOTIFY
   void send_notify(AoR::Subscription* s, int cseq, AoR::Binding* b, std::string b_id);
 
+  // Send a single SIP NOTIFY reporting that several bindings have expired
+  void send_notify(AoR::Subscription* s, int cseq,
+                   const std::map<std::string, AoR::Binding>& bindings);
+
 private:
-  int expire_bindings(AoR* aor_data, int now);
-  void expire_subscriptions(AoR* aor_data, int now);
+  void set_binding_timers(const std::string& aor_id, AoR* aor_data, int now);
+  void set_aor_timer(const std::string& aor_id, AoR* aor_data, int now);
+  int expire(AoR* aor_data, int now);
+  int expire_bindings(AoR* aor_data, int now, int& earliest);
+  void expire_subscriptions(AoR* aor_data, int now, int& earliest);
 
   ChronosConnection* _chronos;
+  TimerMode _timer_mode;
   Connector* _connector;
 };
 
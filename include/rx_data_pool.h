@@ -0,0 +1,137 @@
+/**
+ * @file rx_data_pool.h Recycling pool for cloned pjsip_rx_data structures.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef RX_DATA_POOL_H__
+#define RX_DATA_POOL_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <pthread.h>
+#include <vector>
+#include <atomic>
+
+#include "statistic.h"
+#include "counter.h"
+
+/// Pool of memory pools for cloning received messages.
+///
+/// Every message received by the stack is cloned so it can be queued to a
+/// worker thread.  Creating and releasing a pj_pool for every clone goes
+/// through the (globally locked) caching pool factory, so instead this
+/// class keeps the pools of freed clones and resets them for re-use.
+///
+/// Pools are cached per thread so that getting and returning a pool does
+/// not normally take any locks.  Clones are typically created on transport
+/// threads and freed on worker threads, so per-thread caches that grow too
+/// large spill pools in batches to a shared depot, and threads whose cache
+/// is empty refill it in batches from the depot.
+class RxDataPool
+{
+public:
+  /// Constructor.
+  ///
+  /// @param factory     - Pool factory used to create new pools.
+  /// @param max_cached  - Maximum number of unused pools to hold in the
+  ///                      shared depot.  Further pools are released.
+  /// @param lvc         - Statistics aggregator.
+  RxDataPool(pj_pool_factory* factory,
+             int max_cached,
+             LastValueCache* lvc);
+  ~RxDataPool();
+
+  /// Clone a received message, in the same way as pjsip_rx_data_clone.
+  /// The clone holds a reference to the transport, and must be freed with
+  /// free_cloned.
+  pj_status_t clone(const pjsip_rx_data* src, pjsip_rx_data** p_rdata);
+
+  /// Free a message cloned by this pool, keeping its memory for re-use.
+  void free_cloned(pjsip_rx_data* rdata);
+
+  /// Number of pools in the shared depot.
+  int depot_size();
+
+  /// Number of clones currently in use.
+  inline int in_use() const { return _in_use.load(); }
+
+  /// Highest number of clones in use at once.
+  inline int high_water_mark() const { return _high_water_mark.load(); }
+
+  /// Number of pools moved between the per-thread caches and the depot at
+  /// once.
+  static const unsigned int BATCH_SIZE = 16;
+
+  /// Initial size and increment of the pools.
+  static const int POOL_LEN = PJSIP_POOL_RDATA_LEN;
+  static const int POOL_INC = PJSIP_POOL_RDATA_INC;
+
+private:
+  /// Per-thread cache of unused pools.
+  struct ThreadCache
+  {
+    RxDataPool* owner;
+    std::vector<pj_pool_t*> pools;
+  };
+
+  pj_pool_t* get_pool();
+  void put_pool(pj_pool_t* pool);
+  void spill_pools(std::vector<pj_pool_t*>& pools, unsigned int count);
+  ThreadCache* thread_cache();
+  void release_pools(std::vector<pj_pool_t*>& pools, unsigned int count);
+  void update_high_water_mark(int in_use);
+  static void destroy_thread_cache(void* p);
+
+  pj_pool_factory* _factory;
+  const unsigned int _max_cached;
+
+  pthread_key_t _cache_key;
+
+  pthread_mutex_t _depot_lock;
+  std::vector<pj_pool_t*> _depot;
+
+  std::atomic<int> _in_use;
+  std::atomic<int> _high_water_mark;
+
+  // Statistics
+  StatisticCounter _hits_counter;
+  StatisticCounter _misses_counter;
+  Statistic _high_water_mark_stat;
+};
+
+#endif
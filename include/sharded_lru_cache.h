@@ -0,0 +1,246 @@
+/**
+ * @file sharded_lru_cache.h Thread-safe sharded LRU cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SHARDED_LRU_CACHE_H__
+#define SHARDED_LRU_CACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+
+#include <string>
+#include <list>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+
+/// LRU cache of values keyed by string, each stamped with the time it was
+/// stored, for use by caches shared by all the threads in the process.
+///
+/// The cache is split into a number of shards, chosen by a hash of the key,
+/// each with its own lock, LRU list and index, so lookups of different keys
+/// rarely contend.  The maximum number of entries is divided evenly between
+/// the shards, and each shard evicts its own least recently used entry when
+/// it is full.
+///
+/// Entries are not expired by the cache itself - each lookup says how old an
+/// entry may be, and whether an older entry should be removed.
+template<class V>
+class ShardedLRUCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param max_entries - Maximum number of entries held.
+  /// @param num_shards  - Number of independently locked shards.
+  ShardedLRUCache(int max_entries, int num_shards) :
+    _max_entries_per_shard((max_entries > num_shards) ?
+                             (max_entries + num_shards - 1) / num_shards : 1),
+    _shards()
+  {
+    num_shards = (num_shards > 0) ? num_shards : 1;
+    for (int ii = 0; ii < num_shards; ++ii)
+    {
+      Shard* shard = new Shard();
+      pthread_mutex_init(&shard->lock, NULL);
+      _shards.push_back(shard);
+    }
+  }
+
+  ~ShardedLRUCache()
+  {
+    for (typename std::vector<Shard*>::iterator i = _shards.begin();
+         i != _shards.end();
+         ++i)
+    {
+      pthread_mutex_destroy(&(*i)->lock);
+      delete *i;
+    }
+  }
+
+  /// Look up a key, copying its value if the cache holds an entry for it
+  /// that was stored less than max_age_ms ago.  An older entry is removed if
+  /// remove_expired is set, and otherwise left for put to replace.
+  bool get(const std::string& key,
+           int max_age_ms,
+           bool remove_expired,
+           V& value)
+  {
+    bool found = false;
+    Shard& shard = shard_for(key);
+
+    pthread_mutex_lock(&shard.lock);
+    typename Index::iterator i = shard.index.find(key);
+    if (i != shard.index.end())
+    {
+      if (now_ms() - i->second->stored_ms < (unsigned long)max_age_ms)
+      {
+        // Move the entry to the front of the LRU list.
+        shard.lru.splice(shard.lru.begin(), shard.lru, i->second);
+        value = i->second->value;
+        found = true;
+      }
+      else if (remove_expired)
+      {
+        shard.lru.erase(i->second);
+        shard.index.erase(i);
+      }
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    return found;
+  }
+
+  /// Store a value for a key, evicting the least recently used entry in
+  /// the shard if it is full.  If the cache already held an entry for the
+  /// key and replaced is not NULL, the old value is swapped into replaced
+  /// and true is returned.
+  bool put(const std::string& key, const V& value, V* replaced = NULL)
+  {
+    bool found = false;
+    Shard& shard = shard_for(key);
+
+    pthread_mutex_lock(&shard.lock);
+    typename Index::iterator i = shard.index.find(key);
+    if (i != shard.index.end())
+    {
+      Entry& entry = *i->second;
+      if (replaced != NULL)
+      {
+        std::swap(*replaced, entry.value);
+      }
+      entry.value = value;
+      entry.stored_ms = now_ms();
+      shard.lru.splice(shard.lru.begin(), shard.lru, i->second);
+      found = true;
+    }
+    else
+    {
+      shard.lru.push_front(Entry());
+      Entry& entry = shard.lru.front();
+      entry.key = key;
+      entry.value = value;
+      entry.stored_ms = now_ms();
+      shard.index[key] = shard.lru.begin();
+
+      if (shard.lru.size() > _max_entries_per_shard)
+      {
+        // Evict the least recently used entry.
+        shard.index.erase(shard.lru.back().key);
+        shard.lru.pop_back();
+      }
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    return found;
+  }
+
+  /// Remove the entry for a key.  If there was one and removed is not NULL,
+  /// its value is swapped into removed and true is returned.
+  bool remove(const std::string& key, V* removed = NULL)
+  {
+    bool found = false;
+    Shard& shard = shard_for(key);
+
+    pthread_mutex_lock(&shard.lock);
+    typename Index::iterator i = shard.index.find(key);
+    if (i != shard.index.end())
+    {
+      if (removed != NULL)
+      {
+        std::swap(*removed, i->second->value);
+      }
+      shard.lru.erase(i->second);
+      shard.index.erase(i);
+      found = true;
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    return found;
+  }
+
+  /// Number of entries held.
+  int size()
+  {
+    int size = 0;
+    for (typename std::vector<Shard*>::iterator i = _shards.begin();
+         i != _shards.end();
+         ++i)
+    {
+      pthread_mutex_lock(&(*i)->lock);
+      size += (*i)->lru.size();
+      pthread_mutex_unlock(&(*i)->lock);
+    }
+    return size;
+  }
+
+private:
+  struct Entry
+  {
+    std::string key;
+    V value;
+    unsigned long stored_ms;
+  };
+
+  typedef std::list<Entry> LRUList;
+  typedef std::unordered_map<std::string, typename LRUList::iterator> Index;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+
+    /// Most recently used first.
+    LRUList lru;
+    Index index;
+  };
+
+  Shard& shard_for(const std::string& key)
+  {
+    return *_shards[std::hash<std::string>()(key) % _shards.size()];
+  }
+
+  static unsigned long now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  const unsigned int _max_entries_per_shard;
+  std::vector<Shard*> _shards;
+};
+
+#endif
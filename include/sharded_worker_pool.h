@@ -0,0 +1,117 @@
+/**
+ * @file sharded_worker_pool.h Pool of worker threads that preserves the order
+ * of work with the same key.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SHARDED_WORKER_POOL_H__
+#define SHARDED_WORKER_POOL_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "dispatch_queue.h"
+
+/// Pool of worker threads, each with its own queue of work.  Work is queued
+/// to a thread chosen by hashing a key, so work with the same key is always
+/// run in the order it was submitted, while work with different keys runs
+/// in parallel.  Threads don't steal work from each other, as that would
+/// break the ordering.
+class ShardedWorkerPool
+{
+public:
+  /// A piece of work for the pool.
+  class Work
+  {
+  public:
+    virtual ~Work() {}
+
+    /// Do the work.  Called on one of the worker threads, which deletes the
+    /// work once it returns.
+    virtual void run() = 0;
+  };
+
+  /// Constructor.
+  ///
+  /// @param name        - Name of the worker threads.
+  /// @param num_threads - Number of worker threads.
+  /// @param max_queue   - Number of pieces of work that can be queued across
+  ///                      all threads before submit() waits for space.
+  ShardedWorkerPool(const std::string& name, int num_threads, int max_queue);
+
+  /// Destructor.  Waits for the worker threads to finish the work already
+  /// queued to them, then stops them.
+  ~ShardedWorkerPool();
+
+  /// Start the worker threads.
+  void start();
+
+  /// Queue work to the thread for the specified key, waiting for space if
+  /// the queue is full.  The pool takes ownership of the work.  Returns
+  /// false, without taking ownership, if the pool has been stopped.
+  bool submit(const std::string& key, Work* work);
+
+  /// The shard that work with the specified key is queued to.
+  unsigned int shard(const std::string& key) const;
+
+  inline int num_threads() const { return _num_threads; }
+
+  /// How long submit() waits for space at a time, before checking whether
+  /// the pool has been stopped.
+  static const int SUBMIT_WAIT_MS = 100;
+
+private:
+  struct Thread
+  {
+    ShardedWorkerPool* pool;
+    unsigned int shard;
+    pj_thread_t* thread;
+  };
+
+  static int worker_thread(void* p);
+  void run(unsigned int shard);
+
+  const std::string _name;
+  const int _num_threads;
+  std::atomic<bool> _terminated;
+  DispatchQueue<Work*> _queue;
+  std::vector<Thread*> _threads;
+};
+
+#endif
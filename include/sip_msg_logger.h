@@ -0,0 +1,174 @@
+/**
+ * @file sip_msg_logger.h Asynchronous SAS and local logging of SIP messages.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef SIP_MSG_LOGGER_H__
+#define SIP_MSG_LOGGER_H__
+
+extern "C" {
+#include <pjsip.h>
+#include <pjlib.h>
+}
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "sas.h"
+#include "counter.h"
+
+/// Logs received and transmitted SIP messages to SAS and the local log
+/// from a background thread.
+///
+/// The thread handling a message only copies the message and the details
+/// needed to log it into a slot on a ring owned by that thread, which takes
+/// no locks.  The slots are reused, so once the ring has warmed up this
+/// doesn't allocate memory either, and the details that are only needed for
+/// the local log are only copied if verbose logging is enabled.  The logging
+/// thread collects the messages from all the rings in batches and builds
+/// and sends the SAS events and local logs.
+///
+/// If a ring starts to fill up because the logging thread can't keep up,
+/// only one in every SAMPLE_INTERVAL messages from that thread is logged,
+/// and if it fills completely further messages are not logged until there
+/// is space, so logging never blocks message processing.
+class SipMsgLogger
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ring_size   - Number of messages each thread's ring can hold.
+  ///                      Rounded up to a power of two.
+  /// @param lvc         - Statistics aggregator.
+  SipMsgLogger(unsigned int ring_size, LastValueCache* lvc);
+
+  /// Destructor.  Logs any messages still queued before returning.
+  ~SipMsgLogger();
+
+  /// Log a received message.  The message must already have a SAS trail.
+  void log_rx_msg(const pjsip_rx_data* rdata);
+
+  /// Log a message about to be transmitted.
+  void log_tx_msg(const pjsip_tx_data* tdata);
+
+  /// Log all the messages queued so far, from the calling thread.
+  void flush();
+
+  static const unsigned int DEFAULT_RING_SIZE = 4096;
+
+  /// Maximum number of messages taken from each ring in one pass of the
+  /// logging thread.
+  static const unsigned int BATCH_SIZE = 64;
+
+  /// Once a ring is more than three quarters full, only one in every
+  /// SAMPLE_INTERVAL messages is logged.
+  static const unsigned int SAMPLE_INTERVAL = 8;
+
+  /// Time the logging thread sleeps for when there is nothing to log.
+  static const int IDLE_POLL_MS = 5;
+
+private:
+  /// Details of a message to log.  The transport name and message info are
+  /// only filled in if the entry is to be logged locally.
+  struct Entry
+  {
+    bool rx;
+    bool verbose;
+    SAS::TrailId trail;
+    int transport_type;
+    std::string transport_name;
+    std::string address;
+    int port;
+    std::string info;
+    std::string msg;
+  };
+
+  /// Single producer, single consumer ring of entries.
+  struct Ring
+  {
+    Ring(unsigned int size) :
+      entries(size),
+      mask(size - 1),
+      head(0),
+      tail(0),
+      sampled(0)
+    {
+    }
+
+    std::vector<Entry> entries;
+    const unsigned int mask;
+
+    /// Next entry to write, updated by the producer.
+    std::atomic<unsigned int> head;
+
+    /// Next entry to read, updated by the consumer.
+    std::atomic<unsigned int> tail;
+
+    /// Number of messages seen while sampling, used by the producer.
+    unsigned int sampled;
+  };
+
+  Entry* claim(Ring* ring);
+  void publish(Ring* ring);
+  Ring* thread_ring();
+  int drain(unsigned int max_per_ring);
+  void write(Entry* entry);
+  static void* logger_thread(void* p);
+  void run();
+
+  const unsigned int _ring_size;
+
+  pthread_key_t _ring_key;
+
+  /// All the rings created, protected by _rings_lock.
+  pthread_mutex_t _rings_lock;
+  std::vector<Ring*> _rings;
+
+  /// Held while taking entries from the rings, so there is only ever one
+  /// consumer for each ring.
+  pthread_mutex_t _drain_lock;
+
+  pthread_t _thread;
+  pthread_mutex_t _stop_lock;
+  pthread_cond_t _stop_cond;
+  bool _stop;
+
+  // Statistics
+  StatisticCounter _dropped_counter;
+};
+
+#endif
@@ -48,6 +48,7 @@ extern "C" {
 }
 
 #include <string>
+#include <vector>
 #include <unordered_set>
 
 #include "sas.h"
@@ -151,6 +152,15 @@ extern pj_status_t init_stack(const std::string& sas_system_name,
                               SIPResolver* sipresolver,
                               int num_pjsip_threads,
                               int num_worker_threads,
+                              int max_active_workers,
+                              bool worker_affinity,
+                              int max_queue_depth,
+                              const std::vector<int>& lane_weights,
+                              int queue_deadline_ms,
+                              bool load_control_queue_wait,
+                              const std::vector<int>& pjsip_cpus,
+                              const std::vector<int>& worker_cpus,
+                              int options_fast_path_rate,
                               int record_routing_model,
                               const int default_session_expires,
                               QuiescingManager *quiescing_mgr,
@@ -163,6 +173,19 @@ extern void destroy_stack();
 extern pj_status_t init_pjsip();
 extern void term_pjsip();
 
+// Receive queue hooks, used by the UTs to drive message dispatch without
+// starting the PJSIP and worker threads.
+extern pjsip_module mod_stack;
+extern void init_rx_msg_queue(int num_worker_threads,
+                              bool worker_affinity,
+                              int max_queue_depth,
+                              const std::vector<int>& lane_weights,
+                              int queue_deadline_ms,
+                              int options_fast_path_rate,
+                              LoadMonitor* load_monitor);
+extern void destroy_rx_msg_queue();
+extern bool process_next_rx_msg(unsigned int worker_id);
+
 extern const std::string* known_statnames;
 extern const int num_known_stats;
 
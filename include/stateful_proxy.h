@@ -54,6 +54,7 @@ class UACTransaction;
 #include "analyticslogger.h"
 #include "callservices.h"
 #include "regstore.h"
+#include "hedged_reg_store_reader.h"
 #include "stack.h"
 #include "trustboundary.h"
 #include "sessioncase.h"
@@ -208,7 +209,10 @@ private:
   AsChainLink::Disposition apply_services(Target*& target);
   void handle_outgoing_non_cancel(Target* target);
 
-  bool get_data_from_hss(std::string public_id, HSSCallInformation& data, SAS::TrailId trail);
+  bool get_data_from_hss(std::string public_id,
+                         HSSCallInformation& data,
+                         SubscriberProfileCache::ProfileType type,
+                         SAS::TrailId trail);
   bool lookup_ifcs(std::string public_id, Ifcs& ifcs, SAS::TrailId trail);
   bool get_associated_uris(std::string public_id, std::vector<std::string>& uris, SAS::TrailId trail);
   bool is_user_registered(std::string public_id);
@@ -345,6 +349,7 @@ private:
 
 pj_status_t init_stateful_proxy(RegStore* registrar_store,
                                 RegStore* remote_reg_store,
+                                HedgedRegStoreReader* hedged_reg_store_reader,
                                 CallServices* call_services,
                                 IfcHandler* ifc_handler,
                                 pj_bool_t enable_access_proxy,
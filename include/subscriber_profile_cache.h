@@ -0,0 +1,124 @@
+/**
+ * @file subscriber_profile_cache.h Process-wide cache of subscriber data from the HSS.
+ * the local and remote stores.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SUBSCRIBER_PROFILE_CACHE_H__
+#define SUBSCRIBER_PROFILE_CACHE_H__
+
+#include <string>
+#include <vector>
+
+#include "sharded_lru_cache.h"
+#include "ifchandler.h"
+#include "statistic.h"
+#include "counter.h"
+
+/// Sharded LRU cache of the subscriber data returned by Homestead - the
+/// registration state, iFCs and associated URIs of each public ID - shared
+/// by all transactions in the process.
+///
+/// Entries are refreshed whenever Homestead returns the data for a public
+/// ID, and expire after a fixed time so that changes made on the HSS
+/// without a push to this node are eventually picked up.  Entries are
+/// removed when the subscriber is deregistered.
+class SubscriberProfileCache
+{
+public:
+  /// The parts of the profile, which are counted separately in the
+  /// statistics.
+  enum ProfileType
+  {
+    REGSTATE,
+    IFCS,
+    ASSOCIATED_URIS
+  };
+
+  /// Constructor.
+  ///
+  /// @param max_entries - Maximum number of public IDs held.
+  /// @param ttl_ms      - Time for which an entry is used after it was
+  ///                      last refreshed.
+  /// @param lvc         - Statistics aggregator.
+  /// @param num_shards  - Number of independently locked shards.
+  SubscriberProfileCache(int max_entries,
+                         int ttl_ms,
+                         LastValueCache* lvc,
+                         int num_shards = DEFAULT_NUM_SHARDS);
+  ~SubscriberProfileCache();
+
+  /// Look up the profile of a public ID.  Returns true if the cache holds
+  /// an unexpired entry for it.  The type is the part of the profile the
+  /// caller needs, and only selects the statistics updated.
+  bool get(const std::string& public_id,
+           ProfileType type,
+           std::string& regstate,
+           Ifcs& ifcs,
+           std::vector<std::string>& associated_uris);
+
+  /// Record the profile of a public ID just returned by Homestead.
+  void put(const std::string& public_id,
+           const std::string& regstate,
+           const Ifcs& ifcs,
+           const std::vector<std::string>& associated_uris);
+
+  /// Remove the entry for a public ID, along with the entries for its
+  /// associated URIs, which share its registration state.
+  void invalidate(const std::string& public_id);
+
+  /// Number of public IDs held.
+  inline int size() { return _cache.size(); }
+
+  inline int ttl_ms() const { return _ttl_ms; }
+
+  static const int DEFAULT_NUM_SHARDS = 16;
+
+private:
+  struct Profile
+  {
+    std::string regstate;
+    Ifcs ifcs;
+    std::vector<std::string> associated_uris;
+  };
+
+  const int _ttl_ms;
+  ShardedLRUCache<Profile> _cache;
+
+  // Statistics, indexed by ProfileType.
+  std::vector<StatisticCounter*> _hits_counters;
+  std::vector<StatisticCounter*> _misses_counters;
+};
+
+#endif
@@ -43,6 +43,7 @@ extern "C" {
 }
 
 #include "regstore.h"
+#include "reg_store_replicator.h"
 #include "hssconnection.h"
 #include "analyticslogger.h"
 #include "acr.h"
@@ -51,9 +52,12 @@ extern pjsip_module mod_subscription;
 
 extern pj_status_t init_subscription(RegStore* registrar_store,
                                      RegStore* remote_reg_store,
+                                     RegStoreReplicator* remote_reg_store_replicator,
                                      HSSConnection* hss_connection,
                                      ACRFactory* rfacr_factory,
-                                     AnalyticsLogger* analytics_logger);
+                                     AnalyticsLogger* analytics_logger,
+                                     int cfg_cas_max_retries,
+                                     int cfg_cas_max_backoff_ms);
 
 extern void destroy_subscription();
 
@@ -0,0 +1,129 @@
+/**
+ * @file timer_wheel.h Hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef TIMER_WHEEL_H__
+#define TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+
+/// Hierarchical timer wheel.
+///
+/// Time is divided into ticks of a fixed length, and each timer is held in
+/// a slot of one of four wheels of 256 slots.  Timers due in the next 256
+/// ticks are held on the first wheel, in the slot for the tick they are due
+/// in.  Timers due later are held on the wheel whose slots span their due
+/// time, and are moved down to the next wheel when the ticks spanned by
+/// their slot are reached.  Setting, removing and popping a timer are all
+/// constant time, however many timers are running.
+///
+/// Timers pop on the first tick at or after they are due.  Timers can be
+/// set up to 2^32 ticks ahead - timers set further ahead than that pop
+/// early.
+///
+/// The wheel is not thread-safe - callers must serialize access to it.
+class TimerWheel
+{
+public:
+  struct Timer
+  {
+    std::string id;
+    std::string callback_uri;
+    std::string opaque;
+    uint64_t due_ms;
+  };
+
+  /// Constructor.
+  ///
+  /// @param tick_ms - Length of a tick in milliseconds.
+  /// @param now_ms  - The current time in milliseconds.  Times passed to
+  ///                  the wheel can be from any clock, as long as they are
+  ///                  all from the same one.
+  TimerWheel(uint64_t tick_ms, uint64_t now_ms);
+
+  /// Destructor.  Discards any running timers.
+  ~TimerWheel();
+
+  /// Set a timer, replacing any running timer with the same ID.
+  void set(const std::string& id,
+           uint64_t due_ms,
+           const std::string& callback_uri,
+           const std::string& opaque);
+
+  /// Remove a timer.  Returns false if the timer wasn't running.
+  bool remove(const std::string& id);
+
+  /// Advance the wheel to the specified time, appending the timers that pop
+  /// to the vector.  Timers due in earlier ticks are appended first.
+  void tick(uint64_t now_ms, std::vector<Timer>& pops);
+
+  /// Number of running timers.
+  inline size_t size() const { return _entries.size(); }
+
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 8;
+  static const int SLOTS = 1 << SLOT_BITS;
+
+private:
+  struct Entry;
+  typedef std::list<Entry*> Slot;
+
+  struct Entry
+  {
+    Timer timer;
+    uint64_t due_tick;
+    int level;
+    int slot;
+    Slot::iterator pos;
+  };
+
+  void insert(Entry* entry, uint64_t base_tick);
+  void unlink(Entry* entry);
+  void process_tick(uint64_t tick, std::vector<Timer>& pops);
+
+  const uint64_t _tick_ms;
+
+  /// The last tick processed.
+  uint64_t _current_tick;
+
+  Slot _wheels[LEVELS][SLOTS];
+  std::map<std::string, Entry*> _entries;
+};
+
+#endif
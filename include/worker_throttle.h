@@ -0,0 +1,110 @@
+/**
+ * @file worker_throttle.h Limits the number of worker threads doing CPU work.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef WORKER_THROTTLE_H__
+#define WORKER_THROTTLE_H__
+
+#include <pthread.h>
+
+/// Limits the number of worker threads processing messages at once, not
+/// counting threads that are blocked waiting for a remote server.
+///
+/// Message processing makes synchronous calls to Homestead, Homer, Ralf and
+/// memcached, and a worker thread blocked in one of these calls is doing no
+/// useful work.  Running many more worker threads than CPUs keeps the CPUs
+/// busy while requests wait on remote servers, but if too many threads are
+/// runnable at once they just contend for the CPUs and locks.  This class
+/// allows a large pool of worker threads while keeping the number that are
+/// runnable close to a configured limit - a thread gives up its slot when it
+/// starts a blocking call (marked with a BlockingCall object) and another
+/// worker can then start processing a message.
+///
+/// A thread that finishes a blocking call takes its slot back without
+/// waiting, so the number of active threads can briefly exceed the limit,
+/// but no new messages are started until it falls back below the limit.
+class WorkerThrottle
+{
+public:
+  /// Constructor.
+  ///
+  /// @param max_active  - Maximum number of threads processing messages and
+  ///                      not blocked on a remote server.
+  WorkerThrottle(int max_active);
+  ~WorkerThrottle();
+
+  /// Called by a worker thread before processing a message.  Waits until
+  /// fewer than the maximum number of threads are active.
+  void start_work();
+
+  /// Called by a worker thread when it has finished processing a message.
+  void end_work();
+
+  /// Number of threads processing messages and not blocked.
+  int active();
+
+  /// Number of threads processing messages but blocked on a remote server.
+  int blocked();
+
+  inline int max_active() const { return _max_active; }
+
+  /// Marks the scope of a blocking call to a remote server.  If the
+  /// calling thread is a throttled worker thread it gives up its slot for
+  /// the lifetime of this object, otherwise this has no effect.
+  class BlockingCall
+  {
+  public:
+    BlockingCall();
+    ~BlockingCall();
+
+  private:
+    WorkerThrottle* _throttle;
+  };
+
+private:
+  void blocking_start();
+  void blocking_end();
+
+  /// The throttle (if any) the current thread is doing work under.
+  static __thread WorkerThrottle* _current;
+
+  const int _max_active;
+  int _active;
+  int _blocked;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+};
+
+#endif
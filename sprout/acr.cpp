@@ -40,6 +40,7 @@
 #include "constants.h"
 #include "custom_headers.h"
 #include "acr.h"
+#include "worker_throttle.h"
 
 const pj_time_val ACR::unspec = {-1,0};
 
@@ -646,10 +647,12 @@ void RalfACR::send_message(pj_time_val timestamp)
               ACR::node_name(_node_functionality).c_str(), this);
   std::string path = "/call-id/" + Utils::url_escape(_user_session_id);
   std::map<std::string, std::string> headers;
-  long rc = _ralf->send_post(path,
-                             headers,
-                             get_message(timestamp),
-                             _trail);
+  std::string message = get_message(timestamp);
+  long rc;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    rc = _ralf->send_post(path, headers, message, _trail);
+  }
 
   if (rc != HTTP_OK)
   {
@@ -0,0 +1,125 @@
+/**
+ * @file aor_cache.cpp In-process cache of AoR records read from the store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "log.h"
+#include "aor_cache.h"
+
+const uint64_t AoRCache::UNKNOWN_CAS;
+
+AoRCache::AoRCache(const std::string& stat_prefix,
+                   int max_entries,
+                   int staleness_ms,
+                   LastValueCache* lvc,
+                   int num_shards) :
+  _staleness_ms((staleness_ms > 0) ? staleness_ms : 0),
+  _cache(max_entries, num_shards),
+  _hits_counter(stat_prefix + "_hits", lvc),
+  _misses_counter(stat_prefix + "_misses", lvc),
+  _revalidated_counter(stat_prefix + "_revalidated", lvc),
+  _stale_counter(stat_prefix + "_stale", lvc)
+{
+}
+
+
+bool AoRCache::get(const std::string& aor_id, std::string& data, uint64_t& cas)
+{
+  // Records outside the staleness window are kept, so that when the record
+  // is next read from the store put_read can tell whether it had changed.
+  Record record;
+  bool found = _cache.get(aor_id, _staleness_ms, false, record);
+
+  if (found)
+  {
+    data.swap(record.data);
+    cas = record.cas;
+    _hits_counter.increment();
+  }
+  else
+  {
+    _misses_counter.increment();
+  }
+
+  return found;
+}
+
+
+void AoRCache::put_read(const std::string& aor_id,
+                        const std::string& data,
+                        uint64_t cas)
+{
+  put(aor_id, data, cas, true);
+}
+
+
+void AoRCache::put_write(const std::string& aor_id, const std::string& data)
+{
+  put(aor_id, data, UNKNOWN_CAS, false);
+}
+
+
+void AoRCache::put(const std::string& aor_id,
+                   const std::string& data,
+                   uint64_t cas,
+                   bool from_read)
+{
+  Record record;
+  record.data = data;
+  record.cas = cas;
+
+  Record replaced;
+  if ((_cache.put(aor_id, record, &replaced)) &&
+      (from_read) &&
+      (replaced.cas != UNKNOWN_CAS))
+  {
+    // This replaces a record previously read from the store, so check
+    // whether the record has changed since, which shows whether the cached
+    // copy went stale.
+    if (replaced.cas == cas)
+    {
+      _revalidated_counter.increment();
+    }
+    else
+    {
+      _stale_counter.increment();
+    }
+  }
+}
+
+
+void AoRCache::invalidate(const std::string& aor_id)
+{
+  _cache.remove(aor_id);
+}
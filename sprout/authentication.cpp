@@ -60,6 +60,7 @@ extern "C" {
 #include "hssconnection.h"
 #include "authentication.h"
 #include "avstore.h"
+#include "worker_throttle.h"
 
 
 //
@@ -404,6 +405,7 @@ void create_challenge(pjsip_authorization_hdr* auth_hdr,
       std::string timer_id;
       std::string chronos_body = "{\"impi\": \"" + impi + "\", \"impu\": \"" + impu +"\", \"nonce\": \"" + nonce +"\"}";
       LOG_DEBUG("Sending %s to Chronos to set AV timer", chronos_body.c_str());
+      WorkerThrottle::BlockingCall blocking;
       chronos->send_post(timer_id, 30, "/authentication-timeout", chronos_body, 0);
     }
 
@@ -40,6 +40,7 @@
 #include "log.h"
 #include "store.h"
 #include "avstore.h"
+#include "worker_throttle.h"
 #include "sas.h"
 #include "sproutsasevent.h"
 
@@ -63,7 +64,11 @@ bool AvStore::set_av(const std::string& impi,
   Json::FastWriter writer;
   std::string data = writer.write(*av);
   LOG_DEBUG("Set AV for %s\n%s", key.c_str(), data.c_str());
-  Store::Status status = _data_store->set_data("av", key, data, 0, AV_EXPIRY, trail);
+  Store::Status status;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->set_data("av", key, data, 0, AV_EXPIRY, trail);
+  }
   std::string operation = "SET";
   if (status != Store::Status::OK)
   {
@@ -94,7 +99,11 @@ bool AvStore::delete_av(const std::string& impi,
 {
   std::string key = impi + '\\' + nonce;
   LOG_DEBUG("Delete AV for %s", key.c_str());
-  Store::Status status = _data_store->delete_data("av", key, trail);
+  Store::Status status;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->delete_data("av", key, trail);
+  }
   std::string operation = "DELETE";
   if (status != Store::Status::OK)
   {
@@ -128,7 +137,11 @@ Json::Value* AvStore::get_av(const std::string& impi,
   std::string key = impi + '\\' + nonce;
   std::string data;
   uint64_t cas;
-  Store::Status status = _data_store->get_data("av", key, data, cas, trail);
+  Store::Status status;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->get_data("av", key, data, cas, trail);
+  }
   std::string operation = "GET";
 
   if (status == Store::Status::OK)
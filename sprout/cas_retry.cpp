@@ -0,0 +1,133 @@
+/**
+ * @file cas_retry.cpp Retry policy and statistics for CAS updates.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+#include "cas_retry.h"
+#include "worker_throttle.h"
+
+CasRetry::CasRetry(const std::string& stat_prefix,
+                   LastValueCache* lvc,
+                   int max_retries,
+                   int max_backoff_ms) :
+  _max_retries(max_retries),
+  _max_backoff_us(max_backoff_ms * 1000),
+  _retries_histogram(stat_prefix + "_cas_retries", lvc),
+  _conflicts_counter(stat_prefix + "_cas_conflicts", lvc),
+  _exhausted_counter(stat_prefix + "_cas_exhausted", lvc)
+{
+}
+
+
+int CasRetry::backoff_limit_us(int retry) const
+{
+  // Double the limit for each retry, stopping once it reaches the maximum
+  // (which also keeps the shift in range).
+  int limit = INITIAL_BACKOFF_US;
+  for (int ii = 1; (ii < retry) && (limit < _max_backoff_us); ++ii)
+  {
+    limit *= 2;
+  }
+  return (limit < _max_backoff_us) ? limit : _max_backoff_us;
+}
+
+
+int CasRetry::retry_after_secs() const
+{
+  long total_us = 0;
+  for (int ii = 1; ii <= _max_retries; ++ii)
+  {
+    total_us += backoff_limit_us(ii);
+  }
+  int secs = (int)((total_us + 999999) / 1000000);
+  return (secs > 0) ? secs : 1;
+}
+
+
+CasRetry::Update::Update(CasRetry* cas_retry) :
+  _cas_retry(cas_retry),
+  _retries(0),
+  _exhausted(false)
+{
+}
+
+
+CasRetry::Update::~Update()
+{
+  _cas_retry->_retries_histogram.record(_retries);
+}
+
+
+bool CasRetry::Update::retry()
+{
+  _cas_retry->_conflicts_counter.increment();
+
+  if (_retries >= _cas_retry->_max_retries)
+  {
+    LOG_WARNING("Giving up update after %d retries", _retries);
+    _cas_retry->_exhausted_counter.increment();
+    _exhausted = true;
+    return false;
+  }
+
+  ++_retries;
+  int limit_us = _cas_retry->backoff_limit_us(_retries);
+
+  if (limit_us > 0)
+  {
+    // Wait for a random time up to the limit, so that updates that
+    // conflicted with each other are unlikely to collide again.  The
+    // worker thread isn't doing anything useful while it waits, so let
+    // another one run.
+    static __thread unsigned int seed = 0;
+    if (seed == 0)
+    {
+      seed = (unsigned int)time(NULL) ^ (unsigned int)(unsigned long)&seed;
+    }
+    long wait_us = rand_r(&seed) % (limit_us + 1);
+    LOG_DEBUG("Retry %d after %ldus", _retries, wait_us);
+
+    struct timespec ts;
+    ts.tv_sec = wait_us / 1000000;
+    ts.tv_nsec = (wait_us % 1000000) * 1000;
+    WorkerThrottle::BlockingCall blocking;
+    nanosleep(&ts, NULL);
+  }
+
+  return true;
+}
@@ -34,6 +34,7 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <algorithm>
 #include <json/reader.h>
 
 extern "C" {
@@ -48,64 +49,139 @@ extern "C" {
 #include "ifchandler.h"
 #include "registration_utils.h"
 
-static bool reg_store_access_common(RegStore::AoR** aor_data, bool& previous_aor_data_alloced,
-                                    std::string aor_id, RegStore* current_store,
-                                    RegStore* remote_store, RegStore::AoR** previous_aor_data,
-                                    SAS::TrailId trail)
+/// Copy the bindings and subscriptions of one AoR into another.
+static void copy_bindings(RegStore::AoR* src, RegStore::AoR* dst)
 {
-  // Find the current bindings for the AoR.
-  delete *aor_data;
-  *aor_data = current_store->get_aor_data(aor_id, trail);
-  LOG_DEBUG("Retrieved AoR data %p", *aor_data);
+  //LCOV_EXCL_START
+  for (RegStore::AoR::Bindings::const_iterator i = src->bindings().begin();
+       i != src->bindings().end();
+       ++i)
+  {
+    RegStore::AoR::Binding* dst_b = dst->get_binding(i->first);
+    *dst_b = *(i->second);
+  }
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = src->subscriptions().begin();
+       i != src->subscriptions().end();
+       ++i)
+  {
+    RegStore::AoR::Subscription* dst_s = dst->get_subscription(i->first);
+    *dst_s = *(i->second);
+  }
+  //LCOV_EXCL_STOP
+}
 
-  if (*aor_data == NULL)
+/// Read a batch of AoRs from the current store into aor_data.  Any AoR that
+/// has no bindings takes them from its entry in previous_aor_data.  AoRs
+/// with no entry there are read from the remote store (if there is one) in
+/// a second batch, and added to previous_aor_data.
+static bool reg_store_access_common(const std::vector<std::string>& aor_ids,
+                                    std::map<std::string, RegStore::AoR*>& aor_data,
+                                    RegStore* current_store,
+                                    RegStore* remote_store,
+                                    std::map<std::string, RegStore::AoR*>& previous_aor_data,
+                                    SAS::TrailId trail)
+{
+  // Find the current bindings for the AoRs.
+  if (!current_store->get_aor_data_multi(aor_ids, aor_data, trail))
   {
-    // Failed to get data for the AoR because there is no connection
+    // Failed to get data for an AoR because there is no connection
     // to the store.
     // LCOV_EXCL_START - local store (used in testing) never fails
-    LOG_ERROR("Failed to get AoR binding for %s from store", aor_id.c_str());
+    LOG_ERROR("Failed to get AoR bindings for %d AoRs from store", aor_ids.size());
     return false;
     // LCOV_EXCL_STOP
   }
 
-  // If we don't have any bindings, try the backup AoR and/or store.
-  if ((*aor_data)->bindings().empty())
+  // If we don't have any bindings, try the backup AoRs and/or store.
+  std::vector<std::string> empty_ids;
+  std::vector<std::string> remote_ids;
+
+  for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+       i != aor_ids.end();
+       ++i)
   {
-    if ((*previous_aor_data == NULL) &&
-        (remote_store != NULL))
+    if (aor_data[*i]->bindings().empty())
     {
-      *previous_aor_data = remote_store->get_aor_data(aor_id, trail);
-      previous_aor_data_alloced = true;
-    }
+      empty_ids.push_back(*i);
 
-    if ((*previous_aor_data != NULL) &&
-        (!(*previous_aor_data)->bindings().empty()))
-    {
-      //LCOV_EXCL_START
-      for (RegStore::AoR::Bindings::const_iterator i = (*previous_aor_data)->bindings().begin();
-           i != (*previous_aor_data)->bindings().end();
-           ++i)
+      if (previous_aor_data.find(*i) == previous_aor_data.end())
       {
-        RegStore::AoR::Binding* src = i->second;
-        RegStore::AoR::Binding* dst = (*aor_data)->get_binding(i->first);
-        *dst = *src;
+        remote_ids.push_back(*i);
       }
+    }
+  }
 
-      for (RegStore::AoR::Subscriptions::const_iterator i = (*previous_aor_data)->subscriptions().begin();
-           i != (*previous_aor_data)->subscriptions().end();
-           ++i)
-      {
-        RegStore::AoR::Subscription* src = i->second;
-        RegStore::AoR::Subscription* dst = (*aor_data)->get_subscription(i->first);
-        *dst = *src;
-      }
-      //LCOV_EXCL_STOP
+  if ((!remote_ids.empty()) &&
+      (remote_store != NULL))
+  {
+    // Failures here are ignored - the AoRs are just left without bindings.
+    remote_store->get_aor_data_multi(remote_ids, previous_aor_data, trail);
+  }
+
+  for (std::vector<std::string>::const_iterator i = empty_ids.begin();
+       i != empty_ids.end();
+       ++i)
+  {
+    std::map<std::string, RegStore::AoR*>::const_iterator previous =
+                                                   previous_aor_data.find(*i);
+
+    if ((previous != previous_aor_data.end()) &&
+        (previous->second != NULL) &&
+        (!previous->second->bindings().empty()))
+    {
+      copy_bindings(previous->second, aor_data[*i]);
     }
   }
 
   return true;
 }
 
+/// Delete a batch of AoRs.
+static void delete_aor_data(std::map<std::string, RegStore::AoR*>& aor_data)
+{
+  for (std::map<std::string, RegStore::AoR*>::iterator i = aor_data.begin();
+       i != aor_data.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  aor_data.clear();
+}
+
+/// Work out which AoRs in a batch still need to be read, because they
+/// haven't been read yet or their last update was rejected.  Rejected AoRs
+/// are deleted so that they are read again.
+static std::vector<std::string> unread_aor_ids(const std::vector<std::string>& aor_ids,
+                                               std::map<std::string, RegStore::AoR*>& aor_data,
+                                               const std::set<std::string>& rejected)
+{
+  std::vector<std::string> unread_ids;
+
+  for (std::set<std::string>::const_iterator i = rejected.begin();
+       i != rejected.end();
+       ++i)
+  {
+    // LCOV_EXCL_START - no UT for CAS contention
+    delete aor_data[*i];
+    aor_data.erase(*i);
+    // LCOV_EXCL_STOP
+  }
+
+  for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+       i != aor_ids.end();
+       ++i)
+  {
+    if (aor_data.find(*i) == aor_data.end())
+    {
+      unread_ids.push_back(*i);
+    }
+  }
+
+  return unread_ids;
+}
+
 //LCOV_EXCL_START - don't want to actually run the handlers in the UT
 void RegistrationTimeoutHandler::run()
 {
@@ -130,9 +206,15 @@ void RegistrationTimeoutHandler::run()
 
   SAS::Marker start_marker(trail(), MARKER_ID_START, 1u);
   SAS::report_marker(start_marker);
-  SAS::Marker calling_dn(trail(), MARKER_ID_CALLING_DN, 1u);
-  calling_dn.add_var_param(_aor_id);
-  SAS::report_marker(calling_dn);
+
+  for (std::vector<std::string>::const_iterator i = _aor_ids.begin();
+       i != _aor_ids.end();
+       ++i)
+  {
+    SAS::Marker calling_dn(trail(), MARKER_ID_CALLING_DN, 1u);
+    calling_dn.add_var_param(*i);
+    SAS::report_marker(calling_dn);
+  }
 
   handle_response();
 
@@ -216,68 +298,163 @@ void DeregistrationHandler::run()
 
 void RegistrationTimeoutHandler::handle_response()
 {
-  bool all_bindings_expired = false;
-  RegStore::AoR* aor_data = set_aor_data(_cfg->_store, _aor_id, NULL, _cfg->_remote_store, true, all_bindings_expired);
+  expire_bindings(_cfg, _aor_ids, trail());
+}
+
+HTTPCode RegistrationTimeoutHandler::handle_timer_pop(const Config* cfg,
+                                                      const std::string& opaque,
+                                                      SAS::TrailId trail)
+{
+  std::string aor_id;
+  std::string binding_id;
+  HTTPCode rc = parse_opaque(opaque, aor_id, binding_id);
+
+  if (rc != HTTP_OK)
+  {
+    LOG_DEBUG("Unable to parse local timer pop");
+    return rc;
+  }
+
+  SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
+  SAS::report_marker(start_marker);
+  SAS::Marker calling_dn(trail, MARKER_ID_CALLING_DN, 1u);
+  calling_dn.add_var_param(aor_id);
+  SAS::report_marker(calling_dn);
+
+  expire_bindings(cfg, std::vector<std::string>(1, aor_id), trail);
+
+  SAS::Marker end_marker(trail, MARKER_ID_END, 1u);
+  SAS::report_marker(end_marker);
+
+  return HTTP_OK;
+}
+
+void RegistrationTimeoutHandler::expire_bindings(const Config* cfg,
+                                                 const std::vector<std::string>& aor_ids,
+                                                 SAS::TrailId trail)
+{
+  std::map<std::string, RegStore::AoR*> aor_data;
+  std::map<std::string, RegStore::AoR*> previous_aor_data;
+  std::set<std::string> all_bindings_expired;
 
-  if (aor_data != NULL)
+  if (set_aor_data(cfg->_store, aor_ids, aor_data, previous_aor_data,
+                   cfg->_remote_store, true, all_bindings_expired, trail))
   {
     // If we have a remote store, try to store this there too.  We don't worry
     // about failures in this case.
-    if (_cfg->_remote_store != NULL)
+    if (cfg->_remote_store != NULL)
     {
-      bool ignored;
-      RegStore::AoR* remote_aor_data = set_aor_data(_cfg->_remote_store, _aor_id, aor_data, NULL, false, ignored);
-      delete remote_aor_data;
+      std::map<std::string, RegStore::AoR*> remote_aor_data;
+      std::set<std::string> ignored;
+      set_aor_data(cfg->_remote_store, aor_ids, remote_aor_data, aor_data,
+                   NULL, false, ignored, trail);
+      delete_aor_data(remote_aor_data);
     }
 
-    if (all_bindings_expired)
+    for (std::set<std::string>::const_iterator i = all_bindings_expired.begin();
+         i != all_bindings_expired.end();
+         ++i)
     {
       LOG_DEBUG("All bindings have expired based on a Chronos callback - triggering deregistration at the HSS");
-      _cfg->_hss->update_registration_state(_aor_id, "", HSSConnection::DEREG_TIMEOUT, 0);
+      cfg->_hss->update_registration_state(*i, "", HSSConnection::DEREG_TIMEOUT, 0);
     }
   }
 
-  delete aor_data;
+  delete_aor_data(aor_data);
+  delete_aor_data(previous_aor_data);
 }
 
-RegStore::AoR* RegistrationTimeoutHandler::set_aor_data(RegStore* current_store,
-                                                        std::string aor_id,
-                                                        RegStore::AoR* previous_aor_data,
-                                                        RegStore* remote_store,
-                                                        bool is_primary,
-                                                        bool& all_bindings_expired)
+/// Rewrite a batch of AoRs so that their expired bindings are removed,
+/// retrying any AoRs whose update is rejected.
+bool RegistrationTimeoutHandler::set_aor_data(RegStore* current_store,
+                                              const std::vector<std::string>& aor_ids,
+                                              std::map<std::string, RegStore::AoR*>& aor_data,
+                                              std::map<std::string, RegStore::AoR*>& previous_aor_data,
+                                              RegStore* remote_store,
+                                              bool is_primary,
+                                              std::set<std::string>& all_bindings_expired,
+                                              SAS::TrailId trail)
 {
-  RegStore::AoR* aor_data = NULL;
-  bool previous_aor_data_alloced = false;
+  bool success;
+  std::set<std::string> rejected;
 
-  do
+  for (;;)
   {
-    if (!reg_store_access_common(&aor_data, previous_aor_data_alloced, aor_id,
-                                 current_store, remote_store, &previous_aor_data, trail()))
+    std::vector<std::string> unread_ids = unread_aor_ids(aor_ids, aor_data, rejected);
+    std::map<std::string, RegStore::AoR*> unwritten_aor_data;
+
+    success = reg_store_access_common(unread_ids, unwritten_aor_data, current_store,
+                                      remote_store, previous_aor_data, trail);
+    aor_data.insert(unwritten_aor_data.begin(), unwritten_aor_data.end());
+
+    if (!success)
     {
       // LCOV_EXCL_START - local store (used in testing) never fails
       break;
       // LCOV_EXCL_STOP
     }
+
+    rejected.clear();
+
+    std::set<std::string> failed;
+
+    if (current_store->set_aor_data_multi(unwritten_aor_data, is_primary, trail,
+                                          rejected, failed, all_bindings_expired))
+    {
+      break;
+    }
+
+    if (!failed.empty())
+    {
+      // Retrying won't fix a store error, so give up on the batch rather
+      // than retrying any rejected AoRs.
+      success = false;
+      break;
+    }
   }
-  while (!current_store->set_aor_data(aor_id, aor_data, is_primary, trail(), all_bindings_expired));
 
-  // If we allocated the AoR, tidy up.
-  if (previous_aor_data_alloced)
+  return success;
+}
+
+/// Retrieve the aor and binding ID from the opaque data of a single timer.
+static HTTPCode parse_timer(const Json::Value& json_body,
+                            std::string& aor_id,
+                            std::string& binding_id)
+{
+  if ((json_body.isMember("aor_id")) &&
+      ((json_body)["aor_id"].isString()))
   {
-    delete previous_aor_data;
+    aor_id = json_body.get("aor_id", "").asString();
+  }
+  else
+  {
+    LOG_WARNING("AoR ID not available in JSON");
+    return HTTP_BAD_RESULT;
   }
 
-  return aor_data;
+  if ((json_body.isMember("binding_id")) &&
+      ((json_body)["binding_id"].isString()))
+  {
+    binding_id = json_body.get("binding_id", "").asString();
+  }
+  else
+  {
+    LOG_WARNING("Binding ID not available in JSON");
+    return HTTP_BAD_RESULT;
+  }
+
+  return HTTP_OK;
 }
 
-// Retrieve the aor and binding ID from the opaque data
+// Retrieve the aor and binding ID from the opaque data.  The body is either
+// the opaque data of a single timer, or a batch of timers of the form
+// {"timers": [<opaque data>, ...]}.  Each AoR in a batch is only updated
+// once, however many of its timers have popped.
 HTTPCode RegistrationTimeoutHandler::parse_response(std::string body)
 {
   Json::Value json_body;
-  std::string json_str = body;
   Json::Reader reader;
-  bool parsingSuccessful = reader.parse(json_str.c_str(), json_body);
+  bool parsingSuccessful = reader.parse(body.c_str(), json_body);
 
   if (!parsingSuccessful)
   {
@@ -286,31 +463,74 @@ HTTPCode RegistrationTimeoutHandler::parse_response(std::string body)
     return HTTP_BAD_RESULT;
   }
 
-  if ((json_body.isMember("aor_id")) &&
-      ((json_body)["aor_id"].isString()))
+  _aor_ids.clear();
+
+  if (!json_body.isMember("timers"))
   {
-    _aor_id = json_body.get("aor_id", "").asString();
+    HTTPCode rc = parse_timer(json_body, _aor_id, _binding_id);
+    if (rc == HTTP_OK)
+    {
+      _aor_ids.push_back(_aor_id);
+    }
+    return rc;
   }
-  else
+
+  if (!json_body["timers"].isArray())
   {
-    LOG_WARNING("AoR ID not available in JSON");
+    LOG_WARNING("Timers in JSON are not an array");
     return HTTP_BAD_RESULT;
   }
 
-  if ((json_body.isMember("binding_id")) &&
-      ((json_body)["binding_id"].isString()))
+  Json::Value timers = json_body["timers"];
+  std::set<std::string> seen_aor_ids;
+
+  for (size_t ii = 0; ii < timers.size(); ++ii)
   {
-    _binding_id = json_body.get("binding_id", "").asString();
+    std::string aor_id;
+    std::string binding_id;
+    HTTPCode rc = parse_timer(timers[(int)ii], aor_id, binding_id);
+
+    if (rc != HTTP_OK)
+    {
+      _aor_ids.clear();
+      return rc;
+    }
+
+    if (seen_aor_ids.insert(aor_id).second)
+    {
+      _aor_ids.push_back(aor_id);
+    }
   }
-  else
+
+  LOG_DEBUG("Batch of %d timer pops for %d AoRs", timers.size(), _aor_ids.size());
+
+  if (!_aor_ids.empty())
   {
-    LOG_WARNING("Binding ID not available in JSON");
-    return HTTP_BAD_RESULT;
+    _aor_id = _aor_ids.front();
   }
 
   return HTTP_OK;
 }
 
+HTTPCode RegistrationTimeoutHandler::parse_opaque(const std::string& body,
+                                                  std::string& aor_id,
+                                                  std::string& binding_id)
+{
+  Json::Value json_body;
+  std::string json_str = body;
+  Json::Reader reader;
+  bool parsingSuccessful = reader.parse(json_str.c_str(), json_body);
+
+  if (!parsingSuccessful)
+  {
+    LOG_WARNING("Failed to read opaque data, %s",
+                reader.getFormattedErrorMessages().c_str());
+    return HTTP_BAD_RESULT;
+  }
+
+  return parse_timer(json_body, aor_id, binding_id);
+}
+
 // Retrieve the aors and any private IDs from the request body
 HTTPCode DeregistrationHandler::parse_request(std::string body)
 {
@@ -369,123 +589,318 @@ HTTPCode DeregistrationHandler::parse_request(std::string body)
 
 HTTPCode DeregistrationHandler::handle_request()
 {
+  // Group the AoRs by the worker thread they are processed on, so that each
+  // batch is processed in order with other updates to the same AoRs.
+  ShardedWorkerPool* pool = _cfg->_pool;
+  int num_shards = (pool != NULL) ? pool->num_threads() : 1;
+  std::vector<std::vector<std::string> > shard_aor_ids(num_shards);
+
   for (std::map<std::string, std::string>::iterator it=_bindings.begin(); it!=_bindings.end(); ++it)
   {
-    RegStore::AoR* aor_data = set_aor_data(_cfg->_store, it->first, it->second, NULL, _cfg->_remote_store, true);
+    shard_aor_ids[(pool != NULL) ? pool->shard(it->first) : 0].push_back(it->first);
+  }
+
+  pthread_mutex_lock(&_lock);
+  _total_aors = _bindings.size();
+  pthread_mutex_unlock(&_lock);
+
+  for (int ii = 0; ii < num_shards; ++ii)
+  {
+    const std::vector<std::string>& aor_ids = shard_aor_ids[ii];
 
-    if (aor_data != NULL)
+    for (size_t start = 0; start < aor_ids.size(); start += BATCH_SIZE)
     {
-      // If we have a remote store, try to store this there too.  We don't worry
-      // about failures in this case.
-      if (_cfg->_remote_store != NULL)
+      size_t end = std::min(start + BATCH_SIZE, aor_ids.size());
+      std::vector<std::string> batch(aor_ids.begin() + start,
+                                     aor_ids.begin() + end);
+
+      pthread_mutex_lock(&_lock);
+      _pending_batches++;
+      pthread_mutex_unlock(&_lock);
+
+      if (pool != NULL)
       {
-        RegStore::AoR* remote_aor_data = set_aor_data(_cfg->_remote_store, it->first, it->second, aor_data, NULL, false);
-        delete remote_aor_data;
+        Batch* work = new Batch(this, batch);
+        if (pool->submit(batch.front(), work))
+        {
+          continue;
+        }
+
+        // LCOV_EXCL_START - the pool is only stopped on shutdown
+        LOG_WARNING("Deregistration pool stopped, processing batch inline");
+        delete work;
+        // LCOV_EXCL_STOP
       }
+
+      batch_done(batch.size(), process_batch(batch));
     }
-    else
+  }
+
+  // Wait for the batches on the worker pool to finish.
+  pthread_mutex_lock(&_lock);
+  while (_pending_batches > 0)
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+  bool success = _success;
+  pthread_mutex_unlock(&_lock);
+
+  if (!success)
+  {
+    // Can't connect to memcached, return 500.  Some of the AoRs may already
+    // have been updated, which will lead to an inconsistency between the HSS
+    // and Sprout, as HSS will believe they all failed.  Sprout accepts
+    // changes to AoRs that don't exist though.
+    LOG_WARNING("Unable to connect to memcached for some of %d AoRs", _bindings.size());
+  }
+
+  return (success) ? HTTP_OK : HTTP_SERVER_ERROR;
+}
+
+/// Deregister a batch of AoRs in the local store, then in the remote store
+/// if there is one.  Returns false if the local store couldn't be updated.
+bool DeregistrationHandler::process_batch(const std::vector<std::string>& aor_ids)
+{
+  // The HSS has changed the registration state of these subscribers, so stop
+  // using any cached copy of their data.
+  if (_cfg->_hss != NULL)
+  {
+    for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+         i != aor_ids.end();
+         ++i)
     {
-      // Can't connect to memcached, return 500. If this isn't the first AoR being edited
-      // then this will lead to an inconsistency between the HSS and Sprout, as
-      // Sprout will have changed some of the AoRs, but HSS will believe they all failed.
-      // Sprout accepts changes to AoRs that don't exist though.
-      // LCOV_EXCL_START - local store (used in testing) never fails
-      LOG_WARNING("Unable to connect to memcached for AoR %s", it->first.c_str());
-      delete aor_data;
-      return HTTP_SERVER_ERROR;
-      // LCOV_EXCL_STOP
+      _cfg->_hss->invalidate_profile(*i);
     }
+  }
+
+  std::map<std::string, RegStore::AoR*> aor_data;
+  std::map<std::string, RegStore::AoR*> previous_aor_data;
+  bool success = set_aor_data(_cfg->_store, aor_ids, aor_data,
+                              previous_aor_data, _cfg->_remote_store, true);
 
-    delete aor_data;
+  if (success)
+  {
+    // If we have a remote store, try to store this there too.  We don't worry
+    // about failures in this case.
+    if (_cfg->_remote_store != NULL)
+    {
+      std::map<std::string, RegStore::AoR*> remote_aor_data;
+      set_aor_data(_cfg->_remote_store, aor_ids, remote_aor_data, aor_data,
+                   NULL, false);
+      delete_aor_data(remote_aor_data);
+    }
+  }
+  else
+  {
+    // LCOV_EXCL_START - local store (used in testing) never fails
+    LOG_WARNING("Unable to connect to memcached for %d AoRs", aor_ids.size());
+    // LCOV_EXCL_STOP
   }
 
-  return HTTP_OK;
+  delete_aor_data(aor_data);
+  delete_aor_data(previous_aor_data);
+
+  return success;
+}
+
+/// Record that a batch has been processed, logging the progress of large
+/// requests.
+void DeregistrationHandler::batch_done(size_t num_aors, bool success)
+{
+  pthread_mutex_lock(&_lock);
+
+  size_t previous_aors = _done_aors;
+  _done_aors += num_aors;
+  _success = _success && success;
+
+  if (((_done_aors / PROGRESS_INTERVAL) != (previous_aors / PROGRESS_INTERVAL)) ||
+      ((_done_aors == _total_aors) && (_total_aors > PROGRESS_INTERVAL)))
+  {
+    LOG_INFO("Deregistered %lu of %lu AoRs", _done_aors, _total_aors);
+  }
+
+  _pending_batches--;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+/// The private ID whose bindings are removed from an AoR, or an empty
+/// string if all its bindings are removed.
+const std::string& DeregistrationHandler::private_id(const std::string& aor_id) const
+{
+  static const std::string no_private_id;
+  std::map<std::string, std::string>::const_iterator i = _bindings.find(aor_id);
+  return (i != _bindings.end()) ? i->second : no_private_id;
 }
 
-RegStore::AoR* DeregistrationHandler::set_aor_data(RegStore* current_store,
-                                                   std::string aor_id,
-                                                   std::string private_id,
-                                                   RegStore::AoR* previous_aor_data,
-                                                   RegStore* remote_store,
-                                                   bool is_primary)
+/// Remove the bindings for the requested private IDs from a batch of AoRs,
+/// retrying any AoRs whose update is rejected, then deregister AoRs with no
+/// private ID from their application servers.
+bool DeregistrationHandler::set_aor_data(RegStore* current_store,
+                                         const std::vector<std::string>& aor_ids,
+                                         std::map<std::string, RegStore::AoR*>& aor_data,
+                                         std::map<std::string, RegStore::AoR*>& previous_aor_data,
+                                         RegStore* remote_store,
+                                         bool is_primary)
 {
-  RegStore::AoR* aor_data = NULL;
-  bool previous_aor_data_alloced = false;
-  bool all_bindings_expired = false;
+  bool success;
+  std::set<std::string> rejected;
+  std::set<std::string> all_bindings_expired;
 
-  do
+  for (;;)
   {
-    if (!reg_store_access_common(&aor_data, previous_aor_data_alloced, aor_id,
-                                 current_store, remote_store, &previous_aor_data, trail()))
+    std::vector<std::string> unread_ids = unread_aor_ids(aor_ids, aor_data, rejected);
+    std::map<std::string, RegStore::AoR*> unwritten_aor_data;
+
+    success = reg_store_access_common(unread_ids, unwritten_aor_data, current_store,
+                                      remote_store, previous_aor_data, trail());
+    aor_data.insert(unwritten_aor_data.begin(), unwritten_aor_data.end());
+
+    if (!success)
     {
       // LCOV_EXCL_START - local store (used in testing) never fails
       break;
       // LCOV_EXCL_STOP
     }
 
-    std::vector<std::string> binding_ids;
-
-    for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
-         i != aor_data->bindings().end();
+    for (std::map<std::string, RegStore::AoR*>::const_iterator i = unwritten_aor_data.begin();
+         i != unwritten_aor_data.end();
          ++i)
     {
-      // Get a list of the bindings to iterate over
-      binding_ids.push_back(i->first);
+      remove_bindings(current_store, i->second, private_id(i->first), is_primary);
     }
 
-    for (std::vector<std::string>::const_iterator i = binding_ids.begin();
-         i != binding_ids.end();
-         ++i)
+    rejected.clear();
+
+    std::set<std::string> failed;
+
+    if (current_store->set_aor_data_multi(unwritten_aor_data, is_primary, trail(),
+                                          rejected, failed, all_bindings_expired))
     {
-      std::string b_id = *i;
-      RegStore::AoR::Binding* b = aor_data->get_binding(b_id);
+      break;
+    }
 
-      if (private_id == "" || private_id == b->_private_id)
-      {
-        // Update the cseq
-        aor_data->_notify_cseq++;
+    if (!failed.empty())
+    {
+      // Retrying won't fix a store error, so give up on the batch rather
+      // than retrying any rejected AoRs.
+      success = false;
+      break;
+    }
+  }
 
-        // The binding matches the private id, or no private id was supplied.
-        // Send a SIP NOTIFY for this binding if there are any subscriptions
-        if (_notify == "true" && is_primary)
+  for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+       i != aor_ids.end();
+       ++i)
+  {
+    if (private_id(*i) == "")
+    {
+      // Deregister with any application servers
+      std::vector<std::string> uris;
+      std::map<std::string, Ifcs> ifc_map;
+      std::string state;
+      LOG_INFO("ID %s", i->c_str());
+      _cfg->_hss->get_registration_data(*i, state, ifc_map, uris, 0);
+      RegistrationUtils::deregister_with_application_servers(ifc_map[*i], current_store, *i, 0);
+    }
+  }
+
+  return success;
+}
+
+/// Remove the bindings for a private ID (or all bindings if no private ID
+/// is supplied) from an AoR, sending NOTIFYs for them.
+void DeregistrationHandler::remove_bindings(RegStore* current_store,
+                                            RegStore::AoR* aor_data,
+                                            const std::string& private_id,
+                                            bool is_primary)
+{
+  std::vector<std::string> binding_ids;
+
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    // Get a list of the bindings to iterate over
+    binding_ids.push_back(i->first);
+  }
+
+  for (std::vector<std::string>::const_iterator i = binding_ids.begin();
+       i != binding_ids.end();
+       ++i)
+  {
+    std::string b_id = *i;
+    RegStore::AoR::Binding* b = aor_data->get_binding(b_id);
+
+    if (private_id == "" || private_id == b->_private_id)
+    {
+      // Update the cseq
+      aor_data->_notify_cseq++;
+
+      // The binding matches the private id, or no private id was supplied.
+      // Send a SIP NOTIFY for this binding if there are any subscriptions
+      if (_notify == "true" && is_primary)
+      {
+        for (RegStore::AoR::Subscriptions::const_iterator j = aor_data->subscriptions().begin();
+            j != aor_data->subscriptions().end();
+             ++j)
         {
-          for (RegStore::AoR::Subscriptions::const_iterator j = aor_data->subscriptions().begin();
-              j != aor_data->subscriptions().end();
-               ++j)
-          {
-            // LCOV_EXCL_START
-            current_store->send_notify(j->second, aor_data->_notify_cseq, b, b_id);
-            // LCOV_EXCL_STOP
-          }
+          // LCOV_EXCL_START
+          current_store->send_notify(j->second, aor_data->_notify_cseq, b, b_id);
+          // LCOV_EXCL_STOP
         }
-
-        aor_data->remove_binding(b_id);
       }
+
+      aor_data->remove_binding(b_id);
     }
   }
-  while (!current_store->set_aor_data(aor_id, aor_data, is_primary, trail(), all_bindings_expired));
+}
 
-  if (private_id == "")
+HTTPCode AuthTimeoutHandler::handle_response(std::string body)
+{
+  HTTPCode rc = parse_opaque(body, _impi, _impu, _nonce);
+
+  if (rc != HTTP_OK)
   {
-    // Deregister with any application servers
-    std::vector<std::string> uris;
-    std::map<std::string, Ifcs> ifc_map;
-    std::string state;
-    LOG_INFO("ID %s", aor_id.c_str());
-    _cfg->_hss->get_registration_data(aor_id, state, ifc_map, uris, 0);
-    RegistrationUtils::deregister_with_application_servers(ifc_map[aor_id], current_store, aor_id, 0);
+    return rc;
   }
 
-  // If we allocated the AoR, tidy up.
-  if (previous_aor_data_alloced)
+  return handle_timeout(_cfg, _impi, _impu, _nonce, trail());
+}
+
+HTTPCode AuthTimeoutHandler::handle_timer_pop(const Config* cfg,
+                                              const std::string& opaque,
+                                              SAS::TrailId trail)
+{
+  std::string impi;
+  std::string impu;
+  std::string nonce;
+  HTTPCode rc = parse_opaque(opaque, impi, impu, nonce);
+
+  if (rc != HTTP_OK)
   {
-    delete previous_aor_data;
+    LOG_DEBUG("Unable to parse local timer pop");
+    return rc;
   }
 
-  return aor_data;
+  SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
+  SAS::report_marker(start_marker);
+  SAS::Marker calling_dn(trail, MARKER_ID_CALLING_DN, 1u);
+  calling_dn.add_var_param(impu);
+  SAS::report_marker(calling_dn);
+
+  rc = handle_timeout(cfg, impi, impu, nonce, trail);
+
+  SAS::Marker end_marker(trail, MARKER_ID_END, 1u);
+  SAS::report_marker(end_marker);
+
+  return rc;
 }
 
-HTTPCode AuthTimeoutHandler::handle_response(std::string body)
+HTTPCode AuthTimeoutHandler::parse_opaque(const std::string& body,
+                                          std::string& impi,
+                                          std::string& impu,
+                                          std::string& nonce)
 {
   Json::Value json_body;
   std::string json_str = body;
@@ -502,7 +917,7 @@ HTTPCode AuthTimeoutHandler::handle_response(std::string body)
   if ((json_body.isMember("impi")) &&
       ((json_body)["impi"].isString()))
   {
-    _impi = json_body.get("impi", "").asString();
+    impi = json_body.get("impi", "").asString();
   }
   else
   {
@@ -513,7 +928,7 @@ HTTPCode AuthTimeoutHandler::handle_response(std::string body)
   if ((json_body.isMember("impu")) &&
       ((json_body)["impu"].isString()))
   {
-    _impu = json_body.get("impu", "").asString();
+    impu = json_body.get("impu", "").asString();
   }
   else
   {
@@ -524,7 +939,7 @@ HTTPCode AuthTimeoutHandler::handle_response(std::string body)
   if ((json_body.isMember("nonce")) &&
       ((json_body)["nonce"].isString()))
   {
-    _nonce = json_body.get("nonce", "").asString();
+    nonce = json_body.get("nonce", "").asString();
   }
   else
   {
@@ -532,7 +947,16 @@ HTTPCode AuthTimeoutHandler::handle_response(std::string body)
     return HTTP_BAD_RESULT;
   }
 
-  Json::Value* json = _cfg->_avstore->get_av(_impi, _nonce, trail());
+  return HTTP_OK;
+}
+
+HTTPCode AuthTimeoutHandler::handle_timeout(const Config* cfg,
+                                            const std::string& impi,
+                                            const std::string& impu,
+                                            const std::string& nonce,
+                                            SAS::TrailId trail)
+{
+  Json::Value* json = cfg->_avstore->get_av(impi, nonce, trail);
   bool success = false;
   HTTPCode hss_query = HTTP_OK;
 
@@ -547,7 +971,7 @@ HTTPCode AuthTimeoutHandler::handle_response(std::string body)
   }
   else
   {
-    LOG_DEBUG("AV for %s:%s has timed out", _impi.c_str(), _nonce.c_str());
+    LOG_DEBUG("AV for %s:%s has timed out", impi.c_str(), nonce.c_str());
 
     // Note that both AV deletion and the AUTHENTICATION_TIMEOUT SAR
     // are idempotent, so there's no problem if Chronos' timer pops
@@ -557,13 +981,13 @@ HTTPCode AuthTimeoutHandler::handle_response(std::string body)
     // If either of these operations fail, we return a 500 Internal
     // Server Error - this will trigger Chronos to try a different
     // Sprout, which may have better connectivity to Homestead or Memcached.
-    hss_query = _cfg->_hss->update_registration_state(_impu, _impi, HSSConnection::AUTH_TIMEOUT, 0);
+    hss_query = cfg->_hss->update_registration_state(impu, impi, HSSConnection::AUTH_TIMEOUT, 0);
 
     if (hss_query == HTTP_OK)
     {
-      success = _cfg->_avstore->delete_av(_impi, _nonce, trail());
+      success = cfg->_avstore->delete_av(impi, nonce, trail);
       if (!success) {
-        LOG_ERROR("Tried to delete AV for %s/%s based on a Chronos timer pop, but failed", _impi.c_str(), _nonce.c_str()); // LCOV_EXCL_LINE
+        LOG_ERROR("Tried to delete AV for %s/%s based on a Chronos timer pop, but failed", impi.c_str(), nonce.c_str()); // LCOV_EXCL_LINE
       }
 
     }
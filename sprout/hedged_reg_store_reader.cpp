@@ -0,0 +1,352 @@
+/**
+ * @file hedged_reg_store_reader.cpp Hedged reads of registration records
+ * from the local and remote stores.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "log.h"
+#include "stack.h"
+#include "pjutils.h"
+#include "worker_throttle.h"
+#include "hedged_reg_store_reader.h"
+
+HedgedRegStoreReader::HedgedRegStoreReader(RegStore* local_store,
+                                           RegStore* remote_store,
+                                           int num_threads,
+                                           double percentile,
+                                           LastValueCache* lvc) :
+  _num_threads(num_threads),
+  _percentile(percentile),
+  _terminated(false),
+  _idle_threads(0),
+  _queue(),
+  _threads(),
+  _latencies(),
+  _period_start_us(now_us()),
+  _hedge_delay_us(DEFAULT_DELAY_US),
+  _hedged_counter("hedged_reads", lvc),
+  _wins_counter("hedged_read_wins", lvc)
+{
+  _stores[LOCAL] = local_store;
+  _stores[REMOTE] = remote_store;
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_work_cond, NULL);
+}
+
+
+HedgedRegStoreReader::~HedgedRegStoreReader()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_work_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pj_thread_t*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pj_thread_join(*i);
+    pj_thread_destroy(*i);
+  }
+
+  // Fail any reads that were never started, so their callers don't wait
+  // for ever.
+  pthread_mutex_lock(&_lock);
+  while (!_queue.empty())
+  {
+    Task task = _queue.front();
+    _queue.pop_front();
+    task.read->done[task.source] = true;
+    pthread_cond_broadcast(&task.read->cond);
+    release(task.read);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  pthread_cond_destroy(&_work_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void HedgedRegStoreReader::start()
+{
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pj_thread_t* thread;
+    pj_status_t status = pj_thread_create(stack_data.pool, "hedged-reader",
+                                          &reader_thread,
+                                          (void*)this, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating hedged reader thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      continue;
+      // LCOV_EXCL_STOP
+    }
+    _threads.push_back(thread);
+  }
+}
+
+
+bool HedgedRegStoreReader::get_aor_view(const std::string& aor_id,
+                                        pj_pool_t* pool,
+                                        RegStore::AoRView& view,
+                                        SAS::TrailId trail)
+{
+  pthread_mutex_lock(&_lock);
+
+  if ((int)_queue.size() >= _idle_threads)
+  {
+    // There is no reader thread free to make the local read, so make the
+    // reads here, one after the other.
+    pthread_mutex_unlock(&_lock);
+    LOG_DEBUG("No hedged reader thread free, reading %s serially", aor_id.c_str());
+    bool found = _stores[LOCAL]->get_aor_view(aor_id, pool, view, trail);
+    if ((!found) || (view.num_bindings() == 0))
+    {
+      _stores[REMOTE]->get_aor_view(aor_id, pool, view, trail);
+    }
+    return found;
+  }
+
+  Read* read = new Read();
+  read->aor_id = aor_id;
+  read->trail = trail;
+  read->refs = 1;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&read->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  for (int ii = LOCAL; ii <= REMOTE; ++ii)
+  {
+    read->started[ii] = false;
+    read->done[ii] = false;
+    read->found[ii] = false;
+    read->pools[ii] = NULL;
+  }
+
+  queue_read(read, LOCAL);
+
+  {
+    WorkerThrottle::BlockingCall blocking;
+
+    // Give the local read until the hedge delay to return.
+    uint64_t deadline_us = now_us() + hedge_delay_us();
+    struct timespec deadline;
+    deadline.tv_sec = deadline_us / 1000000;
+    deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+    int rc = 0;
+    while ((!read->done[LOCAL]) && (rc == 0))
+    {
+      rc = pthread_cond_timedwait(&read->cond, &_lock, &deadline);
+    }
+
+    if (!usable(read, LOCAL))
+    {
+      if (!read->done[LOCAL])
+      {
+        LOG_DEBUG("Local read of %s is slow, starting remote read", aor_id.c_str());
+        _hedged_counter.increment();
+      }
+      queue_read(read, REMOTE);
+
+      // Wait for either read to return bindings, or both to finish.
+      while ((!usable(read, LOCAL)) &&
+             (!usable(read, REMOTE)) &&
+             ((!read->done[LOCAL]) || (!read->done[REMOTE])))
+      {
+        pthread_cond_wait(&read->cond, &_lock);
+      }
+    }
+  }
+
+  bool found = read->found[LOCAL];
+  if (usable(read, LOCAL))
+  {
+    view.copy(read->views[LOCAL], pool);
+  }
+  else if (usable(read, REMOTE))
+  {
+    if (!read->done[LOCAL])
+    {
+      LOG_DEBUG("Using remote read of %s", aor_id.c_str());
+      _wins_counter.increment();
+    }
+    view.copy(read->views[REMOTE], pool);
+    found = true;
+  }
+  else
+  {
+    view = RegStore::AoRView();
+  }
+
+  release(read);
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
+
+
+/// Queue one of the reads.  Must be called with the lock held.
+void HedgedRegStoreReader::queue_read(Read* read, Source source)
+{
+  Task task;
+  task.read = read;
+  task.source = source;
+  read->started[source] = true;
+  read->refs++;
+  _queue.push_back(task);
+  pthread_cond_signal(&_work_cond);
+}
+
+
+/// Drop a reference to a read, freeing it when it is no longer used.  Must
+/// be called with the lock held.
+void HedgedRegStoreReader::release(Read* read)
+{
+  if (--read->refs == 0)
+  {
+    for (int ii = LOCAL; ii <= REMOTE; ++ii)
+    {
+      if (read->pools[ii] != NULL)
+      {
+        pj_pool_release(read->pools[ii]);
+      }
+    }
+    pthread_cond_destroy(&read->cond);
+    delete read;
+  }
+}
+
+
+/// Whether one of the reads has returned bindings.  Must be called with the
+/// lock held.
+bool HedgedRegStoreReader::usable(Read* read, Source source)
+{
+  return ((read->done[source]) &&
+          (read->found[source]) &&
+          (read->views[source].num_bindings() > 0));
+}
+
+
+int HedgedRegStoreReader::reader_thread(void* p)
+{
+  ((HedgedRegStoreReader*)p)->run();
+  return 0;
+}
+
+
+void HedgedRegStoreReader::run()
+{
+  pthread_mutex_lock(&_lock);
+  _idle_threads++;
+
+  while (!_terminated)
+  {
+    if (_queue.empty())
+    {
+      pthread_cond_wait(&_work_cond, &_lock);
+      continue;
+    }
+
+    Task task = _queue.front();
+    _queue.pop_front();
+    _idle_threads--;
+    pthread_mutex_unlock(&_lock);
+
+    Read* read = task.read;
+    uint64_t start_us = now_us();
+    pj_pool_t* pool = pj_pool_create(&stack_data.cp.factory, "hedged-read", 1024, 1024, NULL);
+    RegStore::AoRView view;
+    bool found = _stores[task.source]->get_aor_view(read->aor_id, pool, view, read->trail);
+
+    if (task.source == LOCAL)
+    {
+      record_local_latency(now_us() - start_us);
+    }
+
+    pthread_mutex_lock(&_lock);
+    read->pools[task.source] = pool;
+    read->views[task.source] = view;
+    read->found[task.source] = found;
+    read->done[task.source] = true;
+    pthread_cond_broadcast(&read->cond);
+    release(read);
+    _idle_threads++;
+  }
+
+  _idle_threads--;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Time a local read, and at the end of each period set the hedge delay
+/// from the reads timed in it.
+void HedgedRegStoreReader::record_local_latency(uint64_t latency_us)
+{
+  _latencies.record(latency_us);
+
+  uint64_t now = now_us();
+  uint64_t period_start = _period_start_us.load();
+  if ((now < period_start + DELAY_PERIOD_US) ||
+      (!_period_start_us.compare_exchange_strong(period_start, now)))
+  {
+    return;
+  }
+
+  LatencyHistogram last;
+  _latencies.move_to(last);
+
+  if (last.count() >= MIN_DELAY_SAMPLES)
+  {
+    uint64_t delay_us = last.percentile(_percentile);
+    if (delay_us < MIN_DELAY_US)
+    {
+      delay_us = MIN_DELAY_US;
+    }
+    LOG_DEBUG("Hedge delay for registration store reads is now %lu us", delay_us);
+    _hedge_delay_us = delay_us;
+  }
+}
+
+
+uint64_t HedgedRegStoreReader::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
@@ -38,6 +38,7 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <algorithm>
 #include <json/reader.h>
 #include <json/writer.h>
 
@@ -48,6 +49,7 @@
 #include "httpconnection.h"
 #include "hssconnection.h"
 #include "accumulator.h"
+#include "worker_throttle.h"
 
 const std::string HSSConnection::REG = "reg";
 const std::string HSSConnection::CALL = "call";
@@ -62,13 +64,15 @@ const std::string HSSConnection::STATE_NOT_REGISTERED = "NOT_REGISTERED";
 
 HSSConnection::HSSConnection(const std::string& server,
                              LoadMonitor *load_monitor,
-                             LastValueCache *stats_aggregator) :
+                             LastValueCache *stats_aggregator,
+                             SubscriberProfileCache *profile_cache) :
   _http(new HttpConnection(server,
                            false,
                            "connected_homesteads",
                            load_monitor,
                            stats_aggregator,
                            SASEvent::HttpLogLevel::PROTOCOL)),
+  _profile_cache(profile_cache),
   _latency_stat("hss_latency_us", stats_aggregator),
   _digest_latency_stat("hss_digest_latency_us", stats_aggregator),
   _subscription_latency_stat("hss_subscription_latency_us", stats_aggregator),
@@ -153,7 +157,11 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
 {
   std::string json_data;
 
-  HTTPCode rc = _http->send_get(path, json_data, "", trail);
+  HTTPCode rc;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    rc = _http->send_get(path, json_data, "", trail);
+  }
   if (rc == HTTP_OK)
   {
     json_object = new Json::Value;
@@ -202,7 +210,11 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
 {
   std::string raw_data;
 
-  HTTPCode http_code = _http->send_put(path, raw_data, body, trail);
+  HTTPCode http_code;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    http_code = _http->send_put(path, raw_data, body, trail);
+  }
 
   if (http_code == HTTP_OK)
   {
@@ -220,7 +232,11 @@ HTTPCode HSSConnection::get_xml_object(const std::string& path,
 {
   std::string raw_data;
 
-  HTTPCode http_code = _http->send_get(path, raw_data, "", trail);
+  HTTPCode http_code;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    http_code = _http->send_get(path, raw_data, "", trail);
+  }
 
   if (http_code == HTTP_OK)
   {
@@ -391,10 +407,78 @@ HTTPCode HSSConnection::update_registration_state(const std::string& public_user
     // the subscriber on the HSS or been unable to communicate with
     // the HSS successfully. In either case we should fail.
     LOG_ERROR("Could not get subscriber data from HSS");
+
+    if ((type != REG) && (type != CALL))
+    {
+      // The subscriber may have been deregistered anyway, so don't keep
+      // serving the old data.
+      invalidate_profile(public_user_identity);
+    }
     return http_code;
   }
 
-  return decode_homestead_xml(root, regstate, ifcs_map, associated_uris, false) ? HTTP_OK : HTTP_SERVER_ERROR;
+  if (!decode_homestead_xml(root, regstate, ifcs_map, associated_uris, false))
+  {
+    return HTTP_SERVER_ERROR;
+  }
+
+  update_profile_cache(public_user_identity, type, regstate, ifcs_map, associated_uris);
+  return HTTP_OK;
+}
+
+/// Refresh the profile cache with the result of a registration state update.
+/// Registrations and calls return the current data for the whole implicit
+/// registration set, so it is cached for each of the associated URIs, but
+/// any other update is a deregistration and the data is dropped.
+///
+/// Only registered subscribers are cached.  An unregistered subscriber may
+/// register at any time, possibly through another node, and a cached
+/// NOT_REGISTERED or UNREGISTERED state would then wrongly reject or
+/// misroute requests for them until it expired.
+void HSSConnection::update_profile_cache(const std::string& public_user_identity,
+                                         const std::string& type,
+                                         const std::string& regstate,
+                                         const std::map<std::string, Ifcs >& ifcs_map,
+                                         const std::vector<std::string>& associated_uris)
+{
+  if (_profile_cache == NULL)
+  {
+    return;
+  }
+
+  if (((type == REG) || (type == CALL)) &&
+      (regstate == STATE_REGISTERED))
+  {
+    std::vector<std::string> public_ids(associated_uris);
+    if (std::find(public_ids.begin(), public_ids.end(), public_user_identity) ==
+        public_ids.end())
+    {
+      public_ids.push_back(public_user_identity);
+    }
+
+    for (std::vector<std::string>::const_iterator i = public_ids.begin();
+         i != public_ids.end();
+         ++i)
+    {
+      std::map<std::string, Ifcs >::const_iterator ifcs = ifcs_map.find(*i);
+      _profile_cache->put(*i,
+                          regstate,
+                          (ifcs != ifcs_map.end()) ? ifcs->second : Ifcs(),
+                          associated_uris);
+    }
+  }
+  else
+  {
+    _profile_cache->invalidate(public_user_identity);
+  }
+}
+
+void HSSConnection::invalidate_profile(const std::string& public_user_identity)
+{
+  if (_profile_cache != NULL)
+  {
+    _profile_cache->invalidate(public_user_identity);
+  }
 }
 
 HTTPCode HSSConnection::get_registration_data(const std::string& public_user_identity,
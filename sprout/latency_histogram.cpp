@@ -0,0 +1,204 @@
+/**
+ * @file latency_histogram.cpp Log-linear latency histograms.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <math.h>
+#include <vector>
+
+#include "latency_histogram.h"
+
+LatencyHistogram::LatencyHistogram() :
+  _count(0)
+{
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii] = 0;
+  }
+}
+
+
+void LatencyHistogram::record(uint_fast64_t value)
+{
+  ++_buckets[bucket_index(value)];
+  ++_count;
+}
+
+
+uint_fast64_t LatencyHistogram::count() const
+{
+  return _count.load();
+}
+
+
+uint_fast64_t LatencyHistogram::percentile(double percent) const
+{
+  uint_fast64_t count = _count.load();
+
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  // Find the first bucket at which the cumulative count reaches the rank of
+  // the requested percentile.
+  uint_fast64_t rank = (uint_fast64_t)ceil(percent * count / 100.0);
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+
+  uint_fast64_t seen = 0;
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    seen += _buckets[ii].load();
+    if (seen >= rank)
+    {
+      return bucket_value(ii);
+    }
+  }
+
+  // Values were being recorded while we looked, so the count is ahead of
+  // the buckets.  Return the largest value seen.
+  return bucket_value(NUM_BUCKETS - 1);
+}
+
+
+void LatencyHistogram::move_to(LatencyHistogram& other)
+{
+  for (unsigned int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    uint_fast64_t n = _buckets[ii].exchange(0);
+    other._buckets[ii] += n;
+    other._count += n;
+    _count -= n;
+  }
+}
+
+
+/// Get the index of the bucket a value is counted in.
+unsigned int LatencyHistogram::bucket_index(uint_fast64_t value)
+{
+  if (value < 2 * SUB_BUCKETS)
+  {
+    return value;
+  }
+
+  // Shift the value down so it has SUB_BUCKET_BITS + 1 significant bits.
+  // The shift selects the range of buckets, and the bits below the top one
+  // select the bucket within the range.
+  unsigned int msb = 63 - __builtin_clzll(value);
+  unsigned int shift = msb - SUB_BUCKET_BITS;
+  unsigned int index = (shift + 1) * SUB_BUCKETS +
+                       (unsigned int)((value >> shift) - SUB_BUCKETS);
+
+  return (index < NUM_BUCKETS) ? index : NUM_BUCKETS - 1;
+}
+
+
+/// Get the highest value counted in a bucket.
+uint_fast64_t LatencyHistogram::bucket_value(unsigned int index)
+{
+  if (index < 2 * SUB_BUCKETS)
+  {
+    return index;
+  }
+
+  unsigned int shift = index / SUB_BUCKETS - 1;
+  uint_fast64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+
+  return ((mantissa + 1) << shift) - 1;
+}
+
+
+StatisticHistogram::StatisticHistogram(std::string statname,
+                                       LastValueCache* lvc,
+                                       uint_fast64_t period_us) :
+  _current(),
+  _statistic(statname, lvc),
+  _period_us(period_us),
+  _period_start_us(now_us()),
+  _p50(0),
+  _p99(0),
+  _p999(0)
+{
+}
+
+
+void StatisticHistogram::record(uint_fast64_t value)
+{
+  refresh();
+  _current.record(value);
+}
+
+
+void StatisticHistogram::refresh(bool force)
+{
+  uint_fast64_t now = now_us();
+  uint_fast64_t period_start = _period_start_us.load();
+
+  if ((!force) && (now < period_start + _period_us))
+  {
+    return;
+  }
+
+  // Only one thread reports each period.
+  if (!_period_start_us.compare_exchange_strong(period_start, now))
+  {
+    return;
+  }
+
+  LatencyHistogram last;
+  _current.move_to(last);
+
+  _p50 = last.percentile(50.0);
+  _p99 = last.percentile(99.0);
+  _p999 = last.percentile(99.9);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(last.count()));
+  values.push_back(std::to_string(_p50.load()));
+  values.push_back(std::to_string(_p99.load()));
+  values.push_back(std::to_string(_p999.load()));
+  _statistic.report_change(values);
+}
+
+
+uint_fast64_t StatisticHistogram::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint_fast64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,325 @@
+/**
+ * @file local_chronos_connection.cpp In-process replacement for Chronos.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "log.h"
+#include "stack.h"
+#include "pjutils.h"
+#include "local_chronos_connection.h"
+
+LocalChronosConnection::LocalChronosConnection(int num_threads,
+                                               int tick_ms,
+                                               LastValueCache* lvc) :
+  ChronosConnection("localhost", "localhost"),
+  _num_threads(num_threads),
+  _tick_ms(tick_ms),
+  _id_prefix(std::to_string(time(NULL)) + "-"),
+  _next_id(0),
+  _terminated(false),
+  _wheel(tick_ms, now_ms()),
+  _last_sample_ms(now_ms()),
+  _pops(),
+  _callbacks(),
+  _ticker(NULL),
+  _threads(),
+  _occupancy_stat("local_timers", lvc),
+  _pops_counter("local_timer_pops", lvc),
+  _lateness_histogram("local_timer_lateness_us", lvc)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_tick_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+
+LocalChronosConnection::~LocalChronosConnection()
+{
+  stop();
+
+  for (std::map<std::string, Callback*>::iterator i = _callbacks.begin();
+       i != _callbacks.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  pthread_cond_destroy(&_tick_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void LocalChronosConnection::register_callback(const std::string& callback_uri,
+                                               Callback* callback)
+{
+  delete _callbacks[callback_uri];
+  _callbacks[callback_uri] = callback;
+}
+
+
+void LocalChronosConnection::start()
+{
+  pj_status_t status = pj_thread_create(stack_data.pool, "local-timer-tick",
+                                        &ticker_thread,
+                                        (void*)this, 0, 0, &_ticker);
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Error creating local timer ticker thread, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    _ticker = NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pj_thread_t* thread;
+    status = pj_thread_create(stack_data.pool, "local-timer-pop",
+                              &pop_thread,
+                              (void*)this, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating local timer pop thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      continue;
+      // LCOV_EXCL_STOP
+    }
+    _threads.push_back(thread);
+  }
+}
+
+
+void LocalChronosConnection::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_tick_cond);
+  pthread_mutex_unlock(&_lock);
+  _pops.terminate();
+
+  if (_ticker != NULL)
+  {
+    pj_thread_join(_ticker);
+    pj_thread_destroy(_ticker);
+    _ticker = NULL;
+  }
+
+  for (std::vector<pj_thread_t*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pj_thread_join(*i);
+    pj_thread_destroy(*i);
+  }
+  _threads.clear();
+}
+
+
+HTTPCode LocalChronosConnection::send_post(std::string& post_identity,
+                                           uint32_t timer_interval,
+                                           const std::string& callback_uri,
+                                           const std::string& opaque_data,
+                                           SAS::TrailId trail)
+{
+  pthread_mutex_lock(&_lock);
+  post_identity = _id_prefix + std::to_string(_next_id++);
+  _wheel.set(post_identity,
+             now_ms() + (uint64_t)timer_interval * 1000,
+             callback_uri,
+             opaque_data);
+  pthread_mutex_unlock(&_lock);
+
+  LOG_DEBUG("Set local timer %s for %u seconds", post_identity.c_str(), timer_interval);
+  return HTTP_OK;
+}
+
+
+HTTPCode LocalChronosConnection::send_put(std::string& put_identity,
+                                          uint32_t timer_interval,
+                                          const std::string& callback_uri,
+                                          const std::string& opaque_data,
+                                          SAS::TrailId trail)
+{
+  if (put_identity == "")
+  {
+    return send_post(put_identity, timer_interval, callback_uri, opaque_data, trail);
+  }
+
+  // As with Chronos, updating a timer that isn't running (for example
+  // because it was set before a restart) creates it.
+  pthread_mutex_lock(&_lock);
+  _wheel.set(put_identity,
+             now_ms() + (uint64_t)timer_interval * 1000,
+             callback_uri,
+             opaque_data);
+  pthread_mutex_unlock(&_lock);
+
+  LOG_DEBUG("Updated local timer %s for %u seconds", put_identity.c_str(), timer_interval);
+  return HTTP_OK;
+}
+
+
+HTTPCode LocalChronosConnection::send_delete(const std::string& delete_identity,
+                                             SAS::TrailId trail)
+{
+  pthread_mutex_lock(&_lock);
+  _wheel.remove(delete_identity);
+  pthread_mutex_unlock(&_lock);
+
+  LOG_DEBUG("Deleted local timer %s", delete_identity.c_str());
+  return HTTP_OK;
+}
+
+
+size_t LocalChronosConnection::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _wheel.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+int LocalChronosConnection::ticker_thread(void* p)
+{
+  ((LocalChronosConnection*)p)->tick();
+  return 0;
+}
+
+
+int LocalChronosConnection::pop_thread(void* p)
+{
+  ((LocalChronosConnection*)p)->pop();
+  return 0;
+}
+
+
+void LocalChronosConnection::tick()
+{
+  std::vector<TimerWheel::Timer> pops;
+
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    uint64_t deadline_ms = now_ms() + _tick_ms;
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ms / 1000;
+    deadline.tv_nsec = (deadline_ms % 1000) * 1000000;
+    pthread_cond_timedwait(&_tick_cond, &_lock, &deadline);
+
+    if (_terminated)
+    {
+      break;
+    }
+
+    uint64_t now = now_ms();
+    _wheel.tick(now, pops);
+
+    if (now >= _last_sample_ms + OCCUPANCY_PERIOD_MS)
+    {
+      _occupancy_stat.accumulate(_wheel.size());
+      _last_sample_ms = now;
+    }
+
+    if (!pops.empty())
+    {
+      // Hand the timers to the pop threads without holding the lock, so
+      // that callbacks can set timers while they are queued.
+      pthread_mutex_unlock(&_lock);
+      for (std::vector<TimerWheel::Timer>::const_iterator i = pops.begin();
+           i != pops.end();
+           ++i)
+      {
+        _pops.push(0, 0, *i);
+      }
+      pops.clear();
+      pthread_mutex_lock(&_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void LocalChronosConnection::pop()
+{
+  TimerWheel::Timer timer;
+
+  while (_pops.pop(0, timer))
+  {
+    dispatch(timer);
+  }
+}
+
+
+void LocalChronosConnection::dispatch(const TimerWheel::Timer& timer)
+{
+  uint64_t now = now_us();
+  uint64_t due = timer.due_ms * 1000;
+  _lateness_histogram.record((now > due) ? (now - due) : 0);
+  _pops_counter.increment();
+
+  std::map<std::string, Callback*>::const_iterator i = _callbacks.find(timer.callback_uri);
+  if (i == _callbacks.end())
+  {
+    LOG_WARNING("No callback for local timer %s with callback URI %s",
+                timer.id.c_str(), timer.callback_uri.c_str());
+    return;
+  }
+
+  LOG_DEBUG("Local timer %s popped", timer.id.c_str());
+  SAS::TrailId trail = SAS::new_trail(1u);
+  i->second->timer_pop(timer.opaque, trail);
+}
+
+
+uint64_t LocalChronosConnection::now_ms()
+{
+  return now_us() / 1000;
+}
+
+
+uint64_t LocalChronosConnection::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
@@ -47,6 +47,7 @@ extern "C" {
 #include <signal.h>
 #include <errno.h>
 #include <semaphore.h>
+#include <sched.h>
 
 // Common STL includes.
 #include <cassert>
@@ -63,6 +64,8 @@ extern "C" {
 #include "sasevent.h"
 #include "analyticslogger.h"
 #include "regstore.h"
+#include "reg_store_replicator.h"
+#include "hedged_reg_store_reader.h"
 #include "stack.h"
 #include "hssconnection.h"
 #include "xdmconnection.h"
@@ -85,6 +88,8 @@ extern "C" {
 #include "scscfselector.h"
 #include "icscfproxy.h"
 #include "chronosconnection.h"
+#include "local_chronos_connection.h"
+#include "sharded_worker_pool.h"
 #include "handlers.h"
 #include "httpstack.h"
 
@@ -92,7 +97,32 @@ enum OptionTypes
 {
   OPT_DEFAULT_SESSION_EXPIRES=256+1,
   OPT_ADDITIONAL_HOME_DOMAINS,
-  OPT_EMERGENCY_REG_ACCEPTED
+  OPT_EMERGENCY_REG_ACCEPTED,
+  OPT_WORKER_AFFINITY,
+  OPT_MAX_QUEUE_DEPTH,
+  OPT_DISPATCH_WEIGHTS,
+  OPT_QUEUE_DEADLINE,
+  OPT_LOAD_CONTROL_QUEUE_WAIT,
+  OPT_PJSIP_CPUS,
+  OPT_WORKER_CPUS,
+  OPT_MAX_ACTIVE_WORKERS,
+  OPT_OPTIONS_FAST_PATH_RATE,
+  OPT_AOR_CACHE_SIZE,
+  OPT_AOR_CACHE_STALENESS,
+  OPT_REG_STORE_LAYOUT,
+  OPT_CAS_MAX_RETRIES,
+  OPT_CAS_MAX_BACKOFF,
+  OPT_REMOTE_REPLICATION_QUEUE,
+  OPT_REMOTE_REPLICATION_THREADS,
+  OPT_HEDGED_READ_PERCENTILE,
+  OPT_HEDGED_READ_THREADS,
+  OPT_REG_STORE_COMPRESS_THRESHOLD,
+  OPT_REG_TIMER_MODE,
+  OPT_REG_STORE_FORMAT,
+  OPT_LOCAL_TIMERS,
+  OPT_DEREG_THREADS,
+  OPT_HSS_CACHE_SIZE,
+  OPT_HSS_CACHE_TTL
 };
 
 struct options
@@ -146,6 +176,31 @@ struct options
   std::string            billing_cdf;
   pj_bool_t              emerg_reg_accepted;
   int                    worker_threads;
+  pj_bool_t              worker_affinity;
+  int                    max_queue_depth;
+  std::vector<int>       dispatch_weights;
+  int                    queue_deadline;
+  pj_bool_t              load_control_queue_wait;
+  std::vector<int>       pjsip_cpus;
+  std::vector<int>       worker_cpus;
+  int                    max_active_workers;
+  int                    options_fast_path_rate;
+  int                    aor_cache_size;
+  int                    aor_cache_staleness;
+  RegStore::Layout       reg_store_layout;
+  int                    reg_store_compress_threshold;
+  RegStore::TimerMode    reg_timer_mode;
+  RegStore::Format       reg_store_format;
+  pj_bool_t              local_timers;
+  int                    dereg_threads;
+  int                    hss_cache_size;
+  int                    hss_cache_ttl;
+  int                    cas_max_retries;
+  int                    cas_max_backoff;
+  int                    remote_replication_queue;
+  int                    remote_replication_threads;
+  double                 hedged_read_percentile;
+  int                    hedged_read_threads;
   pj_bool_t              log_to_file;
   std::string            log_directory;
   int                    log_level;
@@ -186,6 +241,31 @@ struct options
     { "reg-max-expires",   required_argument, 0, 'e'},
     { "pjsip-threads",     required_argument, 0, 'P'},
     { "worker-threads",    required_argument, 0, 'W'},
+    { "worker-affinity",   no_argument,       0, OPT_WORKER_AFFINITY},
+    { "max-queue-depth",   required_argument, 0, OPT_MAX_QUEUE_DEPTH},
+    { "dispatch-weights",  required_argument, 0, OPT_DISPATCH_WEIGHTS},
+    { "queue-deadline",    required_argument, 0, OPT_QUEUE_DEADLINE},
+    { "load-control-queue-wait", no_argument, 0, OPT_LOAD_CONTROL_QUEUE_WAIT},
+    { "pjsip-cpus",        required_argument, 0, OPT_PJSIP_CPUS},
+    { "worker-cpus",       required_argument, 0, OPT_WORKER_CPUS},
+    { "max-active-workers", required_argument, 0, OPT_MAX_ACTIVE_WORKERS},
+    { "options-fast-path-rate", required_argument, 0, OPT_OPTIONS_FAST_PATH_RATE},
+    { "aor-cache-size",    required_argument, 0, OPT_AOR_CACHE_SIZE},
+    { "aor-cache-staleness", required_argument, 0, OPT_AOR_CACHE_STALENESS},
+    { "reg-store-layout",  required_argument, 0, OPT_REG_STORE_LAYOUT},
+    { "reg-store-compress-threshold", required_argument, 0, OPT_REG_STORE_COMPRESS_THRESHOLD},
+    { "reg-timer-mode",    required_argument, 0, OPT_REG_TIMER_MODE},
+    { "reg-store-format",  required_argument, 0, OPT_REG_STORE_FORMAT},
+    { "local-timers",      no_argument,       0, OPT_LOCAL_TIMERS},
+    { "dereg-threads",     required_argument, 0, OPT_DEREG_THREADS},
+    { "hss-cache-size",    required_argument, 0, OPT_HSS_CACHE_SIZE},
+    { "hss-cache-ttl",     required_argument, 0, OPT_HSS_CACHE_TTL},
+    { "cas-max-retries",   required_argument, 0, OPT_CAS_MAX_RETRIES},
+    { "cas-max-backoff",   required_argument, 0, OPT_CAS_MAX_BACKOFF},
+    { "remote-replication-queue", required_argument, 0, OPT_REMOTE_REPLICATION_QUEUE},
+    { "remote-replication-threads", required_argument, 0, OPT_REMOTE_REPLICATION_THREADS},
+    { "hedged-read-percentile", required_argument, 0, OPT_HEDGED_READ_PERCENTILE},
+    { "hedged-read-threads", required_argument, 0, OPT_HEDGED_READ_THREADS},
     { "analytics",         required_argument, 0, 'a'},
     { "authentication",    no_argument,       0, 'A'},
     { "log-file",          required_argument, 0, 'F'},
@@ -297,6 +377,131 @@ static void usage(void)
        " -P, --pjsip_threads N      Number of PJSIP threads (default: 1)\n"
        " -B, --billing-cdf <server> Billing CDF server\n"
        " -W, --worker_threads N     Number of worker threads (default: 1)\n"
+       "     --worker-affinity      Give each worker thread its own queue and dispatch\n"
+       "                            messages to workers by Call-ID, with idle workers\n"
+       "                            taking work from busy ones\n"
+       "     --max-queue-depth N    Maximum number of requests queued for the worker\n"
+       "                            threads.  When the queue is full, requests on TCP\n"
+       "                            connections are held until there is space\n"
+       "                            (pausing that connection only) and requests on\n"
+       "                            UDP are rejected with a 503\n"
+       "                            (default: 0, meaning unlimited)\n"
+       "     --dispatch-weights <urgent>,<in-dialog>,<initial>\n"
+       "                            Relative rates at which worker threads take\n"
+       "                            responses, in-dialog requests and initial\n"
+       "                            requests from the queue (default: strict\n"
+       "                            priority order)\n"
+       "     --queue-deadline <milliseconds>\n"
+       "                            Time after which initial requests waiting for a\n"
+       "                            worker thread are discarded (or rejected with a\n"
+       "                            503 on TCP) without being processed.  0 disables\n"
+       "                            this (default: 4*T1)\n"
+       "     --load-control-queue-wait\n"
+       "                            Drive overload control from the 99th percentile\n"
+       "                            time requests wait for a worker thread, rather\n"
+       "                            than the total latency of each request\n"
+       "     --pjsip-cpus <cpus>    Pin the PJSIP threads to the listed CPUs, one per\n"
+       "                            thread in turn (for example, 0-3,8)\n"
+       "     --worker-cpus <cpus>   Pin the worker threads to the listed CPUs, one per\n"
+       "                            thread in turn.  For the best memory locality, use\n"
+       "                            CPUs on the same NUMA node as the PJSIP threads\n"
+       "     --max-active-workers N Maximum number of worker threads processing\n"
+       "                            messages at once, not counting threads waiting\n"
+       "                            on Homestead, Homer, Ralf or memcached.  Use with\n"
+       "                            a large number of worker threads to keep the CPUs\n"
+       "                            busy while requests wait on remote servers\n"
+       "                            (default: 0, meaning unlimited)\n"
+       "     --options-fast-path-rate N\n"
+       "                            Maximum number of out-of-dialog OPTIONS polls per\n"
+       "                            second answered directly on the PJSIP threads.\n"
+       "                            Further polls are queued to the worker threads\n"
+       "                            (default: 1000, 0 disables this)\n"
+       "     --aor-cache-size N     Number of registration records to cache in memory\n"
+       "                            for routing requests to registered users\n"
+       "                            (default: 0, meaning no cache)\n"
+       "     --aor-cache-staleness <milliseconds>\n"
+       "                            Time for which a cached registration record is\n"
+       "                            used before reading it from the store again\n"
+       "                            (default: 1000)\n"
+       "     --reg-store-layout <single|per-binding>\n"
+       "                            How registration records are written to the\n"
+       "                            store - a single record per AoR, or a record\n"
+       "                            per binding and subscription so that updates\n"
+       "                            only rewrite the bindings that have changed.\n"
+       "                            Records in either layout can always be read\n"
+       "                            (default: single)\n"
+       "     --reg-store-compress-threshold N\n"
+       "                            Compress registration records of N bytes or more\n"
+       "                            when writing them to the store.  Only records\n"
+       "                            in the binary format are compressed, and\n"
+       "                            compressed records can only be read by this\n"
+       "                            version of Sprout or later (default: 0, which\n"
+       "                            disables compression)\n"
+       "     --reg-timer-mode <binding|aor>\n"
+       "                            Whether a Chronos timer is set for each binding,\n"
+       "                            or a single timer for each AoR that pops when\n"
+       "                            its first binding expires.  Existing timers are\n"
+       "                            migrated when each AoR is next updated\n"
+       "                            (default: binding)\n"
+       "     --reg-store-format <legacy|binary>\n"
+       "                            Format registration records are written in.\n"
+       "                            The binary format is smaller and quicker to\n"
+       "                            process, but can only be read by this version\n"
+       "                            of Sprout or later, so only enable it once all\n"
+       "                            nodes have been upgraded.  Records in either\n"
+       "                            format can always be read.  Must be binary to\n"
+       "                            compress records, to persist each AoR's expiry\n"
+       "                            bounds, or to use --reg-timer-mode aor with the\n"
+       "                            single layout (default: legacy)\n"
+       "     --local-timers         Run registration and authentication timers in\n"
+       "                            this process rather than in Chronos.  Timers\n"
+       "                            are not shared with other nodes, so are lost if\n"
+       "                            this process restarts.  If set, no Chronos\n"
+       "                            service is needed\n"
+       "     --dereg-threads N      Number of threads processing deregistration\n"
+       "                            requests from Homestead.  The AoRs in each\n"
+       "                            request are spread across the threads\n"
+       "                            (default: 4, 0 processes each request on the\n"
+       "                            HTTP thread that received it)\n"
+       "     --hss-cache-size N     Maximum number of public IDs whose registration\n"
+       "                            state, iFCs and associated URIs are cached\n"
+       "                            across transactions (default: 0, which disables\n"
+       "                            the cache)\n"
+       "     --hss-cache-ttl <seconds>\n"
+       "                            Time for which cached subscriber data is used\n"
+       "                            before requesting it from Homestead again\n"
+       "                            (default: 30)\n"
+       "     --cas-max-retries N    Maximum number of times a registration or\n"
+       "                            subscription update is retried when it\n"
+       "                            conflicts with another update to the same AoR,\n"
+       "                            before the request is rejected with a 503\n"
+       "                            (default: 10)\n"
+       "     --cas-max-backoff <milliseconds>\n"
+       "                            Maximum time to wait before retrying a\n"
+       "                            conflicting update.  Waits are random, up to a\n"
+       "                            limit that doubles with each retry.  The 503's\n"
+       "                            Retry-After covers the longest time all the\n"
+       "                            retries could wait (default: 100)\n"
+       "     --remote-replication-queue N\n"
+       "                            Write registration records to the remote store\n"
+       "                            in the background, with up to N records waiting\n"
+       "                            to be written.  Updates to a waiting record are\n"
+       "                            merged, and updates are dropped if the queue is\n"
+       "                            full (default: 0, meaning the remote store is\n"
+       "                            written before responding to each request)\n"
+       "     --remote-replication-threads N\n"
+       "                            Number of threads writing to the remote store in\n"
+       "                            the background (default: 4)\n"
+       "     --hedged-read-percentile P\n"
+       "                            When looking up the targets of a call, start a\n"
+       "                            read from the remote store if the local read has\n"
+       "                            not returned within the Pth percentile of recent\n"
+       "                            local read times, and use whichever returns\n"
+       "                            bindings first (default: 0, which only reads the\n"
+       "                            remote store if the local read returns nothing)\n"
+       "     --hedged-read-threads N\n"
+       "                            Number of threads making hedged reads\n"
+       "                            (default: 8)\n"
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -A, --authentication       Enable authentication\n"
@@ -331,6 +536,44 @@ int parse_port(const std::string& port_str)
 }
 
 
+/// Parse a list of CPUs, such as "0-3,8,10-11".
+/// @returns Whether the list is valid.
+bool parse_cpu_list(const std::string& cpu_list_str, std::vector<int>& cpus)
+{
+  std::vector<std::string> ranges;
+  Utils::split_string(cpu_list_str, ',', ranges, 0, true);
+  cpus.clear();
+
+  for (size_t ii = 0; ii < ranges.size(); ++ii)
+  {
+    int first;
+    int last;
+    char extra;
+    if (sscanf(ranges[ii].c_str(), "%d-%d%c", &first, &last, &extra) != 2)
+    {
+      // Not a range, so must be a single CPU.
+      if (sscanf(ranges[ii].c_str(), "%d%c", &first, &extra) != 1)
+      {
+        return false;
+      }
+      last = first;
+    }
+
+    if ((first < 0) || (last < first) || (last >= CPU_SETSIZE))
+    {
+      return false;
+    }
+
+    for (int cpu = first; cpu <= last; ++cpu)
+    {
+      cpus.push_back(cpu);
+    }
+  }
+
+  return !cpus.empty();
+}
+
+
 static pj_status_t init_logging_options(int argc, char *argv[], struct options *options)
 {
   int c;
@@ -716,6 +959,201 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       LOG_INFO("Emergency registrations accepted");
       break;
 
+    case OPT_WORKER_AFFINITY:
+      options->worker_affinity = PJ_TRUE;
+      LOG_INFO("Worker affinity enabled");
+      break;
+
+    case OPT_MAX_QUEUE_DEPTH:
+      options->max_queue_depth = atoi(pj_optarg);
+      LOG_INFO("Maximum receive queue depth set to %d", options->max_queue_depth);
+      break;
+
+    case OPT_DISPATCH_WEIGHTS:
+      {
+        std::vector<std::string> weights;
+        Utils::split_string(std::string(pj_optarg), ',', weights, 0, false);
+        options->dispatch_weights.clear();
+        for (size_t ii = 0; ii < weights.size(); ++ii)
+        {
+          int weight = atoi(weights[ii].c_str());
+          if (weight <= 0)
+          {
+            break;
+          }
+          options->dispatch_weights.push_back(weight);
+        }
+
+        if (options->dispatch_weights.size() != 3)
+        {
+          LOG_ERROR("Dispatch weights %s invalid", pj_optarg);
+          return -1;
+        }
+        LOG_INFO("Dispatch weights set to %s", pj_optarg);
+      }
+      break;
+
+    case OPT_QUEUE_DEADLINE:
+      options->queue_deadline = atoi(pj_optarg);
+      LOG_INFO("Queue deadline set to %dms", options->queue_deadline);
+      break;
+
+    case OPT_LOAD_CONTROL_QUEUE_WAIT:
+      options->load_control_queue_wait = PJ_TRUE;
+      LOG_INFO("Overload control driven by queue wait time");
+      break;
+
+    case OPT_PJSIP_CPUS:
+      if (!parse_cpu_list(pj_optarg, options->pjsip_cpus))
+      {
+        LOG_ERROR("PJSIP thread CPU list %s invalid", pj_optarg);
+        return -1;
+      }
+      LOG_INFO("PJSIP threads pinned to CPUs %s", pj_optarg);
+      break;
+
+    case OPT_WORKER_CPUS:
+      if (!parse_cpu_list(pj_optarg, options->worker_cpus))
+      {
+        LOG_ERROR("Worker thread CPU list %s invalid", pj_optarg);
+        return -1;
+      }
+      LOG_INFO("Worker threads pinned to CPUs %s", pj_optarg);
+      break;
+
+    case OPT_AOR_CACHE_SIZE:
+      options->aor_cache_size = atoi(pj_optarg);
+      LOG_INFO("AoR cache size set to %d", options->aor_cache_size);
+      break;
+
+    case OPT_AOR_CACHE_STALENESS:
+      options->aor_cache_staleness = atoi(pj_optarg);
+      LOG_INFO("AoR cache staleness set to %dms", options->aor_cache_staleness);
+      break;
+
+    case OPT_REG_STORE_LAYOUT:
+      if (std::string(pj_optarg) == "single")
+      {
+        options->reg_store_layout = RegStore::SINGLE_RECORD;
+      }
+      else if (std::string(pj_optarg) == "per-binding")
+      {
+        options->reg_store_layout = RegStore::PER_BINDING_RECORDS;
+      }
+      else
+      {
+        LOG_ERROR("Registration store layout %s invalid", pj_optarg);
+        return -1;
+      }
+      LOG_INFO("Registration store layout set to %s", pj_optarg);
+      break;
+
+    case OPT_REG_STORE_COMPRESS_THRESHOLD:
+      options->reg_store_compress_threshold = atoi(pj_optarg);
+      LOG_INFO("Registration store compression threshold set to %d bytes",
+               options->reg_store_compress_threshold);
+      break;
+
+    case OPT_REG_TIMER_MODE:
+      if (std::string(pj_optarg) == "binding")
+      {
+        options->reg_timer_mode = RegStore::BINDING_TIMERS;
+      }
+      else if (std::string(pj_optarg) == "aor")
+      {
+        options->reg_timer_mode = RegStore::AOR_TIMERS;
+      }
+      else
+      {
+        LOG_ERROR("Registration timer mode %s invalid", pj_optarg);
+        return -1;
+      }
+      LOG_INFO("Registration timer mode set to %s", pj_optarg);
+      break;
+
+    case OPT_REG_STORE_FORMAT:
+      if (std::string(pj_optarg) == "legacy")
+      {
+        options->reg_store_format = RegStore::LEGACY_FORMAT;
+      }
+      else if (std::string(pj_optarg) == "binary")
+      {
+        options->reg_store_format = RegStore::BINARY_FORMAT;
+      }
+      else
+      {
+        LOG_ERROR("Registration store format %s invalid", pj_optarg);
+        return -1;
+      }
+      LOG_INFO("Registration store format set to %s", pj_optarg);
+      break;
+
+    case OPT_LOCAL_TIMERS:
+      options->local_timers = PJ_TRUE;
+      LOG_INFO("Timers will be run locally rather than in Chronos");
+      break;
+
+    case OPT_DEREG_THREADS:
+      options->dereg_threads = atoi(pj_optarg);
+      LOG_INFO("Deregistration threads set to %d", options->dereg_threads);
+      break;
+
+    case OPT_HSS_CACHE_SIZE:
+      options->hss_cache_size = atoi(pj_optarg);
+      LOG_INFO("HSS cache size set to %d", options->hss_cache_size);
+      break;
+
+    case OPT_HSS_CACHE_TTL:
+      options->hss_cache_ttl = atoi(pj_optarg);
+      LOG_INFO("HSS cache TTL set to %ds", options->hss_cache_ttl);
+      break;
+
+    case OPT_CAS_MAX_RETRIES:
+      options->cas_max_retries = atoi(pj_optarg);
+      LOG_INFO("Maximum CAS retries set to %d", options->cas_max_retries);
+      break;
+
+    case OPT_CAS_MAX_BACKOFF:
+      options->cas_max_backoff = atoi(pj_optarg);
+      LOG_INFO("Maximum CAS retry backoff set to %dms", options->cas_max_backoff);
+      break;
+
+    case OPT_REMOTE_REPLICATION_QUEUE:
+      options->remote_replication_queue = atoi(pj_optarg);
+      LOG_INFO("Remote replication queue set to %d",
+               options->remote_replication_queue);
+      break;
+
+    case OPT_REMOTE_REPLICATION_THREADS:
+      options->remote_replication_threads = atoi(pj_optarg);
+      LOG_INFO("Remote replication threads set to %d",
+               options->remote_replication_threads);
+      break;
+
+    case OPT_HEDGED_READ_PERCENTILE:
+      options->hedged_read_percentile = atof(pj_optarg);
+      LOG_INFO("Hedged read percentile set to %g",
+               options->hedged_read_percentile);
+      break;
+
+    case OPT_HEDGED_READ_THREADS:
+      options->hedged_read_threads = atoi(pj_optarg);
+      LOG_INFO("Hedged read threads set to %d",
+               options->hedged_read_threads);
+      break;
+
+    case OPT_OPTIONS_FAST_PATH_RATE:
+      options->options_fast_path_rate = atoi(pj_optarg);
+      LOG_INFO("OPTIONS fast path rate set to %d per second",
+               options->options_fast_path_rate);
+      break;
+
+    case OPT_MAX_ACTIVE_WORKERS:
+      options->max_active_workers = atoi(pj_optarg);
+      LOG_INFO("Maximum active worker threads set to %d",
+               options->max_active_workers);
+      break;
+
     case 'h':
       usage();
       return -1;
@@ -919,10 +1357,17 @@ int main(int argc, char *argv[])
   Store* remote_data_store = NULL;
   RegStore* local_reg_store = NULL;
   RegStore* remote_reg_store = NULL;
+  RegStoreReplicator* remote_reg_store_replicator = NULL;
+  HedgedRegStoreReader* hedged_reg_store_reader = NULL;
+  AoRCache* local_aor_cache = NULL;
+  AoRCache* remote_aor_cache = NULL;
+  SubscriberProfileCache* hss_profile_cache = NULL;
   AvStore* av_store = NULL;
   SCSCFSelector* scscf_selector = NULL;
   ICSCFProxy* icscf_proxy = NULL;
   ChronosConnection* chronos_connection = NULL;
+  LocalChronosConnection* local_chronos_connection = NULL;
+  ShardedWorkerPool* dereg_pool = NULL;
   HttpConnection* ralf_connection = NULL;
   ACRFactory* scscf_acr_factory = NULL;
   ACRFactory* bgcf_acr_factory = NULL;
@@ -976,6 +1421,28 @@ int main(int argc, char *argv[])
   opt.record_routing_model = 1;
   opt.default_session_expires = 10 * 60;
   opt.worker_threads = 1;
+  opt.worker_affinity = PJ_FALSE;
+  opt.max_queue_depth = 0;
+  opt.queue_deadline = -1;
+  opt.load_control_queue_wait = PJ_FALSE;
+  opt.max_active_workers = 0;
+  opt.options_fast_path_rate = 1000;
+  opt.aor_cache_size = 0;
+  opt.aor_cache_staleness = 1000;
+  opt.reg_store_layout = RegStore::SINGLE_RECORD;
+  opt.reg_store_compress_threshold = 0;
+  opt.reg_timer_mode = RegStore::BINDING_TIMERS;
+  opt.reg_store_format = RegStore::LEGACY_FORMAT;
+  opt.local_timers = PJ_FALSE;
+  opt.dereg_threads = 4;
+  opt.hss_cache_size = 0;
+  opt.hss_cache_ttl = 30;
+  opt.cas_max_retries = 10;
+  opt.cas_max_backoff = 100;
+  opt.remote_replication_queue = 0;
+  opt.remote_replication_threads = 4;
+  opt.hedged_read_percentile = 0;
+  opt.hedged_read_threads = 8;
   opt.analytics_enabled = PJ_FALSE;
   opt.http_address = "0.0.0.0";
   opt.http_port = 9888;
@@ -1100,6 +1567,14 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if ((opt.reg_timer_mode == RegStore::AOR_TIMERS) &&
+      (opt.reg_store_layout == RegStore::SINGLE_RECORD) &&
+      (opt.reg_store_format == RegStore::LEGACY_FORMAT))
+  {
+    LOG_ERROR("Cannot use AoR timers with the legacy registration store format");
+    return 1;
+  }
+
   if ((opt.pcscf_enabled) && (opt.hss_server != ""))
   {
     LOG_WARNING("Homestead server configured on P-CSCF, ignoring");
@@ -1110,7 +1585,7 @@ int main(int argc, char *argv[])
     LOG_WARNING("XDM server configured on P-CSCF, ignoring");
   }
 
-  if (opt.scscf_enabled && (opt.chronos_service == ""))
+  if (opt.scscf_enabled && (opt.chronos_service == "") && (!opt.local_timers))
   {
     LOG_ERROR("S-CSCF enabled with no Chronos service");
     return 1;
@@ -1176,6 +1651,15 @@ int main(int argc, char *argv[])
                       sip_resolver,
                       opt.pjsip_threads,
                       opt.worker_threads,
+                      opt.max_active_workers,
+                      opt.worker_affinity,
+                      opt.max_queue_depth,
+                      opt.dispatch_weights,
+                      opt.queue_deadline,
+                      opt.load_control_queue_wait,
+                      opt.pjsip_cpus,
+                      opt.worker_cpus,
+                      opt.options_fast_path_rate,
                       opt.record_routing_model,
                       opt.default_session_expires,
                       quiescing_mgr,
@@ -1206,9 +1690,21 @@ int main(int argc, char *argv[])
   {
     // Create a connection to the HSS.
     LOG_STATUS("Creating connection to HSS %s", opt.hss_server.c_str());
+
+    if (opt.hss_cache_size > 0)
+    {
+      // Cache subscriber data across transactions.
+      LOG_STATUS("Caching data for up to %d subscribers for %ds",
+                 opt.hss_cache_size, opt.hss_cache_ttl);
+      hss_profile_cache = new SubscriberProfileCache(opt.hss_cache_size,
+                                                     opt.hss_cache_ttl * 1000,
+                                                     stack_data.stats_aggregator);
+    }
+
     hss_connection = new HSSConnection(opt.hss_server,
                                        load_monitor,
-                                       stack_data.stats_aggregator);
+                                       stack_data.stats_aggregator,
+                                       hss_profile_cache);
   }
 
   if (ralf_connection != NULL)
@@ -1241,7 +1737,18 @@ int main(int argc, char *argv[])
     pcscf_acr_factory = null_acr_factory;
   }
 
-  if (opt.chronos_service != "")
+  if (opt.local_timers)
+  {
+    // Run timers in this process.  The callbacks are registered once the
+    // stores they use have been created.
+    LOG_STATUS("Running timers locally");
+    local_chronos_connection =
+      new LocalChronosConnection(LocalChronosConnection::DEFAULT_THREADS,
+                                 LocalChronosConnection::DEFAULT_TICK_MS,
+                                 stack_data.stats_aggregator);
+    chronos_connection = local_chronos_connection;
+  }
+  else if (opt.chronos_service != "")
   {
     std::string port_str = std::to_string(opt.http_port);
     std::string http_uri = opt.http_address + ":" + std::string(port_str);
@@ -1277,9 +1784,73 @@ int main(int argc, char *argv[])
       exit(0);
     }
 
+    if (opt.aor_cache_size > 0)
+    {
+      // Create caches of records read from the registration data stores.
+      LOG_STATUS("Caching up to %d registration records for %dms",
+                 opt.aor_cache_size, opt.aor_cache_staleness);
+      local_aor_cache = new AoRCache("aor_cache",
+                                     opt.aor_cache_size,
+                                     opt.aor_cache_staleness,
+                                     stack_data.stats_aggregator);
+      if (remote_data_store != NULL)
+      {
+        remote_aor_cache = new AoRCache("remote_aor_cache",
+                                        opt.aor_cache_size,
+                                        opt.aor_cache_staleness,
+                                        stack_data.stats_aggregator);
+      }
+    }
+
     // Create local and optionally remote registration data stores.
-    local_reg_store = new RegStore(local_data_store, chronos_connection);
-    remote_reg_store = (remote_data_store != NULL) ? new RegStore(remote_data_store, chronos_connection) : NULL;
+    local_reg_store = new RegStore(local_data_store,
+                                   chronos_connection,
+                                   local_aor_cache,
+                                   opt.reg_store_layout,
+                                   stack_data.stats_aggregator,
+                                   "reg_store",
+                                   opt.reg_store_compress_threshold,
+                                   opt.reg_timer_mode,
+                                   opt.reg_store_format);
+    remote_reg_store = (remote_data_store != NULL) ?
+                         new RegStore(remote_data_store,
+                                      chronos_connection,
+                                      remote_aor_cache,
+                                      opt.reg_store_layout,
+                                      stack_data.stats_aggregator,
+                                      "remote_reg_store",
+                                      opt.reg_store_compress_threshold,
+                                      opt.reg_timer_mode,
+                                      opt.reg_store_format) :
+                         NULL;
+
+    if ((remote_reg_store != NULL) && (opt.remote_replication_queue > 0))
+    {
+      // Replicate registration records to the remote store in the background.
+      LOG_STATUS("Replicating to remote store with %d threads, queue %d",
+                 opt.remote_replication_threads, opt.remote_replication_queue);
+      remote_reg_store_replicator = new RegStoreReplicator(remote_reg_store,
+                                                           opt.remote_replication_threads,
+                                                           opt.remote_replication_queue,
+                                                           opt.cas_max_retries,
+                                                           opt.cas_max_backoff,
+                                                           stack_data.stats_aggregator);
+      remote_reg_store_replicator->start();
+    }
+
+    if ((remote_reg_store != NULL) && (opt.hedged_read_percentile > 0))
+    {
+      // Hedge slow local reads of registration records with reads from the
+      // remote store.
+      LOG_STATUS("Hedging reads at %g percentile with %d threads",
+                 opt.hedged_read_percentile, opt.hedged_read_threads);
+      hedged_reg_store_reader = new HedgedRegStoreReader(local_reg_store,
+                                                         remote_reg_store,
+                                                         opt.hedged_read_threads,
+                                                         opt.hedged_read_percentile,
+                                                         stack_data.stats_aggregator);
+      hedged_reg_store_reader->start();
+    }
 
     if (opt.xdm_server != "")
     {
@@ -1332,11 +1903,14 @@ int main(int argc, char *argv[])
     // Launch the registrar.
     status = init_registrar(local_reg_store,
                             remote_reg_store,
+                            remote_reg_store_replicator,
                             hss_connection,
                             analytics_logger,
                             scscf_acr_factory,
                             ifc_handler,
-                            opt.reg_max_expires);
+                            opt.reg_max_expires,
+                            opt.cas_max_retries,
+                            opt.cas_max_backoff);
 
     if (status != PJ_SUCCESS)
     {
@@ -1347,9 +1921,12 @@ int main(int argc, char *argv[])
     // Launch the subscription module.
     status = init_subscription(local_reg_store,
                                remote_reg_store,
+                               remote_reg_store_replicator,
                                hss_connection,
                                scscf_acr_factory,
-                               analytics_logger);
+                               analytics_logger,
+                               opt.cas_max_retries,
+                               opt.cas_max_backoff);
 
     if (status != PJ_SUCCESS)
     {
@@ -1360,6 +1937,7 @@ int main(int argc, char *argv[])
     // Launch stateful proxy as S-CSCF.
     status = init_stateful_proxy(local_reg_store,
                                  remote_reg_store,
+                                 hedged_reg_store_reader,
                                  call_services,
                                  ifc_handler,
                                  false,
@@ -1399,6 +1977,7 @@ int main(int argc, char *argv[])
                                  NULL,
                                  NULL,
                                  NULL,
+                                 NULL,
                                  true,
                                  opt.upstream_proxy,
                                  opt.upstream_proxy_port,
@@ -1470,9 +2049,16 @@ int main(int argc, char *argv[])
   {
     http_stack = HttpStack::get_instance();
 
+    if (opt.dereg_threads > 0)
+    {
+      dereg_pool = new ShardedWorkerPool("dereg", opt.dereg_threads,
+                                         opt.dereg_threads * 4);
+      dereg_pool->start();
+    }
+
     RegistrationTimeoutHandler::Config reg_timeout_config(local_reg_store, remote_reg_store, hss_connection);
     AuthTimeoutHandler::Config auth_timeout_config(av_store, hss_connection);
-    DeregistrationHandler::Config deregistration_config(local_reg_store, remote_reg_store, hss_connection, sip_resolver);
+    DeregistrationHandler::Config deregistration_config(local_reg_store, remote_reg_store, hss_connection, sip_resolver, dereg_pool);
 
     // The RegistrationTimeoutHandler and AuthTimeoutHandler both handle
     // chronos requests, so use the ChronosHandlerFactory.
@@ -1496,6 +2082,17 @@ int main(int argc, char *argv[])
     {
       LOG_ERROR("Caught HttpStack::Exception - %s - %d\n", e._func, e._rc);
     }
+
+    if (local_chronos_connection != NULL)
+    {
+      // Timers that pop locally are handled by the same handlers as timer
+      // pops from Chronos.
+      local_chronos_connection->register_callback("/timers",
+        new LocalTimerCallback<RegistrationTimeoutHandler, RegistrationTimeoutHandler::Config>(reg_timeout_config));
+      local_chronos_connection->register_callback("/authentication-timeout",
+        new LocalTimerCallback<AuthTimeoutHandler, AuthTimeoutHandler::Config>(auth_timeout_config));
+      local_chronos_connection->start();
+    }
   }
 
   // Wait here until the quite semaphore is signaled.
@@ -1512,6 +2109,13 @@ int main(int argc, char *argv[])
     {
       LOG_ERROR("Caught HttpStack::Exception - %s - %d\n", e._func, e._rc);
     }
+
+    if (local_chronos_connection != NULL)
+    {
+      local_chronos_connection->stop();
+    }
+
+    delete dereg_pool;
   }
 
   stop_stack();
@@ -1524,14 +2128,17 @@ int main(int argc, char *argv[])
   {
     destroy_subscription();
     destroy_registrar();
+    delete remote_reg_store_replicator;
     if (opt.auth_enabled)
     {
       destroy_authentication();
     }
     destroy_stateful_proxy();
+    delete hedged_reg_store_reader;
     delete ifc_handler;
     delete call_services;
     delete hss_connection;
+    delete hss_profile_cache;
     delete xdm_connection;
     delete enum_service;
     delete bgcf_service;
@@ -1561,6 +2168,8 @@ int main(int argc, char *argv[])
   delete load_monitor;
   delete local_reg_store;
   delete remote_reg_store;
+  delete local_aor_cache;
+  delete remote_aor_cache;
   delete av_store;
   delete local_data_store;
   delete remote_data_store;
@@ -148,7 +148,7 @@ pj_xml_node* notify_create_reg_state_xml(
                          pj_pool_t *pool,
                          std::string& aor,
                          RegStore::AoR::Subscription* subscription,
-                         std::map<std::string, RegStore::AoR::Binding> bindings,
+                         const std::map<std::string, RegStore::AoR::Binding>& bindings,
                          NotifyUtils::DocState doc_state,
                          NotifyUtils::RegContactState reg_state,
                          NotifyUtils::RegContactState contact_state,
@@ -262,7 +262,7 @@ pj_status_t notify_create_body(pjsip_msg_body* body,
                                pj_pool_t *pool,
                                std::string& aor,
                                RegStore::AoR::Subscription* subscription,
-                               std::map<std::string, RegStore::AoR::Binding> bindings,
+                               const std::map<std::string, RegStore::AoR::Binding>& bindings,
                                NotifyUtils::DocState doc_state,
                                NotifyUtils::RegContactState reg_state,
                                NotifyUtils::RegContactState contact_state,
@@ -335,7 +335,7 @@ pj_status_t NotifyUtils::create_notify(
                                     RegStore::AoR::Subscription* subscription,
                                     std::string aor,
                                     int cseq,
-                                    std::map<std::string, RegStore::AoR::Binding> bindings,
+                                    const std::map<std::string, RegStore::AoR::Binding>& bindings,
                                     NotifyUtils::DocState doc_state,
                                     NotifyUtils::RegContactState reg_state,
                                     NotifyUtils::RegContactState contact_state,
@@ -68,18 +68,24 @@ pjsip_module mod_options =
 };
 
 
+pj_bool_t is_local_options(pjsip_rx_data* rdata)
+{
+  // OPTIONS targetted at this node/home domain, with either no route header
+  // or a single local route header.
+  return ((rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
+          (rdata->msg_info.msg->line.req.method.id == PJSIP_OPTIONS_METHOD) &&
+          (PJUtils::is_uri_local(rdata->msg_info.msg->line.req.uri)) &&
+          (PJUtils::check_route_headers(rdata)));
+}
+
+
 pj_bool_t on_rx_request(pjsip_rx_data* rdata)
 {
-  if (rdata->msg_info.msg->line.req.method.id == PJSIP_OPTIONS_METHOD)
+  if (is_local_options(rdata))
   {
-    if (PJUtils::is_uri_local(rdata->msg_info.msg->line.req.uri) &&
-        PJUtils::check_route_headers(rdata))
-    {
-      // OPTIONS targetted at this node/home domain, and there's either no route
-      // header or a single local route header. espond statelessly.
-      PJUtils::respond_stateless(stack_data.endpt, rdata, 200, NULL, NULL, NULL);
-      return PJ_TRUE;
-    }
+    // Respond statelessly.
+    PJUtils::respond_stateless(stack_data.endpt, rdata, 200, NULL, NULL, NULL);
+    return PJ_TRUE;
   }
 
   return PJ_FALSE;
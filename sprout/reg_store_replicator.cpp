@@ -0,0 +1,348 @@
+/**
+ * @file reg_store_replicator.cpp Background replication of registration
+ * records to a remote store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "log.h"
+#include "stack.h"
+#include "pjutils.h"
+#include "reg_store_replicator.h"
+
+RegStoreReplicator::RegStoreReplicator(RegStore* store,
+                                       int num_threads,
+                                       int max_queue,
+                                       int max_retries,
+                                       int max_backoff_ms,
+                                       LastValueCache* lvc) :
+  _store(store),
+  _num_threads(num_threads),
+  _max_queue(max_queue),
+  _terminated(false),
+  _queue(),
+  _updates(),
+  _in_flight(),
+  _threads(),
+  _cas_retry("remote_replication", lvc, max_retries, max_backoff_ms),
+  _lag_histogram("remote_replication_lag_us", lvc),
+  _coalesced_counter("remote_replication_coalesced", lvc),
+  _dropped_counter("remote_replication_dropped", lvc),
+  _failed_counter("remote_replication_failed", lvc)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_work_cond, NULL);
+  pthread_cond_init(&_idle_cond, NULL);
+}
+
+
+RegStoreReplicator::~RegStoreReplicator()
+{
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_broadcast(&_work_cond);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<pj_thread_t*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    pj_thread_join(*i);
+    pj_thread_destroy(*i);
+  }
+
+  if (!_updates.empty())
+  {
+    LOG_WARNING("Discarding %d updates waiting to be replicated", (int)_updates.size());
+  }
+
+  for (std::map<std::string, Update>::iterator i = _updates.begin();
+       i != _updates.end();
+       ++i)
+  {
+    delete i->second.aor_data;
+    delete i->second.original_aor_data;
+  }
+
+  pthread_cond_destroy(&_idle_cond);
+  pthread_cond_destroy(&_work_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void RegStoreReplicator::start()
+{
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    pj_thread_t* thread;
+    pj_status_t status = pj_thread_create(stack_data.pool, "replicator",
+                                          &replication_thread,
+                                          (void*)this, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating replication thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      continue;
+      // LCOV_EXCL_STOP
+    }
+    _threads.push_back(thread);
+  }
+}
+
+
+void RegStoreReplicator::replicate(const std::string& aor_id,
+                                   RegStore::AoR* aor_data,
+                                   RegStore::AoR* original_aor_data,
+                                   SAS::TrailId trail)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Update>::iterator i = _updates.find(aor_id);
+  if (i != _updates.end())
+  {
+    // There is already an update queued for this AoR, so replace it.  The
+    // original AoR and the time it was queued are kept, so the update covers
+    // both changes and the lag covers the oldest change that hasn't been
+    // written.
+    LOG_DEBUG("Coalescing update to %s with queued update", aor_id.c_str());
+    delete i->second.aor_data;
+    i->second.aor_data = new RegStore::AoR(*aor_data);
+    i->second.trail = trail;
+    _coalesced_counter.increment();
+  }
+  else if (_queue.size() >= _max_queue)
+  {
+    LOG_WARNING("Replication queue full, dropping update to %s", aor_id.c_str());
+    _dropped_counter.increment();
+  }
+  else
+  {
+    Update update;
+    update.aor_data = new RegStore::AoR(*aor_data);
+    update.original_aor_data = (original_aor_data != NULL) ?
+                                 new RegStore::AoR(*original_aor_data) :
+                                 new RegStore::AoR();
+    update.queued_us = now_us();
+    update.trail = trail;
+    _updates[aor_id] = update;
+    _queue.push_back(aor_id);
+    pthread_cond_signal(&_work_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+int RegStoreReplicator::queue_size()
+{
+  pthread_mutex_lock(&_lock);
+  int size = _queue.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+
+void RegStoreReplicator::wait_idle()
+{
+  pthread_mutex_lock(&_lock);
+  while ((!_queue.empty()) || (!_in_flight.empty()))
+  {
+    pthread_cond_wait(&_idle_cond, &_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+
+int RegStoreReplicator::replication_thread(void* p)
+{
+  ((RegStoreReplicator*)p)->run();
+  return 0;
+}
+
+
+void RegStoreReplicator::run()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminated)
+  {
+    // Take the oldest update for an AoR that isn't already being written.
+    std::list<std::string>::iterator i = _queue.begin();
+    while ((i != _queue.end()) && (_in_flight.find(*i) != _in_flight.end()))
+    {
+      ++i;
+    }
+
+    if (i == _queue.end())
+    {
+      pthread_cond_wait(&_work_cond, &_lock);
+      continue;
+    }
+
+    std::string aor_id = *i;
+    _queue.erase(i);
+    Update update = _updates[aor_id];
+    _updates.erase(aor_id);
+    _in_flight.insert(aor_id);
+    pthread_mutex_unlock(&_lock);
+
+    if (!write(aor_id, update))
+    {
+      LOG_WARNING("Failed to replicate AoR %s", aor_id.c_str());
+      _failed_counter.increment();
+    }
+    _lag_histogram.record(now_us() - update.queued_us);
+    delete update.aor_data;
+    delete update.original_aor_data;
+
+    pthread_mutex_lock(&_lock);
+    _in_flight.erase(aor_id);
+
+    // Another update to this AoR may have been waiting for this one.
+    pthread_cond_broadcast(&_work_cond);
+
+    if ((_queue.empty()) && (_in_flight.empty()))
+    {
+      pthread_cond_broadcast(&_idle_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Apply an update to an AoR in the remote store.
+bool RegStoreReplicator::write(const std::string& aor_id,
+                               const Update& update)
+{
+  CasRetry::Update retry(&_cas_retry);
+  RegStore::AoR* remote_aor_data = NULL;
+  Store::Status status;
+  bool ignored;
+
+  do
+  {
+    delete remote_aor_data;
+    remote_aor_data = _store->get_aor_data(aor_id, update.trail);
+
+    if (remote_aor_data == NULL)
+    {
+      // LCOV_EXCL_START - local store (used in testing) never fails
+      LOG_ERROR("Failed to get AoR %s from remote store", aor_id.c_str());
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    apply_changes(update.original_aor_data, update.aor_data, remote_aor_data);
+  }
+  while (((status = _store->try_set_aor_data(aor_id, remote_aor_data, false, update.trail, ignored)) ==
+          Store::Status::DATA_CONTENTION) &&
+         (retry.retry()));
+
+  delete remote_aor_data;
+  return (status == Store::Status::OK);
+}
+
+
+/// Copy the bindings and subscriptions that have been added or changed
+/// between the original and updated AoR to the remote AoR, and remove the
+/// ones that have been removed.  Bindings and subscriptions that haven't
+/// changed are left as they are in the remote AoR.
+void RegStoreReplicator::apply_changes(RegStore::AoR* original_aor_data,
+                                       RegStore::AoR* aor_data,
+                                       RegStore::AoR* remote_aor_data)
+{
+  const RegStore::AoR::Bindings& original_bindings = original_aor_data->bindings();
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    RegStore::AoR::Bindings::const_iterator j = original_bindings.find(i->first);
+    if ((j == original_bindings.end()) || (*j->second != *i->second))
+    {
+      LOG_DEBUG("Replicate binding %s", i->first.c_str());
+      *remote_aor_data->get_binding(i->first) = *i->second;
+    }
+  }
+  for (RegStore::AoR::Bindings::const_iterator i = original_bindings.begin();
+       i != original_bindings.end();
+       ++i)
+  {
+    if (aor_data->bindings().find(i->first) == aor_data->bindings().end())
+    {
+      LOG_DEBUG("Replicate removal of binding %s", i->first.c_str());
+      remote_aor_data->remove_binding(i->first);
+    }
+  }
+
+  const RegStore::AoR::Subscriptions& original_subscriptions = original_aor_data->subscriptions();
+  for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    RegStore::AoR::Subscriptions::const_iterator j = original_subscriptions.find(i->first);
+    if ((j == original_subscriptions.end()) || (*j->second != *i->second))
+    {
+      LOG_DEBUG("Replicate subscription %s", i->first.c_str());
+      *remote_aor_data->get_subscription(i->first) = *i->second;
+    }
+  }
+  for (RegStore::AoR::Subscriptions::const_iterator i = original_subscriptions.begin();
+       i != original_subscriptions.end();
+       ++i)
+  {
+    if (aor_data->subscriptions().find(i->first) == aor_data->subscriptions().end())
+    {
+      LOG_DEBUG("Replicate removal of subscription %s", i->first.c_str());
+      remote_aor_data->remove_subscription(i->first);
+    }
+  }
+
+  // NOTIFYs for the AoR may be sent from either site, so never move the
+  // CSeq backwards.
+  if (aor_data->_notify_cseq > remote_aor_data->_notify_cseq)
+  {
+    remote_aor_data->_notify_cseq = aor_data->_notify_cseq;
+  }
+}
+
+
+uint64_t RegStoreReplicator::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
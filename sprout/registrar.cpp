@@ -63,10 +63,15 @@ extern "C" {
 #include "custom_headers.h"
 #include "log.h"
 #include "notify_utils.h"
+#include "cas_retry.h"
 
 static RegStore* store;
 static RegStore* remote_store;
 
+// Background replicator for writes to the remote store, or NULL if the
+// remote store is written synchronously.
+static RegStoreReplicator* remote_replicator;
+
 // Connection to the HSS service for retrieving associated public URIs.
 static HSSConnection* hss;
 
@@ -79,6 +84,9 @@ static AnalyticsLogger* analytics;
 
 static int max_expires;
 
+// Retry policy and statistics for updates to the registration store.
+static CasRetry* cas_retry;
+
 // Pre-constructed Service Route header added to REGISTER responses.
 static pjsip_routing_hdr* service_route;
 
@@ -210,10 +218,12 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
                               int now,                       ///<time now
                               int& expiry,                   ///<[out] longest expiry time
                               bool& out_is_initial_registration,
+                              bool& out_retries_exhausted,   ///<[out] gave up retrying the update
                               RegStore::AoR* backup_aor,     ///<backup data if no entry in store
                               RegStore* backup_store,        ///<backup store to read from if no entry in store and no backup data
                               bool send_notify,              ///<whether to send notifies (only send when writing to the local store)
                               std::string private_id,        ///<private id that the binding was registered with
+                              RegStore::AoR** out_original_aor, ///<[out] if not NULL, the AoR as read before the update
                               SAS::TrailId trail)
 {
   // Get the call identifier and the cseq number from the respective headers.
@@ -228,8 +238,11 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
 
   // The registration service uses optimistic locking to avoid concurrent
   // updates to the same AoR conflicting.  This means we have to loop
-  // reading, updating and writing the AoR until the write is successful.
+  // reading, updating and writing the AoR until the write is successful,
+  // backing off between attempts and giving up if the AoR is too contended.
   RegStore::AoR* aor_data = NULL;
+  CasRetry::Update retry(cas_retry);
+  Store::Status set_status = Store::Status::OK;
   bool backup_aor_alloced = false;
   bool is_initial_registration = true;
   std::map<std::string, RegStore::AoR::Binding> bindings_for_notify;
@@ -254,6 +267,14 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
       // LCOV_EXCL_STOP
     }
 
+    if (out_original_aor != NULL)
+    {
+      // Keep a copy of the AoR as read, so the caller can tell what this
+      // update changed.
+      delete *out_original_aor;
+      *out_original_aor = new RegStore::AoR(*aor_data);
+    }
+
     // If we don't have any bindings, try the backup AoR and/or store.
     if (aor_data->bindings().empty())
     {
@@ -426,7 +447,9 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
     // Finally, update the cseq
     aor_data->_notify_cseq++;
   }
-  while (!primary_store->set_aor_data(aor, aor_data, send_notify, trail, all_bindings_expired));
+  while (((set_status = primary_store->try_set_aor_data(aor, aor_data, send_notify, trail, all_bindings_expired)) ==
+           Store::Status::DATA_CONTENTION) &&
+         (retry.retry()));
 
   // If we allocated the backup AoR, tidy up.
   if (backup_aor_alloced)
@@ -434,8 +457,28 @@ RegStore::AoR* write_to_store(RegStore* primary_store,       ///<store to write
     delete backup_aor;
   }
 
+  if (retry.exhausted())
+  {
+    LOG_ERROR("Failed to update AoR %s after %d retries", aor.c_str(), retry.retries());
+    delete aor_data;
+    aor_data = NULL;
+    all_bindings_expired = false;
+  }
+  else if ((aor_data != NULL) && (set_status != Store::Status::OK))
+  {
+    // Retrying won't help if the store can't be accessed.
+    // LCOV_EXCL_START - local store (used in testing) never fails
+    LOG_ERROR("Failed to write AoR %s to store", aor.c_str());
+    delete aor_data;
+    aor_data = NULL;
+    all_bindings_expired = false;
+    // LCOV_EXCL_STOP
+  }
+
+  out_retries_exhausted = retry.exhausted();
+
   // Finally, send out SIP NOTIFYs for any subscriptions
-  if (send_notify)
+  if ((send_notify) && (aor_data != NULL))
   {
     for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
          i != aor_data->subscriptions().end();
@@ -688,9 +731,14 @@ void process_register_request(pjsip_rx_data* rdata)
 
 
   // Write to the local store, checking the remote store if there is no entry locally.
+  bool retries_exhausted = false;
+  RegStore::AoR* original_aor_data = NULL;
   RegStore::AoR* aor_data = write_to_store(store, aor, rdata, now, expiry,
-                                           is_initial_registration, NULL, remote_store,
-                                           true, private_id_for_binding, trail);
+                                           is_initial_registration, retries_exhausted,
+                                           NULL, remote_store, true,
+                                           private_id_for_binding,
+                                           (remote_replicator != NULL) ? &original_aor_data : NULL,
+                                           trail);
   if (aor_data != NULL)
   {
     // Log the bindings.
@@ -698,17 +746,39 @@ void process_register_request(pjsip_rx_data* rdata)
 
     // If we have a remote store, try to store this there too.  We don't worry
     // about failures in this case.
-    if (remote_store != NULL)
+    if (remote_replicator != NULL)
+    {
+      // Leave the replicator to copy the changes to the remote store in the
+      // background.
+      remote_replicator->replicate(aor, aor_data, original_aor_data, trail);
+    }
+    else if (remote_store != NULL)
     {
       int tmp_expiry = 0;
       bool ignored;
+      bool ignored_exhausted;
       RegStore::AoR* remote_aor_data = write_to_store(remote_store, aor, rdata, now,
-                                                      tmp_expiry, ignored, aor_data,
+                                                      tmp_expiry, ignored,
+                                                      ignored_exhausted, aor_data,
                                                       NULL, false, private_id_for_binding,
-                                                      trail);
+                                                      NULL, trail);
       delete remote_aor_data;
     }
   }
+  else if (retries_exhausted)
+  {
+    // The AoR is being updated too often for this update to get through.
+    // Reject the register with a 503 response, so the UE retries later.
+    // LCOV_EXCL_START - the store we use for UT never has contention
+    st_code = PJSIP_SC_SERVICE_UNAVAILABLE;
+
+    SAS::Event event(trail, SASEvent::REGISTER_FAILED, 0);
+    event.add_var_param(public_id);
+    std::string error_msg = "Registration Store contention";
+    event.add_var_param(error_msg);
+    SAS::report_event(event);
+    // LCOV_EXCL_STOP
+  }
   else
   {
     // Failed to connect to the local store.  Reject the register with a 500
@@ -725,6 +795,8 @@ void process_register_request(pjsip_rx_data* rdata)
     // LCOV_EXCL_STOP
   }
 
+  delete original_aor_data;
+
   // Build and send the reply.
   pjsip_tx_data* tdata;
   status = PJUtils::create_response(stack_data.endpt, rdata, st_code, NULL, &tdata);
@@ -757,6 +829,13 @@ void process_register_request(pjsip_rx_data* rdata)
   {
     // LCOV_EXCL_START - we only reject REGISTER if something goes wrong, and
     // we aren't covering any of those paths so we can't hit this either
+    if (st_code == PJSIP_SC_SERVICE_UNAVAILABLE)
+    {
+      pjsip_retry_after_hdr* retry_after =
+        pjsip_retry_after_hdr_create(tdata->pool, cas_retry->retry_after_secs());
+      pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)retry_after);
+    }
+
     status = pjsip_endpt_send_response2(stack_data.endpt, rdata, tdata, NULL, NULL);
 
     SAS::Event event(trail, SASEvent::REGISTER_FAILED, 0);
@@ -979,21 +1058,29 @@ pj_bool_t registrar_on_rx_request(pjsip_rx_data *rdata)
 
 pj_status_t init_registrar(RegStore* registrar_store,
                            RegStore* remote_reg_store,
+                           RegStoreReplicator* remote_reg_store_replicator,
                            HSSConnection* hss_connection,
                            AnalyticsLogger* analytics_logger,
                            ACRFactory* rfacr_factory,
                            IfcHandler* ifchandler_ref,
-                           int cfg_max_expires)
+                           int cfg_max_expires,
+                           int cfg_cas_max_retries,
+                           int cfg_cas_max_backoff_ms)
 {
   pj_status_t status;
 
   store = registrar_store;
   remote_store = remote_reg_store;
+  remote_replicator = remote_reg_store_replicator;
   hss = hss_connection;
   analytics = analytics_logger;
   ifchandler = ifchandler_ref;
   max_expires = cfg_max_expires;
   acr_factory = rfacr_factory;
+  cas_retry = new CasRetry("registrar",
+                           stack_data.stats_aggregator,
+                           cfg_cas_max_retries,
+                           cfg_cas_max_backoff_ms);
 
   // Construct a Service-Route header pointing at the S-CSCF ready to be added
   // to REGISTER 200 OK response.
@@ -1026,5 +1113,7 @@ pj_status_t init_registrar(RegStore* registrar_store,
 void destroy_registrar()
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_registrar);
+  delete cas_retry;
+  cas_retry = NULL;
 }
 
@@ -42,6 +42,7 @@ extern "C" {
 
 // Common STL includes.
 #include <cassert>
+#include <climits>
 #include <vector>
 #include <map>
 #include <set>
@@ -54,6 +55,8 @@ extern "C" {
 #include <iomanip>
 #include <algorithm>
 #include <time.h>
+#include <string.h>
+#include <zlib.h>
 
 #include "log.h"
 #include "utils.h"
@@ -63,13 +66,210 @@ extern "C" {
 #include "pjutils.h"
 #include "chronosconnection.h"
 #include "sproutsasevent.h"
+#include "worker_throttle.h"
+#include "binary_buffer.h"
+
+const char RegStore::Connector::FORMAT_MAGIC[3] = {'A', 'o', 'R'};
+const char RegStore::Connector::INDEX_MAGIC[3] = {'A', 'o', 'I'};
+const char RegStore::Connector::BINDING_MAGIC[3] = {'A', 'o', 'B'};
+const char RegStore::Connector::SUBSCRIPTION_MAGIC[3] = {'A', 'o', 'S'};
+
+
+/// Upper bound on the encoded size of a binding, including its ID.
+static size_t binding_size(const std::string& id, RegStore::AoR::Binding* b)
+{
+  size_t size = BinaryWriter::string_size(id) +
+                BinaryWriter::string_size(b->_uri) +
+                BinaryWriter::string_size(b->_cid) +
+                BinaryWriter::string_size(b->_timer_id) +
+                BinaryWriter::string_size(b->_private_id) +
+                5 * BinaryWriter::INT_SIZE + 1;
+  for (std::list<std::pair<std::string, std::string> >::const_iterator j = b->_params.begin();
+       j != b->_params.end();
+       ++j)
+  {
+    size += BinaryWriter::string_size(j->first) +
+            BinaryWriter::string_size(j->second);
+  }
+  for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+       j != b->_path_headers.end();
+       ++j)
+  {
+    size += BinaryWriter::string_size(*j);
+  }
+  return size;
+}
+
+
+/// Encode a binding, including its ID.
+static void write_binding(BinaryWriter& w,
+                          const std::string& id,
+                          RegStore::AoR::Binding* b)
+{
+  w.write_string(id);
+  w.write_string(b->_uri);
+  w.write_string(b->_cid);
+  w.write_int(b->_cseq);
+  w.write_int(b->_expires);
+  w.write_int(b->_priority);
+  w.write_uint(b->_params.size());
+  for (std::list<std::pair<std::string, std::string> >::const_iterator j = b->_params.begin();
+       j != b->_params.end();
+       ++j)
+  {
+    w.write_string(j->first);
+    w.write_string(j->second);
+  }
+  w.write_uint(b->_path_headers.size());
+  for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+       j != b->_path_headers.end();
+       ++j)
+  {
+    w.write_string(*j);
+  }
+  w.write_string(b->_timer_id);
+  w.write_string(b->_private_id);
+  w.write_byte(b->_emergency_registration ? 1 : 0);
+}
+
+
+/// Decode the fields of a binding that follow its ID.
+static void read_binding(BinaryReader& r, RegStore::AoR::Binding* b)
+{
+  r.read_string(b->_uri);
+  r.read_string(b->_cid);
+  r.read_int(b->_cseq);
+  r.read_int(b->_expires);
+  r.read_int(b->_priority);
+
+  uint64_t num_params = 0;
+  r.read_uint(num_params);
+  for (uint64_t jj = 0; (jj < num_params) && (r.ok()); ++jj)
+  {
+    std::pair<std::string, std::string> param;
+    r.read_string(param.first);
+    r.read_string(param.second);
+    b->_params.push_back(param);
+  }
+
+  uint64_t num_paths = 0;
+  r.read_uint(num_paths);
+  for (uint64_t jj = 0; (jj < num_paths) && (r.ok()); ++jj)
+  {
+    b->_path_headers.push_back(std::string());
+    r.read_string(b->_path_headers.back());
+  }
+
+  r.read_string(b->_timer_id);
+  r.read_string(b->_private_id);
+  uint8_t emergency = 0;
+  r.read_byte(emergency);
+  b->_emergency_registration = (emergency != 0);
+}
+
+
+/// Upper bound on the encoded size of a subscription, including its To tag.
+static size_t subscription_size(const std::string& id,
+                                RegStore::AoR::Subscription* s)
+{
+  size_t size = BinaryWriter::string_size(id) +
+                BinaryWriter::string_size(s->_req_uri) +
+                BinaryWriter::string_size(s->_from_uri) +
+                BinaryWriter::string_size(s->_from_tag) +
+                BinaryWriter::string_size(s->_to_uri) +
+                BinaryWriter::string_size(s->_to_tag) +
+                BinaryWriter::string_size(s->_cid) +
+                2 * BinaryWriter::INT_SIZE;
+  for (std::list<std::string>::const_iterator j = s->_route_uris.begin();
+       j != s->_route_uris.end();
+       ++j)
+  {
+    size += BinaryWriter::string_size(*j);
+  }
+  return size;
+}
+
+
+/// Encode a subscription, including its To tag.
+static void write_subscription(BinaryWriter& w,
+                               const std::string& id,
+                               RegStore::AoR::Subscription* s)
+{
+  w.write_string(id);
+  w.write_string(s->_req_uri);
+  w.write_string(s->_from_uri);
+  w.write_string(s->_from_tag);
+  w.write_string(s->_to_uri);
+  w.write_string(s->_to_tag);
+  w.write_string(s->_cid);
+  w.write_uint(s->_route_uris.size());
+  for (std::list<std::string>::const_iterator j = s->_route_uris.begin();
+       j != s->_route_uris.end();
+       ++j)
+  {
+    w.write_string(*j);
+  }
+  w.write_int(s->_expires);
+}
+
+
+/// Decode the fields of a subscription that follow its To tag.
+static void read_subscription(BinaryReader& r, RegStore::AoR::Subscription* s)
+{
+  r.read_string(s->_req_uri);
+  r.read_string(s->_from_uri);
+  r.read_string(s->_from_tag);
+  r.read_string(s->_to_uri);
+  r.read_string(s->_to_tag);
+  r.read_string(s->_cid);
+
+  uint64_t num_routes = 0;
+  r.read_uint(num_routes);
+  for (uint64_t jj = 0; (jj < num_routes) && (r.ok()); ++jj)
+  {
+    s->_route_uris.push_back(std::string());
+    r.read_string(s->_route_uris.back());
+  }
+
+  r.read_int(s->_expires);
+}
+
+
+/// Write a record header.
+static void write_header(BinaryWriter& w, const char* magic, int version)
+{
+  w.write_bytes(magic, 3);
+  w.write_byte(0x80 | version);
+}
+
+
+/// Check whether a record has the specified magic number.
+static bool has_magic(const std::string& s, const char* magic, size_t header_len)
+{
+  return ((s.size() >= header_len) && (memcmp(s.data(), magic, 3) == 0));
+}
+
 
 RegStore::RegStore(Store* data_store,
-                   ChronosConnection* chronos_connection) :
+                   ChronosConnection* chronos_connection,
+                   AoRCache* cache,
+                   Layout layout,
+                   LastValueCache* lvc,
+                   const std::string& stat_prefix,
+                   size_t compress_threshold,
+                   TimerMode timer_mode,
+                   Format format) :
   _chronos(chronos_connection),
+  _timer_mode(timer_mode),
   _connector(NULL)
 {
-  _connector = new Connector(data_store);
+  _connector = new Connector(data_store,
+                             cache,
+                             layout,
+                             lvc,
+                             stat_prefix,
+                             compress_threshold,
+                             format);
 }
 
 
@@ -89,9 +289,7 @@ RegStore::AoR* RegStore::get_aor_data(const std::string& aor_id, SAS::TrailId tr
 
   if (aor_data != NULL)
   {
-    int now = time(NULL);
-    expire_bindings(aor_data, now);
-    expire_subscriptions(aor_data, now);
+    expire(aor_data, time(NULL));
   }
 
   return aor_data;
@@ -104,13 +302,35 @@ RegStore::AoR* RegStore::Connector::get_aor_data(const std::string& aor_id, SAS:
 
   std::string data;
   uint64_t cas;
-  Store::Status status = _data_store->get_data("reg", aor_id, data, cas, trail);
+  Store::Status status;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = get_record(aor_id, data, cas, trail);
+  }
 
   if (status == Store::Status::OK)
   {
-    // Retrieved the data, so deserialize it.
-    aor_data = deserialize_aor(data);
-    aor_data->_cas = cas;
+    if (is_index_record(data))
+    {
+      // The AoR is held as per-binding records, so read them all.
+      aor_data = get_indexed_aor(aor_id, data, cas, trail);
+
+      if (_cache != NULL)
+      {
+        _cache->put_read(aor_id, serialize_aor(aor_data), indexed_version(aor_data));
+      }
+    }
+    else
+    {
+      if (_cache != NULL)
+      {
+        _cache->put_read(aor_id, data, cas);
+      }
+
+      // Retrieved the data, so deserialize it.
+      aor_data = deserialize_aor(data);
+      aor_data->_cas = cas;
+    }
     LOG_DEBUG("Data store returned a record, CAS = %ld", aor_data->_cas);
 
     SAS::Event event(trail, SASEvent::REGSTORE_GET_FOUND, 0);
@@ -140,6 +360,180 @@ RegStore::AoR* RegStore::Connector::get_aor_data(const std::string& aor_id, SAS:
   return aor_data;
 }
 
+/// Retrieve the registration data for a batch of SIP Addresses of Record,
+/// creating empty records for AoRs with no data.
+///
+/// @param aor_ids      The SIP Addresses of Record to read
+/// @param aor_data     Filled in with the data for each AoR
+bool RegStore::get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                  std::map<std::string, AoR*>& aor_data,
+                                  SAS::TrailId trail)
+{
+  std::map<std::string, AoR*> new_aor_data;
+  std::vector<std::string> unread_ids;
+
+  for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+       i != aor_ids.end();
+       ++i)
+  {
+    if (aor_data.find(*i) == aor_data.end())
+    {
+      unread_ids.push_back(*i);
+    }
+  }
+
+  bool success = _connector->get_aor_data_multi(unread_ids, new_aor_data, trail);
+
+  int now = time(NULL);
+
+  for (std::map<std::string, AoR*>::const_iterator i = new_aor_data.begin();
+       i != new_aor_data.end();
+       ++i)
+  {
+    if (i->second != NULL)
+    {
+      expire(i->second, now);
+    }
+
+    aor_data[i->first] = i->second;
+  }
+
+  return success;
+}
+
+bool RegStore::Connector::get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                             std::map<std::string, AoR*>& aor_data,
+                                             SAS::TrailId trail)
+{
+  LOG_DEBUG("Get AoR data for %d AoRs", aor_ids.size());
+  bool success = true;
+
+  // Give up this thread's worker slot once for the whole batch rather than
+  // once per read.
+  WorkerThrottle::BlockingCall blocking;
+
+  for (std::vector<std::string>::const_iterator i = aor_ids.begin();
+       i != aor_ids.end();
+       ++i)
+  {
+    if (aor_data.find(*i) != aor_data.end())
+    {
+      // The same AoR appears more than once in the batch.
+      continue;
+    }
+
+    AoR* aor = get_aor_data(*i, trail);
+    aor_data[*i] = aor;
+
+    if (aor == NULL)
+    {
+      success = false; // LCOV_EXCL_LINE - local store never fails
+    }
+  }
+
+  return success;
+}
+
+/// Get a read-only view of the bindings for an AoR.
+///
+/// @param aor_id       The SIP Address of Record for the registration
+/// @param pool         Pool to allocate the view from
+/// @param view         Filled in with the unexpired bindings
+bool RegStore::get_aor_view(const std::string& aor_id,
+                            pj_pool_t* pool,
+                            AoRView& view,
+                            SAS::TrailId trail)
+{
+  if (!_connector->get_aor_view(aor_id, pool, view, trail))
+  {
+    return false;
+  }
+
+  // Leave out any bindings that have expired.
+  int now = time(NULL);
+  unsigned num_live = 0;
+  for (unsigned ii = 0; ii < view._num_bindings; ++ii)
+  {
+    if (view._bindings[ii].expires > now)
+    {
+      view._bindings[num_live++] = view._bindings[ii];
+    }
+  }
+  view._num_bindings = num_live;
+
+  return true;
+}
+
+bool RegStore::Connector::get_aor_view(const std::string& aor_id,
+                                       pj_pool_t* pool,
+                                       AoRView& view,
+                                       SAS::TrailId trail)
+{
+  LOG_DEBUG("Get AoR view for %s", aor_id.c_str());
+  bool success = true;
+
+  std::string data;
+  uint64_t cas;
+  Store::Status status;
+
+  if ((_cache != NULL) && (_cache->get(aor_id, data, cas)))
+  {
+    LOG_DEBUG("Using cached record for %s", aor_id.c_str());
+    status = Store::Status::OK;
+  }
+  else
+  {
+    {
+      WorkerThrottle::BlockingCall blocking;
+      status = get_record(aor_id, data, cas, trail);
+    }
+
+    if ((status == Store::Status::OK) && (is_index_record(data)))
+    {
+      // The AoR is held as per-binding records.  Read them all and view
+      // (and cache) the AoR as a single record.
+      AoR* aor_data = get_indexed_aor(aor_id, data, cas, trail);
+      data = serialize_aor(aor_data);
+      cas = indexed_version(aor_data);
+      delete aor_data;
+    }
+
+    if ((status == Store::Status::OK) && (_cache != NULL))
+    {
+      _cache->put_read(aor_id, data, cas);
+    }
+  }
+
+  if (status == Store::Status::OK)
+  {
+    decode_aor_view(data, pool, view);
+    view._cas = cas;
+
+    SAS::Event event(trail, SASEvent::REGSTORE_GET_FOUND, 0);
+    event.add_var_param(aor_id);
+    SAS::report_event(event);
+  }
+  else if (status == Store::Status::NOT_FOUND)
+  {
+    view = AoRView();
+
+    SAS::Event event(trail, SASEvent::REGSTORE_GET_NEW, 0);
+    event.add_var_param(aor_id);
+    SAS::report_event(event);
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    SAS::Event event(trail, SASEvent::REGSTORE_GET_FAILURE, 0);
+    event.add_var_param(aor_id);
+    SAS::report_event(event);
+    success = false;
+    // LCOV_EXCL_STOP
+  }
+
+  return success;
+}
+
 bool RegStore::set_aor_data(const std::string& aor_id,
                             AoR* aor_data,
                             bool set_chronos,
@@ -167,6 +561,19 @@ bool RegStore::set_aor_data(const std::string& aor_id,
                             bool set_chronos,
                             SAS::TrailId trail,
                             bool& all_bindings_expired)
+{
+  return (try_set_aor_data(aor_id, aor_data, set_chronos, trail, all_bindings_expired) ==
+          Store::Status::OK);
+}
+
+/// Update the data for a particular address of record, returning the
+/// status of the write - DATA_CONTENTION if the underlying data has changed
+/// since it was last read, or ERROR if the store couldn't be accessed.
+Store::Status RegStore::try_set_aor_data(const std::string& aor_id,
+                                         AoR* aor_data,
+                                         bool set_chronos,
+                                         SAS::TrailId trail,
+                                         bool& all_bindings_expired)
 {
   all_bindings_expired = false;
   // Expire any old bindings before writing to the server.  In theory, if
@@ -180,10 +587,15 @@ bool RegStore::set_aor_data(const std::string& aor_id,
   // This prevents a window condition where Chronos can return a binding to
   // expire, but memcached has already deleted the aor data (meaning that
   // no NOTIFYs could be sent)
-  int orig_max_expires = expire_bindings(aor_data, now);
+  //
+  // Expire any old subscriptions as well.  This doesn't get factored in to
+  // the expiry time on the store record because, according to 5.4.2.1.2 /
+  // TS 24.229, all subscriptions automatically expire when the last binding
+  // expires.
+  int orig_max_expires = expire(aor_data, now);
   int max_expires = orig_max_expires + 10;
 
-  // expire_bindings returns "now" if there are no remaining bindings,
+  // expire returns "now" if there are no remaining bindings,
   // so test for that.
   if (orig_max_expires == now)
   {
@@ -191,93 +603,941 @@ bool RegStore::set_aor_data(const std::string& aor_id,
     all_bindings_expired = true;
   }
 
-  // Expire any old subscriptions as well.  This doesn't get factored in to
-  // the expiry time on the store record because, according to 5.4.2.1.2 /
-  // TS 24.229, all subscriptions automatically expire when the last binding
-  // expires.
-  expire_subscriptions(aor_data, now);
-
   LOG_DEBUG("Set AoR data for %s, CAS=%ld, expiry = %d",
             aor_id.c_str(), aor_data->_cas, max_expires);
 
   // Set the chronos timers
   if (set_chronos)
   {
-    for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
-         i != aor_data->_bindings.end();
-         ++i)
+    if (_timer_mode == AOR_TIMERS)
     {
-      AoR::Binding* b = i->second;
-      std::string b_id = i->first;
+      set_aor_timer(aor_id, aor_data, now);
+    }
+    else
+    {
+      set_binding_timers(aor_id, aor_data, now);
+    }
+  }
 
-      HTTPCode status;
-      std::string timer_id = "";
-      std::string opaque = "{\"aor_id\": \"" + aor_id + "\", \"binding_id\": \"" + b_id +"\"}";
-      std::string callback_uri = "/timers";
+  return _connector->set_aor_data(aor_id, aor_data, max_expires - now, trail);
+}
 
-      int now = time(NULL);
-      int expiry = b->_expires - now;
+/// Update the data for a batch of addresses of record.
+///
+/// @param aor_data   The registration data records, keyed by AoR ID.
+/// @param set_chronos   Determines whether Chronos requests should be sent
+///                      to keep track of binding expiry times.
+/// @param rejected   Filled in with the AoRs whose update was rejected
+///                   because they had changed since they were read.
+/// @param failed     Filled in with the AoRs that couldn't be written
+///                   because of a store error.
+/// @param all_bindings_expired   Filled in with the AoRs that no longer
+///                               have any bindings.
+bool RegStore::set_aor_data_multi(const std::map<std::string, AoR*>& aor_data,
+                                  bool set_chronos,
+                                  SAS::TrailId trail,
+                                  std::set<std::string>& rejected,
+                                  std::set<std::string>& failed,
+                                  std::set<std::string>& all_bindings_expired)
+{
+  bool success = true;
 
-      // If a timer has been previously set for this binding, send a PUT. Otherwise sent a POST.
-      if (b->_timer_id == "")
-      {
-        status = _chronos->send_post(timer_id, expiry, callback_uri, opaque, 0);
-      }
-      else
+  for (std::map<std::string, AoR*>::const_iterator i = aor_data.begin();
+       i != aor_data.end();
+       ++i)
+  {
+    if (i->second == NULL)
+    {
+      continue;
+    }
+
+    bool expired = false;
+    Store::Status status = try_set_aor_data(i->first, i->second, set_chronos,
+                                            trail, expired);
+
+    if (status == Store::Status::OK)
+    {
+      if (expired)
       {
-        timer_id = b->_timer_id;
-        status = _chronos->send_put(timer_id, expiry, callback_uri, opaque, 0);
+        all_bindings_expired.insert(i->first);
       }
+    }
+    else if (status == Store::Status::DATA_CONTENTION)
+    {
+      rejected.insert(i->first);
+      success = false;
+    }
+    else
+    {
+      LOG_ERROR("Failed to write AoR %s", i->first.c_str());
+      failed.insert(i->first);
+      success = false;
+    }
+  }
+
+  return success;
+}
+
+/// Set a Chronos timer for each binding of an AoR, to pop when the binding
+/// expires.  If the AoR has a timer of its own, left over from running with
+/// per-AoR timers, it is deleted.
+void RegStore::set_binding_timers(const std::string& aor_id,
+                                  AoR* aor_data,
+                                  int now)
+{
+  if (aor_data->_timer_id != "")
+  {
+    WorkerThrottle::BlockingCall blocking;
+    _chronos->send_delete(aor_data->_timer_id, 0);
+    aor_data->_timer_id = "";
+  }
+
+  for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
+       i != aor_data->_bindings.end();
+       ++i)
+  {
+    AoR::Binding* b = i->second;
+    std::string b_id = i->first;
+
+    HTTPCode status;
+    std::string timer_id = "";
+    std::string opaque = "{\"aor_id\": \"" + aor_id + "\", \"binding_id\": \"" + b_id +"\"}";
+    std::string callback_uri = "/timers";
+
+    int expiry = b->_expires - now;
+
+    // If a timer has been previously set for this binding, send a PUT. Otherwise sent a POST.
+    if (b->_timer_id == "")
+    {
+      WorkerThrottle::BlockingCall blocking;
+      status = _chronos->send_post(timer_id, expiry, callback_uri, opaque, 0);
+    }
+    else
+    {
+      timer_id = b->_timer_id;
+      WorkerThrottle::BlockingCall blocking;
+      status = _chronos->send_put(timer_id, expiry, callback_uri, opaque, 0);
+    }
 
-      // Update the timer id. If the update to Chronos failed, that's OK, don't reject the register
-      // or update the stored timer id.
-      if (status == HTTP_OK)
+    // Update the timer id. If the update to Chronos failed, that's OK, don't reject the register
+    // or update the stored timer id.
+    if (status == HTTP_OK)
+    {
+      b->_timer_id = timer_id;
+    }
+  }
+}
+
+
+/// Set a single Chronos timer for an AoR, to pop when its first binding
+/// expires.  Any per-binding timers left over from running with per-binding
+/// timers are deleted, and the AoR's timer is deleted if it has no bindings
+/// left.
+void RegStore::set_aor_timer(const std::string& aor_id,
+                             AoR* aor_data,
+                             int now)
+{
+  AoR::Bindings::const_iterator first = aor_data->_bindings.end();
+
+  for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
+       i != aor_data->_bindings.end();
+       ++i)
+  {
+    AoR::Binding* b = i->second;
+
+    if (b->_timer_id != "")
+    {
+      WorkerThrottle::BlockingCall blocking;
+      _chronos->send_delete(b->_timer_id, 0);
+      b->_timer_id = "";
+    }
+
+    if ((first == aor_data->_bindings.end()) ||
+        (b->_expires < first->second->_expires))
+    {
+      first = i;
+    }
+  }
+
+  if (first == aor_data->_bindings.end())
+  {
+    if (aor_data->_timer_id != "")
+    {
+      WorkerThrottle::BlockingCall blocking;
+      _chronos->send_delete(aor_data->_timer_id, 0);
+      aor_data->_timer_id = "";
+    }
+
+    return;
+  }
+
+  // The pop is handled in the same way as a per-binding timer pop - it
+  // names the binding that is due to expire, but all the bindings that have
+  // expired by then are removed.
+  HTTPCode status;
+  std::string timer_id = "";
+  std::string opaque = "{\"aor_id\": \"" + aor_id + "\", \"binding_id\": \"" + first->first +"\"}";
+  std::string callback_uri = "/timers";
+  int expiry = first->second->_expires - now;
+
+  if (aor_data->_timer_id == "")
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _chronos->send_post(timer_id, expiry, callback_uri, opaque, 0);
+  }
+  else
+  {
+    timer_id = aor_data->_timer_id;
+    WorkerThrottle::BlockingCall blocking;
+    status = _chronos->send_put(timer_id, expiry, callback_uri, opaque, 0);
+  }
+
+  if (status == HTTP_OK)
+  {
+    aor_data->_timer_id = timer_id;
+  }
+}
+
+
+Store::Status RegStore::Connector::set_aor_data(const std::string& aor_id,
+                                                AoR* aor_data,
+                                                int expiry,
+                                                SAS::TrailId trail)
+{
+  SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
+  event.add_var_param(aor_id);
+  SAS::report_event(event);
+
+  Store::Status status;
+  std::string data;
+
+  if (_layout == PER_BINDING_RECORDS)
+  {
+    status = set_indexed_aor(aor_id, aor_data, expiry, trail);
+  }
+  else
+  {
+    data = (_format == BINARY_FORMAT) ? serialize_aor(aor_data) :
+                                        serialize_legacy_aor(aor_data);
+    status = set_record(aor_id, data, aor_data->_cas, expiry, trail);
+  }
+
+  if (status == Store::Status::OK)
+  {
+    SAS::Event event2(trail, SASEvent::REGSTORE_SET_SUCCESS, 0);
+    event2.add_var_param(aor_id);
+    SAS::report_event(event2);
+
+    if (_cache != NULL)
+    {
+      _cache->put_write(aor_id, (data.empty()) ? serialize_aor(aor_data) : data);
+    }
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    SAS::Event event2(trail, SASEvent::REGSTORE_SET_FAILURE, 0);
+    event2.add_var_param(aor_id);
+    SAS::report_event(event2);
+    // LCOV_EXCL_STOP
+
+    // The record in the store has been changed by someone else (or we
+    // can't tell), so any cached copy is out of date.
+    if (_cache != NULL)
+    {
+      _cache->invalidate(aor_id);
+    }
+  }
+
+  return status;
+}
+
+
+/// Write a single record to the "reg" table.
+Store::Status RegStore::Connector::set_record(const std::string& key,
+                                              const std::string& data,
+                                              uint64_t cas,
+                                              int expiry,
+                                              SAS::TrailId trail)
+{
+  Store::Status status;
+
+  if ((_compress_threshold > 0) &&
+      (data.size() >= _compress_threshold) &&
+      (has_binary_header(data)))
+  {
+    std::string compressed = compress_record(data);
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->set_data("reg", key, compressed, cas, expiry, trail);
+  }
+  else
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->set_data("reg", key, data, cas, expiry, trail);
+  }
+
+  LOG_DEBUG("Data store set_data returned %d", status);
+
+  if (_writes_counter != NULL)
+  {
+    _writes_counter->increment();
+
+    if (status == Store::Status::DATA_CONTENTION)
+    {
+      _conflicts_counter->increment();
+    }
+  }
+
+  return status;
+}
+
+
+/// Read a single record from the "reg" table.
+Store::Status RegStore::Connector::get_record(const std::string& key,
+                                              std::string& data,
+                                              uint64_t& cas,
+                                              SAS::TrailId trail)
+{
+  Store::Status status;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->get_data("reg", key, data, cas, trail);
+  }
+
+  if ((status == Store::Status::OK) && (!decompress_record(data)))
+  {
+    // Leave the record as it is.  It has an unknown format version, so is
+    // treated as corrupt and replaced by the next write.
+    LOG_ERROR("Failed to decompress record %s of %d bytes",
+              key.c_str(), (int)data.size());
+  }
+
+  return status;
+}
+
+
+bool RegStore::Connector::has_binary_header(const std::string& s)
+{
+  return (((has_magic(s, FORMAT_MAGIC, FORMAT_HEADER_LEN)) ||
+           (has_magic(s, INDEX_MAGIC, FORMAT_HEADER_LEN)) ||
+           (has_magic(s, BINDING_MAGIC, FORMAT_HEADER_LEN)) ||
+           (has_magic(s, SUBSCRIPTION_MAGIC, FORMAT_HEADER_LEN))) &&
+          (((uint8_t)s[sizeof(FORMAT_MAGIC)] & 0x80) != 0));
+}
+
+
+bool RegStore::Connector::is_compressed(const std::string& s)
+{
+  return ((has_binary_header(s)) &&
+          (((uint8_t)s[sizeof(FORMAT_MAGIC)] & COMPRESSED_FLAG) != 0));
+}
+
+
+std::string RegStore::Connector::compress_record(const std::string& s)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  const Bytef* contents = (const Bytef*)s.data() + FORMAT_HEADER_LEN;
+  uLong contents_len = s.size() - FORMAT_HEADER_LEN;
+  uLongf compressed_len = compressBound(contents_len);
+
+  std::string buf;
+  buf.reserve(FORMAT_HEADER_LEN + BinaryWriter::INT_SIZE + compressed_len);
+  BinaryWriter w(buf);
+  w.write_bytes(s.data(), sizeof(FORMAT_MAGIC));
+  w.write_byte((uint8_t)s[sizeof(FORMAT_MAGIC)] | COMPRESSED_FLAG);
+  w.write_uint(contents_len);
+
+  size_t offset = buf.size();
+  buf.resize(offset + compressed_len);
+  if ((compress2((Bytef*)&buf[offset],
+                 &compressed_len,
+                 contents,
+                 contents_len,
+                 Z_BEST_SPEED) != Z_OK) ||
+      (offset + compressed_len >= s.size()))
+  {
+    // The record doesn't get any smaller, so write it uncompressed.
+    LOG_DEBUG("Record of %d bytes doesn't compress", (int)s.size());
+    return s;
+  }
+  buf.resize(offset + compressed_len);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  LOG_DEBUG("Compressed record from %d to %d bytes", (int)s.size(), (int)buf.size());
+  if (_compression_ratio != NULL)
+  {
+    _compression_ratio->record((buf.size() * 100) / s.size());
+    _compress_us->record((end.tv_sec - start.tv_sec) * 1000000 +
+                         (end.tv_nsec - start.tv_nsec) / 1000);
+  }
+
+  return buf;
+}
+
+
+bool RegStore::Connector::decompress_record(std::string& s)
+{
+  if (!is_compressed(s))
+  {
+    return true;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  BinaryReader r(s.data() + FORMAT_HEADER_LEN, s.size() - FORMAT_HEADER_LEN);
+  uint64_t contents_len = 0;
+  if (!r.read_uint(contents_len))
+  {
+    return false;
+  }
+
+  if (contents_len > MAX_RECORD_SIZE)
+  {
+    // The length is corrupt (or the record is far larger than any AoR
+    // could be), so don't try to allocate space for it.
+    LOG_ERROR("Compressed record claims to be %lu bytes, limit is %lu",
+              (unsigned long)contents_len, (unsigned long)MAX_RECORD_SIZE);
+    return false;
+  }
+
+  const Bytef* compressed = (const Bytef*)s.data() + s.size() - r.remaining();
+  uLong compressed_len = r.remaining();
+
+  std::string buf;
+  buf.resize(FORMAT_HEADER_LEN + contents_len);
+  memcpy(&buf[0], s.data(), sizeof(FORMAT_MAGIC));
+  buf[sizeof(FORMAT_MAGIC)] = s[sizeof(FORMAT_MAGIC)] & ~COMPRESSED_FLAG;
+
+  uLongf len = contents_len;
+  if ((uncompress((Bytef*)&buf[FORMAT_HEADER_LEN], &len, compressed, compressed_len) != Z_OK) ||
+      (len != contents_len))
+  {
+    return false;
+  }
+  s.swap(buf);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (_decompress_us != NULL)
+  {
+    _decompress_us->record((end.tv_sec - start.tv_sec) * 1000000 +
+                           (end.tv_nsec - start.tv_nsec) / 1000);
+  }
+
+  return true;
+}
+
+
+/// Get the CAS of a record in the "reg" table, or zero (which only allows
+/// the record to be added) if there is no such record.
+uint64_t RegStore::Connector::get_cas(const std::string& key, SAS::TrailId trail)
+{
+  std::string data;
+  uint64_t cas = 0;
+  Store::Status status;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    status = _data_store->get_data("reg", key, data, cas, trail);
+  }
+
+  return (status == Store::Status::OK) ? cas : 0;
+}
+
+
+/// 64-bit FNV-1a hash of a string.  This is used in record keys, so must
+/// give the same result on every node sharing the store.
+static uint64_t fnv1a_hash(const std::string& s)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (std::string::const_iterator i = s.begin(); i != s.end(); ++i)
+  {
+    hash ^= (uint8_t)*i;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+
+/// Key of a binding or subscription record.  Binding IDs can be long, so
+/// the key uses a hash of the ID, and the full ID is held in the record.
+std::string RegStore::Connector::record_key(const std::string& aor_id,
+                                            char type,
+                                            const std::string& id)
+{
+  std::ostringstream oss;
+  oss << aor_id << '\\' << type << '\\' << std::hex << fnv1a_hash(id);
+  return oss.str();
+}
+
+
+bool RegStore::Connector::is_index_record(const std::string& s)
+{
+  return has_magic(s, INDEX_MAGIC, FORMAT_HEADER_LEN);
+}
+
+
+/// Combine the CAS values of the index and the records of an AoR read from
+/// per-binding records, so that a change to any of them changes the value.
+/// This is used in place of the CAS when caching the AoR.
+uint64_t RegStore::Connector::indexed_version(AoR* aor_data)
+{
+  uint64_t version = aor_data->_cas;
+  for (AoR::StoredRecords::const_iterator i = aor_data->_stored_bindings.begin();
+       i != aor_data->_stored_bindings.end();
+       ++i)
+  {
+    version = version * 31 + i->second.cas;
+  }
+  for (AoR::StoredRecords::const_iterator i = aor_data->_stored_subscriptions.begin();
+       i != aor_data->_stored_subscriptions.end();
+       ++i)
+  {
+    version = version * 31 + i->second.cas;
+  }
+  return version;
+}
+
+
+/// Serialize the index record of an AoR, listing its binding IDs and
+/// subscription To tags.
+std::string RegStore::Connector::serialize_index(AoR* aor_data,
+                                                 int notify_cseq,
+                                                 int index_expires)
+{
+  size_t size = FORMAT_HEADER_LEN + 4 * BinaryWriter::INT_SIZE +
+                BinaryWriter::string_size(aor_data->_timer_id);
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    size += BinaryWriter::string_size(i->first);
+  }
+  for (AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    size += BinaryWriter::string_size(i->first);
+  }
+
+  std::string buf;
+  buf.reserve(size);
+  BinaryWriter w(buf);
+
+  write_header(w, INDEX_MAGIC, FORMAT_VERSION);
+  w.write_int(notify_cseq);
+  w.write_int(index_expires);
+
+  w.write_uint(aor_data->bindings().size());
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    w.write_string(i->first);
+  }
+
+  w.write_uint(aor_data->subscriptions().size());
+  for (AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    w.write_string(i->first);
+  }
+
+  w.write_string(aor_data->_timer_id);
+
+  return buf;
+}
+
+
+/// Read an AoR held as per-binding records, given its index record.
+/// Bindings and subscriptions whose records are missing (or tombstones) are
+/// left out - the index is corrected the next time the AoR is written.
+RegStore::AoR* RegStore::Connector::get_indexed_aor(const std::string& aor_id,
+                                                   const std::string& index,
+                                                   uint64_t cas,
+                                                   SAS::TrailId trail)
+{
+  AoR* aor_data = new AoR();
+  aor_data->_cas = cas;
+  aor_data->_stored_index = index;
+
+  int version = (uint8_t)index[sizeof(INDEX_MAGIC)] & 0x7f;
+  if (version != FORMAT_VERSION)
+  {
+    LOG_ERROR("Unsupported AoR index record format version %d", version);
+    return aor_data;
+  }
+
+  BinaryReader r(index.data() + FORMAT_HEADER_LEN, index.size() - FORMAT_HEADER_LEN);
+  r.read_int(aor_data->_notify_cseq);
+  r.read_int(aor_data->_index_expires);
+  aor_data->_index_notify_cseq = aor_data->_notify_cseq;
+
+  uint64_t num_bindings = 0;
+  r.read_count(num_bindings);
+  LOG_DEBUG("Read %d binding records", (int)num_bindings);
+
+  for (uint64_t ii = 0; (ii < num_bindings) && (r.ok()); ++ii)
+  {
+    std::string binding_id;
+    r.read_string(binding_id);
+
+    AoR::StoredRecord record;
+    Store::Status status;
+    {
+      WorkerThrottle::BlockingCall blocking;
+      status = get_record(record_key(aor_id, 'b', binding_id),
+                          record.data,
+                          record.cas,
+                          trail);
+    }
+
+    if ((status != Store::Status::OK) || (record.data.empty()))
+    {
+      // Either the record has expired, or it is the tombstone of a binding
+      // removed by an update that hasn't finished writing the index.
+      LOG_DEBUG("  Binding %s has no record", binding_id.c_str());
+      continue;
+    }
+
+    std::string id;
+    BinaryReader br(record.data.data() + FORMAT_HEADER_LEN,
+                    record.data.size() - FORMAT_HEADER_LEN);
+    if (has_magic(record.data, BINDING_MAGIC, FORMAT_HEADER_LEN))
+    {
+      br.read_string(id);
+    }
+
+    if ((!br.ok()) || (id != binding_id))
+    {
+      LOG_ERROR("Invalid record for binding %s", binding_id.c_str());
+      continue;
+    }
+
+    LOG_DEBUG("  Binding %s", binding_id.c_str());
+    read_binding(br, aor_data->get_binding(binding_id));
+    if (br.ok())
+    {
+      aor_data->_stored_bindings[binding_id] = record;
+    }
+    else
+    {
+      LOG_ERROR("Invalid record for binding %s", binding_id.c_str());
+      aor_data->remove_binding(binding_id);
+    }
+  }
+
+  uint64_t num_subscriptions = 0;
+  r.read_count(num_subscriptions);
+  LOG_DEBUG("Read %d subscription records", (int)num_subscriptions);
+
+  for (uint64_t ii = 0; (ii < num_subscriptions) && (r.ok()); ++ii)
+  {
+    std::string to_tag;
+    r.read_string(to_tag);
+
+    AoR::StoredRecord record;
+    Store::Status status;
+    {
+      WorkerThrottle::BlockingCall blocking;
+      status = get_record(record_key(aor_id, 's', to_tag),
+                          record.data,
+                          record.cas,
+                          trail);
+    }
+
+    if ((status != Store::Status::OK) || (record.data.empty()))
+    {
+      // Either the record has expired, or it is the tombstone of a subscription
+      // removed by an update that hasn't finished writing the index.
+      LOG_DEBUG("  Subscription %s has no record", to_tag.c_str());
+      continue;
+    }
+
+    std::string id;
+    BinaryReader sr(record.data.data() + FORMAT_HEADER_LEN,
+                    record.data.size() - FORMAT_HEADER_LEN);
+    if (has_magic(record.data, SUBSCRIPTION_MAGIC, FORMAT_HEADER_LEN))
+    {
+      sr.read_string(id);
+    }
+
+    if ((!sr.ok()) || (id != to_tag))
+    {
+      LOG_ERROR("Invalid record for subscription %s", to_tag.c_str());
+      continue;
+    }
+
+    LOG_DEBUG("  Subscription %s", to_tag.c_str());
+    read_subscription(sr, aor_data->get_subscription(to_tag));
+    if (sr.ok())
+    {
+      aor_data->_stored_subscriptions[to_tag] = record;
+    }
+    else
+    {
+      LOG_ERROR("Invalid record for subscription %s", to_tag.c_str());
+      aor_data->remove_subscription(to_tag);
+    }
+  }
+
+  // Index records written by older versions don't hold a timer ID.
+  if ((r.ok()) && (r.remaining() > 0))
+  {
+    r.read_string(aor_data->_timer_id);
+  }
+
+  if (!r.ok())
+  {
+    // As for a corrupt single record, discard the contents and keep the
+    // CAS so that the next write replaces the index.
+    LOG_ERROR("Failed to decode AoR index record of %d bytes", (int)index.size());
+    aor_data->clear(true);
+  }
+
+  return aor_data;
+}
+
+
+/// Write an AoR as per-binding records.  Only the binding and subscription
+/// records that have changed since the AoR was read are written, each with
+/// the CAS it was read with, followed by the index if the set of bindings or
+/// subscriptions has changed or the index would otherwise expire before the
+/// bindings.  Records for bindings and subscriptions that have been removed
+/// are overwritten with tombstones, so that a concurrent refresh of one of
+/// them fails its CAS rather than writing a record that is no longer in the
+/// index.  If any write fails, the records already written are restored.
+Store::Status RegStore::Connector::set_indexed_aor(const std::string& aor_id,
+                                                   AoR* aor_data,
+                                                   int expiry,
+                                                   SAS::TrailId trail)
+{
+  int now = time(NULL);
+
+  // Work out when the index should expire.  While there are bindings it is
+  // kept for a while longer than needed, so that refreshing a binding
+  // doesn't usually need to write the index.
+  int max_expires = now + expiry;
+  int index_expires = aor_data->_index_expires;
+  if (aor_data->bindings().empty())
+  {
+    index_expires = max_expires;
+  }
+  else if (max_expires > index_expires)
+  {
+    index_expires = max_expires + INDEX_EXPIRY_SLACK;
+  }
+
+  // The NOTIFY CSeq is only used for subscriptions, so if there are none,
+  // a change to it alone doesn't need the index to be written.
+  std::string index = serialize_index(aor_data, aor_data->_notify_cseq, index_expires);
+  if ((index != aor_data->_stored_index) &&
+      (aor_data->subscriptions().empty()))
+  {
+    std::string old_cseq_index = serialize_index(aor_data,
+                                                 aor_data->_index_notify_cseq,
+                                                 index_expires);
+    if (old_cseq_index == aor_data->_stored_index)
+    {
+      index.swap(old_cseq_index);
+    }
+  }
+
+  std::vector<WrittenRecord> written;
+  Store::Status status = Store::Status::OK;
+
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       (i != aor_data->bindings().end()) && (status == Store::Status::OK);
+       ++i)
+  {
+    std::string data;
+    data.reserve(FORMAT_HEADER_LEN + binding_size(i->first, i->second));
+    BinaryWriter w(data);
+    write_header(w, BINDING_MAGIC, FORMAT_VERSION);
+    write_binding(w, i->first, i->second);
+
+    std::string key = record_key(aor_id, 'b', i->first);
+    AoR::StoredRecords::const_iterator stored = aor_data->_stored_bindings.find(i->first);
+    if (stored != aor_data->_stored_bindings.end())
+    {
+      if (stored->second.data != data)
+      {
+        LOG_DEBUG("Write record for binding %s", i->first.c_str());
+        status = set_indexed_record(key, data, stored->second.cas, expiry,
+                                    &stored->second, written, trail);
+      }
+    }
+    else
+    {
+      // This is a new binding, but there may be a record left over from
+      // an earlier binding with the same ID, so overwrite that.
+      LOG_DEBUG("Write record for new binding %s", i->first.c_str());
+      status = set_indexed_record(key, data, get_cas(key, trail), expiry,
+                                  NULL, written, trail);
+    }
+  }
+
+  for (AoR::StoredRecords::const_iterator i = aor_data->_stored_bindings.begin();
+       (i != aor_data->_stored_bindings.end()) && (status == Store::Status::OK);
+       ++i)
+  {
+    if (aor_data->bindings().find(i->first) == aor_data->bindings().end())
+    {
+      LOG_DEBUG("Write tombstone for removed binding %s", i->first.c_str());
+      status = set_indexed_record(record_key(aor_id, 'b', i->first), "",
+                                  i->second.cas, expiry, &i->second,
+                                  written, trail);
+    }
+  }
+
+  for (AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       (i != aor_data->subscriptions().end()) && (status == Store::Status::OK);
+       ++i)
+  {
+    std::string data;
+    data.reserve(FORMAT_HEADER_LEN + subscription_size(i->first, i->second));
+    BinaryWriter w(data);
+    write_header(w, SUBSCRIPTION_MAGIC, FORMAT_VERSION);
+    write_subscription(w, i->first, i->second);
+
+    // A subscription can outlive the bindings that are current when it is
+    // written, so the record lasts at least as long as the subscription.
+    int record_expiry = std::max(expiry, i->second->_expires - now);
+
+    std::string key = record_key(aor_id, 's', i->first);
+    AoR::StoredRecords::const_iterator stored = aor_data->_stored_subscriptions.find(i->first);
+    if (stored != aor_data->_stored_subscriptions.end())
+    {
+      if (stored->second.data != data)
       {
-        b->_timer_id = timer_id;
+        LOG_DEBUG("Write record for subscription %s", i->first.c_str());
+        status = set_indexed_record(key, data, stored->second.cas, record_expiry,
+                                    &stored->second, written, trail);
       }
     }
+    else
+    {
+      LOG_DEBUG("Write record for new subscription %s", i->first.c_str());
+      status = set_indexed_record(key, data, get_cas(key, trail), record_expiry,
+                                  NULL, written, trail);
+    }
   }
 
-  return _connector->set_aor_data(aor_id, aor_data, max_expires - now, trail);
-}
+  for (AoR::StoredRecords::const_iterator i = aor_data->_stored_subscriptions.begin();
+       (i != aor_data->_stored_subscriptions.end()) && (status == Store::Status::OK);
+       ++i)
+  {
+    if (aor_data->subscriptions().find(i->first) == aor_data->subscriptions().end())
+    {
+      LOG_DEBUG("Write tombstone for removed subscription %s", i->first.c_str());
+      status = set_indexed_record(record_key(aor_id, 's', i->first), "",
+                                  i->second.cas, expiry, &i->second,
+                                  written, trail);
+    }
+  }
 
-bool RegStore::Connector::set_aor_data(const std::string& aor_id,
-                                       AoR* aor_data,
-                                       int expiry,
-                                       SAS::TrailId trail)
-{
-  std::string data = serialize_aor(aor_data);
+  if ((status == Store::Status::OK) && (index != aor_data->_stored_index))
+  {
+    LOG_DEBUG("Write index record for %s", aor_id.c_str());
+    status = set_record(aor_id, index, aor_data->_cas, index_expires - now, trail);
+  }
+  else if ((status == Store::Status::OK) && (written.empty()))
+  {
+    LOG_DEBUG("AoR %s is unchanged", aor_id.c_str());
+  }
 
-  SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
-  event.add_var_param(aor_id);
-  SAS::report_event(event);
+  if (status != Store::Status::OK)
+  {
+    undo_indexed_records(written, trail);
+  }
 
-  Store::Status status = _data_store->set_data("reg",
-                                               aor_id,
-                                               data,
-                                               aor_data->_cas,
-                                               expiry,
-                                               trail);
+  return status;
+}
 
-  LOG_DEBUG("Data store set_data returned %d", status);
 
+/// Write a binding or subscription record for set_indexed_aor, noting it
+/// in the list of records written.
+Store::Status RegStore::Connector::set_indexed_record(const std::string& key,
+                                                      const std::string& data,
+                                                      uint64_t cas,
+                                                      int expiry,
+                                                      const AoR::StoredRecord* original,
+                                                      std::vector<WrittenRecord>& written,
+                                                      SAS::TrailId trail)
+{
+  Store::Status status = set_record(key, data, cas, expiry, trail);
   if (status == Store::Status::OK)
   {
-    SAS::Event event2(trail, SASEvent::REGSTORE_SET_SUCCESS, 0);
-    event2.add_var_param(aor_id);
-    SAS::report_event(event2);
+    WrittenRecord record;
+    record.key = key;
+    record.data = data;
+    record.original = original;
+    record.expiry = expiry;
+    written.push_back(record);
   }
-  else
+  return status;
+}
+
+
+/// Restore the records written by a failed set_indexed_aor to the values
+/// they had when the AoR was read, unless they have been changed again
+/// since.  New records aren't listed in the index, so are left to expire.
+void RegStore::Connector::undo_indexed_records(const std::vector<WrittenRecord>& written,
+                                               SAS::TrailId trail)
+{
+  for (std::vector<WrittenRecord>::const_reverse_iterator i = written.rbegin();
+       i != written.rend();
+       ++i)
   {
-    // LCOV_EXCL_START
-    SAS::Event event2(trail, SASEvent::REGSTORE_SET_FAILURE, 0);
-    event2.add_var_param(aor_id);
-    SAS::report_event(event2);
-    // LCOV_EXCL_STOP
+    if (i->original == NULL)
+    {
+      continue;
+    }
+
+    std::string data;
+    uint64_t cas;
+    if ((get_record(i->key, data, cas, trail) == Store::Status::OK) &&
+        (data == i->data))
+    {
+      LOG_DEBUG("Restore record %s", i->key.c_str());
+      set_record(i->key, i->original->data, cas, i->expiry, trail);
+    }
   }
+}
+
 
+/// Expire any old bindings and subscriptions, and calculate the latest
+/// outstanding binding expiry time, or now if none.  If the AoR's bounds
+/// on expiry times show that nothing has expired, the bindings and
+/// subscriptions aren't examined and the upper bound on binding expiry
+/// times is returned.
+///
+/// @returns             The latest expiry time from all unexpired bindings.
+/// @param aor_data      The registration data record.
+/// @param now           The current time in seconds since the epoch.
+int RegStore::expire(AoR* aor_data,
+                     int now)
+{
+  int earliest;
+  int latest;
+  if ((aor_data->expiry_bounds(earliest, latest)) && (earliest > now))
+  {
+    LOG_DEBUG("Nothing expires until %d", earliest);
+    return (aor_data->_bindings.empty()) ? now : latest;
+  }
 
-  return (status == Store::Status::OK);
+  earliest = INT_MAX;
+  int max_expires = expire_bindings(aor_data, now, earliest);
+  expire_subscriptions(aor_data, now, earliest);
+  aor_data->set_expiry_bounds((earliest != INT_MAX) ? earliest : 0,
+                              max_expires);
+  return max_expires;
 }
 
 
@@ -287,10 +1547,16 @@ bool RegStore::Connector::set_aor_data(const std::string& aor_id,
 /// @returns             The latest expiry time from all unexpired bindings.
 /// @param aor_data      The registration data record.
 /// @param now           The current time in seconds since the epoch.
+/// @param earliest      Lowered to the earliest expiry time of the
+///                      unexpired bindings.
 int RegStore::expire_bindings(AoR* aor_data,
-                              int now)
+                              int now,
+                              int& earliest)
 {
   int max_expires = now;
+  bool expired = false;
+  std::map<std::string, AoR::Binding> notify_bindings;
+
   for (AoR::Bindings::iterator i = aor_data->_bindings.begin();
        i != aor_data->_bindings.end();
       )
@@ -299,26 +1565,21 @@ int RegStore::expire_bindings(AoR* aor_data,
     std::string b_id = i->first;
     if (b->_expires <= now)
     {
-      // Update the cseq
-      aor_data->_notify_cseq++;
+      // The binding has expired, so remove it.  Subscribers are notified of
+      // all the bindings that expire together in a single NOTIFY, but don't
+      // send a notification when an emergency registration expires.
+      expired = true;
 
-      // The binding has expired, so remove it. Send a SIP NOTIFY for this binding
-      // if there are any subscriptions
-      for (AoR::Subscriptions::iterator j = aor_data->_subscriptions.begin();
-           j != aor_data->_subscriptions.end();
-          ++j)
+      if (!b->_emergency_registration)
       {
-        // Don't send a notification when an emergency registration expires
-        if (!b->_emergency_registration)
-        {
-          send_notify(j->second, aor_data->_notify_cseq, b, b_id);
-        }
+        notify_bindings.insert(std::make_pair(b_id, *b));
       }
 
       // If a timer id is present, then delete it. If the timer id is empty (because a
       // previous post/put failed) then don't.
       if (b->_timer_id != "")
       {
+        WorkerThrottle::BlockingCall blocking;
         _chronos->send_delete(b->_timer_id, 0);
       }
 
@@ -331,9 +1592,30 @@ int RegStore::expire_bindings(AoR* aor_data,
       {
         max_expires = b->_expires;
       }
+      if (b->_expires < earliest)
+      {
+        earliest = b->_expires;
+      }
       ++i;
     }
   }
+
+  if (expired)
+  {
+    // Update the cseq
+    aor_data->_notify_cseq++;
+
+    if (!notify_bindings.empty())
+    {
+      for (AoR::Subscriptions::iterator j = aor_data->_subscriptions.begin();
+           j != aor_data->_subscriptions.end();
+           ++j)
+      {
+        send_notify(j->second, aor_data->_notify_cseq, notify_bindings);
+      }
+    }
+  }
+
   return max_expires;
 }
 
@@ -342,8 +1624,11 @@ int RegStore::expire_bindings(AoR* aor_data,
 ///
 /// @param aor_data      The registration data record.
 /// @param now           The current time in seconds since the epoch.
+/// @param earliest      Lowered to the earliest expiry time of the
+///                      unexpired subscriptions.
 void RegStore::expire_subscriptions(AoR* aor_data,
-                                   int now)
+                                   int now,
+                                   int& earliest)
 {
   for (AoR::Subscriptions::iterator i = aor_data->_subscriptions.begin();
        i != aor_data->_subscriptions.end();
@@ -358,6 +1643,10 @@ void RegStore::expire_subscriptions(AoR* aor_data,
     }
     else
     {
+      if (s->_expires < earliest)
+      {
+        earliest = s->_expires;
+      }
       ++i;
     }
   }
@@ -366,6 +1655,146 @@ void RegStore::expire_subscriptions(AoR* aor_data,
 
 /// Serialize the contents of an AoR.
 std::string RegStore::Connector::serialize_aor(AoR* aor_data)
+{
+  // Work out an upper bound on the size of the record, so it can be
+  // encoded into a single buffer without reallocating.
+  size_t size = FORMAT_HEADER_LEN + 5 * BinaryWriter::INT_SIZE +
+                BinaryWriter::string_size(aor_data->_timer_id);
+
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    size += binding_size(i->first, i->second);
+  }
+
+  for (AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    size += subscription_size(i->first, i->second);
+  }
+
+  std::string buf;
+  buf.reserve(size);
+  BinaryWriter w(buf);
+
+  write_header(w, FORMAT_MAGIC, FORMAT_VERSION);
+  w.write_int(aor_data->_notify_cseq);
+
+  LOG_DEBUG("Serialize %d bindings", (int)aor_data->bindings().size());
+  w.write_uint(aor_data->bindings().size());
+
+  for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    LOG_DEBUG("  Binding %s", i->first.c_str());
+    write_binding(w, i->first, i->second);
+  }
+
+  LOG_DEBUG("Serialize %d subscriptions", (int)aor_data->subscriptions().size());
+  w.write_uint(aor_data->subscriptions().size());
+
+  for (AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    LOG_DEBUG("  Subscription %s", i->first.c_str());
+    write_subscription(w, i->first, i->second);
+  }
+
+  // The bounds on expiry times follow the subscriptions, so that readers
+  // that don't know about them ignore them.
+  int earliest = 0;
+  int latest = 0;
+  aor_data->expiry_bounds(earliest, latest);
+  w.write_int(earliest);
+  w.write_int(latest);
+  w.write_string(aor_data->_timer_id);
+
+  return buf;
+}
+
+
+/// Deserialize the contents of an AoR
+RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& s)
+{
+  if (!has_magic(s, FORMAT_MAGIC, FORMAT_HEADER_LEN))
+  {
+    return deserialize_legacy_aor(s);
+  }
+
+  int version = (uint8_t)s[sizeof(FORMAT_MAGIC)] & 0x7f;
+  if (version != FORMAT_VERSION)
+  {
+    LOG_ERROR("Unsupported AoR record format version %d", version);
+    return new AoR();
+  }
+
+  BinaryReader r(s.data() + FORMAT_HEADER_LEN, s.size() - FORMAT_HEADER_LEN);
+  AoR* aor_data = new AoR();
+
+  r.read_int(aor_data->_notify_cseq);
+
+  uint64_t num_bindings = 0;
+  r.read_uint(num_bindings);
+  LOG_DEBUG("Deserialize %d bindings", (int)num_bindings);
+
+  for (uint64_t ii = 0; (ii < num_bindings) && (r.ok()); ++ii)
+  {
+    std::string binding_id;
+    r.read_string(binding_id);
+    LOG_DEBUG("  Binding %s", binding_id.c_str());
+    read_binding(r, aor_data->get_binding(binding_id));
+  }
+
+  uint64_t num_subscriptions = 0;
+  r.read_uint(num_subscriptions);
+  LOG_DEBUG("Deserialize %d subscriptions", (int)num_subscriptions);
+
+  for (uint64_t ii = 0; (ii < num_subscriptions) && (r.ok()); ++ii)
+  {
+    std::string to_tag;
+    r.read_string(to_tag);
+    LOG_DEBUG("  Subscription %s", to_tag.c_str());
+    read_subscription(r, aor_data->get_subscription(to_tag));
+  }
+
+  // Records written by older versions don't hold the bounds on expiry
+  // times, in which case they are worked out the next time the AoR's
+  // bindings are expired.
+  if (r.remaining() > 0)
+  {
+    int earliest = 0;
+    int latest = 0;
+    r.read_int(earliest);
+    r.read_int(latest);
+    aor_data->set_expiry_bounds(earliest, latest);
+  }
+
+  // Likewise, older records don't hold a timer ID for the AoR.
+  if (r.remaining() > 0)
+  {
+    r.read_string(aor_data->_timer_id);
+  }
+
+  if (!r.ok())
+  {
+    // The record is corrupt, so discard its contents rather than act on
+    // partially decoded bindings.  The CAS is kept, so the next write
+    // replaces the record.
+    LOG_ERROR("Failed to decode AoR record of %d bytes", (int)s.size());
+    aor_data->clear(true);
+    aor_data->set_expiry_bounds(0, 0);
+  }
+
+  return aor_data;
+}
+
+
+/// Serialize the contents of an AoR in the legacy format.
+std::string RegStore::Connector::serialize_legacy_aor(AoR* aor_data)
 {
   std::ostringstream oss(std::ostringstream::out|std::ostringstream::binary);
 
@@ -404,7 +1833,10 @@ std::string RegStore::Connector::serialize_aor(AoR* aor_data)
     }
     oss << b->_timer_id << '\0';
     oss << b->_private_id << '\0';
-    oss.write((const char *)&b->_emergency_registration, sizeof(int));
+    // The emergency registration flag is written as an int, as older
+    // versions read it.
+    int emergency = b->_emergency_registration;
+    oss.write((const char *)&emergency, sizeof(int));
   }
 
   int num_subscriptions = aor_data->subscriptions().size();
@@ -443,14 +1875,14 @@ std::string RegStore::Connector::serialize_aor(AoR* aor_data)
 }
 
 
-/// Deserialize the contents of an AoR
-RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& s)
+/// Deserialize the contents of an AoR in the legacy format.
+RegStore::AoR* RegStore::Connector::deserialize_legacy_aor(const std::string& s)
 {
   std::istringstream iss(s, std::istringstream::in|std::istringstream::binary);
 
   AoR* aor_data = new AoR();
 
-  int num_bindings;
+  int num_bindings = 0;
   iss.read((char *)&num_bindings, sizeof(int));
   LOG_DEBUG("Deserialize %d bindings", num_bindings);
 
@@ -471,7 +1903,7 @@ RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& s)
 
     iss.read((char *)&b->_priority, sizeof(int));
 
-    int num_params;
+    int num_params = 0;
     iss.read((char *)&num_params, sizeof(int));
     b->_params.resize(num_params);
     for (std::list<std::pair<std::string, std::string> >::iterator i = b->_params.begin();
@@ -495,10 +1927,14 @@ RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& s)
     }
     getline(iss, b->_timer_id, '\0');
     getline(iss, b->_private_id, '\0');
-    iss.read((char *)&b->_emergency_registration, sizeof(int));
+    // The emergency registration flag was written as a bool followed by
+    // padding up to the size of an int.
+    char emergency[sizeof(int)] = {0};
+    iss.read(emergency, sizeof(int));
+    b->_emergency_registration = (emergency[0] != 0);
   }
 
-  int num_subscriptions;
+  int num_subscriptions = 0;
   iss.read((char *)&num_subscriptions, sizeof(int));
   LOG_DEBUG("Deserialize %d subscriptions", num_subscriptions);
 
@@ -538,12 +1974,195 @@ RegStore::AoR* RegStore::Connector::deserialize_aor(const std::string& s)
   return aor_data;
 }
 
+
+/// Copy a string into a pool, null terminating it.
+static void pool_str(pj_pool_t* pool, pj_str_t* dst, const char* data, size_t len)
+{
+  dst->ptr = (char*)pj_pool_alloc(pool, len + 1);
+  memcpy(dst->ptr, data, len);
+  dst->ptr[len] = '\0';
+  dst->slen = len;
+}
+
+
+static void pool_str(pj_pool_t* pool, pj_str_t* dst, const std::string& s)
+{
+  pool_str(pool, dst, s.data(), s.size());
+}
+
+
+/// Read a string into a pool.  On failure the string is left empty.
+static void read_pool_str(BinaryReader& r, pj_pool_t* pool, pj_str_t* dst)
+{
+  const char* data = "";
+  size_t len = 0;
+  r.read_string(data, len);
+  pool_str(pool, dst, data, len);
+}
+
+
+/// Decode an AoR into a view allocated from the pool.  Records in the
+/// current format are decoded straight from the buffer.  Older records are
+/// deserialized in full and copied into the pool.  Subscriptions are not
+/// included in the view.
+void RegStore::Connector::decode_aor_view(const std::string& s,
+                                          pj_pool_t* pool,
+                                          AoRView& view)
+{
+  view = AoRView();
+
+  if ((!has_magic(s, FORMAT_MAGIC, FORMAT_HEADER_LEN)) ||
+      (((uint8_t)s[sizeof(FORMAT_MAGIC)] & 0x7f) != FORMAT_VERSION))
+  {
+    AoR* aor_data = deserialize_aor(s);
+    view._notify_cseq = aor_data->_notify_cseq;
+    view._bindings = (AoRView::Binding*)pj_pool_calloc(pool,
+                                                       aor_data->bindings().size(),
+                                                       sizeof(AoRView::Binding));
+
+    for (AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      AoR::Binding* b = i->second;
+      AoRView::Binding* vb = &view._bindings[view._num_bindings++];
+      pool_str(pool, &vb->id, i->first);
+      pool_str(pool, &vb->uri, b->_uri);
+      pool_str(pool, &vb->cid, b->_cid);
+      vb->cseq = b->_cseq;
+      vb->expires = b->_expires;
+      vb->priority = b->_priority;
+
+      vb->num_params = b->_params.size();
+      vb->params = (pj_str_t*)pj_pool_calloc(pool, 2 * vb->num_params, sizeof(pj_str_t));
+      pj_str_t* param = vb->params;
+      for (std::list<std::pair<std::string, std::string> >::const_iterator j = b->_params.begin();
+           j != b->_params.end();
+           ++j)
+      {
+        pool_str(pool, param++, j->first);
+        pool_str(pool, param++, j->second);
+      }
+
+      vb->num_path_headers = b->_path_headers.size();
+      vb->path_headers = (pj_str_t*)pj_pool_calloc(pool, vb->num_path_headers, sizeof(pj_str_t));
+      pj_str_t* path = vb->path_headers;
+      for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+           j != b->_path_headers.end();
+           ++j)
+      {
+        pool_str(pool, path++, *j);
+      }
+
+      pool_str(pool, &vb->timer_id, b->_timer_id);
+      pool_str(pool, &vb->private_id, b->_private_id);
+      vb->emergency_registration = b->_emergency_registration;
+    }
+
+    delete aor_data;
+    return;
+  }
+
+  BinaryReader r(s.data() + FORMAT_HEADER_LEN, s.size() - FORMAT_HEADER_LEN);
+
+  r.read_int(view._notify_cseq);
+
+  uint64_t num_bindings = 0;
+  r.read_count(num_bindings);
+  view._bindings = (AoRView::Binding*)pj_pool_calloc(pool,
+                                                     num_bindings,
+                                                     sizeof(AoRView::Binding));
+
+  for (uint64_t ii = 0; (ii < num_bindings) && (r.ok()); ++ii)
+  {
+    AoRView::Binding* vb = &view._bindings[ii];
+    read_pool_str(r, pool, &vb->id);
+    read_pool_str(r, pool, &vb->uri);
+    read_pool_str(r, pool, &vb->cid);
+    r.read_int(vb->cseq);
+    r.read_int(vb->expires);
+    r.read_int(vb->priority);
+
+    uint64_t num_params = 0;
+    r.read_count(num_params);
+    vb->num_params = num_params;
+    vb->params = (pj_str_t*)pj_pool_calloc(pool, 2 * num_params, sizeof(pj_str_t));
+    for (uint64_t jj = 0; jj < 2 * num_params; ++jj)
+    {
+      read_pool_str(r, pool, &vb->params[jj]);
+    }
+
+    uint64_t num_paths = 0;
+    r.read_count(num_paths);
+    vb->num_path_headers = num_paths;
+    vb->path_headers = (pj_str_t*)pj_pool_calloc(pool, num_paths, sizeof(pj_str_t));
+    for (uint64_t jj = 0; jj < num_paths; ++jj)
+    {
+      read_pool_str(r, pool, &vb->path_headers[jj]);
+    }
+
+    read_pool_str(r, pool, &vb->timer_id);
+    read_pool_str(r, pool, &vb->private_id);
+    uint8_t emergency = 0;
+    r.read_byte(emergency);
+    vb->emergency_registration = (emergency != 0);
+  }
+
+  if (r.ok())
+  {
+    view._num_bindings = num_bindings;
+  }
+  else
+  {
+    LOG_ERROR("Failed to decode AoR record of %d bytes", (int)s.size());
+  }
+}
+
+
+/// Copy another view into this one, allocating the copy from the pool.
+void RegStore::AoRView::copy(const AoRView& other, pj_pool_t* pool)
+{
+  _notify_cseq = other._notify_cseq;
+  _cas = other._cas;
+  _num_bindings = other._num_bindings;
+  _bindings = (Binding*)pj_pool_calloc(pool, _num_bindings, sizeof(Binding));
+
+  for (unsigned ii = 0; ii < _num_bindings; ++ii)
+  {
+    const Binding* from = &other._bindings[ii];
+    Binding* to = &_bindings[ii];
+    *to = *from;
+    pool_str(pool, &to->id, from->id.ptr, from->id.slen);
+    pool_str(pool, &to->uri, from->uri.ptr, from->uri.slen);
+    pool_str(pool, &to->cid, from->cid.ptr, from->cid.slen);
+
+    to->params = (pj_str_t*)pj_pool_calloc(pool, 2 * to->num_params, sizeof(pj_str_t));
+    for (unsigned jj = 0; jj < 2 * to->num_params; ++jj)
+    {
+      pool_str(pool, &to->params[jj], from->params[jj].ptr, from->params[jj].slen);
+    }
+
+    to->path_headers = (pj_str_t*)pj_pool_calloc(pool, to->num_path_headers, sizeof(pj_str_t));
+    for (unsigned jj = 0; jj < to->num_path_headers; ++jj)
+    {
+      pool_str(pool, &to->path_headers[jj], from->path_headers[jj].ptr, from->path_headers[jj].slen);
+    }
+
+    pool_str(pool, &to->timer_id, from->timer_id.ptr, from->timer_id.slen);
+    pool_str(pool, &to->private_id, from->private_id.ptr, from->private_id.slen);
+  }
+}
+
 /// Default constructor.
 RegStore::AoR::AoR() :
   _notify_cseq(1),
   _bindings(),
   _subscriptions(),
-  _cas(0)
+  _cas(0),
+  _index_expires(0),
+  _index_notify_cseq(0),
+  _earliest_expires(0),
+  _latest_expires(0)
 {
 }
 
@@ -592,7 +2211,17 @@ void RegStore::AoR::common_constructor(const AoR& other)
   }
 
   _notify_cseq = other._notify_cseq;
+  _timer_id = other._timer_id;
   _cas = other._cas;
+  _stored_index = other._stored_index;
+  _index_expires = other._index_expires;
+  _index_notify_cseq = other._index_notify_cseq;
+  _stored_bindings = other._stored_bindings;
+  _stored_subscriptions = other._stored_subscriptions;
+  _earliest_expires = other._earliest_expires;
+  _latest_expires = other._latest_expires;
+  _touched_bindings = other._touched_bindings;
+  _touched_subscriptions = other._touched_subscriptions;
 }
 
 
@@ -648,6 +2277,13 @@ RegStore::AoR::Binding* RegStore::AoR::get_binding(const std::string& binding_id
     b->_expires = 0;
     _bindings.insert(std::make_pair(binding_id, b));
   }
+
+  // The caller may change when the binding expires.
+  if (_earliest_expires != 0)
+  {
+    _touched_bindings.insert(binding_id);
+  }
+
   return b;
 }
 
@@ -680,10 +2316,62 @@ RegStore::AoR::Subscription* RegStore::AoR::get_subscription(const std::string&
     s = new Subscription;
     _subscriptions.insert(std::make_pair(to_tag, s));
   }
+
+  if (_earliest_expires != 0)
+  {
+    _touched_subscriptions.insert(to_tag);
+  }
+
   return s;
 }
 
 
+bool RegStore::AoR::expiry_bounds(int& earliest, int& latest)
+{
+  if (_earliest_expires == 0)
+  {
+    return false;
+  }
+
+  earliest = _earliest_expires;
+  latest = _latest_expires;
+
+  for (std::set<std::string>::const_iterator i = _touched_bindings.begin();
+       i != _touched_bindings.end();
+       ++i)
+  {
+    Bindings::const_iterator b = _bindings.find(*i);
+    if (b != _bindings.end())
+    {
+      earliest = std::min(earliest, b->second->_expires);
+      latest = std::max(latest, b->second->_expires);
+    }
+  }
+
+  for (std::set<std::string>::const_iterator i = _touched_subscriptions.begin();
+       i != _touched_subscriptions.end();
+       ++i)
+  {
+    Subscriptions::const_iterator s = _subscriptions.find(*i);
+    if (s != _subscriptions.end())
+    {
+      earliest = std::min(earliest, s->second->_expires);
+    }
+  }
+
+  return true;
+}
+
+
+void RegStore::AoR::set_expiry_bounds(int earliest, int latest)
+{
+  _earliest_expires = earliest;
+  _latest_expires = latest;
+  _touched_bindings.clear();
+  _touched_subscriptions.clear();
+}
+
+
 /// Removes the subscription with the specified tag.  If there is no such
 /// subscription, does nothing.
 void RegStore::AoR::remove_subscription(const std::string& to_tag)
@@ -696,12 +2384,44 @@ void RegStore::AoR::remove_subscription(const std::string& to_tag)
   }
 }
 
+bool RegStore::AoR::Binding::operator==(const Binding& other) const
+{
+  return ((_uri == other._uri) &&
+          (_cid == other._cid) &&
+          (_path_headers == other._path_headers) &&
+          (_cseq == other._cseq) &&
+          (_expires == other._expires) &&
+          (_priority == other._priority) &&
+          (_params == other._params) &&
+          (_timer_id == other._timer_id) &&
+          (_private_id == other._private_id) &&
+          (_emergency_registration == other._emergency_registration));
+}
+
+bool RegStore::AoR::Subscription::operator==(const Subscription& other) const
+{
+  return ((_req_uri == other._req_uri) &&
+          (_from_uri == other._from_uri) &&
+          (_from_tag == other._from_tag) &&
+          (_to_uri == other._to_uri) &&
+          (_to_tag == other._to_tag) &&
+          (_cid == other._cid) &&
+          (_route_uris == other._route_uris) &&
+          (_expires == other._expires));
+}
+
 void RegStore::send_notify(AoR::Subscription* s, int cseq,
                            AoR::Binding* b, std::string b_id)
 {
-  pjsip_tx_data* tdata_notify = NULL;
   std::map<std::string, AoR::Binding> bindings;
   bindings.insert(std::pair<std::string, RegStore::AoR::Binding>(b_id, *b));
+  send_notify(s, cseq, bindings);
+}
+
+void RegStore::send_notify(AoR::Subscription* s, int cseq,
+                           const std::map<std::string, AoR::Binding>& bindings)
+{
+  pjsip_tx_data* tdata_notify = NULL;
   pj_status_t status = NotifyUtils::create_notify(&tdata_notify, s, "aor", cseq, bindings,
                                   NotifyUtils::PARTIAL, NotifyUtils::ACTIVE,
                                   NotifyUtils::TERMINATED, NotifyUtils::EXPIRED);
@@ -712,12 +2432,40 @@ void RegStore::send_notify(AoR::Subscription* s, int cseq,
   }
 }
 
-RegStore::Connector::Connector(Store* data_store) :
-  _data_store(data_store)
+RegStore::Connector::Connector(Store* data_store,
+                               AoRCache* cache,
+                               Layout layout,
+                               LastValueCache* lvc,
+                               const std::string& stat_prefix,
+                               size_t compress_threshold,
+                               Format format) :
+  _data_store(data_store),
+  _cache(cache),
+  _layout(layout),
+  _writes_counter(NULL),
+  _conflicts_counter(NULL),
+  _compress_threshold(compress_threshold),
+  _format(format),
+  _compression_ratio(NULL),
+  _compress_us(NULL),
+  _decompress_us(NULL)
 {
+  if (lvc != NULL)
+  {
+    _writes_counter = new StatisticCounter(stat_prefix + "_writes", lvc);
+    _conflicts_counter = new StatisticCounter(stat_prefix + "_write_conflicts", lvc);
+    _compression_ratio = new StatisticHistogram(stat_prefix + "_compression_ratio", lvc);
+    _compress_us = new StatisticHistogram(stat_prefix + "_compress_us", lvc);
+    _decompress_us = new StatisticHistogram(stat_prefix + "_decompress_us", lvc);
+  }
 }
 
 RegStore::Connector::~Connector()
 {
+  delete _writes_counter;
+  delete _conflicts_counter;
+  delete _compression_ratio;
+  delete _compress_us;
+  delete _decompress_us;
 }
 
@@ -0,0 +1,362 @@
+/**
+ * @file rx_data_pool.cpp Recycling pool for cloned pjsip_rx_data structures.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "log.h"
+#include "rx_data_pool.h"
+
+RxDataPool::RxDataPool(pj_pool_factory* factory,
+                       int max_cached,
+                       LastValueCache* lvc) :
+  _factory(factory),
+  _max_cached((max_cached > 0) ? max_cached : 0),
+  _depot(),
+  _in_use(0),
+  _high_water_mark(0),
+  _hits_counter("rx_pool_hits", lvc),
+  _misses_counter("rx_pool_misses", lvc),
+  _high_water_mark_stat("rx_pool_hwm", lvc)
+{
+  pthread_key_create(&_cache_key, destroy_thread_cache);
+  pthread_mutex_init(&_depot_lock, NULL);
+}
+
+
+RxDataPool::~RxDataPool()
+{
+  // Return the calling thread's cache to the depot.  The caches of any
+  // other threads still running are leaked, but by the time the pool is
+  // destroyed the transport and worker threads have all exited, so their
+  // caches have already been returned.
+  ThreadCache* cache = (ThreadCache*)pthread_getspecific(_cache_key);
+  if (cache != NULL)
+  {
+    pthread_setspecific(_cache_key, NULL);
+    destroy_thread_cache(cache);
+  }
+
+  pthread_key_delete(_cache_key);
+  release_pools(_depot, _depot.size());
+  pthread_mutex_destroy(&_depot_lock);
+}
+
+
+pj_status_t RxDataPool::clone(const pjsip_rx_data* src,
+                              pjsip_rx_data** p_rdata)
+{
+  pj_pool_t* pool = get_pool();
+  if (pool == NULL)
+  {
+    return PJ_ENOMEM;                                              // LCOV_EXCL_LINE
+  }
+
+  pjsip_rx_data* dst = PJ_POOL_ZALLOC_T(pool, pjsip_rx_data);
+
+  // Parts of tp_info.
+  dst->tp_info.pool = pool;
+  dst->tp_info.transport = src->tp_info.transport;
+
+  // pkt_info can be copied, apart from the packet buffer, which belongs to
+  // the transport.
+  memcpy(&dst->pkt_info, &src->pkt_info, sizeof(src->pkt_info));
+  dst->pkt_info.packet = (char*)pj_pool_alloc(pool, src->pkt_info.len + 1);
+  memcpy(dst->pkt_info.packet, src->pkt_info.packet, src->pkt_info.len);
+  dst->pkt_info.packet[src->pkt_info.len] = '\0';
+
+  // msg_info needs a deep clone, then the shortcuts to the headers are
+  // filled in from the cloned message.
+  dst->msg_info.msg_buf = dst->pkt_info.packet;
+  dst->msg_info.len = src->msg_info.len;
+  dst->msg_info.msg = pjsip_msg_clone(pool, src->msg_info.msg);
+  pj_list_init(&dst->msg_info.parse_err);
+
+  pjsip_hdr* hdr = dst->msg_info.msg->hdr.next;
+  while (hdr != &dst->msg_info.msg->hdr)
+  {
+    switch (hdr->type)
+    {
+    case PJSIP_H_CALL_ID:
+      if (dst->msg_info.cid == NULL)
+      {
+        dst->msg_info.cid = (pjsip_cid_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_FROM:
+      if (dst->msg_info.from == NULL)
+      {
+        dst->msg_info.from = (pjsip_from_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_TO:
+      if (dst->msg_info.to == NULL)
+      {
+        dst->msg_info.to = (pjsip_to_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_VIA:
+      if (dst->msg_info.via == NULL)
+      {
+        dst->msg_info.via = (pjsip_via_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_CSEQ:
+      if (dst->msg_info.cseq == NULL)
+      {
+        dst->msg_info.cseq = (pjsip_cseq_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_MAX_FORWARDS:
+      if (dst->msg_info.max_fwd == NULL)
+      {
+        dst->msg_info.max_fwd = (pjsip_max_fwd_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_ROUTE:
+      if (dst->msg_info.route == NULL)
+      {
+        dst->msg_info.route = (pjsip_route_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_RECORD_ROUTE:
+      if (dst->msg_info.record_route == NULL)
+      {
+        dst->msg_info.record_route = (pjsip_rr_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_CONTENT_TYPE:
+      if (dst->msg_info.ctype == NULL)
+      {
+        dst->msg_info.ctype = (pjsip_ctype_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_CONTENT_LENGTH:
+      if (dst->msg_info.clen == NULL)
+      {
+        dst->msg_info.clen = (pjsip_clen_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_REQUIRE:
+      if (dst->msg_info.require == NULL)
+      {
+        dst->msg_info.require = (pjsip_require_hdr*)hdr;
+      }
+      break;
+
+    case PJSIP_H_SUPPORTED:
+      if (dst->msg_info.supported == NULL)
+      {
+        dst->msg_info.supported = (pjsip_supported_hdr*)hdr;
+      }
+      break;
+
+    default:
+      break;
+    }
+
+    hdr = hdr->next;
+  }
+
+  *p_rdata = dst;
+
+  // Finally, add a reference to the transport for the clone.
+  return pjsip_transport_add_ref(dst->tp_info.transport);
+}
+
+
+void RxDataPool::free_cloned(pjsip_rx_data* rdata)
+{
+  pjsip_transport_dec_ref(rdata->tp_info.transport);
+  put_pool(rdata->tp_info.pool);
+}
+
+
+int RxDataPool::depot_size()
+{
+  pthread_mutex_lock(&_depot_lock);
+  int size = _depot.size();
+  pthread_mutex_unlock(&_depot_lock);
+  return size;
+}
+
+
+/// Get a pool for a new clone, from the calling thread's cache if possible.
+pj_pool_t* RxDataPool::get_pool()
+{
+  ThreadCache* cache = thread_cache();
+
+  if (cache->pools.empty())
+  {
+    // Refill the cache from the depot.
+    pthread_mutex_lock(&_depot_lock);
+    unsigned int count = std::min((unsigned int)_depot.size(),
+                                  (unsigned int)BATCH_SIZE);
+    cache->pools.insert(cache->pools.end(), _depot.end() - count, _depot.end());
+    _depot.resize(_depot.size() - count);
+    pthread_mutex_unlock(&_depot_lock);
+  }
+
+  pj_pool_t* pool;
+
+  if (!cache->pools.empty())
+  {
+    pool = cache->pools.back();
+    cache->pools.pop_back();
+    _hits_counter.increment();
+  }
+  else
+  {
+    pool = pj_pool_create(_factory,
+                          "rtd%p",
+                          POOL_LEN,
+                          POOL_INC,
+                          NULL);
+    _misses_counter.increment();
+
+    if (pool == NULL)
+    {
+      LOG_ERROR("Failed to create pool for received message");   // LCOV_EXCL_LINE
+      return NULL;                                                 // LCOV_EXCL_LINE
+    }
+  }
+
+  update_high_water_mark(++_in_use);
+
+  return pool;
+}
+
+
+/// Return a pool to the calling thread's cache.
+void RxDataPool::put_pool(pj_pool_t* pool)
+{
+  --_in_use;
+
+  // Reset the pool, which frees all but the first block of memory.
+  pj_pool_reset(pool);
+
+  ThreadCache* cache = thread_cache();
+  cache->pools.push_back(pool);
+
+  if (cache->pools.size() >= 2 * BATCH_SIZE)
+  {
+    // This thread frees more clones than it creates, so spill a batch of
+    // pools to the depot for other threads to use.
+    spill_pools(cache->pools, BATCH_SIZE);
+  }
+}
+
+
+/// Move pools from the end of a list to the depot.  If the depot is full,
+/// the pools are released back to the pool factory instead.
+void RxDataPool::spill_pools(std::vector<pj_pool_t*>& pools,
+                             unsigned int count)
+{
+  pthread_mutex_lock(&_depot_lock);
+  unsigned int space = (_depot.size() < _max_cached) ?
+                         _max_cached - _depot.size() : 0;
+  unsigned int moved = std::min(count, space);
+  _depot.insert(_depot.end(), pools.end() - moved, pools.end());
+  pthread_mutex_unlock(&_depot_lock);
+  pools.resize(pools.size() - moved);
+
+  release_pools(pools, count - moved);
+}
+
+
+/// Get the calling thread's cache, creating it if necessary.
+RxDataPool::ThreadCache* RxDataPool::thread_cache()
+{
+  ThreadCache* cache = (ThreadCache*)pthread_getspecific(_cache_key);
+
+  if (cache == NULL)
+  {
+    cache = new ThreadCache;
+    cache->owner = this;
+    pthread_setspecific(_cache_key, cache);
+  }
+
+  return cache;
+}
+
+
+/// Release the specified number of pools from the end of a list back to
+/// the pool factory.
+void RxDataPool::release_pools(std::vector<pj_pool_t*>& pools,
+                               unsigned int count)
+{
+  for (unsigned int ii = 0; ii < count; ++ii)
+  {
+    pj_pool_release(pools.back());
+    pools.pop_back();
+  }
+}
+
+
+void RxDataPool::update_high_water_mark(int in_use)
+{
+  int hwm = _high_water_mark.load();
+
+  while (in_use > hwm)
+  {
+    if (_high_water_mark.compare_exchange_weak(hwm, in_use))
+    {
+      std::vector<std::string> message;
+      message.push_back(std::to_string(in_use));
+      _high_water_mark_stat.report_change(message);
+      break;
+    }
+  }
+}
+
+
+/// Called when a thread exits to return its cached pools to the depot.
+void RxDataPool::destroy_thread_cache(void* p)
+{
+  ThreadCache* cache = (ThreadCache*)p;
+  cache->owner->spill_pools(cache->pools, cache->pools.size());
+  delete cache;
+}
@@ -0,0 +1,156 @@
+/**
+ * @file sharded_worker_pool.cpp Pool of worker threads that preserves the
+ * order of work with the same key.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <functional>
+
+#include "log.h"
+#include "stack.h"
+#include "pjutils.h"
+#include "sharded_worker_pool.h"
+
+ShardedWorkerPool::ShardedWorkerPool(const std::string& name,
+                                     int num_threads,
+                                     int max_queue) :
+  _name(name),
+  _num_threads((num_threads > 0) ? num_threads : 1),
+  _terminated(false),
+  _queue(_num_threads, false, max_queue),
+  _threads()
+{
+}
+
+
+ShardedWorkerPool::~ShardedWorkerPool()
+{
+  // Queue an empty piece of work behind any work already queued to each
+  // thread, which tells the thread to exit.
+  _terminated = true;
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    _queue.push(ii, 0, NULL);
+  }
+
+  for (std::vector<Thread*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    if ((*i)->thread != NULL)
+    {
+      pj_thread_join((*i)->thread);
+      pj_thread_destroy((*i)->thread);
+    }
+    delete *i;
+  }
+
+  // Delete any work left on the queues of threads that never started.
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    Work* work;
+    while ((_queue.shard_size(ii) > 0) && (_queue.pop(ii, work)))
+    {
+      delete work;
+    }
+  }
+}
+
+
+void ShardedWorkerPool::start()
+{
+  for (int ii = 0; ii < _num_threads; ++ii)
+  {
+    Thread* thread = new Thread();
+    thread->pool = this;
+    thread->shard = ii;
+    thread->thread = NULL;
+    _threads.push_back(thread);
+
+    pj_status_t status = pj_thread_create(stack_data.pool, _name.c_str(),
+                                          &worker_thread,
+                                          (void*)thread, 0, 0, &thread->thread);
+    if (status != PJ_SUCCESS)
+    {
+      // LCOV_EXCL_START
+      LOG_ERROR("Error creating %s thread, %s",
+                _name.c_str(),
+                PJUtils::pj_status_to_string(status).c_str());
+      thread->thread = NULL;
+      // LCOV_EXCL_STOP
+    }
+  }
+}
+
+
+bool ShardedWorkerPool::submit(const std::string& key, Work* work)
+{
+  unsigned int s = shard(key);
+
+  while (!_terminated)
+  {
+    if (_queue.push(s, 0, work, SUBMIT_WAIT_MS))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+unsigned int ShardedWorkerPool::shard(const std::string& key) const
+{
+  return std::hash<std::string>()(key) % _num_threads;
+}
+
+
+int ShardedWorkerPool::worker_thread(void* p)
+{
+  Thread* thread = (Thread*)p;
+  thread->pool->run(thread->shard);
+  return 0;
+}
+
+
+void ShardedWorkerPool::run(unsigned int shard)
+{
+  Work* work;
+
+  while ((_queue.pop(shard, work)) && (work != NULL))
+  {
+    work->run();
+    delete work;
+  }
+}
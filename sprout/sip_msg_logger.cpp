@@ -0,0 +1,329 @@
+/**
+ * @file sip_msg_logger.cpp Asynchronous SAS and local logging of SIP messages.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "log.h"
+#include "stack.h"
+#include "sproutsasevent.h"
+#include "sip_msg_logger.h"
+
+/// Round a ring size up to a power of two, so ring indices can be masked.
+static unsigned int round_up_pow2(unsigned int size)
+{
+  unsigned int rounded = 1;
+  while (rounded < size)
+  {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+SipMsgLogger::SipMsgLogger(unsigned int ring_size, LastValueCache* lvc) :
+  _ring_size(round_up_pow2(ring_size)),
+  _rings(),
+  _stop(false),
+  _dropped_counter("sip_log_dropped", lvc)
+{
+  pthread_key_create(&_ring_key, NULL);
+  pthread_mutex_init(&_rings_lock, NULL);
+  pthread_mutex_init(&_drain_lock, NULL);
+  pthread_mutex_init(&_stop_lock, NULL);
+  pthread_cond_init(&_stop_cond, NULL);
+
+  pthread_create(&_thread, NULL, &logger_thread, this);
+}
+
+
+SipMsgLogger::~SipMsgLogger()
+{
+  pthread_mutex_lock(&_stop_lock);
+  _stop = true;
+  pthread_cond_signal(&_stop_cond);
+  pthread_mutex_unlock(&_stop_lock);
+  pthread_join(_thread, NULL);
+
+  flush();
+
+  for (std::vector<Ring*>::iterator i = _rings.begin();
+       i != _rings.end();
+       ++i)
+  {
+    delete *i;
+  }
+
+  pthread_key_delete(_ring_key);
+  pthread_cond_destroy(&_stop_cond);
+  pthread_mutex_destroy(&_stop_lock);
+  pthread_mutex_destroy(&_drain_lock);
+  pthread_mutex_destroy(&_rings_lock);
+}
+
+
+void SipMsgLogger::log_rx_msg(const pjsip_rx_data* rdata)
+{
+  Ring* ring = thread_ring();
+  Entry* entry = claim(ring);
+
+  if (entry != NULL)
+  {
+    entry->rx = true;
+    entry->verbose = (Log::loggingLevel >= Log::VERBOSE_LEVEL);
+    entry->trail = get_trail(rdata);
+    entry->transport_type = pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag);
+    entry->address = rdata->pkt_info.src_name;
+    entry->port = rdata->pkt_info.src_port;
+    entry->msg.assign(rdata->msg_info.msg_buf, rdata->msg_info.len);
+
+    if (entry->verbose)
+    {
+      entry->transport_name = rdata->tp_info.transport->type_name;
+      entry->info = pjsip_rx_data_get_info((pjsip_rx_data*)rdata);
+    }
+
+    publish(ring);
+  }
+}
+
+
+void SipMsgLogger::log_tx_msg(const pjsip_tx_data* tdata)
+{
+  Ring* ring = thread_ring();
+  Entry* entry = claim(ring);
+
+  if (entry != NULL)
+  {
+    entry->rx = false;
+    entry->verbose = (Log::loggingLevel >= Log::VERBOSE_LEVEL);
+    entry->trail = get_trail(tdata);
+    entry->transport_type = pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag);
+    entry->address = tdata->tp_info.dst_name;
+    entry->port = tdata->tp_info.dst_port;
+    entry->msg.assign(tdata->buf.start, tdata->buf.cur - tdata->buf.start);
+
+    if (entry->verbose)
+    {
+      entry->transport_name = tdata->tp_info.transport->type_name;
+      entry->info = pjsip_tx_data_get_info((pjsip_tx_data*)tdata);
+    }
+
+    publish(ring);
+  }
+}
+
+
+void SipMsgLogger::flush()
+{
+  while (drain(_ring_size) > 0)
+  {
+  }
+}
+
+
+/// Get the next free slot on a ring, or NULL if the message should be
+/// discarded because the ring is too full.
+SipMsgLogger::Entry* SipMsgLogger::claim(Ring* ring)
+{
+  unsigned int head = ring->head.load(std::memory_order_relaxed);
+  unsigned int used = head - ring->tail.load(std::memory_order_acquire);
+
+  if ((used >= _ring_size) ||
+      ((used >= _ring_size - _ring_size / 4) &&
+       (ring->sampled++ % SAMPLE_INTERVAL != 0)))
+  {
+    _dropped_counter.increment();
+    return NULL;
+  }
+
+  return &ring->entries[head & ring->mask];
+}
+
+
+/// Pass the slot returned by the last call to claim to the logging thread.
+void SipMsgLogger::publish(Ring* ring)
+{
+  unsigned int head = ring->head.load(std::memory_order_relaxed);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+
+/// Get the calling thread's ring, creating it if necessary.
+SipMsgLogger::Ring* SipMsgLogger::thread_ring()
+{
+  Ring* ring = (Ring*)pthread_getspecific(_ring_key);
+
+  if (ring == NULL)
+  {
+    ring = new Ring(_ring_size);
+    pthread_setspecific(_ring_key, ring);
+
+    pthread_mutex_lock(&_rings_lock);
+    _rings.push_back(ring);
+    pthread_mutex_unlock(&_rings_lock);
+  }
+
+  return ring;
+}
+
+
+/// Log up to the specified number of entries from each ring.  Returns the
+/// number of entries logged.
+int SipMsgLogger::drain(unsigned int max_per_ring)
+{
+  int count = 0;
+
+  pthread_mutex_lock(&_drain_lock);
+
+  // Take a copy of the list of rings, so threads starting up aren't held
+  // up while we log.
+  pthread_mutex_lock(&_rings_lock);
+  std::vector<Ring*> rings = _rings;
+  pthread_mutex_unlock(&_rings_lock);
+
+  for (std::vector<Ring*>::iterator i = rings.begin();
+       i != rings.end();
+       ++i)
+  {
+    Ring* ring = *i;
+    unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+    unsigned int head = ring->head.load(std::memory_order_acquire);
+
+    for (unsigned int ii = 0; (ii < max_per_ring) && (tail != head); ++ii)
+    {
+      // The slot is only handed back to the producer once it has been
+      // logged.
+      write(&ring->entries[tail & ring->mask]);
+      ++tail;
+      ring->tail.store(tail, std::memory_order_release);
+      ++count;
+    }
+  }
+
+  pthread_mutex_unlock(&_drain_lock);
+
+  return count;
+}
+
+
+/// Send the SAS event and local log for a message.
+void SipMsgLogger::write(Entry* entry)
+{
+  // The verbose details are only filled in if verbose logging was enabled
+  // when the message was queued.
+  if (entry->verbose)
+  {
+    if (entry->rx)
+    {
+      LOG_VERBOSE("RX %d bytes %s from %s %s:%d:\n"
+                  "--start msg--\n\n"
+                  "%.*s\n"
+                  "--end msg--",
+                  (int)entry->msg.length(),
+                  entry->info.c_str(),
+                  entry->transport_name.c_str(),
+                  entry->address.c_str(),
+                  entry->port,
+                  (int)entry->msg.length(),
+                  entry->msg.data());
+    }
+    else
+    {
+      LOG_VERBOSE("TX %d bytes %s to %s %s:%d:\n"
+                  "--start msg--\n\n"
+                  "%.*s\n"
+                  "--end msg--",
+                  (int)entry->msg.length(),
+                  entry->info.c_str(),
+                  entry->transport_name.c_str(),
+                  entry->address.c_str(),
+                  entry->port,
+                  (int)entry->msg.length(),
+                  entry->msg.data());
+    }
+  }
+
+  if (entry->trail != 0)
+  {
+    SAS::Event event(entry->trail,
+                     entry->rx ? SASEvent::RX_SIP_MSG : SASEvent::TX_SIP_MSG,
+                     0);
+    event.add_static_param(entry->transport_type);
+    event.add_static_param(entry->port);
+    event.add_var_param(entry->address);
+    event.add_var_param(entry->msg);
+    SAS::report_event(event);
+  }
+  else
+  {
+    LOG_ERROR("%s message with no SAS trail identifier\n%s",
+              entry->rx ? "Received" : "Transmitting",
+              entry->msg.c_str());
+  }
+}
+
+
+void* SipMsgLogger::logger_thread(void* p)
+{
+  ((SipMsgLogger*)p)->run();
+  return NULL;
+}
+
+
+void SipMsgLogger::run()
+{
+  pthread_mutex_lock(&_stop_lock);
+
+  while (!_stop)
+  {
+    pthread_mutex_unlock(&_stop_lock);
+    int count = drain(BATCH_SIZE);
+    pthread_mutex_lock(&_stop_lock);
+
+    if ((count == 0) && (!_stop))
+    {
+      // Nothing to log, so wait a while for more messages.  Producers don't
+      // signal us, as that would mean taking a lock for every message.
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += (long)IDLE_POLL_MS * 1000000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec = ts.tv_nsec % 1000000000L;
+      pthread_cond_timedwait(&_stop_cond, &_stop_lock, &ts);
+    }
+  }
+
+  pthread_mutex_unlock(&_stop_lock);
+}
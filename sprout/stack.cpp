@@ -45,6 +45,9 @@ extern "C" {
 #include <pjlib.h>
 }
 #include <arpa/inet.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
 
 // Common STL includes.
 #include <cassert>
@@ -53,10 +56,16 @@ extern "C" {
 #include <set>
 #include <list>
 #include <queue>
+#include <deque>
 #include <string>
+#include <atomic>
 
 #include "constants.h"
-#include "eventq.h"
+#include "dispatch_queue.h"
+#include "rx_data_pool.h"
+#include "sip_msg_logger.h"
+#include "worker_throttle.h"
+#include "latency_histogram.h"
 #include "pjutils.h"
 #include "log.h"
 #include "sas.h"
@@ -73,6 +82,7 @@ extern "C" {
 #include "quiescing_manager.h"
 #include "load_monitor.h"
 #include "counter.h"
+#include "options.h"
 
 class StackQuiesceHandler;
 
@@ -80,20 +90,131 @@ struct stack_data_struct stack_data;
 
 static std::vector<pj_thread_t*> pjsip_threads;
 static std::vector<pj_thread_t*> worker_threads;
+
+// CPUs to pin the PJSIP and worker threads to.  Threads are assigned to
+// the CPUs in turn.  If empty, the threads are not pinned.
+static std::vector<int> pjsip_cpus;
+static std::vector<int> worker_cpus;
 static volatile pj_bool_t quit_flag;
 
-// Queue for incoming messages.
+// Queue for incoming messages.  If worker affinity is enabled this has a
+// shard per worker thread, otherwise it has a single shard shared by all
+// the workers.  Messages are queued on one of the following priority
+// lanes, so that responses and in-dialog requests are not held up behind
+// a backlog of new work.  A request is always queued on the same lane as
+// any earlier request it refers to (so a CANCEL is queued behind its
+// INVITE, and a BYE or ACK behind the other requests in its dialog), as
+// pjsip can only match it to a transaction or dialog that already exists.
+enum rx_msg_lane
+{
+  LANE_URGENT = 0,    // responses
+  LANE_IN_DIALOG,     // in-dialog requests
+  LANE_INITIAL,       // initial requests, and CANCELs for them
+  NUM_LANES
+};
+static const char* lane_names[NUM_LANES] = {"urgent", "in_dialog", "initial"};
+
 struct rx_msg_qe
 {
   pjsip_rx_data* rdata;    // received message
   Utils::StopWatch stop_watch;    // stop watch for tracking message latency
+  rx_msg_lane lane;        // priority lane the message was queued on
+  unsigned long deadline_us;    // time after which the message is stale,
+                                // or zero if it never goes stale
 };
-eventq<struct rx_msg_qe> rx_msg_q;
+static DispatchQueue<struct rx_msg_qe>* rx_msg_q = NULL;
+
+// Pool of recycled memory for cloning received messages, and the maximum
+// number of unused pools it holds on to.
+static RxDataPool* rx_data_pool = NULL;
+static const int RX_DATA_POOL_MAX_CACHED = 1000;
+
+// Logs received and transmitted messages to SAS and the local log.
+static SipMsgLogger* msg_logger = NULL;
+
+// Limits the number of worker threads processing messages at once, if
+// configured.
+static WorkerThrottle* worker_throttle = NULL;
+
+// Histograms of the time messages spend waiting on the receive queue and
+// being processed by worker threads, overall and for each method.
+enum rx_msg_method
+{
+  METHOD_INVITE = 0,
+  METHOD_ACK,
+  METHOD_BYE,
+  METHOD_CANCEL,
+  METHOD_REGISTER,
+  METHOD_SUBSCRIBE,
+  METHOD_NOTIFY,
+  METHOD_OPTIONS,
+  METHOD_OTHER,
+  NUM_METHODS
+};
+static const char* method_names[NUM_METHODS] = {"invite", "ack", "bye",
+                                                "cancel", "register",
+                                                "subscribe", "notify",
+                                                "options", "other"};
+static StatisticHistogram* queue_wait_histogram;
+static StatisticHistogram* service_time_histogram;
+static StatisticHistogram* method_queue_wait_histograms[NUM_METHODS];
+static StatisticHistogram* method_service_time_histograms[NUM_METHODS];
+
+// Whether the load monitor is driven by the 99th percentile queue wait
+// rather than the latency of each request.
+static bool load_control_queue_wait = false;
 
 static Accumulator* latency_accumulator;
 static Accumulator* queue_size_accumulator;
 static Counter* requests_counter;
 static Counter* overload_counter;
+static Counter* queue_full_counter;
+static Accumulator* transport_pause_accumulator;
+static Statistic* paused_transports_stat;
+static Accumulator* lane_queue_size_accumulators[NUM_LANES];
+static Accumulator* lane_latency_accumulators[NUM_LANES];
+
+// Reliable transports that are paused because the receive queue was full
+// when a request arrived on them, in the order they were paused.  While a
+// transport is paused its messages are parked here rather than queued, so
+// they stay in order, and the workers move them to the receive queue as it
+// frees up.  The transport thread is never held up, so the other
+// connections it serves are unaffected.
+struct paused_transport
+{
+  pjsip_transport* transport;
+  std::deque<struct rx_msg_qe> parked;
+  Utils::StopWatch pause_watch;
+};
+static std::list<paused_transport> paused_transport_list;
+static pthread_mutex_t paused_transport_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of transports currently paused.
+static std::atomic<int> paused_transports(0);
+
+// Maximum number of requests parked on a paused transport.  Any further
+// requests on the transport are rejected.
+static const size_t MAX_PARKED_REQUESTS = 100;
+
+// Maximum number of messages parked across all paused transports.  Messages
+// that complete work (responses, ACKs, CANCELs and BYEs) are parked beyond
+// MAX_PARKED_REQUESTS, but once this many are parked even they are shed.
+// Protected by the paused transport lock.
+static const size_t MAX_PARKED_MESSAGES = 10000;
+static size_t parked_messages = 0;
+
+// Time after which a queued initial request is considered stale, or zero
+// if requests are never shed.
+static unsigned long queue_deadline_us = 0;
+static Counter* shed_counter;
+
+// Maximum number of OPTIONS polls per second answered on the transport
+// threads, or zero if they are always queued to the worker threads.  The
+// count is kept for the current second only, so checking it is cheap.
+static int options_fast_path_rate = 0;
+static std::atomic<long> options_fast_path_second(0);
+static std::atomic<int> options_fast_path_count(0);
+static Counter* options_fast_path_counter;
 
 static LoadMonitor *load_monitor = NULL;
 static QuiescingManager *quiescing_mgr = NULL;
@@ -103,9 +224,16 @@ static ConnectionTracker *connection_tracker = NULL;
 // We register a single module to handle scheduling plus local and
 // SAS logging.
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata);
+static bool queue_rx_msg(pjsip_rx_data* rdata,
+                         struct rx_msg_qe& qe,
+                         bool always_queue);
+static bool rx_msg_queue_full(pjsip_rx_data* rdata);
+static void reject_queue_full(pjsip_rx_data* rdata);
+static void resume_paused_transports();
+static void correlate_trail(pjsip_rx_data* rdata);
 static pj_status_t on_tx_msg(pjsip_tx_data* tdata);
 
-static pjsip_module mod_stack =
+pjsip_module mod_stack =
 {
   NULL, NULL,                           /* prev, next.          */
   pj_str("mod-stack"),                  /* Name.                */
@@ -138,6 +266,83 @@ const static std::string _known_statnames[] = {
   "hss_user_auth_latency_us",
   "hss_location_latency_us",
   "connected_ralfs",
+  "rejected_queue_full",
+  "paused_transports",
+  "transport_pause_us",
+  "urgent_queue_size",
+  "urgent_latency_us",
+  "in_dialog_queue_size",
+  "in_dialog_latency_us",
+  "initial_queue_size",
+  "initial_latency_us",
+  "rejected_stale",
+  "rx_pool_hits",
+  "rx_pool_misses",
+  "rx_pool_hwm",
+  "sip_log_dropped",
+  "queue_wait_us",
+  "service_time_us",
+  "invite_queue_wait_us",
+  "invite_service_time_us",
+  "ack_queue_wait_us",
+  "ack_service_time_us",
+  "bye_queue_wait_us",
+  "bye_service_time_us",
+  "cancel_queue_wait_us",
+  "cancel_service_time_us",
+  "register_queue_wait_us",
+  "register_service_time_us",
+  "subscribe_queue_wait_us",
+  "subscribe_service_time_us",
+  "notify_queue_wait_us",
+  "notify_service_time_us",
+  "options_queue_wait_us",
+  "options_service_time_us",
+  "other_queue_wait_us",
+  "other_service_time_us",
+  "options_fast_path",
+  "aor_cache_hits",
+  "aor_cache_misses",
+  "aor_cache_revalidated",
+  "aor_cache_stale",
+  "remote_aor_cache_hits",
+  "remote_aor_cache_misses",
+  "remote_aor_cache_revalidated",
+  "remote_aor_cache_stale",
+  "reg_store_writes",
+  "reg_store_write_conflicts",
+  "remote_reg_store_writes",
+  "remote_reg_store_write_conflicts",
+  "registrar_cas_retries",
+  "registrar_cas_conflicts",
+  "registrar_cas_exhausted",
+  "subscription_cas_retries",
+  "subscription_cas_conflicts",
+  "subscription_cas_exhausted",
+  "remote_replication_lag_us",
+  "remote_replication_coalesced",
+  "remote_replication_dropped",
+  "remote_replication_failed",
+  "remote_replication_cas_retries",
+  "remote_replication_cas_conflicts",
+  "remote_replication_cas_exhausted",
+  "hedged_reads",
+  "hedged_read_wins",
+  "reg_store_compression_ratio",
+  "reg_store_compress_us",
+  "reg_store_decompress_us",
+  "remote_reg_store_compression_ratio",
+  "remote_reg_store_compress_us",
+  "remote_reg_store_decompress_us",
+  "local_timers",
+  "local_timer_pops",
+  "local_timer_lateness_us",
+  "hss_cache_regstate_hits",
+  "hss_cache_regstate_misses",
+  "hss_cache_ifcs_hits",
+  "hss_cache_ifcs_misses",
+  "hss_cache_uris_hits",
+  "hss_cache_uris_misses",
 };
 
 const static std::string SPROUT_ZMQ_PORT = "6666";
@@ -146,13 +351,79 @@ const static std::string BONO_ZMQ_PORT = "6669";
 const std::string* known_statnames = _known_statnames;
 const int num_known_stats = sizeof(_known_statnames) / sizeof(std::string);
 
+/// Get the NUMA node a CPU belongs to, or -1 if this isn't known.
+static int cpu_numa_node(int cpu)
+{
+  int node = -1;
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR* dir = opendir(path.c_str());
+
+  if (dir != NULL)
+  {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (sscanf(entry->d_name, "node%d", &node) == 1)
+      {
+        break;
+      }
+    }
+    closedir(dir);
+  }
+
+  return node;
+}
+
+
+/// Get the set of NUMA nodes a list of CPUs are on.
+static std::set<int> cpu_numa_nodes(const std::vector<int>& cpus)
+{
+  std::set<int> nodes;
+  for (std::vector<int>::const_iterator i = cpus.begin();
+       i != cpus.end();
+       ++i)
+  {
+    nodes.insert(cpu_numa_node(*i));
+  }
+  return nodes;
+}
+
+
+/// Pin the calling thread to the next CPU from a list, logging the CPU and
+/// the NUMA node it is on.
+static void pin_thread(const char* type, int index, const std::vector<int>& cpus)
+{
+  if (cpus.empty())
+  {
+    return;
+  }
+
+  int cpu = cpus[index % cpus.size()];
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (rc == 0)
+  {
+    LOG_STATUS("%s thread %d pinned to CPU %d (NUMA node %d)",
+               type, index, cpu, cpu_numa_node(cpu));
+  }
+  else
+  {
+    LOG_ERROR("Failed to pin %s thread %d to CPU %d: %s",
+              type, index, cpu, strerror(rc));
+  }
+}
+
+
 /// PJSIP threads are donated to PJSIP to handle receiving at transport level
 /// and timers.
 static int pjsip_thread(void *p)
 {
   pj_time_val delay = {0, 10};
 
-  PJ_UNUSED_ARG(p);
+  pin_thread("PJSIP", (int)(long)p, pjsip_cpus);
 
   LOG_DEBUG("PJSIP thread started");
 
@@ -167,83 +438,206 @@ static int pjsip_thread(void *p)
 }
 
 
-/// Worker threads handle most SIP message processing.
-static int worker_thread(void* p)
+/// Check whether a queued message has passed its deadline.
+static bool rx_msg_stale(struct rx_msg_qe& qe)
+{
+  unsigned long queued_us;
+  return ((qe.deadline_us != 0) &&
+          (qe.stop_watch.read(queued_us)) &&
+          (queued_us > qe.deadline_us));
+}
+
+
+/// Shed a stale request without processing it.  On unreliable transports
+/// the UAC will have retransmitted the request by now, so just drop it and
+/// let the retransmission (if it is not stale itself) be processed.  On
+/// reliable transports there are no retransmissions, so reject the request
+/// with a stateless 503 so the UAC can retry elsewhere.
+static void shed_rx_msg(pjsip_rx_data* rdata)
+{
+  if (rdata->tp_info.transport->flag & PJSIP_TRANSPORT_RELIABLE)
+  {
+    LOG_DEBUG("Rejecting stale request %p", rdata);
+    pjsip_retry_after_hdr* retry_after = pjsip_retry_after_hdr_create(rdata->tp_info.pool, 0);
+    PJUtils::respond_stateless(stack_data.endpt,
+                               rdata,
+                               PJSIP_SC_SERVICE_UNAVAILABLE,
+                               NULL,
+                               (pjsip_hdr*)retry_after,
+                               NULL);
+  }
+  else
+  {
+    LOG_DEBUG("Dropping stale request %p", rdata);
+  }
+
+  shed_counter->increment();
+}
+
+
+/// Get the method of a request, or of the request a response is for.
+static rx_msg_method rx_msg_method_of(pjsip_rx_data* rdata)
 {
-  // Set up data to always process incoming messages at the first PJSIP
-  // module after our module.
-  pjsip_process_rdata_param rp;
-  pjsip_process_rdata_param_default(&rp);
-  rp.start_mod = &mod_stack;
-  rp.idx_after_start = 1;
+  const pjsip_method* method = (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) ?
+                                 &rdata->msg_info.msg->line.req.method :
+                                 &rdata->msg_info.cseq->method;
+
+  switch (method->id)
+  {
+  case PJSIP_INVITE_METHOD:
+    return METHOD_INVITE;
+  case PJSIP_ACK_METHOD:
+    return METHOD_ACK;
+  case PJSIP_BYE_METHOD:
+    return METHOD_BYE;
+  case PJSIP_CANCEL_METHOD:
+    return METHOD_CANCEL;
+  case PJSIP_REGISTER_METHOD:
+    return METHOD_REGISTER;
+  case PJSIP_OPTIONS_METHOD:
+    return METHOD_OPTIONS;
+  default:
+    break;
+  }
 
-  LOG_DEBUG("Worker thread started");
+  if (pj_strcmp2(&method->name, "SUBSCRIBE") == 0)
+  {
+    return METHOD_SUBSCRIBE;
+  }
+  else if (pj_strcmp2(&method->name, "NOTIFY") == 0)
+  {
+    return METHOD_NOTIFY;
+  }
+
+  return METHOD_OTHER;
+}
 
+
+/// Take the next message off the shard of the receive queue serviced by the
+/// specified worker and process it.  Returns false once the queue has been
+/// terminated.
+bool process_next_rx_msg(unsigned int worker_id)
+{
   struct rx_msg_qe qe = {0};
 
-  while (rx_msg_q.pop(qe))
+  if (!rx_msg_q->pop(worker_id, qe))
+  {
+    return false;
+  }
+
+  pjsip_rx_data* rdata = qe.rdata;
+  if (rdata)
   {
-    pjsip_rx_data* rdata = qe.rdata;
-    if (rdata)
+    LOG_DEBUG("Worker thread dequeue message %p", rdata);
+
+    // Taking the message off the queue makes space for any messages
+    // parked on paused transports.
+    resume_paused_transports();
+
+    // Wait until there is a free slot to process the message.  The time
+    // spent waiting counts as queue wait time.
+    if (worker_throttle != NULL)
     {
-      LOG_DEBUG("Worker thread dequeue message %p", rdata);
+      worker_throttle->start_work();
+    }
+
+    // Split the latency into the time spent waiting on the queue and the
+    // time spent processing the message.
+    unsigned long queue_wait_us = 0;
+    qe.stop_watch.read(queue_wait_us);
+    rx_msg_method method = rx_msg_method_of(rdata);
+
+    // Correlate the message to its SAS trail and log it.  This is done
+    // here rather than on the transport thread as finding the trail
+    // means looking up the transaction.
+    correlate_trail(rdata);
+    msg_logger->log_rx_msg(rdata);
+
+    if (rx_msg_stale(qe))
+    {
+      shed_rx_msg(rdata);
+    }
+    else
+    {
+      // Always process incoming messages at the first PJSIP module after
+      // our module.
+      pjsip_process_rdata_param rp;
+      pjsip_process_rdata_param_default(&rp);
+      rp.start_mod = &mod_stack;
+      rp.idx_after_start = 1;
+
       pjsip_endpt_process_rx_data(stack_data.endpt, rdata, &rp, NULL);
       LOG_DEBUG("Worker thread completed processing message %p", rdata);
-      pjsip_rx_data_free_cloned(rdata);
+    }
+    rx_data_pool->free_cloned(rdata);
 
-      unsigned long latency_us;
-      if (qe.stop_watch.read(latency_us))
+    if (worker_throttle != NULL)
+    {
+      worker_throttle->end_work();
+    }
+
+    unsigned long latency_us;
+    if (qe.stop_watch.read(latency_us))
+    {
+      LOG_DEBUG("Request latency = %ldus", latency_us);
+      latency_accumulator->accumulate(latency_us);
+      lane_latency_accumulators[qe.lane]->accumulate(latency_us);
+
+      unsigned long service_time_us = (latency_us > queue_wait_us) ?
+                                        latency_us - queue_wait_us : 0;
+      queue_wait_histogram->record(queue_wait_us);
+      service_time_histogram->record(service_time_us);
+      method_queue_wait_histograms[method]->record(queue_wait_us);
+      method_service_time_histograms[method]->record(service_time_us);
+
+      if (load_control_queue_wait)
       {
-        LOG_DEBUG("Request latency = %ldus", latency_us);
-        latency_accumulator->accumulate(latency_us);
-        load_monitor->request_complete(latency_us);
+        // Use the 99th percentile queue wait over the last statistics
+        // period, or this message's queue wait until the first period
+        // completes.
+        unsigned long p99 = queue_wait_histogram->p99();
+        load_monitor->request_complete((p99 > 0) ? p99 : queue_wait_us);
       }
       else
       {
-        LOG_ERROR("Failed to get done timestamp: %s", strerror(errno));
+        load_monitor->request_complete(latency_us);
       }
     }
+    else
+    {
+      LOG_ERROR("Failed to get done timestamp: %s", strerror(errno));
+    }
   }
 
-  LOG_DEBUG("Worker thread ended");
-
-  return 0;
+  return true;
 }
 
 
-static void local_log_rx_msg(pjsip_rx_data* rdata)
+/// Worker threads handle most SIP message processing.  The parameter is
+/// the index of the worker thread, which identifies the shard of the
+/// receive queue it services.
+static int worker_thread(void* p)
 {
-  LOG_VERBOSE("RX %d bytes %s from %s %s:%d:\n"
-              "--start msg--\n\n"
-              "%.*s\n"
-              "--end msg--",
-              rdata->msg_info.len,
-              pjsip_rx_data_get_info(rdata),
-              rdata->tp_info.transport->type_name,
-              rdata->pkt_info.src_name,
-              rdata->pkt_info.src_port,
-              (int)rdata->msg_info.len,
-              rdata->msg_info.msg_buf);
-}
+  unsigned int worker_id = (unsigned int)(long)p;
 
+  pin_thread("Worker", worker_id, worker_cpus);
 
-static void local_log_tx_msg(pjsip_tx_data* tdata)
-{
-  LOG_VERBOSE("TX %d bytes %s to %s %s:%d:\n"
-              "--start msg--\n\n"
-              "%.*s\n"
-              "--end msg--",
-              (tdata->buf.cur - tdata->buf.start),
-              pjsip_tx_data_get_info(tdata),
-              tdata->tp_info.transport->type_name,
-              tdata->tp_info.dst_name,
-              tdata->tp_info.dst_port,
-              (int)(tdata->buf.cur - tdata->buf.start),
-              tdata->buf.start);
+  LOG_DEBUG("Worker thread %d started", worker_id);
+
+  while (process_next_rx_msg(worker_id))
+  {
+  }
+
+  LOG_DEBUG("Worker thread %d ended", worker_id);
+
+  return 0;
 }
 
 
-static void sas_log_rx_msg(pjsip_rx_data* rdata)
+/// Find the SAS trail for a received message.  Responses, ACKs and CANCELs
+/// are correlated to the trail of the transaction they relate to, and all
+/// other messages start a new trail.
+static void correlate_trail(pjsip_rx_data* rdata)
 {
   SAS::TrailId trail = 0;
 
@@ -308,49 +702,127 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
 
   // Store the trail in the message as it gets passed up the stack.
   set_trail(rdata, trail);
+}
+
+
+/// Pick the receive queue shard for a message.  All the messages in a
+/// dialog share a Call-ID, and the proxy preserves the Call-ID when it
+/// forwards requests, so hashing the Call-ID sends requests, the responses
+/// to them and any CANCELs chasing them to the same worker thread.
+///
+/// The shard doesn't depend on the NUMA node of the PJSIP thread that
+/// received the message.  A request and its response usually arrive on
+/// different connections, so on different PJSIP threads, and picking a
+/// worker on the receiving thread's node would split them across workers
+/// and let a CANCEL or response overtake the request it relates to.
+static unsigned int rx_msg_shard(pjsip_rx_data* rdata)
+{
+  // Updated by all the transport threads, so must be atomic.
+  static std::atomic<unsigned int> next_shard(0);
+
+  if (rx_msg_q->num_shards() == 1)
+  {
+    return 0;
+  }
+
+  if (rdata->msg_info.cid != NULL)
+  {
+    return pj_hash_calc(0,
+                        rdata->msg_info.cid->id.ptr,
+                        rdata->msg_info.cid->id.slen);
+  }
+
+  // The message has no Call-ID (so it will be rejected), so just spread
+  // these across the workers.
+  return next_shard++;
+}
+
+
+/// Pick the priority lane for a message.  A CANCEL has the same To header
+/// as the request it cancels, so is queued on the same lane as it.
+static rx_msg_lane rx_msg_priority(pjsip_rx_data* rdata)
+{
+  if (rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG)
+  {
+    return LANE_URGENT;
+  }
+  else if ((rdata->msg_info.to != NULL) &&
+           (rdata->msg_info.to->tag.slen > 0))
+  {
+    return LANE_IN_DIALOG;
+  }
 
-  // Log the message event.
-  SAS::Event event(trail, SASEvent::RX_SIP_MSG, 0);
-  event.add_static_param(pjsip_transport_get_type_from_flag(rdata->tp_info.transport->flag));
-  event.add_static_param(rdata->pkt_info.src_port);
-  event.add_var_param(rdata->pkt_info.src_name);
-  event.add_var_param(rdata->msg_info.len, rdata->msg_info.msg_buf);
-  SAS::report_event(event);
+  return LANE_INITIAL;
 }
 
 
-static void sas_log_tx_msg(pjsip_tx_data *tdata)
+/// Determines whether a message completes work that is already in progress.
+/// These messages are always queued, even if the queue is over its maximum
+/// size, and are never shed however late they are.
+static bool rx_msg_completes_work(pjsip_rx_data* rdata)
 {
-  // For outgoing messages always use the trail identified in the module data
-  SAS::TrailId trail = get_trail(tdata);
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  return ((msg->type == PJSIP_RESPONSE_MSG) ||
+          (msg->line.req.method.id == PJSIP_ACK_METHOD) ||
+          (msg->line.req.method.id == PJSIP_CANCEL_METHOD) ||
+          (msg->line.req.method.id == PJSIP_BYE_METHOD));
+}
+
 
-  if (trail != 0)
+/// Log a received message that is being handled without being queued to
+/// the worker threads.
+static void log_unqueued_rx_msg(pjsip_rx_data* rdata)
+{
+  set_trail(rdata, SAS::new_trail(1u));
+  msg_logger->log_rx_msg(rdata);
+}
+
+
+/// Determines whether a received message is an out-of-dialog OPTIONS poll
+/// that can be answered on the transport thread, without cloning it and
+/// queuing it to a worker thread.  Polls over the rate limit are queued as
+/// normal.
+static bool options_fast_path(pjsip_rx_data* rdata)
+{
+  if ((options_fast_path_rate <= 0) ||
+      (mod_options.id == -1) ||
+      (rdata->msg_info.msg->type != PJSIP_REQUEST_MSG) ||
+      (rdata->msg_info.msg->line.req.method.id != PJSIP_OPTIONS_METHOD) ||
+      (rdata->msg_info.to->tag.slen != 0) ||
+      (!is_local_options(rdata)))
   {
-    // Log the message event.
-    SAS::Event event(trail, SASEvent::TX_SIP_MSG, 0);
-    event.add_static_param(pjsip_transport_get_type_from_flag(tdata->tp_info.transport->flag));
-    event.add_static_param(tdata->tp_info.dst_port);
-    event.add_var_param(tdata->tp_info.dst_name);
-    event.add_var_param((int)(tdata->buf.cur - tdata->buf.start), tdata->buf.start);
-    SAS::report_event(event);
+    return false;
   }
-  else
+
+  // Reset the count at the start of each second.  This can race with
+  // another thread, but at worst a few extra polls are queued or answered.
+  long now = (long)time(NULL);
+  long second = options_fast_path_second.load();
+  if ((second != now) &&
+      (options_fast_path_second.compare_exchange_strong(second, now)))
   {
-    LOG_ERROR("Transmitting message with no SAS trail identifier\n%.*s",
-              (int)(tdata->buf.cur - tdata->buf.start),
-              tdata->buf.start);
+    options_fast_path_count.store(0);
   }
+
+  return (options_fast_path_count.fetch_add(1) < options_fast_path_rate);
 }
 
 
 static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
 {
-  // Do logging.
-  local_log_rx_msg(rdata);
-  sas_log_rx_msg(rdata);
-
   requests_counter->increment();
 
+  if (options_fast_path(rdata))
+  {
+    // Answer the OPTIONS poll here rather than waiting for a worker thread.
+    LOG_DEBUG("Answering OPTIONS poll on transport thread");
+    options_fast_path_counter->increment();
+    log_unqueued_rx_msg(rdata);
+    PJUtils::respond_stateless(stack_data.endpt, rdata, 200, NULL, NULL, NULL);
+    return PJ_TRUE;
+  }
+
   // Check whether the request should be processed
   if (!(load_monitor->admit_request())                                  &&
       (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG)                  &&
@@ -361,6 +833,7 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
     // Respond statelessly with a 503 Service Unavailable, including a
     // Retry-After header with a zero length timeout.
     LOG_DEBUG("Rejected request due to overload");
+    log_unqueued_rx_msg(rdata);
 
     pjsip_retry_after_hdr* retry_after = pjsip_retry_after_hdr_create(rdata->tp_info.pool, 0);
     PJUtils::respond_stateless(stack_data.endpt,
@@ -385,11 +858,24 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
   qe.stop_watch.start();
 
   // Notify the connection tracker that the transport is active.
-  connection_tracker->connection_active(rdata->tp_info.transport);
+  if (connection_tracker != NULL)
+  {
+    connection_tracker->connection_active(rdata->tp_info.transport);
+  }
+
+  // If the request is going to be rejected because the queue is full, reject
+  // it now, before going to the expense of cloning it.
+  bool completes_work = rx_msg_completes_work(rdata);
+
+  if ((!completes_work) && (rx_msg_queue_full(rdata)))
+  {
+    reject_queue_full(rdata);
+    return PJ_TRUE;
+  }
 
   // Clone the message and queue it to a scheduler thread.
   pjsip_rx_data* clone_rdata;
-  pj_status_t status = pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+  pj_status_t status = rx_data_pool->clone(rdata, &clone_rdata);
 
   if (status != PJ_SUCCESS)
   {
@@ -398,32 +884,274 @@ static pj_bool_t on_rx_msg(pjsip_rx_data* rdata)
     return PJ_TRUE;
   }
 
-  // Make sure the trail identifier is passed across.
-  set_trail(clone_rdata, get_trail(rdata));
-
-  // @TODO - need to think about back-pressure mechanisms.  For example,
-  // should we have a maximum depth of queue and drop messages after that?
-  // May be better to hold on to the message until the queue has space - this
-  // will force back pressure on the particular TCP connection.  Or should we
-  // have a queue per transport and round-robin them?
-
   LOG_DEBUG("Queuing cloned received message %p for worker threads", clone_rdata);
   qe.rdata = clone_rdata;
+  qe.lane = rx_msg_priority(clone_rdata);
+
+  // Initial requests are shed if they wait too long on the queue, as the UAC
+  // will have given up on them or retransmitted them by the time we get
+  // round to them.  Anything else is handled however late it is, as it
+  // relates to a transaction or dialog that is already established.
+  qe.deadline_us = ((qe.lane == LANE_INITIAL) && (!completes_work)) ?
+                     queue_deadline_us : 0;
 
   // Track the current queue size
-  queue_size_accumulator->accumulate(rx_msg_q.size());
-  rx_msg_q.push(qe);
+  queue_size_accumulator->accumulate(rx_msg_q->size());
+  lane_queue_size_accumulators[qe.lane]->accumulate(rx_msg_q->lane_size(qe.lane));
+
+  if (!queue_rx_msg(rdata, qe, completes_work))
+  {
+    rx_data_pool->free_cloned(clone_rdata);
+
+    if (completes_work)
+    {
+      // Too many messages are parked on paused transports, so shed this one.
+      // It can't be rejected, so is dropped, and counted as overload.
+      LOG_WARNING("Dropped received message as too many messages are parked");
+      log_unqueued_rx_msg(rdata);
+      overload_counter->increment();
+    }
+    else
+    {
+      reject_queue_full(rdata);
+    }
+  }
 
   // return TRUE to flag that we have absorbed the incoming message.
   return PJ_TRUE;
 }
 
 
+/// Reject a received request because the receive queue is full.  Responds
+/// statelessly with a 503 Service Unavailable, including a Retry-After header
+/// with a zero length timeout, in the same way as for overload.
+static void reject_queue_full(pjsip_rx_data* rdata)
+{
+  LOG_DEBUG("Rejected request as receive queue is full");
+  log_unqueued_rx_msg(rdata);
+
+  pjsip_retry_after_hdr* retry_after = pjsip_retry_after_hdr_create(rdata->tp_info.pool, 0);
+  PJUtils::respond_stateless(stack_data.endpt,
+                             rdata,
+                             PJSIP_SC_SERVICE_UNAVAILABLE,
+                             NULL,
+                             (pjsip_hdr*)retry_after,
+                             NULL);
+  queue_full_counter->increment();
+}
+
+
+/// Report a change in the number of paused transports.
+static void report_paused_transports(int count)
+{
+  std::vector<std::string> message;
+  message.push_back(std::to_string(count));
+  paused_transports_stat->report_change(message);
+}
+
+
+/// Find the entry for a transport if it is paused.  Must be called with
+/// the paused transport lock held.
+static paused_transport* find_paused_transport(pjsip_transport* transport)
+{
+  for (std::list<paused_transport>::iterator i = paused_transport_list.begin();
+       i != paused_transport_list.end();
+       ++i)
+  {
+    if (i->transport == transport)
+    {
+      return &(*i);
+    }
+  }
+
+  return NULL;
+}
+
+
+/// Whether a received request would be rejected by queue_rx_msg because the
+/// receive queue is full or its transport has too many messages parked.
+/// This is checked before the request is cloned, so that rejecting it costs
+/// as little as possible, but queue_rx_msg makes the final decision, as the
+/// queue can fill up in between.
+static bool rx_msg_queue_full(pjsip_rx_data* rdata)
+{
+  pjsip_transport* transport = rdata->tp_info.transport;
+
+  if ((transport->flag & PJSIP_TRANSPORT_RELIABLE) == 0)
+  {
+    return rx_msg_q->full();
+  }
+
+  if (paused_transports.load() == 0)
+  {
+    return false;
+  }
+
+  // A paused transport has too many requests parked, and no transport can
+  // park any more (or be paused) once the total cap is reached.
+  pthread_mutex_lock(&paused_transport_lock);
+  paused_transport* pt = find_paused_transport(transport);
+  bool full = (pt != NULL) ?
+                ((pt->parked.size() >= MAX_PARKED_REQUESTS) ||
+                 (parked_messages >= MAX_PARKED_MESSAGES)) :
+                ((rx_msg_q->full()) &&
+                 (parked_messages >= MAX_PARKED_MESSAGES));
+  pthread_mutex_unlock(&paused_transport_lock);
+
+  return full;
+}
+
+
+/// Queue a received message to the worker threads, applying back-pressure
+/// if the receive queue is full.  Returns false if the message could not be
+/// queued.
+///
+/// If a request arrives on a reliable transport when the queue is full, the
+/// transport is paused - the request, and any further messages on the
+/// transport, are parked until the workers have made space for them.  This
+/// holds up the sender without holding up the transport thread, so other
+/// connections are unaffected.  For unreliable transports there is no
+/// ordering to preserve, so the request is rejected immediately, before it
+/// has cost us anything.
+static bool queue_rx_msg(pjsip_rx_data* rdata,
+                         struct rx_msg_qe& qe,
+                         bool always_queue)
+{
+  pjsip_transport* transport = rdata->tp_info.transport;
+  bool reliable = ((transport->flag & PJSIP_TRANSPORT_RELIABLE) != 0);
+
+  if ((reliable) && (paused_transports.load() > 0))
+  {
+    // If the transport is paused, park the message behind the messages
+    // already parked on it so they are processed in order.
+    pthread_mutex_lock(&paused_transport_lock);
+    paused_transport* pt = find_paused_transport(transport);
+    if (pt != NULL)
+    {
+      bool parked = ((parked_messages < MAX_PARKED_MESSAGES) &&
+                     ((always_queue) ||
+                      (pt->parked.size() < MAX_PARKED_REQUESTS)));
+      if (parked)
+      {
+        pt->parked.push_back(qe);
+        parked_messages++;
+      }
+      pthread_mutex_unlock(&paused_transport_lock);
+      return parked;
+    }
+    pthread_mutex_unlock(&paused_transport_lock);
+  }
+
+  unsigned int shard = rx_msg_shard(qe.rdata);
+
+  if (always_queue)
+  {
+    rx_msg_q->push(shard, qe.lane, qe);
+    return true;
+  }
+
+  if (rx_msg_q->push_noblock(shard, qe.lane, qe))
+  {
+    return true;
+  }
+
+  if (!reliable)
+  {
+    return false;
+  }
+
+  LOG_DEBUG("Receive queue full, pausing transport %s", transport->obj_name);
+  pthread_mutex_lock(&paused_transport_lock);
+  if (parked_messages >= MAX_PARKED_MESSAGES)
+  {
+    pthread_mutex_unlock(&paused_transport_lock);
+    return false;
+  }
+  paused_transport_list.push_back(paused_transport());
+  paused_transport& pt = paused_transport_list.back();
+  pt.transport = transport;
+  pt.parked.push_back(qe);
+  parked_messages++;
+  pt.pause_watch.start();
+  pjsip_transport_add_ref(transport);
+  report_paused_transports(++paused_transports);
+  pthread_mutex_unlock(&paused_transport_lock);
+
+  return true;
+}
+
+
+/// Move messages parked on paused transports to the receive queue while
+/// there is space on it, resuming each transport once it has no more
+/// parked messages.  Transports are resumed in the order they were paused.
+static void resume_paused_transports()
+{
+  if (paused_transports.load() == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&paused_transport_lock);
+  while (!paused_transport_list.empty())
+  {
+    paused_transport& pt = paused_transport_list.front();
+
+    while ((!pt.parked.empty()) &&
+           (rx_msg_q->push_noblock(rx_msg_shard(pt.parked.front().rdata),
+                                   pt.parked.front().lane,
+                                   pt.parked.front())))
+    {
+      pt.parked.pop_front();
+      parked_messages--;
+    }
+
+    if (!pt.parked.empty())
+    {
+      // The queue is full again.
+      break;
+    }
+
+    LOG_DEBUG("Resuming transport %s", pt.transport->obj_name);
+    unsigned long pause_us;
+    if (pt.pause_watch.read(pause_us))
+    {
+      transport_pause_accumulator->accumulate(pause_us);
+    }
+    pjsip_transport_dec_ref(pt.transport);
+    paused_transport_list.pop_front();
+    report_paused_transports(--paused_transports);
+  }
+  pthread_mutex_unlock(&paused_transport_lock);
+}
+
+
+/// Free the messages parked on any paused transports.
+static void free_parked_rx_msgs()
+{
+  pthread_mutex_lock(&paused_transport_lock);
+  for (std::list<paused_transport>::iterator i = paused_transport_list.begin();
+       i != paused_transport_list.end();
+       ++i)
+  {
+    for (std::deque<struct rx_msg_qe>::iterator j = i->parked.begin();
+         j != i->parked.end();
+         ++j)
+    {
+      rx_data_pool->free_cloned(j->rdata);
+    }
+    pjsip_transport_dec_ref(i->transport);
+  }
+  paused_transport_list.clear();
+  parked_messages = 0;
+  paused_transports.store(0);
+  pthread_mutex_unlock(&paused_transport_lock);
+}
+
+
 static pj_status_t on_tx_msg(pjsip_tx_data* tdata)
 {
   // Do logging.
-  local_log_tx_msg(tdata);
-  sas_log_tx_msg(tdata);
+  msg_logger->log_tx_msg(tdata);
 
   // Return success so the message gets transmitted.
   return PJ_SUCCESS;
@@ -771,6 +1499,177 @@ pj_status_t init_pjsip()
 }
 
 
+/// Create the receive queue, the pool and logger for received messages and
+/// the statistics for them.  This is done separately from the rest of the
+/// stack so that the UTs can drive the receive queue without creating any
+/// transports or threads.
+void init_rx_msg_queue(int num_worker_threads,
+                       bool worker_affinity,
+                       int max_queue_depth,
+                       const std::vector<int>& lane_weights,
+                       int queue_deadline_ms,
+                       int options_fast_path_rate_arg,
+                       LoadMonitor* load_monitor_arg)
+{
+  // Create the receive queue.  With worker affinity each worker services
+  // its own shard of the queue (stealing from the other shards when it
+  // runs out of work), otherwise all the workers share a single queue.
+  if (worker_affinity)
+  {
+    LOG_STATUS("Dispatching messages to %d workers by Call-ID", num_worker_threads);
+    rx_msg_q = new DispatchQueue<struct rx_msg_qe>(num_worker_threads,
+                                                   true,
+                                                   max_queue_depth,
+                                                   NUM_LANES,
+                                                   lane_weights);
+  }
+  else
+  {
+    rx_msg_q = new DispatchQueue<struct rx_msg_qe>(1,
+                                                   false,
+                                                   max_queue_depth,
+                                                   NUM_LANES,
+                                                   lane_weights);
+  }
+
+  // By default initial requests go stale once the UAC has retransmitted
+  // them a few times.
+  if (queue_deadline_ms < 0)
+  {
+    queue_deadline_ms = 4 * PJSIP_T1_TIMEOUT;
+  }
+  queue_deadline_us = (unsigned long)queue_deadline_ms * 1000;
+
+  if (queue_deadline_ms > 0)
+  {
+    LOG_STATUS("Shedding initial requests queued for more than %dms",
+               queue_deadline_ms);
+  }
+
+  options_fast_path_rate = options_fast_path_rate_arg;
+  if (options_fast_path_rate > 0)
+  {
+    LOG_STATUS("Answer up to %d OPTIONS polls per second on transport threads",
+               options_fast_path_rate);
+  }
+
+  if (rx_msg_q->weighted())
+  {
+    LOG_STATUS("Dispatching by weight: urgent %d, in-dialog %d, initial %d",
+               lane_weights[LANE_URGENT],
+               lane_weights[LANE_IN_DIALOG],
+               lane_weights[LANE_INITIAL]);
+  }
+
+  if (max_queue_depth > 0)
+  {
+    LOG_STATUS("Receive queue limited to %d requests", max_queue_depth);
+  }
+
+  latency_accumulator = new StatisticAccumulator("latency_us",
+                                                 stack_data.stats_aggregator);
+  queue_size_accumulator = new StatisticAccumulator("queue_size",
+                                                    stack_data.stats_aggregator);
+  requests_counter = new StatisticCounter("incoming_requests",
+                                          stack_data.stats_aggregator);
+  overload_counter = new StatisticCounter("rejected_overload",
+                                          stack_data.stats_aggregator);
+  queue_full_counter = new StatisticCounter("rejected_queue_full",
+                                            stack_data.stats_aggregator);
+  shed_counter = new StatisticCounter("rejected_stale",
+                                      stack_data.stats_aggregator);
+  options_fast_path_counter = new StatisticCounter("options_fast_path",
+                                                   stack_data.stats_aggregator);
+  msg_logger = new SipMsgLogger(SipMsgLogger::DEFAULT_RING_SIZE,
+                                stack_data.stats_aggregator);
+  rx_data_pool = new RxDataPool(&stack_data.cp.factory,
+                                RX_DATA_POOL_MAX_CACHED,
+                                stack_data.stats_aggregator);
+  transport_pause_accumulator = new StatisticAccumulator("transport_pause_us",
+                                                         stack_data.stats_aggregator);
+  paused_transports_stat = new Statistic("paused_transports",
+                                         stack_data.stats_aggregator);
+  queue_wait_histogram = new StatisticHistogram("queue_wait_us",
+                                                stack_data.stats_aggregator);
+  service_time_histogram = new StatisticHistogram("service_time_us",
+                                                  stack_data.stats_aggregator);
+  for (int method = 0; method < NUM_METHODS; ++method)
+  {
+    std::string name = method_names[method];
+    method_queue_wait_histograms[method] =
+      new StatisticHistogram(name + "_queue_wait_us", stack_data.stats_aggregator);
+    method_service_time_histograms[method] =
+      new StatisticHistogram(name + "_service_time_us", stack_data.stats_aggregator);
+  }
+  for (int lane = 0; lane < NUM_LANES; ++lane)
+  {
+    std::string name = lane_names[lane];
+    lane_queue_size_accumulators[lane] =
+      new StatisticAccumulator(name + "_queue_size", stack_data.stats_aggregator);
+    lane_latency_accumulators[lane] =
+      new StatisticAccumulator(name + "_latency_us", stack_data.stats_aggregator);
+  }
+
+  if (load_monitor_arg != NULL)
+  {
+    load_monitor = load_monitor_arg;
+  }
+}
+
+
+/// Destroy everything created by init_rx_msg_queue.  This must be done
+/// before the statistics aggregator is deleted.
+void destroy_rx_msg_queue()
+{
+  delete latency_accumulator;
+  latency_accumulator = NULL;
+  delete queue_size_accumulator;
+  queue_size_accumulator = NULL;
+  delete requests_counter;
+  requests_counter = NULL;
+  delete overload_counter;
+  overload_counter = NULL;
+  delete queue_full_counter;
+  queue_full_counter = NULL;
+  delete shed_counter;
+  shed_counter = NULL;
+  delete options_fast_path_counter;
+  options_fast_path_counter = NULL;
+  delete transport_pause_accumulator;
+  transport_pause_accumulator = NULL;
+  delete paused_transports_stat;
+  paused_transports_stat = NULL;
+  delete queue_wait_histogram;
+  queue_wait_histogram = NULL;
+  delete service_time_histogram;
+  service_time_histogram = NULL;
+  for (int method = 0; method < NUM_METHODS; ++method)
+  {
+    delete method_queue_wait_histograms[method];
+    method_queue_wait_histograms[method] = NULL;
+    delete method_service_time_histograms[method];
+    method_service_time_histograms[method] = NULL;
+  }
+  for (int lane = 0; lane < NUM_LANES; ++lane)
+  {
+    delete lane_queue_size_accumulators[lane];
+    lane_queue_size_accumulators[lane] = NULL;
+    delete lane_latency_accumulators[lane];
+    lane_latency_accumulators[lane] = NULL;
+  }
+
+  free_parked_rx_msgs();
+  delete rx_msg_q;
+  rx_msg_q = NULL;
+
+  delete rx_data_pool;
+  rx_data_pool = NULL;
+
+  delete msg_logger;
+  msg_logger = NULL;
+}
+
+
 pj_status_t init_stack(const std::string& system_name,
                        const std::string& sas_address,
                        int pcscf_trusted_port,
@@ -786,6 +1685,15 @@ pj_status_t init_stack(const std::string& system_name,
                        SIPResolver* sipresolver,
                        int num_pjsip_threads,
                        int num_worker_threads,
+                       int max_active_workers,
+                       bool worker_affinity,
+                       int max_queue_depth,
+                       const std::vector<int>& lane_weights,
+                       int queue_deadline_ms,
+                       bool load_control_queue_wait_arg,
+                       const std::vector<int>& pjsip_cpus_arg,
+                       const std::vector<int>& worker_cpus_arg,
+                       int options_fast_path_rate_arg,
                        int record_routing_model,
                        const int default_session_expires,
                        QuiescingManager *quiescing_mgr_arg,
@@ -802,6 +1710,32 @@ pj_status_t init_stack(const std::string& system_name,
   // start_stack is called.
   pjsip_threads.resize(num_pjsip_threads);
   worker_threads.resize(num_worker_threads);
+  pjsip_cpus = pjsip_cpus_arg;
+  worker_cpus = worker_cpus_arg;
+
+  // Messages are sharded to workers by Call-ID rather than by the NUMA node
+  // they were received on (see rx_msg_shard), so warn if that means they
+  // will cross between nodes.
+  std::vector<int> all_cpus = pjsip_cpus;
+  all_cpus.insert(all_cpus.end(), worker_cpus.begin(), worker_cpus.end());
+  if (cpu_numa_nodes(all_cpus).size() > 1)
+  {
+    LOG_STATUS("PJSIP or worker threads span NUMA nodes, so messages may be "
+               "processed on a different node from the one they arrive on");
+  }
+
+  if (max_active_workers > 0)
+  {
+    LOG_STATUS("Limit %d of %d worker threads to processing messages at once",
+               max_active_workers, num_worker_threads);
+    worker_throttle = new WorkerThrottle(max_active_workers);
+  }
+
+  load_control_queue_wait = load_control_queue_wait_arg;
+  if (load_control_queue_wait)
+  {
+    LOG_STATUS("Load monitor driven by queue wait time");
+  }
 
   // Get ports and host names specified on options.  If local host was not
   // specified, use the host name returned by pj_gethostname.
@@ -1048,19 +1982,13 @@ pj_status_t init_stack(const std::string& system_name,
                                                    known_statnames,
                                                    zmq_port);
 
-  latency_accumulator = new StatisticAccumulator("latency_us",
-                                                 stack_data.stats_aggregator);
-  queue_size_accumulator = new StatisticAccumulator("queue_size",
-                                                    stack_data.stats_aggregator);
-  requests_counter = new StatisticCounter("incoming_requests",
-                                          stack_data.stats_aggregator);
-  overload_counter = new StatisticCounter("rejected_overload",
-                                          stack_data.stats_aggregator);
-
-  if (load_monitor_arg != NULL)
-  {
-    load_monitor = load_monitor_arg;
-  }
+  init_rx_msg_queue(num_worker_threads,
+                    worker_affinity,
+                    max_queue_depth,
+                    lane_weights,
+                    queue_deadline_ms,
+                    options_fast_path_rate_arg,
+                    load_monitor_arg);
 
   if (quiescing_mgr_arg != NULL)
   {
@@ -1096,7 +2024,7 @@ pj_status_t start_stack()
   {
     pj_thread_t* thread;
     status = pj_thread_create(stack_data.pool, "worker", &worker_thread,
-                              NULL, 0, 0, &thread);
+                              (void*)ii, 0, 0, &thread);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error creating worker thread, %s",
@@ -1111,7 +2039,7 @@ pj_status_t start_stack()
   {
     pj_thread_t* thread;
     status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread,
-                              NULL, 0, 0, &thread);
+                              (void*)ii, 0, 0, &thread);
     if (status != PJ_SUCCESS)
     {
       LOG_ERROR("Error creating PJSIP thread, %s",
@@ -1144,7 +2072,7 @@ void stop_stack()
 
   // Now it is safe to signal the worker threads to exit via the queue and to
   // wait for them to terminate.
-  rx_msg_q.terminate();
+  rx_msg_q->terminate();
   for (std::vector<pj_thread_t*>::iterator i = worker_threads.begin();
        i != worker_threads.end();
        ++i)
@@ -1176,15 +2104,9 @@ void term_pjsip()
 // Destroy stack
 void destroy_stack(void)
 {
-  // Tear down the stack.
-  delete latency_accumulator;
-  latency_accumulator = NULL;
-  delete queue_size_accumulator;
-  queue_size_accumulator = NULL;
-  delete requests_counter;
-  requests_counter = NULL;
-  delete overload_counter;
-  overload_counter = NULL;
+  // Tear down the stack.  The receive queue statistics, message pool and
+  // logger must be deleted before the statistics aggregator.
+  destroy_rx_msg_queue();
   delete stack_data.stats_aggregator;
 
   delete stack_quiesce_handler;
@@ -1196,6 +2118,9 @@ void destroy_stack(void)
   pjsip_threads.clear();
   worker_threads.clear();
 
+  delete worker_throttle;
+  worker_throttle = NULL;
+
   SAS::term();
 
   // Terminate PJSIP.
@@ -99,6 +99,7 @@ extern "C" {
 
 // Common STL includes.
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <set>
@@ -133,6 +134,7 @@ extern "C" {
 
 static RegStore* store;
 static RegStore* remote_store;
+static HedgedRegStoreReader* hedged_reader;
 
 static CallServices* call_services_handler;
 static IfcHandler* ifc_handler;
@@ -1643,22 +1645,42 @@ void UASTransaction::cancel_trying_timer()
 // Gets the subscriber's associated URIs and iFCs for each URI from
 // the HSS. Returns true on success, false on failure.
 
+// The data is taken from the per-transaction cache if possible, then from
+// the cache shared by all transactions (if there is one), and only
+// requested from the HSS if neither holds it.  The type is the part of the
+// data the caller needs, and is only used for the shared cache statistics.
+
 // The info parameter is only filled in correctly if this function
 // returns true,
-bool UASTransaction::get_data_from_hss(std::string public_id, HSSCallInformation& info, SAS::TrailId trail)
+bool UASTransaction::get_data_from_hss(std::string public_id,
+                                       HSSCallInformation& info,
+                                       SubscriberProfileCache::ProfileType type,
+                                       SAS::TrailId trail)
 {
   std::map<std::string, HSSCallInformation>::iterator data = cached_hss_data.find(public_id);
   bool rc = false;
+  SubscriberProfileCache* profile_cache = hss->profile_cache();
+  std::string regstate;
+  Ifcs ifcs;
+  std::vector<std::string> uris;
+
   if (data != cached_hss_data.end())
   {
     info = data->second;
     rc = true;
   }
+  else if ((profile_cache != NULL) &&
+           (profile_cache->get(public_id, type, regstate, ifcs, uris)))
+  {
+    LOG_DEBUG("Using cached HSS data for %s", public_id.c_str());
+    bool registered = (regstate == HSSConnection::STATE_REGISTERED);
+    info = {registered, ifcs, uris};
+    cached_hss_data[public_id] = info;
+    rc = true;
+  }
   else
   {
-    std::vector<std::string> uris;
     std::map<std::string, Ifcs> ifc_map;
-    std::string regstate;
     long http_code = hss->update_registration_state(public_id, "", HSSConnection::CALL, regstate, ifc_map, uris, trail);
     bool registered = (regstate == HSSConnection::STATE_REGISTERED);
     info = {registered, ifc_map[public_id], uris};
@@ -1676,7 +1698,7 @@ bool UASTransaction::get_data_from_hss(std::string public_id, HSSCallInformation
 bool UASTransaction::is_user_registered(std::string public_id)
 {
   HSSCallInformation data;
-  bool success = get_data_from_hss(public_id, data, trail());
+  bool success = get_data_from_hss(public_id, data, SubscriberProfileCache::REGSTATE, trail());
   if (success)
   {
     return data.registered;
@@ -1694,7 +1716,7 @@ bool UASTransaction::is_user_registered(std::string public_id)
 bool UASTransaction::get_associated_uris(std::string public_id, std::vector<std::string>& uris, SAS::TrailId trail)
 {
   HSSCallInformation data;
-  bool success = get_data_from_hss(public_id, data, trail);
+  bool success = get_data_from_hss(public_id, data, SubscriberProfileCache::ASSOCIATED_URIS, trail);
   if (success)
   {
     uris = data.uris;
@@ -1708,7 +1730,7 @@ bool UASTransaction::get_associated_uris(std::string public_id, std::vector<std:
 bool UASTransaction::lookup_ifcs(std::string public_id, Ifcs& ifcs, SAS::TrailId trail)
 {
   HSSCallInformation data;
-  bool success = get_data_from_hss(public_id, data, trail);
+  bool success = get_data_from_hss(public_id, data, SubscriberProfileCache::IFCS, trail);
   if (success)
   {
     ifcs = data.ifcs;
@@ -1716,6 +1738,13 @@ bool UASTransaction::lookup_ifcs(std::string public_id, Ifcs& ifcs, SAS::TrailId
   return success;
 }
 
+/// Orders bindings by expiry time, latest first.
+static bool later_expiry(const RegStore::AoRView::Binding* b1,
+                         const RegStore::AoRView::Binding* b2)
+{
+  return (b1->expires > b2->expires);
+}
+
 ///@{
 // IN-TRANSACTION PROCESSING
 
@@ -1869,84 +1898,81 @@ void UASTransaction::proxy_calculate_targets(pjsip_msg* msg,
       aor = public_id;
     }
 
-    // Look up the target in the registration data store.
+    // Look up the target in the registration data store.  The bindings are
+    // only read, so get a view of them allocated from the request's pool
+    // rather than a full copy of the record.
     LOG_INFO("Look up targets in registration store: %s", aor.c_str());
-    RegStore::AoR* aor_data = store->get_aor_data(aor, trail);
-
-    // If we didn't get bindings from the local store and we have a remote
-    // store, try the remote.
-    if ((remote_store != NULL) &&
-        ((aor_data == NULL) ||
-         (aor_data->bindings().empty())))
+    RegStore::AoRView aor_view;
+    if (hedged_reader != NULL)
+    {
+      // Read from the local store, but try the remote store as well if the
+      // local read is slow or returns no bindings.
+      hedged_reader->get_aor_view(aor, pool, aor_view, trail);
+    }
+    else
     {
-      delete aor_data;
-      aor_data = remote_store->get_aor_data(aor, trail);
+      bool found = store->get_aor_view(aor, pool, aor_view, trail);
+
+      // If we didn't get bindings from the local store and we have a remote
+      // store, try the remote.
+      if ((remote_store != NULL) &&
+          ((!found) ||
+           (aor_view.num_bindings() == 0)))
+      {
+        remote_store->get_aor_view(aor, pool, aor_view, trail);
+      }
     }
 
     // Pick up to max_targets bindings to attempt to contact.  Since
     // some of these may be stale, and we don't want stale bindings to
     // push live bindings out, we sort by expiry time and pick those
     // with the most distant expiry times.  See bug 45.
-    std::list<RegStore::AoR::Bindings::value_type> target_bindings;
-    if (aor_data != NULL)
+    std::vector<const RegStore::AoRView::Binding*> target_bindings;
+    if ((int)aor_view.num_bindings() <= max_targets)
     {
-      const RegStore::AoR::Bindings& bindings = aor_data->bindings();
-      if ((int)bindings.size() <= max_targets)
+      for (unsigned ii = 0; ii < aor_view.num_bindings(); ++ii)
       {
-        for (RegStore::AoR::Bindings::const_iterator i = bindings.begin();
-             i != bindings.end();
-             ++i)
-        {
-          target_bindings.push_back(*i);
-        }
+        target_bindings.push_back(&aor_view.binding(ii));
       }
-      else
+    }
+    else
+    {
+      // Sort from the last binding to the first, so that bindings with the
+      // same expiry time are picked in that order.
+      for (unsigned ii = aor_view.num_bindings(); ii > 0; --ii)
       {
-        std::multimap<int, RegStore::AoR::Bindings::value_type> ordered;
-        for (RegStore::AoR::Bindings::const_iterator i = bindings.begin();
-             i != bindings.end();
-             ++i)
-        {
-          std::pair<int, RegStore::AoR::Bindings::value_type> p = std::make_pair(i->second->_expires, *i);
-          ordered.insert(p);
-        }
-
-        int num_contacts = 0;
-        for (std::multimap<int, RegStore::AoR::Bindings::value_type>::const_reverse_iterator i = ordered.rbegin();
-             num_contacts < max_targets;
-             ++i)
-        {
-          target_bindings.push_back(i->second);
-          num_contacts++;
-        }
+        target_bindings.push_back(&aor_view.binding(ii - 1));
       }
+      std::stable_sort(target_bindings.begin(),
+                       target_bindings.end(),
+                       later_expiry);
+      target_bindings.resize(max_targets);
     }
 
-    for (std::list<RegStore::AoR::Bindings::value_type>::const_iterator i = target_bindings.begin();
+    for (std::vector<const RegStore::AoRView::Binding*>::const_iterator i = target_bindings.begin();
          i != target_bindings.end();
          ++i)
     {
-      RegStore::AoR::Binding* binding = i->second;
-      LOG_DEBUG("Target = %s", binding->_uri.c_str());
+      const RegStore::AoRView::Binding* binding = *i;
+      LOG_DEBUG("Target = %s", binding->uri.ptr);
       bool useable_contact = true;
       Target target;
       target.from_store = PJ_TRUE;
       target.aor = aor;
-      target.binding_id = i->first;
-      target.uri = PJUtils::uri_from_string(binding->_uri, pool);
+      target.binding_id = PJUtils::pj_str_to_string(&binding->id);
+      target.uri = pjsip_parse_uri(pool, binding->uri.ptr, binding->uri.slen, 0);
       if (target.uri == NULL)
       {
         LOG_WARNING("Ignoring badly formed contact URI %s for target %s",
-                    binding->_uri.c_str(), aor.c_str());
+                    binding->uri.ptr, aor.c_str());
         useable_contact = false;
       }
       else
       {
-        for (std::list<std::string>::const_iterator j = binding->_path_headers.begin();
-             j != binding->_path_headers.end();
-             ++j)
+        for (unsigned j = 0; j < binding->num_path_headers; ++j)
         {
-          pjsip_uri* path = PJUtils::uri_from_string(*j, pool);
+          const pj_str_t* path_str = &binding->path_headers[j];
+          pjsip_uri* path = pjsip_parse_uri(pool, path_str->ptr, path_str->slen, 0);
           if (path != NULL)
           {
             target.paths.push_back(path);
@@ -1954,7 +1980,7 @@ void UASTransaction::proxy_calculate_targets(pjsip_msg* msg,
           else
           {
             LOG_WARNING("Ignoring contact %s for target %s because of badly formed path header %s",
-                        binding->_uri.c_str(), aor.c_str(), (*j).c_str());
+                        binding->uri.ptr, aor.c_str(), path_str->ptr);
             useable_contact = false;
             break;
           }
@@ -1971,8 +1997,6 @@ void UASTransaction::proxy_calculate_targets(pjsip_msg* msg,
     {
       LOG_ERROR("Failed to find any valid bindings for %s in registration store", aor.c_str());
     }
-
-    delete aor_data;
   }
 }
 
@@ -4552,6 +4576,7 @@ void UACTransaction::exit_context()
 
 pj_status_t init_stateful_proxy(RegStore* registrar_store,
                                 RegStore* remote_reg_store,
+                                HedgedRegStoreReader* hedged_reg_store_reader,
                                 CallServices* call_services,
                                 IfcHandler* ifc_handler_in,
                                 pj_bool_t enable_edge_proxy,
@@ -4582,6 +4607,7 @@ pj_status_t init_stateful_proxy(RegStore* registrar_store,
   analytics_logger = analytics;
   store = registrar_store;
   remote_store = remote_reg_store;
+  hedged_reader = hedged_reg_store_reader;
 
   call_services_handler = call_services;
   ifc_handler = ifc_handler_in;
@@ -0,0 +1,129 @@
+/**
+ * @file subscriber_profile_cache.cpp Process-wide cache of subscriber data from the HSS.
+ * the local and remote stores.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "log.h"
+#include "subscriber_profile_cache.h"
+
+/// Names of the parts of the profile used in the statistic names, indexed
+/// by ProfileType.
+static const char* const PROFILE_TYPE_NAMES[] = {"regstate", "ifcs", "uris"};
+
+SubscriberProfileCache::SubscriberProfileCache(int max_entries,
+                                               int ttl_ms,
+                                               LastValueCache* lvc,
+                                               int num_shards) :
+  _ttl_ms((ttl_ms > 0) ? ttl_ms : 0),
+  _cache(max_entries, num_shards),
+  _hits_counters(),
+  _misses_counters()
+{
+  for (int ii = REGSTATE; ii <= ASSOCIATED_URIS; ++ii)
+  {
+    std::string prefix = std::string("hss_cache_") + PROFILE_TYPE_NAMES[ii];
+    _hits_counters.push_back(new StatisticCounter(prefix + "_hits", lvc));
+    _misses_counters.push_back(new StatisticCounter(prefix + "_misses", lvc));
+  }
+}
+
+
+SubscriberProfileCache::~SubscriberProfileCache()
+{
+  for (size_t ii = 0; ii < _hits_counters.size(); ++ii)
+  {
+    delete _hits_counters[ii];
+    delete _misses_counters[ii];
+  }
+}
+
+
+bool SubscriberProfileCache::get(const std::string& public_id,
+                                 ProfileType type,
+                                 std::string& regstate,
+                                 Ifcs& ifcs,
+                                 std::vector<std::string>& associated_uris)
+{
+  // Expired entries are dropped now rather than waiting for them to reach
+  // the end of the LRU list.
+  Profile profile;
+  bool found = _cache.get(public_id, _ttl_ms, true, profile);
+
+  if (found)
+  {
+    regstate.swap(profile.regstate);
+    ifcs = profile.ifcs;
+    associated_uris.swap(profile.associated_uris);
+    _hits_counters[type]->increment();
+  }
+  else
+  {
+    _misses_counters[type]->increment();
+  }
+
+  return found;
+}
+
+
+void SubscriberProfileCache::put(const std::string& public_id,
+                                 const std::string& regstate,
+                                 const Ifcs& ifcs,
+                                 const std::vector<std::string>& associated_uris)
+{
+  Profile profile;
+  profile.regstate = regstate;
+  profile.ifcs = ifcs;
+  profile.associated_uris = associated_uris;
+  _cache.put(public_id, profile);
+}
+
+
+void SubscriberProfileCache::invalidate(const std::string& public_id)
+{
+  // The associated URIs are held in other shards, so collect them and
+  // remove them once the lock on this shard has been released.
+  Profile profile;
+  _cache.remove(public_id, &profile);
+
+  for (std::vector<std::string>::iterator i = profile.associated_uris.begin();
+       i != profile.associated_uris.end();
+       ++i)
+  {
+    if (*i != public_id)
+    {
+      _cache.remove(*i);
+    }
+  }
+}
@@ -56,10 +56,15 @@ extern "C" {
 #include "constants.h"
 #include "sas.h"
 #include "sproutsasevent.h"
+#include "cas_retry.h"
 
 static RegStore* store;
 static RegStore* remote_store;
 
+// Background replicator for writes to the remote store, or NULL if the
+// remote store is written synchronously.
+static RegStoreReplicator* remote_replicator;
+
 // Connection to the HSS service for retrieving associated public URIs.
 static HSSConnection* hss;
 
@@ -68,6 +73,9 @@ static ACRFactory* acr_factory;
 
 static AnalyticsLogger* analytics;
 
+/// Retry policy and statistics for updates to the registration store.
+static CasRetry* cas_retry;
+
 /// Default value for a subscription expiry. RFC3860 has this as 3761 seconds.
 static const int DEFAULT_SUBSCRIPION_EXPIRES = 3761;
 
@@ -129,6 +137,8 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
                                          RegStore::AoR** aor_data,     ///<aor_data to write to
                                          bool update_notify,           ///<whether to generate a SIP NOTIFY
                                          std::string& subscription_id,
+                                         bool& out_retries_exhausted,  ///<[out] gave up retrying the update
+                                         RegStore::AoR** out_original_aor, ///<[out] if not NULL, the AoR as read before the update
                                          SAS::TrailId trail)
 {
   // Parse the headers
@@ -140,7 +150,11 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
 
   // The registration store uses optimistic locking to avoid concurrent
   // updates to the same AoR conflicting.  This means we have to loop
-  // reading, updating and writing the AoR until the write is successful.
+  // reading, updating and writing the AoR until the write is successful,
+  // backing off between attempts and giving up if the AoR is too contended.
+  CasRetry::Update retry(cas_retry);
+  Store::Status set_status = Store::Status::OK;
+  bool all_bindings_expired;
   bool backup_aor_alloced = false;
   int expiry = 0;
   pj_status_t status = PJ_FALSE;
@@ -165,6 +179,14 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
       // LCOV_EXCL_STOP
     }
 
+    if (out_original_aor != NULL)
+    {
+      // Keep a copy of the AoR as read, so the caller can tell what this
+      // update changed.
+      delete *out_original_aor;
+      *out_original_aor = new RegStore::AoR(**aor_data);
+    }
+
     // If we don't have any subscriptions, try the backup AoR and/or store.
     if ((*aor_data)->subscriptions().empty())
     {
@@ -259,6 +281,13 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
 
       if (update_notify)
       {
+        if ((*tdata_notify) != NULL)
+        {
+          // Discard the NOTIFY built on a previous attempt.
+          pjsip_tx_data_dec_ref(*tdata_notify);
+          (*tdata_notify) = NULL;
+        }
+
         status = NotifyUtils::create_notify(tdata_notify, subscription, aor, (*aor_data)->_notify_cseq, bindings,
                            NotifyUtils::FULL, NotifyUtils::ACTIVE, NotifyUtils::ACTIVE, NotifyUtils::REGISTERED);
       }
@@ -270,7 +299,9 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
       }
     }
   }
-  while (!primary_store->set_aor_data(aor, (*aor_data), false, trail));
+  while (((set_status = primary_store->try_set_aor_data(aor, (*aor_data), false, trail, all_bindings_expired)) ==
+           Store::Status::DATA_CONTENTION) &&
+         (retry.retry()));
 
   // If we allocated the backup AoR, tidy up.
   if (backup_aor_alloced)
@@ -278,6 +309,24 @@ pj_status_t write_subscriptions_to_store(RegStore* primary_store,      ///<store
     delete backup_aor;
   }
 
+  if ((retry.exhausted()) ||
+      (((*aor_data) != NULL) && (set_status != Store::Status::OK)))
+  {
+    // Either the AoR is too contended, or the store can't be accessed, in
+    // which case retrying won't help.
+    LOG_ERROR("Failed to update AoR %s after %d retries", aor.c_str(), retry.retries());
+    delete (*aor_data);
+    (*aor_data) = NULL;
+
+    if ((update_notify) && ((*tdata_notify) != NULL))
+    {
+      pjsip_tx_data_dec_ref(*tdata_notify);
+      (*tdata_notify) = NULL;
+    }
+  }
+
+  out_retries_exhausted = retry.exhausted();
+
   return status;
 }
 
@@ -437,10 +486,15 @@ void process_subscription_request(pjsip_rx_data* rdata)
   pjsip_tx_data* tdata_notify = NULL;
   RegStore::AoR* aor_data = NULL;
   std::string subscription_id;
+  bool retries_exhausted = false;
+  RegStore::AoR* original_aor_data = NULL;
   pj_status_t notify_status = write_subscriptions_to_store(store, aor, rdata,
                                                            now, NULL, remote_store,
                                                            &tdata_notify, &aor_data,
                                                            true, subscription_id,
+                                                           retries_exhausted,
+                                                           (remote_replicator != NULL) ?
+                                                             &original_aor_data : NULL,
                                                            trail);
 
   if (aor_data != NULL)
@@ -450,16 +504,31 @@ void process_subscription_request(pjsip_rx_data* rdata)
 
     // If we have a remote store, try to store this there too.  We don't worry
     // about failures in this case.
-    if (remote_store != NULL)
+    if (remote_replicator != NULL)
+    {
+      // Leave the replicator to copy the changes to the remote store in the
+      // background.
+      remote_replicator->replicate(aor, aor_data, original_aor_data, trail);
+    }
+    else if (remote_store != NULL)
     {
       RegStore::AoR* remote_aor_data = NULL;
       std::string ignore;
+      bool ignore_exhausted;
       write_subscriptions_to_store(remote_store, aor, rdata, now, aor_data, NULL,
                                    &tdata_notify, &remote_aor_data, false, ignore,
-                                   trail);
+                                   ignore_exhausted, NULL, trail);
       delete remote_aor_data;
     }
   }
+  else if (retries_exhausted)
+  {
+    // The AoR is being updated too often for this update to get through.
+    // Reject the subscribe with a 503 response.
+    // LCOV_EXCL_START - the store we use for UT never has contention
+    st_code = PJSIP_SC_SERVICE_UNAVAILABLE;
+    // LCOV_EXCL_STOP
+  }
   else
   {
     // Failed to connect to the local store.  Reject the subscribe with a 500
@@ -470,6 +539,8 @@ void process_subscription_request(pjsip_rx_data* rdata)
     // LCOV_EXCL_STOP
   }
 
+  delete original_aor_data;
+
   // Build and send the reply.
   pjsip_tx_data* tdata;
   status = PJUtils::create_response(stack_data.endpt, rdata, st_code, NULL, &tdata);
@@ -497,6 +568,15 @@ void process_subscription_request(pjsip_rx_data* rdata)
     // LCOV_EXCL_STOP
   }
 
+  if (st_code == PJSIP_SC_SERVICE_UNAVAILABLE)
+  {
+    // LCOV_EXCL_START
+    pjsip_retry_after_hdr* retry_after =
+      pjsip_retry_after_hdr_create(tdata->pool, cas_retry->retry_after_secs());
+    pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)retry_after);
+    // LCOV_EXCL_STOP
+  }
+
   // Add expires headers
   pjsip_expires_hdr* expires_hdr = pjsip_expires_hdr_create(tdata->pool, expiry);
   pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)expires_hdr);
@@ -615,17 +695,25 @@ pj_bool_t subscription_on_rx_request(pjsip_rx_data *rdata)
 
 pj_status_t init_subscription(RegStore* registrar_store,
                               RegStore* remote_reg_store,
+                              RegStoreReplicator* remote_reg_store_replicator,
                               HSSConnection* hss_connection,
                               ACRFactory* rfacr_factory,
-                              AnalyticsLogger* analytics_logger)
+                              AnalyticsLogger* analytics_logger,
+                              int cfg_cas_max_retries,
+                              int cfg_cas_max_backoff_ms)
 {
   pj_status_t status;
 
   store = registrar_store;
   remote_store = remote_reg_store;
+  remote_replicator = remote_reg_store_replicator;
   hss = hss_connection;
   acr_factory = rfacr_factory;
   analytics = analytics_logger;
+  cas_retry = new CasRetry("subscription",
+                           stack_data.stats_aggregator,
+                           cfg_cas_max_retries,
+                           cfg_cas_max_backoff_ms);
 
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_subscription);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
@@ -636,4 +724,6 @@ pj_status_t init_subscription(RegStore* registrar_store,
 void destroy_subscription()
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_subscription);
+  delete cas_retry;
+  cas_retry = NULL;
 }
@@ -0,0 +1,185 @@
+/**
+ * @file timer_wheel.cpp Hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(uint64_t tick_ms, uint64_t now_ms) :
+  _tick_ms((tick_ms > 0) ? tick_ms : 1),
+  _current_tick(now_ms / _tick_ms),
+  _entries()
+{
+}
+
+
+TimerWheel::~TimerWheel()
+{
+  for (std::map<std::string, Entry*>::iterator i = _entries.begin();
+       i != _entries.end();
+       ++i)
+  {
+    delete i->second;
+  }
+}
+
+
+void TimerWheel::set(const std::string& id,
+                     uint64_t due_ms,
+                     const std::string& callback_uri,
+                     const std::string& opaque)
+{
+  Entry* entry;
+  std::map<std::string, Entry*>::iterator i = _entries.find(id);
+  if (i != _entries.end())
+  {
+    entry = i->second;
+    unlink(entry);
+  }
+  else
+  {
+    entry = new Entry();
+    entry->timer.id = id;
+    _entries[id] = entry;
+  }
+
+  entry->timer.callback_uri = callback_uri;
+  entry->timer.opaque = opaque;
+  entry->timer.due_ms = due_ms;
+  entry->due_tick = (due_ms + _tick_ms - 1) / _tick_ms;
+
+  insert(entry, _current_tick + 1);
+}
+
+
+bool TimerWheel::remove(const std::string& id)
+{
+  std::map<std::string, Entry*>::iterator i = _entries.find(id);
+  if (i == _entries.end())
+  {
+    return false;
+  }
+
+  unlink(i->second);
+  delete i->second;
+  _entries.erase(i);
+  return true;
+}
+
+
+void TimerWheel::tick(uint64_t now_ms, std::vector<Timer>& pops)
+{
+  uint64_t now_tick = now_ms / _tick_ms;
+
+  while (_current_tick < now_tick)
+  {
+    if (_entries.empty())
+    {
+      // Nothing to pop, so skip straight to the current tick.
+      _current_tick = now_tick;
+      break;
+    }
+    process_tick(_current_tick + 1, pops);
+    _current_tick++;
+  }
+}
+
+
+/// Put a timer on the wheel whose slots span its due time, measured from
+/// the first tick that hasn't been processed.
+void TimerWheel::insert(Entry* entry, uint64_t base_tick)
+{
+  if (entry->due_tick < base_tick)
+  {
+    entry->due_tick = base_tick;
+  }
+
+  uint64_t delta = entry->due_tick - base_tick;
+  const uint64_t max_delta = (1ull << (LEVELS * SLOT_BITS)) - 1;
+  if (delta > max_delta)
+  {
+    entry->due_tick = base_tick + max_delta;
+    delta = max_delta;
+  }
+
+  int level = 0;
+  while ((level < LEVELS - 1) &&
+         (delta >= (1ull << ((level + 1) * SLOT_BITS))))
+  {
+    level++;
+  }
+
+  entry->level = level;
+  entry->slot = (entry->due_tick >> (level * SLOT_BITS)) & (SLOTS - 1);
+  Slot& slot = _wheels[level][entry->slot];
+  entry->pos = slot.insert(slot.end(), entry);
+}
+
+
+void TimerWheel::unlink(Entry* entry)
+{
+  _wheels[entry->level][entry->slot].erase(entry->pos);
+}
+
+
+void TimerWheel::process_tick(uint64_t tick, std::vector<Timer>& pops)
+{
+  // Move timers down from the wheels whose slots start at this tick,
+  // starting with the highest, so a timer can cascade more than one level.
+  for (int level = LEVELS - 1; level > 0; --level)
+  {
+    uint64_t mask = (1ull << (level * SLOT_BITS)) - 1;
+    if ((tick & mask) != 0)
+    {
+      continue;
+    }
+
+    Slot cascade;
+    cascade.swap(_wheels[level][(tick >> (level * SLOT_BITS)) & (SLOTS - 1)]);
+    for (Slot::iterator i = cascade.begin(); i != cascade.end(); ++i)
+    {
+      insert(*i, tick);
+    }
+  }
+
+  Slot& slot = _wheels[0][tick & (SLOTS - 1)];
+  while (!slot.empty())
+  {
+    Entry* entry = slot.front();
+    slot.pop_front();
+    pops.push_back(entry->timer);
+    _entries.erase(entry->timer.id);
+    delete entry;
+  }
+}
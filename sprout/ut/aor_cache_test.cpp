@@ -0,0 +1,144 @@
+/**
+ * @file aor_cache_test.cpp UT for the AoR read cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "aor_cache.h"
+
+using namespace std;
+
+/// Fixture for AoRCacheTest.
+class AoRCacheTest : public BaseTest
+{
+  AoRCacheTest()
+  {
+  }
+
+  virtual ~AoRCacheTest()
+  {
+  }
+};
+
+TEST_F(AoRCacheTest, ServesWithinStalenessWindow)
+{
+  AoRCache cache("aor_cache", 100, 1000, stack_data.stats_aggregator);
+  EXPECT_EQ(1000, cache.staleness_ms());
+
+  std::string data;
+  uint64_t cas = 0;
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", data, cas));
+
+  cache.put_read("sip:6505550001@homedomain", "record1", 7);
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  EXPECT_EQ("record1", data);
+  EXPECT_EQ(7u, cas);
+  EXPECT_FALSE(cache.get("sip:6505550002@homedomain", data, cas));
+
+  // Once the staleness window has passed the record must be read from the
+  // store again.
+  cwtest_advance_time_ms(1001);
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", data, cas));
+
+  // Reading it again (whether or not it has changed) refreshes it.
+  cache.put_read("sip:6505550001@homedomain", "record1", 7);
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  cache.put_read("sip:6505550001@homedomain", "record2", 8);
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  EXPECT_EQ("record2", data);
+  EXPECT_EQ(8u, cas);
+  EXPECT_EQ(1, cache.size());
+}
+
+TEST_F(AoRCacheTest, WritesUpdateCache)
+{
+  AoRCache cache("aor_cache", 100, 1000, stack_data.stats_aggregator);
+
+  std::string data;
+  uint64_t cas = 0;
+  cache.put_read("sip:6505550001@homedomain", "record1", 7);
+  cache.put_write("sip:6505550001@homedomain", "record2");
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  EXPECT_EQ("record2", data);
+  EXPECT_EQ(AoRCache::UNKNOWN_CAS, cas);
+
+  // A read following a write records the CAS.
+  cache.put_read("sip:6505550001@homedomain", "record2", 9);
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  EXPECT_EQ(9u, cas);
+
+  cache.invalidate("sip:6505550001@homedomain");
+  cache.invalidate("sip:6505550002@homedomain");
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", data, cas));
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(AoRCacheTest, EvictsLeastRecentlyUsed)
+{
+  // A single shard holding two records.
+  AoRCache cache("aor_cache", 2, 1000, stack_data.stats_aggregator, 1);
+
+  std::string data;
+  uint64_t cas = 0;
+  cache.put_read("sip:6505550001@homedomain", "record1", 1);
+  cache.put_read("sip:6505550002@homedomain", "record2", 2);
+
+  // Use the first record, so the second is the least recently used.
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  cache.put_write("sip:6505550003@homedomain", "record3");
+  EXPECT_EQ(2, cache.size());
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", data, cas));
+  EXPECT_FALSE(cache.get("sip:6505550002@homedomain", data, cas));
+  EXPECT_TRUE(cache.get("sip:6505550003@homedomain", data, cas));
+}
+
+TEST_F(AoRCacheTest, InvalidParameters)
+{
+  // A zero staleness window means records are never served from the cache.
+  AoRCache cache("aor_cache", 0, -1, stack_data.stats_aggregator, 0);
+  EXPECT_EQ(0, cache.staleness_ms());
+
+  std::string data;
+  uint64_t cas = 0;
+  cache.put_read("sip:6505550001@homedomain", "record1", 1);
+  EXPECT_EQ(1, cache.size());
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", data, cas));
+}
@@ -0,0 +1,133 @@
+/**
+ * @file cas_retry_test.cpp UT for the CAS retry policy.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "cas_retry.h"
+
+using namespace std;
+
+/// Fixture for CasRetryTest.
+class CasRetryTest : public BaseTest
+{
+  CasRetryTest()
+  {
+  }
+
+  virtual ~CasRetryTest()
+  {
+  }
+};
+
+TEST_F(CasRetryTest, BackoffDoublesUpToMaximum)
+{
+  CasRetry cas_retry("registrar", stack_data.stats_aggregator, 10, 5);
+  EXPECT_EQ(1000, cas_retry.backoff_limit_us(1));
+  EXPECT_EQ(2000, cas_retry.backoff_limit_us(2));
+  EXPECT_EQ(4000, cas_retry.backoff_limit_us(3));
+  EXPECT_EQ(5000, cas_retry.backoff_limit_us(4));
+  EXPECT_EQ(5000, cas_retry.backoff_limit_us(100));
+
+  // With no maximum backoff, retries are immediate.
+  CasRetry no_backoff("registrar", stack_data.stats_aggregator, 10, 0);
+  EXPECT_EQ(0, no_backoff.backoff_limit_us(1));
+}
+
+TEST_F(CasRetryTest, RetryAfter)
+{
+  // The defaults back off for under a second in total.
+  CasRetry cas_retry("registrar", stack_data.stats_aggregator, 10, 100);
+  EXPECT_EQ(1, cas_retry.retry_after_secs());
+
+  // Retry-After is never zero, even if retries don't back off at all.
+  CasRetry no_backoff("registrar", stack_data.stats_aggregator, 10, 0);
+  EXPECT_EQ(1, no_backoff.retry_after_secs());
+
+  // Longer backoffs are rounded up to whole seconds.
+  CasRetry long_backoff("registrar", stack_data.stats_aggregator, 20, 1000);
+  EXPECT_EQ(12, long_backoff.retry_after_secs());
+}
+
+TEST_F(CasRetryTest, GivesUpAfterMaxRetries)
+{
+  CasRetry cas_retry("registrar", stack_data.stats_aggregator, 3, 0);
+  EXPECT_EQ(3, cas_retry.max_retries());
+
+  {
+    CasRetry::Update update(&cas_retry);
+    EXPECT_TRUE(update.retry());
+    EXPECT_TRUE(update.retry());
+    EXPECT_TRUE(update.retry());
+    EXPECT_EQ(3, update.retries());
+    EXPECT_FALSE(update.exhausted());
+
+    EXPECT_FALSE(update.retry());
+    EXPECT_TRUE(update.exhausted());
+    EXPECT_EQ(3, update.retries());
+  }
+
+  // Updates record their retry counts when they complete.
+  {
+    CasRetry::Update update(&cas_retry);
+  }
+  EXPECT_EQ(2u, cas_retry._retries_histogram._current.count());
+}
+
+TEST_F(CasRetryTest, NoRetries)
+{
+  CasRetry cas_retry("subscription", stack_data.stats_aggregator, 0, 100);
+  CasRetry::Update update(&cas_retry);
+  EXPECT_FALSE(update.retry());
+  EXPECT_TRUE(update.exhausted());
+  EXPECT_EQ(0, update.retries());
+}
+
+TEST_F(CasRetryTest, RetryWaits)
+{
+  // The wait is random, but never more than the limit.
+  CasRetry cas_retry("subscription", stack_data.stats_aggregator, 5, 1);
+  CasRetry::Update update(&cas_retry);
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    EXPECT_TRUE(update.retry());
+  }
+  EXPECT_FALSE(update.retry());
+}
@@ -0,0 +1,280 @@
+/**
+ * @file dispatch_queue_test.cpp UT for the worker thread dispatch queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "dispatch_queue.h"
+
+using namespace std;
+
+/// Fixture for DispatchQueueTest.
+class DispatchQueueTest : public ::testing::Test
+{
+  DispatchQueueTest()
+  {
+  }
+
+  virtual ~DispatchQueueTest()
+  {
+  }
+};
+
+/// Thread that pops a single item from shard 0 of a queue.
+static void* pop_thread(void* p)
+{
+  DispatchQueue<int>* q = (DispatchQueue<int>*)p;
+  int item = 0;
+  bool popped = q->pop(0, item);
+  return popped ? (void*)(long)item : (void*)-1L;
+}
+
+TEST_F(DispatchQueueTest, SingleShardIsFifo)
+{
+  DispatchQueue<int> q;
+  EXPECT_EQ(1u, q.num_shards());
+
+  q.push(0, 0, 1);
+  q.push(7, 0, 2);
+  q.push(3, 0, 3);
+  EXPECT_EQ(3, q.size());
+
+  int item;
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(1, item);
+  EXPECT_TRUE(q.pop(5, item));
+  EXPECT_EQ(2, item);
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(3, item);
+  EXPECT_EQ(0, q.size());
+}
+
+TEST_F(DispatchQueueTest, ItemsStayOnTheirShard)
+{
+  DispatchQueue<int> q(4, false);
+  EXPECT_EQ(4u, q.num_shards());
+
+  // Shard indices are reduced modulo the number of shards.
+  q.push(1, 0, 10);
+  q.push(5, 0, 11);
+  q.push(2, 0, 20);
+  EXPECT_EQ(2, q.shard_size(1));
+  EXPECT_EQ(1, q.shard_size(2));
+  EXPECT_EQ(0, q.shard_size(0));
+  EXPECT_EQ(3, q.size());
+
+  int item;
+  EXPECT_TRUE(q.pop(2, item));
+  EXPECT_EQ(20, item);
+  EXPECT_TRUE(q.pop(1, item));
+  EXPECT_EQ(10, item);
+  EXPECT_TRUE(q.pop(1, item));
+  EXPECT_EQ(11, item);
+  EXPECT_EQ(0, q.size());
+}
+
+TEST_F(DispatchQueueTest, IdleConsumerStealsWork)
+{
+  DispatchQueue<int> q(2, true);
+
+  // Nobody is servicing shard 1, so the consumer of shard 0 takes the
+  // oldest item from it.
+  q.push(1, 0, 100);
+  q.push(1, 0, 101);
+
+  int item;
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(100, item);
+  EXPECT_EQ(1, q.shard_size(1));
+  EXPECT_EQ(1, q.size());
+
+  // The consumer's own work is always taken first.
+  q.push(0, 0, 1);
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(1, item);
+}
+
+TEST_F(DispatchQueueTest, PopWaitsForPush)
+{
+  DispatchQueue<int> q(2, true);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &pop_thread, &q);
+  q.push(0, 0, 42);
+
+  void* rc;
+  pthread_join(thread, &rc);
+  EXPECT_EQ(42L, (long)rc);
+}
+
+TEST_F(DispatchQueueTest, TerminateWakesConsumers)
+{
+  DispatchQueue<int> q(1, false);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &pop_thread, &q);
+  q.terminate();
+
+  void* rc;
+  pthread_join(thread, &rc);
+  EXPECT_EQ(-1L, (long)rc);
+
+  int item;
+  q.push(0, 0, 1);
+  EXPECT_FALSE(q.pop(0, item));
+}
+
+TEST_F(DispatchQueueTest, BoundedQueue)
+{
+  DispatchQueue<int> q(2, false, 2);
+  EXPECT_EQ(2, q.max_size());
+
+  EXPECT_TRUE(q.push_noblock(0, 0, 1));
+  EXPECT_FALSE(q.full());
+  EXPECT_TRUE(q.push_noblock(1, 0, 2));
+  EXPECT_TRUE(q.full());
+
+  // The queue is full, so non-blocking pushes fail and blocking pushes time
+  // out.
+  EXPECT_FALSE(q.push_noblock(0, 0, 3));
+  EXPECT_FALSE(q.push(0, 0, 3, 10));
+  EXPECT_EQ(2, q.size());
+
+  // The maximum is a soft limit, so an unconditional push still succeeds.
+  q.push(0, 0, 4);
+  EXPECT_EQ(3, q.size());
+
+  // Drain the queue down and check there is space again.
+  int item;
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_FALSE(q.full());
+  EXPECT_TRUE(q.push(1, 0, 5, 10));
+}
+
+/// Thread that pushes an item to a full queue, waiting for space.
+static void* push_thread(void* p)
+{
+  DispatchQueue<int>* q = (DispatchQueue<int>*)p;
+  return q->push(0, 0, 2, 5000) ? (void*)1L : (void*)0L;
+}
+
+TEST_F(DispatchQueueTest, PushWaitsForSpace)
+{
+  DispatchQueue<int> q(1, false, 1);
+  q.push(0, 0, 1);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &push_thread, &q);
+
+  int item;
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(1, item);
+
+  void* rc;
+  pthread_join(thread, &rc);
+  EXPECT_EQ(1L, (long)rc);
+  EXPECT_TRUE(q.pop(0, item));
+  EXPECT_EQ(2, item);
+}
+
+TEST_F(DispatchQueueTest, StrictPriorityLanes)
+{
+  DispatchQueue<int> q(1, false, 0, 3);
+  EXPECT_EQ(3u, q.num_lanes());
+  EXPECT_FALSE(q.weighted());
+
+  // Lanes beyond the last are treated as the last lane.
+  q.push(0, 2, 20);
+  q.push(0, 5, 21);
+  q.push(0, 1, 10);
+  q.push(0, 0, 1);
+  q.push(0, 1, 11);
+  EXPECT_EQ(1, q.lane_size(0));
+  EXPECT_EQ(2, q.lane_size(1));
+  EXPECT_EQ(2, q.lane_size(2));
+  EXPECT_EQ(5, q.shard_size(0));
+
+  int expected[] = {1, 10, 11, 20, 21};
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    int item;
+    EXPECT_TRUE(q.pop(0, item));
+    EXPECT_EQ(expected[ii], item);
+  }
+  EXPECT_EQ(0, q.lane_size(0));
+  EXPECT_EQ(0, q.lane_size(2));
+}
+
+TEST_F(DispatchQueueTest, WeightedLanes)
+{
+  std::vector<int> weights;
+  weights.push_back(2);
+  weights.push_back(1);
+  DispatchQueue<int> q(1, false, 0, 2, weights);
+  EXPECT_TRUE(q.weighted());
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    q.push(0, 0, ii);
+    q.push(0, 1, 100 + ii);
+  }
+
+  // Two items from lane 0 for every one from lane 1, until lane 0 runs out.
+  int expected[] = {0, 1, 100, 2, 3, 101, 102, 103};
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    int item;
+    EXPECT_TRUE(q.pop(0, item));
+    EXPECT_EQ(expected[ii], item);
+  }
+}
+
+TEST_F(DispatchQueueTest, InvalidWeightsAreStrict)
+{
+  std::vector<int> weights;
+  weights.push_back(1);
+  weights.push_back(0);
+  DispatchQueue<int> q(1, false, 0, 2, weights);
+  EXPECT_FALSE(q.weighted());
+
+  weights.pop_back();
+  DispatchQueue<int> q2(1, false, 0, 2, weights);
+  EXPECT_FALSE(q2.weighted());
+}
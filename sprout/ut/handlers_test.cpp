@@ -49,6 +49,30 @@
 
 using namespace std;
 
+/// Local store whose writes fail once _fail_writes is set, as if the store
+/// couldn't be reached.
+class FailingLocalStore : public LocalStore
+{
+public:
+  FailingLocalStore() : LocalStore(), _fail_writes(false) {}
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail = 0)
+  {
+    if (_fail_writes)
+    {
+      return Store::Status::ERROR;
+    }
+    return LocalStore::set_data(table, key, data, cas, expiry, trail);
+  }
+
+  bool _fail_writes;
+};
+
 class RegistrationTimeoutHandlersTest : public BaseTest
 {
   FakeChronosConnection* chronos_connection;
@@ -144,6 +168,139 @@ TEST_F(RegistrationTimeoutHandlersTest, MissingBindingJSONTest)
   ASSERT_EQ(status, 400);
 }
 
+TEST_F(RegistrationTimeoutHandlersTest, BatchTest)
+{
+  // Add two AoRs, the first with two bindings, all of which expire.
+  int now = time(NULL);
+  std::string aor_ids[] = {"sip:6505550231@homedomain", "sip:6505550232@homedomain"};
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    RegStore::AoR* aor_data = store->get_aor_data(aor_ids[ii], 0);
+
+    for (int jj = 0; jj < 2 - ii; ++jj)
+    {
+      RegStore::AoR::Binding* b = aor_data->get_binding(std::to_string(jj));
+      b->_uri = std::string("<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>");
+      b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+      b->_cseq = 17038;
+      b->_expires = now + 5;
+      b->_priority = 0;
+      b->_emergency_registration = false;
+      b->_private_id = "6505550231";
+    }
+
+    store->set_aor_data(aor_ids[ii], aor_data, false, 0);
+    delete aor_data; aor_data = NULL;
+  }
+
+  cwtest_advance_time_ms(6000);
+
+  // The timers for the first AoR are merged, so each AoR is only updated
+  // once.
+  std::string body = "{\"timers\": ["
+                     "{\"aor_id\": \"sip:6505550231@homedomain\", \"binding_id\": \"0\"}, "
+                     "{\"aor_id\": \"sip:6505550232@homedomain\", \"binding_id\": \"0\"}, "
+                     "{\"aor_id\": \"sip:6505550231@homedomain\", \"binding_id\": \"1\"}]}";
+  int status = handler->parse_response(body);
+  ASSERT_EQ(status, 200);
+  ASSERT_EQ(2u, handler->_aor_ids.size());
+  EXPECT_EQ(aor_ids[0], handler->_aor_ids[0]);
+  EXPECT_EQ(aor_ids[1], handler->_aor_ids[1]);
+
+  handler->handle_response();
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    RegStore::AoR* aor_data = store->get_aor_data(aor_ids[ii], 0);
+    EXPECT_EQ(0u, aor_data->bindings().size());
+    delete aor_data; aor_data = NULL;
+  }
+}
+
+TEST_F(RegistrationTimeoutHandlersTest, StoreErrorTest)
+{
+  FailingLocalStore* failing_data_store = new FailingLocalStore();
+  RegStore* failing_store = new RegStore(failing_data_store, chronos_connection);
+  RegistrationTimeoutHandler::Config failing_config(failing_store, failing_store, fake_hss);
+  RegistrationTimeoutHandler* failing_handler = new RegistrationTimeoutHandler(*req, &failing_config, 0);
+
+  int now = time(NULL);
+  RegStore::AoR* aor_data = failing_store->get_aor_data("sip:6505550231@homedomain", 0);
+  RegStore::AoR::Binding* b = aor_data->get_binding("0");
+  b->_uri = std::string("<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>");
+  b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b->_cseq = 17038;
+  b->_expires = now + 5;
+  b->_priority = 0;
+  b->_emergency_registration = false;
+  b->_private_id = "6505550231";
+  failing_store->set_aor_data("sip:6505550231@homedomain", aor_data, false, 0);
+  delete aor_data; aor_data = NULL;
+
+  cwtest_advance_time_ms(6000);
+
+  // A store error isn't retried - the update is abandoned and the binding
+  // is left in the store.
+  failing_data_store->_fail_writes = true;
+  std::string body = "{\"aor_id\": \"sip:6505550231@homedomain\", \"binding_id\": \"0\"}";
+  ASSERT_EQ(200, failing_handler->parse_response(body));
+  failing_handler->handle_response();
+
+  std::string data;
+  uint64_t cas;
+  EXPECT_EQ(Store::Status::OK, failing_data_store->get_data("reg", "sip:6505550231@homedomain", data, cas, 0));
+  EXPECT_NE("", data);
+
+  delete failing_handler; failing_handler = NULL;
+  delete failing_store; failing_store = NULL;
+  delete failing_data_store; failing_data_store = NULL;
+}
+
+TEST_F(RegistrationTimeoutHandlersTest, InvalidBatchTest)
+{
+  // The timers must be an array, and every timer in it must be valid.
+  EXPECT_EQ(400, handler->parse_response("{\"timers\": {}}"));
+  EXPECT_EQ(400, handler->parse_response("{\"timers\": [{\"aor_id\": \"aor_id\", \"binding_id\": \"binding_id\"}, {\"aor_id\": \"aor_id\"}]}"));
+  EXPECT_EQ(0u, handler->_aor_ids.size());
+
+  // An empty batch is accepted.
+  EXPECT_EQ(200, handler->parse_response("{\"timers\": []}"));
+  EXPECT_EQ(0u, handler->_aor_ids.size());
+}
+
+TEST_F(RegistrationTimeoutHandlersTest, LocalTimerPopTest)
+{
+  // Add an AoR record with a binding that is about to expire.
+  int now = time(NULL);
+  RegStore::AoR* aor_data1 = store->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+  RegStore::AoR::Binding* b1 = aor_data1->get_binding(std::string("<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1"));
+  b1->_uri = std::string("<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>");
+  b1->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b1->_cseq = 17038;
+  b1->_expires = now + 5;
+  b1->_priority = 0;
+  b1->_emergency_registration = false;
+  b1->_private_id = "6505550231";
+  store->set_aor_data(std::string("sip:6505550231@homedomain"), aor_data1, true, 0);
+  delete aor_data1; aor_data1 = NULL;
+
+  cwtest_advance_time_ms(6000);
+
+  // Pop the timer through the callback used for local timers, and check the
+  // binding has been removed.
+  LocalTimerCallback<RegistrationTimeoutHandler, RegistrationTimeoutHandler::Config> callback(*chronos_config);
+  std::string body = "{\"aor_id\": \"sip:6505550231@homedomain\", \"binding_id\": \"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1\"}";
+  callback.timer_pop(body, 0);
+
+  aor_data1 = store->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+  EXPECT_EQ(0u, aor_data1->bindings().size());
+  delete aor_data1; aor_data1 = NULL;
+
+  // Timer pops with invalid opaque data are rejected.
+  EXPECT_EQ(400, RegistrationTimeoutHandler::handle_timer_pop(chronos_config, "{\"aor_id\": \"aor_id\"}", 0));
+}
+
 class DeregistrationHandlerTest : public BaseTest
 {
   FakeChronosConnection* chronos_connection;
@@ -244,6 +401,120 @@ TEST_F(DeregistrationHandlerTest, AoRsOnlyTest)
   handler->handle_request();
 }
 
+TEST_F(DeregistrationHandlerTest, MultipleAoRsTest)
+{
+  // Add two AoRs, each with bindings for two private IDs.
+  int now = time(NULL);
+  std::string aor_ids[] = {"sip:6505550231@homedomain", "sip:6505550232@homedomain"};
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    RegStore::AoR* aor_data = store->get_aor_data(aor_ids[ii], 0);
+
+    for (int jj = 0; jj < 2; ++jj)
+    {
+      RegStore::AoR::Binding* b = aor_data->get_binding(std::to_string(jj));
+      b->_uri = std::string("<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>");
+      b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+      b->_cseq = 17038;
+      b->_expires = now + 300;
+      b->_priority = 0;
+      b->_emergency_registration = false;
+      b->_private_id = "650555023" + std::to_string(jj);
+    }
+
+    store->set_aor_data(aor_ids[ii], aor_data, false, 0);
+    delete aor_data; aor_data = NULL;
+  }
+
+  // Deregister one private ID from the first AoR, and all of the second.
+  std::string body = "{\"registrations\": [{\"primary-impu\": \"sip:6505550231@homedomain\", \"impi\": \"6505550230\"}, {\"primary-impu\": \"sip:6505550232@homedomain\"}]}";
+  int status = handler->parse_request(body);
+  ASSERT_EQ(status, 200);
+
+  handler->_notify = "false";
+  ASSERT_EQ(200, handler->handle_request());
+
+  RegStore::AoR* aor_data = store->get_aor_data(aor_ids[0], 0);
+  ASSERT_EQ(1u, aor_data->bindings().size());
+  EXPECT_EQ("6505550231", aor_data->bindings().begin()->second->_private_id);
+  delete aor_data; aor_data = NULL;
+
+  aor_data = store->get_aor_data(aor_ids[1], 0);
+  EXPECT_EQ(0u, aor_data->bindings().size());
+  delete aor_data; aor_data = NULL;
+}
+
+TEST_F(DeregistrationHandlerTest, WorkerPoolTest)
+{
+  // Add enough AoRs that they are split into several batches on each of the
+  // pool's threads.
+  int now = time(NULL);
+  int num_aors = 3 * DeregistrationHandler::BATCH_SIZE;
+  std::string body = "{\"registrations\": [";
+
+  for (int ii = 0; ii < num_aors; ++ii)
+  {
+    std::string aor_id = "sip:" + std::to_string(6505550000 + ii) + "@homedomain";
+    RegStore::AoR* aor_data = store->get_aor_data(aor_id, 0);
+    RegStore::AoR::Binding* b = aor_data->get_binding("binding");
+    b->_uri = std::string("<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>");
+    b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+    b->_cseq = 17038;
+    b->_expires = now + 300;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+    b->_private_id = "6505550000";
+    store->set_aor_data(aor_id, aor_data, false, 0);
+    delete aor_data; aor_data = NULL;
+
+    body += (ii > 0) ? ", " : "";
+    body += "{\"primary-impu\": \"" + aor_id + "\", \"impi\": \"6505550000\"}";
+  }
+  body += "]}";
+
+  ShardedWorkerPool pool("dereg-test", 2, 4);
+  pool.start();
+  DeregistrationHandler::Config pool_config(store, store, fake_hss, NULL, &pool);
+  DeregistrationHandler* pool_handler = new DeregistrationHandler(*req, &pool_config, 0);
+
+  int status = pool_handler->parse_request(body);
+  ASSERT_EQ(status, 200);
+
+  pool_handler->_notify = "false";
+  EXPECT_EQ(200, pool_handler->handle_request());
+  EXPECT_EQ((size_t)num_aors, pool_handler->_done_aors);
+  delete pool_handler; pool_handler = NULL;
+
+  for (int ii = 0; ii < num_aors; ++ii)
+  {
+    std::string aor_id = "sip:" + std::to_string(6505550000 + ii) + "@homedomain";
+    RegStore::AoR* aor_data = store->get_aor_data(aor_id, 0);
+    EXPECT_EQ(0u, aor_data->bindings().size());
+    delete aor_data; aor_data = NULL;
+  }
+}
+
+TEST_F(DeregistrationHandlerTest, StoreErrorTest)
+{
+  FailingLocalStore* failing_data_store = new FailingLocalStore();
+  failing_data_store->_fail_writes = true;
+  RegStore* failing_store = new RegStore(failing_data_store, chronos_connection);
+  DeregistrationHandler::Config failing_config(failing_store, failing_store, fake_hss, NULL);
+  DeregistrationHandler* failing_handler = new DeregistrationHandler(*req, &failing_config, 0);
+
+  // The AoRs can't be written, so the request fails rather than retrying
+  // them forever.
+  std::string body = "{\"registrations\": [{\"primary-impu\": \"sip:6505552001@homedomain\"}, {\"primary-impu\": \"sip:6505552002@homedomain\"}]}";
+  ASSERT_EQ(200, failing_handler->parse_request(body));
+  failing_handler->_notify = "false";
+  EXPECT_EQ(500, failing_handler->handle_request());
+
+  delete failing_handler; failing_handler = NULL;
+  delete failing_store; failing_store = NULL;
+  delete failing_data_store; failing_data_store = NULL;
+}
+
 TEST_F(DeregistrationHandlerTest, InvalidJSONTest)
 {
   std::string body = "{[}";
@@ -319,6 +590,18 @@ TEST_F(AuthTimeoutTest, NonceTimedOut)
   ASSERT_EQ(NULL, store->get_av("6505550231@homedomain", "abcdef", 0));
 }
 
+TEST_F(AuthTimeoutTest, LocalTimerPop)
+{
+  fake_hss->set_impu_result("sip:6505550231@homedomain", "dereg-auth-timeout", HSSConnection::STATE_REGISTERED, "", "?private_id=6505550231%40homedomain");
+  std::string body = "{\"impu\": \"sip:6505550231@homedomain\", \"impi\": \"6505550231@homedomain\", \"nonce\": \"abcdef\"}";
+  Json::Value json("{}");
+  store->set_av("6505550231@homedomain", "abcdef", &json, 0);
+  int status = AuthTimeoutHandler::handle_timer_pop(chronos_config, body, 0);
+
+  ASSERT_EQ(status, 200);
+  ASSERT_EQ(NULL, store->get_av("6505550231@homedomain", "abcdef", 0));
+}
+
 TEST_F(AuthTimeoutTest, MainlineTest)
 {
   std::string body = "{\"impu\": \"sip:test@example.com\", \"impi\": \"test@example.com\", \"nonce\": \"abcdef\"}";
@@ -0,0 +1,201 @@
+/**
+ * @file hedged_reg_store_reader_test.cpp UT for hedged registration store reads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+
+#include <string>
+#include <time.h>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "localstore.h"
+#include "regstore.h"
+#include "hedged_reg_store_reader.h"
+#include "fakechronosconnection.hpp"
+
+using namespace std;
+
+/// Local store whose reads take a while to return.
+class SlowLocalStore : public LocalStore
+{
+public:
+  SlowLocalStore(int delay_ms) : LocalStore(), _delay_ms(delay_ms) {}
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail = 0)
+  {
+    struct timespec delay;
+    delay.tv_sec = _delay_ms / 1000;
+    delay.tv_nsec = (_delay_ms % 1000) * 1000000;
+    nanosleep(&delay, NULL);
+    return LocalStore::get_data(table, key, data, cas, trail);
+  }
+
+private:
+  int _delay_ms;
+};
+
+/// Fixture for HedgedRegStoreReaderTest.
+class HedgedRegStoreReaderTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  HedgedRegStoreReaderTest()
+  {
+    _chronos_connection = new FakeChronosConnection();
+    _local_data_store = new SlowLocalStore(0);
+    _local_store = new RegStore(_local_data_store, _chronos_connection);
+    _remote_data_store = new LocalStore();
+    _remote_store = new RegStore(_remote_data_store, _chronos_connection);
+    _pool = pj_pool_create(&stack_data.cp.factory, "hedged-read-test", 1024, 1024, NULL);
+  }
+
+  virtual ~HedgedRegStoreReaderTest()
+  {
+    pj_pool_release(_pool); _pool = NULL;
+    delete _remote_store; _remote_store = NULL;
+    delete _remote_data_store; _remote_data_store = NULL;
+    delete _local_store; _local_store = NULL;
+    delete _local_data_store; _local_data_store = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Write an AoR with a single binding with the specified contact URI.
+  void add_binding(RegStore* store, const std::string& aor_id, const std::string& uri)
+  {
+    RegStore::AoR* aor_data = store->get_aor_data(aor_id, 0);
+    RegStore::AoR::Binding* b = aor_data->get_binding("binding");
+    b->_uri = uri;
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038;
+    b->_expires = time(NULL) + 300;
+    b->_priority = 0;
+    b->_path_headers.push_back("<sip:abcdefgh@bono1.homedomain;lr>");
+    b->_params.push_back(std::make_pair("+sip.instance", "\"<urn:uuid:00000000-0000-0000-0000-b665231f1213>\""));
+    b->_emergency_registration = false;
+    EXPECT_TRUE(store->set_aor_data(aor_id, aor_data, false, 0));
+    delete aor_data;
+  }
+
+  ChronosConnection* _chronos_connection;
+  SlowLocalStore* _local_data_store;
+  RegStore* _local_store;
+  LocalStore* _remote_data_store;
+  RegStore* _remote_store;
+  pj_pool_t* _pool;
+};
+
+TEST_F(HedgedRegStoreReaderTest, LocalBindings)
+{
+  HedgedRegStoreReader reader(_local_store, _remote_store, 2, 99.0, stack_data.stats_aggregator);
+  reader.start();
+  add_binding(_local_store, "sip:6505550231@homedomain", "sip:local@192.91.191.29");
+  add_binding(_remote_store, "sip:6505550231@homedomain", "sip:remote@192.91.191.29");
+
+  // Make sure the remote read isn't started however long the local read
+  // takes.
+  reader._hedge_delay_us = 10000000;
+
+  RegStore::AoRView view;
+  EXPECT_TRUE(reader.get_aor_view("sip:6505550231@homedomain", _pool, view, 0));
+  ASSERT_EQ(1u, view.num_bindings());
+  EXPECT_STREQ("sip:local@192.91.191.29", view.binding(0).uri.ptr);
+  EXPECT_STREQ("binding", view.binding(0).id.ptr);
+  ASSERT_EQ(1u, view.binding(0).num_path_headers);
+  EXPECT_STREQ("<sip:abcdefgh@bono1.homedomain;lr>", view.binding(0).path_headers[0].ptr);
+  ASSERT_EQ(1u, view.binding(0).num_params);
+  EXPECT_STREQ("+sip.instance", view.binding(0).params[0].ptr);
+}
+
+TEST_F(HedgedRegStoreReaderTest, NoLocalBindings)
+{
+  HedgedRegStoreReader reader(_local_store, _remote_store, 2, 99.0, stack_data.stats_aggregator);
+  reader.start();
+  add_binding(_remote_store, "sip:6505550231@homedomain", "sip:remote@192.91.191.29");
+
+  // The local store has no bindings, so the remote store's are used.
+  RegStore::AoRView view;
+  EXPECT_TRUE(reader.get_aor_view("sip:6505550231@homedomain", _pool, view, 0));
+  ASSERT_EQ(1u, view.num_bindings());
+  EXPECT_STREQ("sip:remote@192.91.191.29", view.binding(0).uri.ptr);
+
+  // Neither store has bindings for another AoR.
+  EXPECT_TRUE(reader.get_aor_view("sip:6505550232@homedomain", _pool, view, 0));
+  EXPECT_EQ(0u, view.num_bindings());
+}
+
+TEST_F(HedgedRegStoreReaderTest, SlowLocalRead)
+{
+  HedgedRegStoreReader reader(_local_store, _remote_store, 2, 99.0, stack_data.stats_aggregator);
+  reader.start();
+  add_binding(_local_store, "sip:6505550231@homedomain", "sip:local@192.91.191.29");
+  add_binding(_remote_store, "sip:6505550231@homedomain", "sip:remote@192.91.191.29");
+
+  // The local read takes much longer than the hedge delay, so the remote
+  // read returns first and its bindings are used.
+  EXPECT_EQ((uint64_t)HedgedRegStoreReader::DEFAULT_DELAY_US, reader.hedge_delay_us());
+  _local_data_store->_delay_ms = 200;
+  RegStore::AoRView view;
+  EXPECT_TRUE(reader.get_aor_view("sip:6505550231@homedomain", _pool, view, 0));
+  ASSERT_EQ(1u, view.num_bindings());
+  EXPECT_STREQ("sip:remote@192.91.191.29", view.binding(0).uri.ptr);
+}
+
+TEST_F(HedgedRegStoreReaderTest, NoFreeThreads)
+{
+  // The reader threads haven't been started, so the reads are made on the
+  // calling thread.
+  HedgedRegStoreReader reader(_local_store, _remote_store, 2, 99.0, stack_data.stats_aggregator);
+  add_binding(_remote_store, "sip:6505550231@homedomain", "sip:remote@192.91.191.29");
+
+  RegStore::AoRView view;
+  EXPECT_TRUE(reader.get_aor_view("sip:6505550231@homedomain", _pool, view, 0));
+  ASSERT_EQ(1u, view.num_bindings());
+  EXPECT_STREQ("sip:remote@192.91.191.29", view.binding(0).uri.ptr);
+}
@@ -152,6 +152,8 @@ class HssConnectionTest : public BaseTest
       "<IMSSubscription>"
       "</IMSSubscription>"
       "</ClearwaterRegData>";
+    fakecurl_responses_with_body[std::make_pair("http://narcissus/impu/pubid42/reg-data", "{\"reqtype\": \"dereg-admin\"}")] =
+      fakecurl_responses_with_body[std::make_pair("http://narcissus/impu/pubid50/reg-data", "{\"reqtype\": \"dereg-admin\"}")];
     fakecurl_responses_with_body[std::make_pair("http://narcissus/impu/missingelement1/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
@@ -351,3 +353,45 @@ TEST_F(HssConnectionTest, LocationNotFound)
   ASSERT_TRUE(rc == 404);
   delete actual;
 }
+
+TEST_F(HssConnectionTest, ProfileCacheRefreshedAndInvalidated)
+{
+  SubscriberProfileCache cache(100, 30000, NULL);
+  HSSConnection hss("narcissus", NULL, NULL, &cache);
+  EXPECT_EQ(&cache, hss.profile_cache());
+
+  // A registration caches the data for the whole implicit registration set.
+  std::vector<std::string> uris;
+  std::map<std::string, Ifcs> ifcs_map;
+  std::string regstate;
+  hss.update_registration_state("pubid42", "", HSSConnection::REG, regstate, ifcs_map, uris, 0);
+  EXPECT_EQ(3, cache.size());
+
+  Ifcs ifcs;
+  std::vector<std::string> cached_uris;
+  std::string cached_regstate;
+  EXPECT_TRUE(cache.get("sip:456@example.com", SubscriberProfileCache::IFCS, cached_regstate, ifcs, cached_uris));
+  EXPECT_EQ("REGISTERED", cached_regstate);
+  EXPECT_EQ(1u, ifcs.size());
+  EXPECT_EQ(uris, cached_uris);
+
+  // Invalidating any of the URIs removes them all.
+  hss.invalidate_profile("sip:123@example.com");
+  EXPECT_EQ(0, cache.size());
+
+  // A deregistration drops the data.
+  uris.clear();
+  ifcs_map.clear();
+  hss.update_registration_state("pubid42", "", HSSConnection::REG, regstate, ifcs_map, uris, 0);
+  EXPECT_EQ(3, cache.size());
+  hss.update_registration_state("pubid42", "", HSSConnection::DEREG_ADMIN, regstate, ifcs_map, uris, 0);
+  EXPECT_EQ(0, cache.size());
+
+  // Subscribers that aren't registered aren't cached.
+  uris.clear();
+  ifcs_map.clear();
+  hss.update_registration_state("pubid50", "", HSSConnection::CALL, regstate, ifcs_map, uris, 0);
+  EXPECT_EQ("UNREGISTERED", regstate);
+  EXPECT_FALSE(cache.get("pubid50", SubscriberProfileCache::REGSTATE, cached_regstate, ifcs, cached_uris));
+  EXPECT_EQ(0, cache.size());
+}
@@ -0,0 +1,168 @@
+/**
+ * @file latency_histogram_test.cpp UT for latency histograms.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "latency_histogram.h"
+
+using namespace std;
+
+/// Fixture for LatencyHistogramTest.
+class LatencyHistogramTest : public BaseTest
+{
+  LatencyHistogramTest()
+  {
+  }
+
+  virtual ~LatencyHistogramTest()
+  {
+  }
+};
+
+TEST_F(LatencyHistogramTest, BucketBoundaries)
+{
+  // Small values have a bucket each.
+  for (uint_fast64_t ii = 0; ii < 2 * LatencyHistogram::SUB_BUCKETS; ++ii)
+  {
+    EXPECT_EQ(ii, LatencyHistogram::bucket_index(ii));
+    EXPECT_EQ(ii, LatencyHistogram::bucket_value(ii));
+  }
+
+  // Above that, buckets double in width every SUB_BUCKETS buckets.
+  EXPECT_EQ(32u, LatencyHistogram::bucket_index(32));
+  EXPECT_EQ(32u, LatencyHistogram::bucket_index(33));
+  EXPECT_EQ(33u, LatencyHistogram::bucket_index(34));
+  EXPECT_EQ(33u, LatencyHistogram::bucket_value(32));
+  EXPECT_EQ(47u, LatencyHistogram::bucket_index(63));
+  EXPECT_EQ(48u, LatencyHistogram::bucket_index(64));
+  EXPECT_EQ(67u, LatencyHistogram::bucket_value(48));
+
+  // Every value is in a bucket whose highest value is within 1/SUB_BUCKETS
+  // of it.
+  for (uint_fast64_t value = 1; value < 10000000; value = value * 3 + 1)
+  {
+    uint_fast64_t highest = LatencyHistogram::bucket_value(LatencyHistogram::bucket_index(value));
+    EXPECT_LE(value, highest);
+    EXPECT_LE(highest - value, value / LatencyHistogram::SUB_BUCKETS);
+  }
+
+  // Huge values go in the last bucket.
+  EXPECT_EQ(LatencyHistogram::NUM_BUCKETS - 1,
+            LatencyHistogram::bucket_index(UINT64_MAX));
+}
+
+TEST_F(LatencyHistogramTest, Percentiles)
+{
+  LatencyHistogram histogram;
+  EXPECT_EQ(0u, histogram.percentile(50.0));
+
+  for (uint_fast64_t ii = 1; ii <= 1000; ++ii)
+  {
+    histogram.record(ii);
+  }
+  EXPECT_EQ(1000u, histogram.count());
+
+  // Percentiles are accurate to the bucket width.
+  EXPECT_EQ(511u, histogram.percentile(50.0));
+  EXPECT_EQ(991u, histogram.percentile(99.0));
+  EXPECT_EQ(1023u, histogram.percentile(99.9));
+  EXPECT_EQ(1u, histogram.percentile(0.0));
+}
+
+TEST_F(LatencyHistogramTest, CountAheadOfBuckets)
+{
+  // If the count is incremented while the percentile is being calculated,
+  // the largest value is returned.
+  LatencyHistogram histogram;
+  histogram.record(10);
+  ++histogram._count;
+  EXPECT_EQ(LatencyHistogram::bucket_value(LatencyHistogram::NUM_BUCKETS - 1),
+            histogram.percentile(100.0));
+}
+
+TEST_F(LatencyHistogramTest, MoveTo)
+{
+  LatencyHistogram from;
+  LatencyHistogram to;
+  from.record(10);
+  from.record(20);
+  to.record(30);
+
+  from.move_to(to);
+  EXPECT_EQ(0u, from.count());
+  EXPECT_EQ(3u, to.count());
+  EXPECT_EQ(30u, to.percentile(100.0));
+}
+
+TEST_F(LatencyHistogramTest, StatisticHistogram)
+{
+  StatisticHistogram stat("queue_wait_us",
+                          stack_data.stats_aggregator,
+                          999999999999); // make the period large to avoid intermittent failures due to timing
+
+  for (uint_fast64_t ii = 1; ii <= 1000; ++ii)
+  {
+    stat.record(ii);
+  }
+
+  // Nothing is reported until the period ends.
+  stat.refresh();
+  EXPECT_EQ(0u, stat.p99());
+
+  stat.refresh(true);
+  EXPECT_EQ(511u, stat.p50());
+  EXPECT_EQ(991u, stat.p99());
+  EXPECT_EQ(1023u, stat.p999());
+
+  // The next period starts empty.
+  stat.refresh(true);
+  EXPECT_EQ(0u, stat.p99());
+}
+
+TEST_F(LatencyHistogramTest, StatisticHistogramPeriod)
+{
+  StatisticHistogram stat("queue_wait_us", stack_data.stats_aggregator, 0);
+
+  // With a zero period, every value reports the previous one.
+  stat.record(100);
+  stat.record(200);
+  EXPECT_EQ(103u, stat.p99());
+}
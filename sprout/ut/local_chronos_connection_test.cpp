@@ -0,0 +1,175 @@
+/**
+ * @file local_chronos_connection_test.cpp UT for the in-process Chronos
+ * replacement.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "local_chronos_connection.h"
+
+using namespace std;
+
+/// Callback that records the timers that pop.
+class RecordingCallback : public LocalChronosConnection::Callback
+{
+public:
+  RecordingCallback()
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  virtual ~RecordingCallback()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void timer_pop(const std::string& opaque, SAS::TrailId trail)
+  {
+    pthread_mutex_lock(&_lock);
+    _pops.push_back(opaque);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /// Wait up to five seconds for the specified number of timers to pop.
+  std::vector<std::string> wait_for_pops(size_t count)
+  {
+    for (int ii = 0; ii < 500; ++ii)
+    {
+      pthread_mutex_lock(&_lock);
+      size_t popped = _pops.size();
+      pthread_mutex_unlock(&_lock);
+      if (popped >= count)
+      {
+        break;
+      }
+      struct timespec delay = {0, 10000000};
+      nanosleep(&delay, NULL);
+    }
+
+    pthread_mutex_lock(&_lock);
+    std::vector<std::string> pops = _pops;
+    pthread_mutex_unlock(&_lock);
+    return pops;
+  }
+
+private:
+  pthread_mutex_t _lock;
+  std::vector<std::string> _pops;
+};
+
+/// Fixture for LocalChronosConnectionTest.
+class LocalChronosConnectionTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  LocalChronosConnectionTest()
+  {
+    _chronos = new LocalChronosConnection(2, 10, stack_data.stats_aggregator);
+    _callback = new RecordingCallback();
+    _chronos->register_callback("/timers", _callback);
+  }
+
+  virtual ~LocalChronosConnectionTest()
+  {
+    delete _chronos; _chronos = NULL;
+  }
+
+  LocalChronosConnection* _chronos;
+  RecordingCallback* _callback;
+};
+
+TEST_F(LocalChronosConnectionTest, SetAndDeleteTimers)
+{
+  std::string id1;
+  EXPECT_EQ(HTTP_OK, _chronos->send_post(id1, 300, "/timers", "one", 0));
+  EXPECT_NE("", id1);
+
+  // A PUT without an ID sets a new timer.
+  std::string id2;
+  EXPECT_EQ(HTTP_OK, _chronos->send_put(id2, 300, "/timers", "two", 0));
+  EXPECT_NE("", id2);
+  EXPECT_NE(id1, id2);
+  EXPECT_EQ(2u, _chronos->size());
+
+  // A PUT with an ID replaces that timer, or creates it if it isn't running.
+  EXPECT_EQ(HTTP_OK, _chronos->send_put(id1, 600, "/timers", "one", 0));
+  EXPECT_EQ(2u, _chronos->size());
+  std::string id3 = "unknown";
+  EXPECT_EQ(HTTP_OK, _chronos->send_put(id3, 600, "/timers", "three", 0));
+  EXPECT_EQ("unknown", id3);
+  EXPECT_EQ(3u, _chronos->size());
+
+  // Deleting a timer that isn't running succeeds, as it does on Chronos.
+  EXPECT_EQ(HTTP_OK, _chronos->send_delete(id1, 0));
+  EXPECT_EQ(HTTP_OK, _chronos->send_delete(id1, 0));
+  EXPECT_EQ(2u, _chronos->size());
+}
+
+TEST_F(LocalChronosConnectionTest, TimersPop)
+{
+  _chronos->start();
+
+  std::string id1;
+  std::string id2;
+  std::string id3;
+  _chronos->send_post(id1, 0, "/unknown", "no callback", 0);
+  _chronos->send_post(id2, 300, "/timers", "no pop", 0);
+  _chronos->send_post(id3, 0, "/timers", "pop", 0);
+
+  std::vector<std::string> pops = _callback->wait_for_pops(1);
+  ASSERT_EQ(1u, pops.size());
+  EXPECT_EQ("pop", pops[0]);
+
+  // The timer with no callback has popped and been discarded.
+  EXPECT_EQ(1u, _chronos->size());
+
+  _chronos->stop();
+}
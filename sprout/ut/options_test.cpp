@@ -203,3 +203,34 @@ TEST_F(OptionsTest, SimpleMainline)
   free_txdata();
 }
 
+// is_local_options is also used by the stack to answer OPTIONS polls on the
+// transport thread, so must pick out the same requests as the module.
+TEST_F(OptionsTest, IsLocalOptions)
+{
+  Message msg;
+  pjsip_rx_data* rdata = build_rxdata(msg.get());
+  parse_rxdata(rdata);
+  EXPECT_EQ(PJ_TRUE, is_local_options(rdata));
+
+  msg._route = "Route: <sip:homedomain;transport=UDP;lr>";
+  rdata = build_rxdata(msg.get());
+  parse_rxdata(rdata);
+  EXPECT_EQ(PJ_TRUE, is_local_options(rdata));
+
+  msg._route = "Route: <sip:notthehomedomain;transport=UDP;lr>";
+  rdata = build_rxdata(msg.get());
+  parse_rxdata(rdata);
+  EXPECT_EQ(PJ_FALSE, is_local_options(rdata));
+
+  msg._route = "";
+  msg._domain = "not-us.example.org";
+  rdata = build_rxdata(msg.get());
+  parse_rxdata(rdata);
+  EXPECT_EQ(PJ_FALSE, is_local_options(rdata));
+
+  msg._domain = "127.0.0.1";
+  msg._method = "INVITE";
+  rdata = build_rxdata(msg.get());
+  parse_rxdata(rdata);
+  EXPECT_EQ(PJ_FALSE, is_local_options(rdata));
+}
@@ -0,0 +1,199 @@
+/**
+ * @file reg_store_replicator_test.cpp UT for background replication of
+ * registration records.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "localstore.h"
+#include "regstore.h"
+#include "reg_store_replicator.h"
+#include "fakechronosconnection.hpp"
+
+using namespace std;
+
+/// Fixture for RegStoreReplicatorTest.
+class RegStoreReplicatorTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  RegStoreReplicatorTest()
+  {
+    _chronos_connection = new FakeChronosConnection();
+    _remote_data_store = new LocalStore();
+    _remote_store = new RegStore(_remote_data_store, _chronos_connection);
+  }
+
+  virtual ~RegStoreReplicatorTest()
+  {
+    delete _remote_store; _remote_store = NULL;
+    delete _remote_data_store; _remote_data_store = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Build an AoR with the specified number of bindings.
+  RegStore::AoR* build_aor(int num_bindings)
+  {
+    RegStore::AoR* aor_data = new RegStore::AoR();
+    for (int ii = 0; ii < num_bindings; ++ii)
+    {
+      RegStore::AoR::Binding* b = aor_data->get_binding("binding" + std::to_string(ii));
+      b->_uri = "sip:6505550231@192.91.191.29:59934;transport=tcp;ob";
+      b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+      b->_cseq = 17038 + ii;
+      b->_expires = time(NULL) + 300;
+      b->_priority = 0;
+      b->_emergency_registration = false;
+    }
+    return aor_data;
+  }
+
+  ChronosConnection* _chronos_connection;
+  LocalStore* _remote_data_store;
+  RegStore* _remote_store;
+};
+
+TEST_F(RegStoreReplicatorTest, ReplicatesAoR)
+{
+  RegStoreReplicator replicator(_remote_store, 2, 100, 3, 0, stack_data.stats_aggregator);
+  replicator.start();
+
+  RegStore::AoR* aor_data = build_aor(2);
+  aor_data->_notify_cseq = 7;
+  replicator.replicate("sip:6505550231@homedomain", aor_data, NULL, 0);
+  delete aor_data;
+  replicator.wait_idle();
+  EXPECT_EQ(0, replicator.queue_size());
+
+  RegStore::AoR* remote_aor_data = _remote_store->get_aor_data("sip:6505550231@homedomain", 0);
+  EXPECT_EQ(2u, remote_aor_data->bindings().size());
+  EXPECT_EQ(1u, remote_aor_data->bindings().count("binding1"));
+  EXPECT_EQ(7, remote_aor_data->_notify_cseq);
+  delete remote_aor_data;
+}
+
+TEST_F(RegStoreReplicatorTest, ReplicatesChangesOnly)
+{
+  RegStoreReplicator replicator(_remote_store, 1, 100, 3, 0, stack_data.stats_aggregator);
+  replicator.start();
+
+  // The remote store holds binding0 and binding1, which are also held
+  // locally, and a binding that was registered at the remote site and isn't
+  // held locally.  Its NOTIFY CSeq is ahead of the local one.
+  RegStore::AoR* remote_aor_data = build_aor(2);
+  RegStore::AoR::Binding* b = remote_aor_data->get_binding("remote");
+  *b = *remote_aor_data->get_binding("binding0");
+  b->_cid = "remote-cid";
+  remote_aor_data->_notify_cseq = 10;
+  EXPECT_TRUE(_remote_store->set_aor_data("sip:6505550231@homedomain", remote_aor_data, false, 0));
+  delete remote_aor_data;
+
+  // Locally, binding0 is refreshed, binding1 is removed and binding2 is
+  // added.
+  RegStore::AoR* original_aor_data = build_aor(2);
+  RegStore::AoR* aor_data = build_aor(3);
+  aor_data->get_binding("binding0")->_cseq = 20000;
+  aor_data->remove_binding("binding1");
+  aor_data->_notify_cseq = 3;
+  replicator.replicate("sip:6505550231@homedomain", aor_data, original_aor_data, 0);
+  delete aor_data;
+  delete original_aor_data;
+  replicator.wait_idle();
+
+  // The changes are applied, and the remote-only binding is left alone.
+  remote_aor_data = _remote_store->get_aor_data("sip:6505550231@homedomain", 0);
+  EXPECT_EQ(3u, remote_aor_data->bindings().size());
+  EXPECT_EQ(20000, remote_aor_data->get_binding("binding0")->_cseq);
+  EXPECT_EQ(0u, remote_aor_data->bindings().count("binding1"));
+  EXPECT_EQ(1u, remote_aor_data->bindings().count("binding2"));
+  EXPECT_EQ(1u, remote_aor_data->bindings().count("remote"));
+  EXPECT_EQ("remote-cid", remote_aor_data->get_binding("remote")->_cid);
+  EXPECT_EQ(10, remote_aor_data->_notify_cseq);
+  delete remote_aor_data;
+}
+
+TEST_F(RegStoreReplicatorTest, CoalescesAndDrops)
+{
+  RegStoreReplicator replicator(_remote_store, 1, 1, 3, 0, stack_data.stats_aggregator);
+
+  // Queue updates before starting the replicator.  A second update to the
+  // same AoR replaces the first, and an update to another AoR is dropped
+  // because the queue is full.
+  RegStore::AoR* aor_data = build_aor(1);
+  replicator.replicate("sip:6505550231@homedomain", aor_data, NULL, 0);
+  delete aor_data;
+  aor_data = build_aor(3);
+  replicator.replicate("sip:6505550231@homedomain", aor_data, NULL, 0);
+  replicator.replicate("sip:6505550232@homedomain", aor_data, NULL, 0);
+  delete aor_data;
+  EXPECT_EQ(1, replicator.queue_size());
+
+  replicator.start();
+  replicator.wait_idle();
+
+  RegStore::AoR* remote_aor_data = _remote_store->get_aor_data("sip:6505550231@homedomain", 0);
+  EXPECT_EQ(3u, remote_aor_data->bindings().size());
+  delete remote_aor_data;
+  remote_aor_data = _remote_store->get_aor_data("sip:6505550232@homedomain", 0);
+  EXPECT_EQ(0u, remote_aor_data->bindings().size());
+  delete remote_aor_data;
+}
+
+TEST_F(RegStoreReplicatorTest, DiscardsQueueOnDestruction)
+{
+  RegStoreReplicator* replicator = new RegStoreReplicator(_remote_store, 1, 10, 3, 0, stack_data.stats_aggregator);
+  RegStore::AoR* aor_data = build_aor(1);
+  replicator->replicate("sip:6505550231@homedomain", aor_data, NULL, 0);
+  delete aor_data;
+  EXPECT_EQ(1, replicator->queue_size());
+  delete replicator;
+
+  RegStore::AoR* remote_aor_data = _remote_store->get_aor_data("sip:6505550231@homedomain", 0);
+  EXPECT_EQ(0u, remote_aor_data->bindings().size());
+  delete remote_aor_data;
+}
@@ -76,7 +76,7 @@ public:
     delete _analytics->_logger;
     _analytics->_logger = NULL;
     _acr_factory = new ACRFactory();
-    pj_status_t ret = init_registrar(_store, _remote_store, _hss_connection, _analytics, _acr_factory, _ifc_handler, 300);
+    pj_status_t ret = init_registrar(_store, _remote_store, NULL, _hss_connection, _analytics, _acr_factory, _ifc_handler, 300, 3, 0);
     ASSERT_EQ(PJ_SUCCESS, ret);
 
     _hss_connection->set_impu_result("sip:6505550231@homedomain", "reg", HSSConnection::STATE_REGISTERED, "");
@@ -36,6 +36,8 @@
 
 
 #include <string>
+#include <sstream>
+#include <time.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
@@ -47,6 +49,7 @@
 #include "sas.h"
 #include "localstore.h"
 #include "regstore.h"
+#include "binary_buffer.h"
 #include "fakelogger.hpp"
 #include "test_utils.hpp"
 #include "test_interposer.hpp"
@@ -54,6 +57,31 @@
 
 using namespace std;
 
+/// Local store that counts the writes it rejects for contention, as the
+/// write_conflicts statistic does.
+class ConflictCountingLocalStore : public LocalStore
+{
+public:
+  ConflictCountingLocalStore() : LocalStore(), _conflicts(0) {}
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail = 0)
+  {
+    Store::Status status = LocalStore::set_data(table, key, data, cas, expiry, trail);
+    if (status == Store::Status::DATA_CONTENTION)
+    {
+      _conflicts++;
+    }
+    return status;
+  }
+
+  int _conflicts;
+};
+
 /// Fixture for RegStoreTest.
 class RegStoreTest : public SipTest
 {
@@ -463,3 +491,1108 @@ TEST_F(RegStoreTest, ExpiryTests)
 }
 
 
+TEST_F(RegStoreTest, ExpiryBoundsTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 NULL,
+                                 RegStore::SINGLE_RECORD,
+                                 stack_data.stats_aggregator,
+                                 "reg_store",
+                                 0,
+                                 RegStore::BINDING_TIMERS,
+                                 RegStore::BINARY_FORMAT);
+  RegStore::Connector* connector = store->_connector;
+  int now = time(NULL);
+  std::string b1_id = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:1";
+  std::string b2_id = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:2";
+
+  // Write an AoR with bindings expiring in 100 and 200 seconds, and a
+  // subscription expiring in 50 seconds.  The first binding is an emergency
+  // registration, so no NOTIFY is sent when it expires.
+  RegStore::AoR* aor_data1 = store->get_aor_data("5102175698@cw-ngv.com", 0);
+  RegStore::AoR::Binding* b = aor_data1->get_binding(b1_id);
+  b->_expires = now + 100;
+  b->_emergency_registration = true;
+  b = aor_data1->get_binding(b2_id);
+  b->_expires = now + 200;
+  b->_emergency_registration = false;
+  aor_data1->get_subscription("1234")->_expires = now + 50;
+  EXPECT_TRUE(store->set_aor_data("5102175698@cw-ngv.com", aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+
+  // The bounds on expiry times are held in the record.
+  std::string data;
+  uint64_t cas;
+  datastore->get_data("reg", "5102175698@cw-ngv.com", data, cas, 0);
+  aor_data1 = connector->deserialize_aor(data);
+  EXPECT_EQ(now + 50, aor_data1->_earliest_expires);
+  EXPECT_EQ(now + 200, aor_data1->_latest_expires);
+
+  // Nothing has expired yet, so expiry returns the latest binding expiry
+  // time without examining the bindings - it doesn't notice a binding that
+  // has been changed without going through get_binding.
+  aor_data1->bindings().find(b1_id)->second->_expires = now;
+  EXPECT_EQ(now + 200, store->expire(aor_data1, now));
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+
+  // A binding changed through get_binding is checked.
+  aor_data1->get_binding(b1_id)->_expires = now;
+  EXPECT_EQ(now + 200, store->expire(aor_data1, now));
+  EXPECT_EQ(1u, aor_data1->bindings().size());
+  EXPECT_EQ(now + 50, aor_data1->_earliest_expires);
+  EXPECT_EQ(0u, aor_data1->_touched_bindings.size());
+  delete aor_data1; aor_data1 = NULL;
+
+  // Once the subscription expires, the bounds are worked out again.
+  aor_data1 = store->get_aor_data("5102175698@cw-ngv.com", 0);
+  EXPECT_EQ(1u, aor_data1->subscriptions().size());
+  EXPECT_EQ(now + 200, store->expire(aor_data1, now + 60));
+  EXPECT_EQ(0u, aor_data1->subscriptions().size());
+  EXPECT_EQ(now + 100, aor_data1->_earliest_expires);
+  delete aor_data1; aor_data1 = NULL;
+
+  // Records without the bounds (or the AoR's timer ID that follows them),
+  // written by older versions, can still be read, and the bounds are worked
+  // out the first time bindings are expired.
+  std::string bounds;
+  BinaryWriter w(bounds);
+  w.write_int(now + 50);
+  w.write_int(now + 200);
+  w.write_string("");
+  ASSERT_EQ(bounds, data.substr(data.size() - bounds.size()));
+  aor_data1 = connector->deserialize_aor(data.substr(0, data.size() - bounds.size()));
+  EXPECT_EQ(0, aor_data1->_earliest_expires);
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+  EXPECT_EQ(now + 200, store->expire(aor_data1, now));
+  EXPECT_EQ(now + 50, aor_data1->_earliest_expires);
+  delete aor_data1; aor_data1 = NULL;
+
+  // The legacy format doesn't hold the bounds.
+  RegStore* legacy_store = new RegStore(datastore, chronos_connection);
+  aor_data1 = legacy_store->get_aor_data("5102175698@cw-ngv.com", 0);
+  EXPECT_TRUE(legacy_store->set_aor_data("5102175698@cw-ngv.com", aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  datastore->get_data("reg", "5102175698@cw-ngv.com", data, cas, 0);
+  aor_data1 = legacy_store->_connector->deserialize_aor(data);
+  EXPECT_EQ(0, aor_data1->_earliest_expires);
+  EXPECT_EQ(0, aor_data1->_latest_expires);
+  delete aor_data1; aor_data1 = NULL;
+
+  delete legacy_store; legacy_store = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+
+
+/// Build an AoR with a few bindings and subscriptions, for the serialization
+/// tests.
+static RegStore::AoR* build_serialization_aor(int now, int num_bindings)
+{
+  RegStore::AoR* aor_data = new RegStore::AoR();
+  aor_data->_notify_cseq = 12;
+
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    std::string id = std::to_string(ii);
+    RegStore::AoR::Binding* b = aor_data->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:" + id);
+    b->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob;n=" + id + ">";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038 + ii;
+    b->_expires = now + 300;
+    b->_priority = -ii;
+    b->_params.push_back(std::make_pair("+sip.instance", "\"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>\""));
+    b->_params.push_back(std::make_pair("reg-id", id));
+    b->_params.push_back(std::make_pair("+sip.ice", ""));
+    b->_path_headers.push_back("<sip:abcdefgh@bono-1.cw-ngv.com;lr>");
+    b->_timer_id = "0000000000" + id;
+    b->_private_id = "5102175698@cw-ngv.com";
+    b->_emergency_registration = (ii == 0);
+  }
+
+  RegStore::AoR::Subscription* s = aor_data->get_subscription("1234");
+  s->_req_uri = "sip:5102175698@192.91.191.29:59934;transport=tcp";
+  s->_from_uri = "<sip:5102175698@cw-ngv.com>";
+  s->_from_tag = "4321";
+  s->_to_uri = "<sip:5102175698@cw-ngv.com>";
+  s->_to_tag = "1234";
+  s->_cid = "xyzabc@192.91.191.29";
+  s->_route_uris.push_back("sip:abcdefgh@bono-1.cw-ngv.com;lr");
+  s->_route_uris.push_back("sip:sprout.cw-ngv.com;lr");
+  s->_expires = now + 150;
+
+  return aor_data;
+}
+
+
+/// Serialize an AoR in the legacy stream-based format, as written by older
+/// versions of Sprout.
+static std::string legacy_serialize_aor(RegStore::AoR* aor_data)
+{
+  std::ostringstream oss(std::ostringstream::out|std::ostringstream::binary);
+
+  int num_bindings = aor_data->bindings().size();
+  oss.write((const char *)&num_bindings, sizeof(int));
+
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data->bindings().begin();
+       i != aor_data->bindings().end();
+       ++i)
+  {
+    oss << i->first << '\0';
+
+    RegStore::AoR::Binding* b = i->second;
+    oss << b->_uri << '\0';
+    oss << b->_cid << '\0';
+    oss.write((const char *)&b->_cseq, sizeof(int));
+    oss.write((const char *)&b->_expires, sizeof(int));
+    oss.write((const char *)&b->_priority, sizeof(int));
+    int num_params = b->_params.size();
+    oss.write((const char *)&num_params, sizeof(int));
+    for (std::list<std::pair<std::string, std::string> >::const_iterator j = b->_params.begin();
+         j != b->_params.end();
+         ++j)
+    {
+      oss << j->first << '\0' << j->second << '\0';
+    }
+    int num_path_hdrs = b->_path_headers.size();
+    oss.write((const char *)&num_path_hdrs, sizeof(int));
+    for (std::list<std::string>::const_iterator j = b->_path_headers.begin();
+         j != b->_path_headers.end();
+         ++j)
+    {
+      oss << *j << '\0';
+    }
+    oss << b->_timer_id << '\0';
+    oss << b->_private_id << '\0';
+    int emergency = b->_emergency_registration;
+    oss.write((const char *)&emergency, sizeof(int));
+  }
+
+  int num_subscriptions = aor_data->subscriptions().size();
+  oss.write((const char *)&num_subscriptions, sizeof(int));
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = aor_data->subscriptions().begin();
+       i != aor_data->subscriptions().end();
+       ++i)
+  {
+    oss << i->first << '\0';
+
+    RegStore::AoR::Subscription* s = i->second;
+    oss << s->_req_uri << '\0';
+    oss << s->_from_uri << '\0';
+    oss << s->_from_tag << '\0';
+    oss << s->_to_uri << '\0';
+    oss << s->_to_tag << '\0';
+    oss << s->_cid << '\0';
+    int num_routes = s->_route_uris.size();
+    oss.write((const char *)&num_routes, sizeof(int));
+    for (std::list<std::string>::const_iterator j = s->_route_uris.begin();
+         j != s->_route_uris.end();
+         ++j)
+    {
+      oss << *j << '\0';
+    }
+    oss.write((const char *)&s->_expires, sizeof(int));
+  }
+
+  oss.write((const char *)&aor_data->_notify_cseq, sizeof(int));
+
+  return oss.str();
+}
+
+
+/// Check that two AoRs have the same contents.
+static void expect_aors_equal(RegStore::AoR* expected, RegStore::AoR* actual)
+{
+  EXPECT_EQ(expected->_notify_cseq, actual->_notify_cseq);
+  ASSERT_EQ(expected->bindings().size(), actual->bindings().size());
+  ASSERT_EQ(expected->subscriptions().size(), actual->subscriptions().size());
+
+  for (RegStore::AoR::Bindings::const_iterator i = expected->bindings().begin(), j = actual->bindings().begin();
+       i != expected->bindings().end();
+       ++i, ++j)
+  {
+    EXPECT_EQ(i->first, j->first);
+    EXPECT_EQ(i->second->_uri, j->second->_uri);
+    EXPECT_EQ(i->second->_cid, j->second->_cid);
+    EXPECT_EQ(i->second->_cseq, j->second->_cseq);
+    EXPECT_EQ(i->second->_expires, j->second->_expires);
+    EXPECT_EQ(i->second->_priority, j->second->_priority);
+    EXPECT_TRUE(i->second->_params == j->second->_params);
+    EXPECT_TRUE(i->second->_path_headers == j->second->_path_headers);
+    EXPECT_EQ(i->second->_timer_id, j->second->_timer_id);
+    EXPECT_EQ(i->second->_private_id, j->second->_private_id);
+    EXPECT_EQ(i->second->_emergency_registration, j->second->_emergency_registration);
+  }
+
+  for (RegStore::AoR::Subscriptions::const_iterator i = expected->subscriptions().begin(), j = actual->subscriptions().begin();
+       i != expected->subscriptions().end();
+       ++i, ++j)
+  {
+    EXPECT_EQ(i->first, j->first);
+    EXPECT_EQ(i->second->_req_uri, j->second->_req_uri);
+    EXPECT_EQ(i->second->_from_uri, j->second->_from_uri);
+    EXPECT_EQ(i->second->_from_tag, j->second->_from_tag);
+    EXPECT_EQ(i->second->_to_uri, j->second->_to_uri);
+    EXPECT_EQ(i->second->_to_tag, j->second->_to_tag);
+    EXPECT_EQ(i->second->_cid, j->second->_cid);
+    EXPECT_TRUE(i->second->_route_uris == j->second->_route_uris);
+    EXPECT_EQ(i->second->_expires, j->second->_expires);
+  }
+}
+
+
+TEST_F(RegStoreTest, SerializationTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore, chronos_connection);
+  RegStore::Connector* connector = store->_connector;
+
+  RegStore::AoR* aor_data1 = build_serialization_aor(time(NULL), 3);
+
+  // The record starts with the format header, and reads back unchanged.
+  std::string data = connector->serialize_aor(aor_data1);
+  ASSERT_LT(4u, data.size());
+  EXPECT_EQ("AoR", data.substr(0, 3));
+  EXPECT_EQ((char)0x81, data[3]);
+
+  RegStore::AoR* aor_data2 = connector->deserialize_aor(data);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+
+  // The binary format is smaller than the legacy format.
+  std::string legacy_data = legacy_serialize_aor(aor_data1);
+  EXPECT_GT(legacy_data.size(), data.size());
+
+  // Records in the legacy format can still be read, and are written the
+  // same way as older versions wrote them.
+  aor_data2 = connector->deserialize_aor(legacy_data);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+  EXPECT_EQ(legacy_data, connector->serialize_legacy_aor(aor_data1));
+
+  // An empty record reads back as empty in both formats.
+  RegStore::AoR* empty_aor = new RegStore::AoR();
+  aor_data2 = connector->deserialize_aor(connector->serialize_aor(empty_aor));
+  expect_aors_equal(empty_aor, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+  aor_data2 = connector->deserialize_aor(legacy_serialize_aor(empty_aor));
+  expect_aors_equal(empty_aor, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+  delete empty_aor; empty_aor = NULL;
+
+  delete aor_data1; aor_data1 = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, RecordFormatTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* legacy_store = new RegStore(datastore, chronos_connection);
+  RegStore* binary_store = new RegStore(datastore,
+                                        chronos_connection,
+                                        NULL,
+                                        RegStore::SINGLE_RECORD,
+                                        NULL,
+                                        "reg_store",
+                                        200,
+                                        RegStore::BINDING_TIMERS,
+                                        RegStore::BINARY_FORMAT);
+  const std::string aor_id = "5102175698@cw-ngv.com";
+  RegStore::AoR* aor_data1 = build_serialization_aor(time(NULL), 4);
+  std::string data;
+  uint64_t cas;
+
+  // By default records are written in the legacy format, so older nodes
+  // sharing the store can read them.
+  EXPECT_TRUE(legacy_store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_EQ(legacy_serialize_aor(aor_data1), data);
+
+  // Once the binary format is enabled records are written in it, and can
+  // be read back by either store.
+  RegStore::AoR* aor_data2 = binary_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(binary_store->set_aor_data(aor_id, aor_data2, false, 0));
+  delete aor_data2; aor_data2 = NULL;
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_TRUE(RegStore::Connector::has_binary_header(data));
+  aor_data2 = legacy_store->get_aor_data(aor_id, 0);
+  expect_aors_equal(aor_data1, aor_data2);
+
+  // Legacy records are never compressed.
+  RegStore* compressing_legacy_store = new RegStore(datastore,
+                                                    chronos_connection,
+                                                    NULL,
+                                                    RegStore::SINGLE_RECORD,
+                                                    NULL,
+                                                    "reg_store",
+                                                    200);
+  EXPECT_TRUE(compressing_legacy_store->set_aor_data(aor_id, aor_data2, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_FALSE(RegStore::Connector::has_binary_header(data));
+  EXPECT_FALSE(RegStore::Connector::is_compressed(data));
+  delete aor_data2; aor_data2 = NULL;
+
+  delete aor_data1; aor_data1 = NULL;
+  delete compressing_legacy_store; compressing_legacy_store = NULL;
+  delete binary_store; binary_store = NULL;
+  delete legacy_store; legacy_store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, CorruptRecordTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore, chronos_connection);
+  RegStore::Connector* connector = store->_connector;
+
+  RegStore::AoR* aor_data1 = build_serialization_aor(time(NULL), 2);
+  std::string data = connector->serialize_aor(aor_data1);
+  delete aor_data1; aor_data1 = NULL;
+
+  // A truncated record decodes as empty rather than partially.  (The last
+  // three bytes are the optional fields that follow the subscriptions, so
+  // the record is truncated part way through the subscription.)
+  aor_data1 = connector->deserialize_aor(data.substr(0, data.size() - 6));
+  EXPECT_EQ(0u, aor_data1->bindings().size());
+  EXPECT_EQ(0u, aor_data1->subscriptions().size());
+  EXPECT_TRUE(_log.contains("Failed to decode AoR record"));
+  delete aor_data1; aor_data1 = NULL;
+
+  // A record in a newer format version is ignored.
+  data[3] = (char)0x82;
+  aor_data1 = connector->deserialize_aor(data);
+  EXPECT_EQ(0u, aor_data1->bindings().size());
+  EXPECT_TRUE(_log.contains("Unsupported AoR record format version 2"));
+  delete aor_data1; aor_data1 = NULL;
+
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+/// Microbenchmark comparing the binary AoR format with the legacy format.
+/// This always passes - it just reports the time per record.
+TEST_F(RegStoreTest, SerializationBenchmark)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore, chronos_connection);
+  RegStore::Connector* connector = store->_connector;
+
+  RegStore::AoR* aor_data = build_serialization_aor(time(NULL), 4);
+  const int iterations = 10000;
+  struct timespec start;
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    std::string data = legacy_serialize_aor(aor_data);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long legacy_encode_ns = ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations;
+
+  std::string legacy_data = legacy_serialize_aor(aor_data);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    delete connector->deserialize_legacy_aor(legacy_data);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long legacy_decode_ns = ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    std::string data = connector->serialize_aor(aor_data);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long encode_ns = ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations;
+
+  std::string data = connector->serialize_aor(aor_data);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    delete connector->deserialize_aor(data);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long decode_ns = ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations;
+
+  printf("AoR serialization (4 bindings, 1 subscription):\n");
+  printf("  legacy: %d bytes, encode %ldns, decode %ldns\n",
+         (int)legacy_data.size(), legacy_encode_ns, legacy_decode_ns);
+  printf("  binary: %d bytes, encode %ldns, decode %ldns\n",
+         (int)data.size(), encode_ns, decode_ns);
+
+  delete aor_data; aor_data = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, AoRViewTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore, chronos_connection);
+  RegStore::AoRView view;
+
+  // A view of an AoR that isn't in the store has no bindings.
+  EXPECT_TRUE(store->get_aor_view("5102175698@cw-ngv.com", stack_data.pool, view, 0));
+  EXPECT_EQ(0u, view.num_bindings());
+
+  // Write a record with three bindings, and expire the first of them.
+  int now = time(NULL);
+  RegStore::AoR* aor_data1 = build_serialization_aor(now, 3);
+  aor_data1->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:0")->_expires = now - 1;
+  std::string data = store->_connector->serialize_aor(aor_data1);
+  datastore->set_data("reg", "5102175698@cw-ngv.com", data, 0, 300, 0);
+
+  // The view holds the two unexpired bindings, in order.
+  EXPECT_TRUE(store->get_aor_view("5102175698@cw-ngv.com", stack_data.pool, view, 0));
+  ASSERT_EQ(2u, view.num_bindings());
+  EXPECT_EQ(12, view._notify_cseq);
+  EXPECT_NE(0u, view._cas);
+
+  const RegStore::AoRView::Binding& vb = view.binding(0);
+  RegStore::AoR::Binding* b = aor_data1->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1");
+  EXPECT_EQ("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1", PJUtils::pj_str_to_string(&vb.id));
+  EXPECT_EQ(b->_uri, PJUtils::pj_str_to_string(&vb.uri));
+  EXPECT_EQ(b->_uri.size(), strlen(vb.uri.ptr));
+  EXPECT_EQ(b->_cid, PJUtils::pj_str_to_string(&vb.cid));
+  EXPECT_EQ(b->_cseq, vb.cseq);
+  EXPECT_EQ(b->_expires, vb.expires);
+  EXPECT_EQ(b->_priority, vb.priority);
+  ASSERT_EQ(3u, vb.num_params);
+  EXPECT_EQ("reg-id", PJUtils::pj_str_to_string(&vb.params[2]));
+  EXPECT_EQ("1", PJUtils::pj_str_to_string(&vb.params[3]));
+  EXPECT_EQ("", PJUtils::pj_str_to_string(&vb.params[5]));
+  ASSERT_EQ(1u, vb.num_path_headers);
+  EXPECT_EQ("<sip:abcdefgh@bono-1.cw-ngv.com;lr>", PJUtils::pj_str_to_string(&vb.path_headers[0]));
+  EXPECT_EQ(b->_timer_id, PJUtils::pj_str_to_string(&vb.timer_id));
+  EXPECT_EQ(b->_private_id, PJUtils::pj_str_to_string(&vb.private_id));
+  EXPECT_FALSE(vb.emergency_registration);
+  EXPECT_EQ("urn:uuid:00000000-0000-0000-0000-b4dd32817622:2", PJUtils::pj_str_to_string(&view.binding(1).id));
+
+  // Records in the legacy format give the same view.
+  datastore->set_data("reg", "5102175699@cw-ngv.com", legacy_serialize_aor(aor_data1), 0, 300, 0);
+  RegStore::AoRView legacy_view;
+  EXPECT_TRUE(store->get_aor_view("5102175699@cw-ngv.com", stack_data.pool, legacy_view, 0));
+  ASSERT_EQ(2u, legacy_view.num_bindings());
+  EXPECT_EQ(12, legacy_view._notify_cseq);
+  const RegStore::AoRView::Binding& lvb = legacy_view.binding(0);
+  EXPECT_EQ(PJUtils::pj_str_to_string(&vb.id), PJUtils::pj_str_to_string(&lvb.id));
+  EXPECT_EQ(PJUtils::pj_str_to_string(&vb.uri), PJUtils::pj_str_to_string(&lvb.uri));
+  EXPECT_EQ(vb.expires, lvb.expires);
+  EXPECT_EQ(vb.num_params, lvb.num_params);
+  EXPECT_EQ(PJUtils::pj_str_to_string(&vb.params[0]), PJUtils::pj_str_to_string(&lvb.params[0]));
+  EXPECT_EQ(PJUtils::pj_str_to_string(&vb.path_headers[0]), PJUtils::pj_str_to_string(&lvb.path_headers[0]));
+  EXPECT_EQ(PJUtils::pj_str_to_string(&vb.timer_id), PJUtils::pj_str_to_string(&lvb.timer_id));
+
+  // A truncated record gives an empty view.
+  RegStore::AoRView corrupt_view;
+  store->_connector->decode_aor_view(data.substr(0, 100), stack_data.pool, corrupt_view);
+  EXPECT_EQ(0u, corrupt_view.num_bindings());
+  EXPECT_TRUE(_log.contains("Failed to decode AoR record"));
+
+  delete aor_data1; aor_data1 = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, AoRCacheTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  AoRCache* cache = new AoRCache("aor_cache", 100, 1000, stack_data.stats_aggregator);
+  RegStore* store = new RegStore(datastore, chronos_connection, cache);
+  RegStore::AoRView view;
+
+  // Writing a record through the RegStore puts it in the cache.
+  int now = time(NULL);
+  RegStore::AoR* aor_data1 = build_serialization_aor(now, 2);
+  EXPECT_TRUE(store->set_aor_data("5102175698@cw-ngv.com", aor_data1, false, 0));
+  EXPECT_EQ(1, cache->size());
+  delete aor_data1; aor_data1 = NULL;
+
+  // Change the record in the underlying store.  Within the staleness window
+  // views come from the cache, so still have two bindings.
+  aor_data1 = build_serialization_aor(now, 1);
+  datastore->set_data("reg", "5102175698@cw-ngv.com", store->_connector->serialize_aor(aor_data1), 0, 300, 0);
+  delete aor_data1; aor_data1 = NULL;
+  EXPECT_TRUE(store->get_aor_view("5102175698@cw-ngv.com", stack_data.pool, view, 0));
+  EXPECT_EQ(2u, view.num_bindings());
+
+  // Once the window has passed the record is read from the store again.
+  cwtest_advance_time_ms(1001);
+  EXPECT_TRUE(store->get_aor_view("5102175698@cw-ngv.com", stack_data.pool, view, 0));
+  EXPECT_EQ(1u, view.num_bindings());
+
+  // A failed write invalidates the cached record.
+  aor_data1 = store->get_aor_data("5102175698@cw-ngv.com", 0);
+  aor_data1->_cas++;
+  EXPECT_FALSE(store->set_aor_data("5102175698@cw-ngv.com", aor_data1, false, 0));
+  EXPECT_EQ(0, cache->size());
+  delete aor_data1; aor_data1 = NULL;
+
+  delete store; store = NULL;
+  delete cache; cache = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, PerBindingRecordTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 NULL,
+                                 RegStore::PER_BINDING_RECORDS,
+                                 stack_data.stats_aggregator,
+                                 "reg_store");
+  RegStore* single_store = new RegStore(datastore, chronos_connection);
+  const std::string aor_id = "5102175698@cw-ngv.com";
+  const std::string b0_id = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:0";
+  const std::string b1_id = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:1";
+
+  // Write an AoR with two bindings and a subscription.  The AoR's record
+  // is an index of the separate binding and subscription records.
+  int now = time(NULL);
+  RegStore::AoR* aor_data1 = build_serialization_aor(now, 2);
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+
+  std::string data;
+  uint64_t cas;
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_TRUE(RegStore::Connector::is_index_record(data));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", RegStore::Connector::record_key(aor_id, 'b', b0_id), data, cas, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", RegStore::Connector::record_key(aor_id, 's', "1234"), data, cas, 0));
+
+  // Read it back through both layouts.
+  RegStore::AoR* aor_data2 = store->get_aor_data(aor_id, 0);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+  aor_data2 = single_store->get_aor_data(aor_id, 0);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+  delete aor_data1; aor_data1 = NULL;
+
+  RegStore::AoRView view;
+  EXPECT_TRUE(store->get_aor_view(aor_id, stack_data.pool, view, 0));
+  EXPECT_EQ(2u, view.num_bindings());
+
+  // While the AoR has subscriptions, a change to its NOTIFY CSeq rewrites
+  // the index, so that each NOTIFY gets a distinct CSeq.
+  uint64_t index_cas;
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, index_cas, 0));
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data1->_notify_cseq++;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_NE(index_cas, cas);
+  delete aor_data1; aor_data1 = NULL;
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data1->remove_subscription("1234");
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+
+  // Without subscriptions, two updates to different bindings based on the
+  // same read both succeed.  Each only writes its binding's record - the
+  // index is untouched.
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data2 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, index_cas, 0));
+  aor_data1->get_binding(b0_id)->_expires = now + 400;
+  aor_data1->_notify_cseq++;
+  aor_data2->get_binding(b1_id)->_expires = now + 500;
+  aor_data2->_notify_cseq++;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data2, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_EQ(index_cas, cas);
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  // A refresh of a binding that has been removed since it was read is
+  // rejected, because the removal overwrote the binding's record with a
+  // tombstone.
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data2 = store->get_aor_data(aor_id, 0);
+  aor_data1->remove_binding(b1_id);
+  aor_data2->get_binding(b1_id)->_expires = now + 600;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", RegStore::Connector::record_key(aor_id, 'b', b1_id), data, cas, 0));
+  EXPECT_EQ("", data);
+  EXPECT_FALSE(store->set_aor_data(aor_id, aor_data2, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  // Equally, a removal of a binding that has been refreshed since it was
+  // read is rejected, and leaves the AoR as it was.
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(1u, aor_data1->bindings().size());
+  aor_data1->get_binding(b1_id)->_expires = now + 500;
+  aor_data1->get_binding(b1_id)->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+  aor_data1->get_binding(b1_id)->_emergency_registration = false;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data2 = store->get_aor_data(aor_id, 0);
+  aor_data1->get_binding(b0_id)->_cseq++;
+  aor_data2->get_binding(b1_id)->_cseq++;
+  aor_data2->remove_binding(b0_id);
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_FALSE(store->set_aor_data(aor_id, aor_data2, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+  EXPECT_EQ(now + 500, aor_data1->get_binding(b1_id)->_expires);
+  delete aor_data1; aor_data1 = NULL;
+
+  // Record keys don't depend on the platform's string hash.
+  EXPECT_EQ(aor_id + "\\b\\af63dc4c8601ec8c",
+            RegStore::Connector::record_key(aor_id, 'b', "a"));
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(now + 400, aor_data1->get_binding(b0_id)->_expires);
+  EXPECT_EQ(now + 500, aor_data1->get_binding(b1_id)->_expires);
+  delete aor_data1; aor_data1 = NULL;
+
+  // Two updates to the same binding conflict.
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data2 = store->get_aor_data(aor_id, 0);
+  aor_data1->get_binding(b0_id)->_cseq++;
+  aor_data2->get_binding(b0_id)->_cseq += 2;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_FALSE(store->set_aor_data(aor_id, aor_data2, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  // Removing a binding rewrites the index and leaves a tombstone in the
+  // binding's record, which is overwritten if the binding is added again.
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  aor_data1->remove_binding(b1_id);
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(1u, aor_data1->bindings().size());
+  RegStore::AoR::Binding* b1 = aor_data1->get_binding(b1_id);
+  b1->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob;n=1>";
+  b1->_expires = now + 300;
+  b1->_emergency_registration = false;
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+
+  // Writing through the single record layout replaces the index, and the
+  // per-binding layout can read that record and migrate it back.
+  EXPECT_TRUE(single_store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_FALSE(RegStore::Connector::is_index_record(data));
+  delete aor_data1; aor_data1 = NULL;
+
+  aor_data1 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_TRUE(RegStore::Connector::is_index_record(data));
+  delete aor_data1; aor_data1 = NULL;
+
+  delete single_store; single_store = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, PerBindingRecordConflictTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  const std::string aor_id = "5102175698@cw-ngv.com";
+  const std::string b0_id = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:0";
+  const std::string b1_id = "urn:uuid:00000000-0000-0000-0000-b4dd32817622:1";
+  int now = time(NULL);
+  int conflicts[2];
+
+  // Refresh two different bindings of an AoR without subscriptions
+  // concurrently under each layout, retrying each refresh until it succeeds
+  // as the registrar does.
+  RegStore::Layout layouts[2] = {RegStore::SINGLE_RECORD,
+                                 RegStore::PER_BINDING_RECORDS};
+  for (int ii = 0; ii < 2; ii++)
+  {
+    ConflictCountingLocalStore* datastore = new ConflictCountingLocalStore();
+    RegStore* store = new RegStore(datastore,
+                                   chronos_connection,
+                                   NULL,
+                                   layouts[ii],
+                                   NULL,
+                                   "reg_store");
+    RegStore::AoR* aor_data1 = build_serialization_aor(now, 2);
+    aor_data1->remove_subscription("1234");
+    EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+    delete aor_data1; aor_data1 = NULL;
+
+    aor_data1 = store->get_aor_data(aor_id, 0);
+    RegStore::AoR* aor_data2 = store->get_aor_data(aor_id, 0);
+    aor_data1->get_binding(b0_id)->_expires = now + 400;
+    aor_data1->_notify_cseq++;
+    aor_data2->get_binding(b1_id)->_expires = now + 500;
+    aor_data2->_notify_cseq++;
+    EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+    if (!store->set_aor_data(aor_id, aor_data2, false, 0))
+    {
+      delete aor_data2; aor_data2 = NULL;
+      aor_data2 = store->get_aor_data(aor_id, 0);
+      aor_data2->get_binding(b1_id)->_expires = now + 500;
+      aor_data2->_notify_cseq++;
+      EXPECT_TRUE(store->set_aor_data(aor_id, aor_data2, false, 0));
+    }
+    delete aor_data1; aor_data1 = NULL;
+    delete aor_data2; aor_data2 = NULL;
+
+    aor_data1 = store->get_aor_data(aor_id, 0);
+    EXPECT_EQ(now + 400, aor_data1->get_binding(b0_id)->_expires);
+    EXPECT_EQ(now + 500, aor_data1->get_binding(b1_id)->_expires);
+    delete aor_data1; aor_data1 = NULL;
+
+    conflicts[ii] = datastore->_conflicts;
+    delete store; store = NULL;
+    delete datastore; datastore = NULL;
+  }
+
+  // The single record layout takes a conflict, the per-binding layout none.
+  EXPECT_EQ(1, conflicts[0]);
+  EXPECT_EQ(0, conflicts[1]);
+
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, CompressionTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore,
+                                 chronos_connection,
+                                 NULL,
+                                 RegStore::SINGLE_RECORD,
+                                 stack_data.stats_aggregator,
+                                 "reg_store",
+                                 200,
+                                 RegStore::BINDING_TIMERS,
+                                 RegStore::BINARY_FORMAT);
+  RegStore* per_binding_store = new RegStore(datastore,
+                                             chronos_connection,
+                                             NULL,
+                                             RegStore::PER_BINDING_RECORDS,
+                                             NULL,
+                                             "reg_store",
+                                             200);
+  RegStore* uncompressed_store = new RegStore(datastore, chronos_connection);
+  RegStore::Connector* connector = store->_connector;
+  const std::string aor_id = "5102175698@cw-ngv.com";
+  int now = time(NULL);
+
+  // A record over the threshold is compressed, and flagged as compressed in
+  // its header.
+  RegStore::AoR* aor_data1 = build_serialization_aor(now, 4);
+  std::string serialized = connector->serialize_aor(aor_data1);
+  EXPECT_TRUE(store->set_aor_data(aor_id, aor_data1, false, 0));
+
+  std::string data;
+  uint64_t cas;
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_EQ("AoR", data.substr(0, 3));
+  EXPECT_EQ((char)0xc1, data[3]);
+  EXPECT_TRUE(RegStore::Connector::is_compressed(data));
+  EXPECT_GT(serialized.size(), data.size());
+
+  // It reads back unchanged, whether or not compression is enabled.
+  RegStore::AoR* aor_data2 = store->get_aor_data(aor_id, 0);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+  aor_data2 = uncompressed_store->get_aor_data(aor_id, 0);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+
+  RegStore::AoRView view;
+  EXPECT_TRUE(uncompressed_store->get_aor_view(aor_id, stack_data.pool, view, 0));
+  EXPECT_EQ(4u, view.num_bindings());
+
+  // Without compression the record is written uncompressed.
+  aor_data2 = uncompressed_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(uncompressed_store->set_aor_data(aor_id, aor_data2, false, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_FALSE(RegStore::Connector::is_compressed(data));
+  delete aor_data2; aor_data2 = NULL;
+
+  // Per-binding records are compressed in the same way.
+  aor_data2 = per_binding_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(per_binding_store->set_aor_data(aor_id, aor_data2, false, 0));
+  delete aor_data2; aor_data2 = NULL;
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_TRUE(RegStore::Connector::is_index_record(data));
+  EXPECT_TRUE(RegStore::Connector::is_compressed(data));
+  aor_data2 = per_binding_store->get_aor_data(aor_id, 0);
+  expect_aors_equal(aor_data1, aor_data2);
+  delete aor_data2; aor_data2 = NULL;
+
+  // Records under the threshold, and records that don't get smaller, are
+  // written uncompressed.
+  aor_data2 = store->get_aor_data("5102175699@cw-ngv.com", 0);
+  RegStore::AoR::Binding* b = aor_data2->get_binding("1");
+  b->_expires = now + 300;
+  b->_emergency_registration = false;
+  EXPECT_TRUE(store->set_aor_data("5102175699@cw-ngv.com", aor_data2, false, 0));
+  delete aor_data2; aor_data2 = NULL;
+  std::string small_data;
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", "5102175699@cw-ngv.com", small_data, cas, 0));
+  EXPECT_EQ((char)0x81, small_data[3]);
+
+  std::string incompressible = serialized.substr(0, 4) + "\x01\x7f\x33";
+  EXPECT_EQ(incompressible, connector->compress_record(incompressible));
+
+  // A compressed record that is corrupt reads back as empty.
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  data = connector->compress_record(serialized);
+  data.resize(data.size() - 5);
+  EXPECT_EQ(Store::Status::OK, datastore->set_data("reg", aor_id, data, cas, 300, 0));
+  aor_data2 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+  EXPECT_TRUE(_log.contains("Failed to decompress record"));
+  delete aor_data2; aor_data2 = NULL;
+
+  // A compressed record claiming to be larger than any record could be is
+  // treated as corrupt without trying to allocate space for it.
+  std::string huge = serialized.substr(0, 3);
+  huge += (char)(serialized[3] | RegStore::Connector::COMPRESSED_FLAG);
+  huge += "\xff\xff\xff\xff\xff\xff\xff\xff\x7f";
+  huge += "\x01\x02\x03";
+  EXPECT_FALSE(connector->decompress_record(huge));
+  EXPECT_EQ(Store::Status::OK, datastore->get_data("reg", aor_id, data, cas, 0));
+  EXPECT_EQ(Store::Status::OK, datastore->set_data("reg", aor_id, huge, cas, 300, 0));
+  aor_data2 = store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(0u, aor_data2->bindings().size());
+  EXPECT_TRUE(_log.contains("Compressed record claims to be"));
+  delete aor_data2; aor_data2 = NULL;
+
+  delete aor_data1; aor_data1 = NULL;
+  delete uncompressed_store; uncompressed_store = NULL;
+  delete per_binding_store; per_binding_store = NULL;
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, MultiAoRTests)
+{
+  ChronosConnection* chronos_connection = new FakeChronosConnection();
+  LocalStore* datastore = new LocalStore();
+  RegStore* store = new RegStore(datastore, chronos_connection);
+
+  int now = time(NULL);
+  RegStore::AoR* aor_data1 = build_serialization_aor(now, 1);
+  EXPECT_TRUE(store->set_aor_data("5102175698@cw-ngv.com", aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  aor_data1 = build_serialization_aor(now, 2);
+  EXPECT_TRUE(store->set_aor_data("5102175699@cw-ngv.com", aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+
+  // Read a batch of AoRs, one of which doesn't exist and one of which
+  // appears twice.
+  std::vector<std::string> aor_ids;
+  aor_ids.push_back("5102175698@cw-ngv.com");
+  aor_ids.push_back("5102175699@cw-ngv.com");
+  aor_ids.push_back("5102175700@cw-ngv.com");
+  aor_ids.push_back("5102175698@cw-ngv.com");
+  std::map<std::string, RegStore::AoR*> aor_data;
+  EXPECT_TRUE(store->get_aor_data_multi(aor_ids, aor_data, 0));
+  ASSERT_EQ(3u, aor_data.size());
+  EXPECT_EQ(1u, aor_data["5102175698@cw-ngv.com"]->bindings().size());
+  EXPECT_EQ(2u, aor_data["5102175699@cw-ngv.com"]->bindings().size());
+  EXPECT_EQ(0u, aor_data["5102175700@cw-ngv.com"]->bindings().size());
+
+  // AoRs that have already been read aren't read again.
+  RegStore::AoR* first = aor_data["5102175698@cw-ngv.com"];
+  EXPECT_TRUE(store->get_aor_data_multi(aor_ids, aor_data, 0));
+  EXPECT_EQ(3u, aor_data.size());
+  EXPECT_EQ(first, aor_data["5102175698@cw-ngv.com"]);
+
+  // Change the second AoR in the store, then write the batch back with
+  // all the bindings removed from the first AoR.
+  aor_data1 = store->get_aor_data("5102175699@cw-ngv.com", 0);
+  EXPECT_TRUE(store->set_aor_data("5102175699@cw-ngv.com", aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  first->clear(true);
+
+  std::set<std::string> rejected;
+  std::set<std::string> failed;
+  std::set<std::string> all_bindings_expired;
+  EXPECT_FALSE(store->set_aor_data_multi(aor_data, false, 0, rejected, failed, all_bindings_expired));
+  EXPECT_TRUE(failed.empty());
+  EXPECT_EQ(1u, rejected.size());
+  EXPECT_EQ(1u, rejected.count("5102175699@cw-ngv.com"));
+  EXPECT_EQ(2u, all_bindings_expired.size());
+  EXPECT_EQ(1u, all_bindings_expired.count("5102175698@cw-ngv.com"));
+  EXPECT_EQ(1u, all_bindings_expired.count("5102175700@cw-ngv.com"));
+
+  // Re-read the rejected AoR and retry.  Entries that are NULL are skipped.
+  delete aor_data["5102175699@cw-ngv.com"];
+  aor_data.erase("5102175699@cw-ngv.com");
+  EXPECT_TRUE(store->get_aor_data_multi(aor_ids, aor_data, 0));
+  std::map<std::string, RegStore::AoR*> retry_aor_data;
+  retry_aor_data["5102175699@cw-ngv.com"] = aor_data["5102175699@cw-ngv.com"];
+  retry_aor_data["5102175701@cw-ngv.com"] = NULL;
+  rejected.clear();
+  EXPECT_TRUE(store->set_aor_data_multi(retry_aor_data, false, 0, rejected, failed, all_bindings_expired));
+  EXPECT_TRUE(rejected.empty());
+  EXPECT_TRUE(failed.empty());
+  EXPECT_EQ(2u, all_bindings_expired.size());
+
+  aor_data1 = store->get_aor_data("5102175698@cw-ngv.com", 0);
+  EXPECT_EQ(0u, aor_data1->bindings().size());
+  delete aor_data1; aor_data1 = NULL;
+
+  for (std::map<std::string, RegStore::AoR*>::iterator i = aor_data.begin();
+       i != aor_data.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  delete store; store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
+
+
+TEST_F(RegStoreTest, AoRTimerTests)
+{
+  FakeChronosConnection* chronos_connection = new FakeChronosConnection();
+  chronos_connection->set_result("", HTTP_OK);
+  chronos_connection->set_result("post_identity", HTTP_OK);
+  LocalStore* datastore = new LocalStore();
+  RegStore* binding_timer_store = new RegStore(datastore, chronos_connection);
+  RegStore* aor_timer_store = new RegStore(datastore,
+                                           chronos_connection,
+                                           NULL,
+                                           RegStore::SINGLE_RECORD,
+                                           NULL,
+                                           "reg_store",
+                                           0,
+                                           RegStore::AOR_TIMERS,
+                                           RegStore::BINARY_FORMAT);
+  RegStore* per_binding_store = new RegStore(datastore,
+                                             chronos_connection,
+                                             NULL,
+                                             RegStore::PER_BINDING_RECORDS,
+                                             NULL,
+                                             "reg_store",
+                                             0,
+                                             RegStore::AOR_TIMERS);
+  const std::string aor_id = "5102175698@cw-ngv.com";
+  int now = time(NULL);
+
+  // With per-binding timers, each binding gets a timer.
+  RegStore::AoR* aor_data1 = build_serialization_aor(now, 2);
+  aor_data1->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:0")->_timer_id = "";
+  aor_data1->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1")->_timer_id = "";
+  EXPECT_TRUE(binding_timer_store->set_aor_data(aor_id, aor_data1, true, 0));
+  delete aor_data1; aor_data1 = NULL;
+  aor_data1 = binding_timer_store->get_aor_data(aor_id, 0);
+  EXPECT_EQ("", aor_data1->_timer_id);
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data1->bindings().begin();
+       i != aor_data1->bindings().end();
+       ++i)
+  {
+    EXPECT_EQ("post_identity", i->second->_timer_id);
+  }
+  delete aor_data1; aor_data1 = NULL;
+
+  // Switching to per-AoR timers replaces the binding timers with a single
+  // timer for the AoR, which is held in the record.
+  aor_data1 = aor_timer_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(aor_timer_store->set_aor_data(aor_id, aor_data1, true, 0));
+  delete aor_data1; aor_data1 = NULL;
+  aor_data1 = aor_timer_store->get_aor_data(aor_id, 0);
+  EXPECT_EQ("post_identity", aor_data1->_timer_id);
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data1->bindings().begin();
+       i != aor_data1->bindings().end();
+       ++i)
+  {
+    EXPECT_EQ("", i->second->_timer_id);
+  }
+
+  // Later updates reset the same timer.
+  EXPECT_TRUE(aor_timer_store->set_aor_data(aor_id, aor_data1, true, 0));
+  EXPECT_EQ("put_identity", aor_data1->_timer_id);
+  delete aor_data1; aor_data1 = NULL;
+
+  // The AoR's timer is also held in the index of per-binding records.
+  aor_data1 = per_binding_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(per_binding_store->set_aor_data(aor_id, aor_data1, false, 0));
+  delete aor_data1; aor_data1 = NULL;
+  aor_data1 = per_binding_store->get_aor_data(aor_id, 0);
+  EXPECT_EQ("put_identity", aor_data1->_timer_id);
+  EXPECT_EQ(2u, aor_data1->bindings().size());
+  delete aor_data1; aor_data1 = NULL;
+
+  // Switching back to per-binding timers deletes the AoR's timer.
+  chronos_connection->set_result("put_identity", HTTP_OK);
+  aor_data1 = binding_timer_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(binding_timer_store->set_aor_data(aor_id, aor_data1, true, 0));
+  EXPECT_EQ("", aor_data1->_timer_id);
+  for (RegStore::AoR::Bindings::const_iterator i = aor_data1->bindings().begin();
+       i != aor_data1->bindings().end();
+       ++i)
+  {
+    EXPECT_EQ("post_identity", i->second->_timer_id);
+  }
+  delete aor_data1; aor_data1 = NULL;
+
+  // An AoR with no bindings left has no timer.
+  aor_data1 = aor_timer_store->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(aor_timer_store->set_aor_data(aor_id, aor_data1, true, 0));
+  delete aor_data1; aor_data1 = NULL;
+  aor_data1 = aor_timer_store->get_aor_data(aor_id, 0);
+  EXPECT_EQ("post_identity", aor_data1->_timer_id);
+  aor_data1->clear(true);
+  EXPECT_TRUE(aor_timer_store->set_aor_data(aor_id, aor_data1, true, 0));
+  EXPECT_EQ("", aor_data1->_timer_id);
+  delete aor_data1; aor_data1 = NULL;
+
+  delete per_binding_store; per_binding_store = NULL;
+  delete aor_timer_store; aor_timer_store = NULL;
+  delete binding_timer_store; binding_timer_store = NULL;
+  delete datastore; datastore = NULL;
+  delete chronos_connection; chronos_connection = NULL;
+}
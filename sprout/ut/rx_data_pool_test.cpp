@@ -0,0 +1,230 @@
+/**
+ * @file rx_data_pool_test.cpp UT for the received message clone pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "stack.h"
+#include "pjutils.h"
+#include "rx_data_pool.h"
+
+using namespace std;
+
+/// Fixture for RxDataPoolTest.
+class RxDataPoolTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  RxDataPoolTest() : SipTest(NULL)
+  {
+  }
+
+  ~RxDataPoolTest()
+  {
+  }
+
+  /// Build and parse a received message to clone.
+  pjsip_rx_data* build_message()
+  {
+    string msg = "INVITE sip:6505550231@homedomain SIP/2.0\r\n"
+                 "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+                 "Via: SIP/2.0/TCP 10.114.61.213:5061;branch=z9hG4bK+7f6b263a983ef39b0bbda2135ee454871+sip+1+a64de9f6\r\n"
+                 "Max-Forwards: 68\r\n"
+                 "From: <sip:6505550000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                 "To: <sip:6505550231@homedomain>\r\n"
+                 "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqs\r\n"
+                 "CSeq: 16567 INVITE\r\n"
+                 "Route: <sip:127.0.0.1;transport=TCP;lr>\r\n"
+                 "Record-Route: <sip:10.114.61.213;transport=TCP;lr>\r\n"
+                 "Require: 100rel\r\n"
+                 "Supported: outbound, path\r\n"
+                 "Contact: <sip:6505550000@10.83.18.38:36530;transport=TCP>\r\n"
+                 "Content-Type: application/sdp\r\n"
+                 "Content-Length: 0\r\n"
+                 "\r\n";
+    pjsip_rx_data* rdata = build_rxdata(msg);
+    parse_rxdata(rdata);
+    return rdata;
+  }
+};
+
+TEST_F(RxDataPoolTest, CloneMatchesOriginal)
+{
+  RxDataPool pool(&stack_data.cp.factory, 100, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+
+  pjsip_rx_data* clone;
+  EXPECT_EQ(PJ_SUCCESS, pool.clone(rdata, &clone));
+
+  // The clone has its own copy of the packet and message.
+  EXPECT_NE(rdata->pkt_info.packet, clone->pkt_info.packet);
+  EXPECT_EQ(string(rdata->pkt_info.packet, rdata->pkt_info.len),
+            string(clone->pkt_info.packet, clone->pkt_info.len));
+  EXPECT_NE(rdata->msg_info.msg, clone->msg_info.msg);
+  EXPECT_EQ(rdata->tp_info.transport, clone->tp_info.transport);
+
+  // The header shortcuts point into the cloned message.
+  EXPECT_EQ(PJUtils::pj_str_to_string(&rdata->msg_info.cid->id),
+            PJUtils::pj_str_to_string(&clone->msg_info.cid->id));
+  EXPECT_NE(rdata->msg_info.cid, clone->msg_info.cid);
+  EXPECT_EQ((void*)clone->msg_info.via,
+            pjsip_msg_find_hdr(clone->msg_info.msg, PJSIP_H_VIA, NULL));
+  EXPECT_EQ(16567, clone->msg_info.cseq->cseq);
+  EXPECT_EQ(68, clone->msg_info.max_fwd->ivalue);
+  EXPECT_TRUE(clone->msg_info.from != NULL);
+  EXPECT_TRUE(clone->msg_info.to != NULL);
+  EXPECT_TRUE(clone->msg_info.route != NULL);
+  EXPECT_TRUE(clone->msg_info.record_route != NULL);
+  EXPECT_TRUE(clone->msg_info.ctype != NULL);
+  EXPECT_TRUE(clone->msg_info.clen != NULL);
+  EXPECT_TRUE(clone->msg_info.require != NULL);
+  EXPECT_TRUE(clone->msg_info.supported != NULL);
+
+  EXPECT_EQ(1, pool.in_use());
+  pool.free_cloned(clone);
+  EXPECT_EQ(0, pool.in_use());
+}
+
+TEST_F(RxDataPoolTest, PoolsAreRecycled)
+{
+  RxDataPool pool(&stack_data.cp.factory, 100, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+
+  pjsip_rx_data* clone1;
+  pjsip_rx_data* clone2;
+  pool.clone(rdata, &clone1);
+  pool.clone(rdata, &clone2);
+  EXPECT_EQ(2, pool.high_water_mark());
+
+  // Freeing a clone keeps its pool, which is used for the next clone.
+  pj_pool_t* pj_pool = clone2->tp_info.pool;
+  pool.free_cloned(clone2);
+  pool.clone(rdata, &clone2);
+  EXPECT_EQ(pj_pool, clone2->tp_info.pool);
+  EXPECT_EQ(2, pool.in_use());
+  EXPECT_EQ(2, pool.high_water_mark());
+
+  pool.free_cloned(clone1);
+  pool.free_cloned(clone2);
+  EXPECT_EQ(2, pool.high_water_mark());
+}
+
+TEST_F(RxDataPoolTest, SpillToDepot)
+{
+  RxDataPool pool(&stack_data.cp.factory,
+                  RxDataPool::BATCH_SIZE,
+                  stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+
+  // Freeing enough clones to fill the thread's cache spills a batch of
+  // pools to the depot.
+  std::vector<pjsip_rx_data*> clones(3 * RxDataPool::BATCH_SIZE);
+  for (size_t ii = 0; ii < clones.size(); ++ii)
+  {
+    pool.clone(rdata, &clones[ii]);
+  }
+  for (size_t ii = 0; ii < 2 * RxDataPool::BATCH_SIZE; ++ii)
+  {
+    pool.free_cloned(clones[ii]);
+  }
+  EXPECT_EQ((int)RxDataPool::BATCH_SIZE, pool.depot_size());
+
+  // The depot is now full, so the next batch is released.
+  for (size_t ii = 2 * RxDataPool::BATCH_SIZE; ii < clones.size(); ++ii)
+  {
+    pool.free_cloned(clones[ii]);
+  }
+  EXPECT_EQ((int)RxDataPool::BATCH_SIZE, pool.depot_size());
+
+  // Once the thread's cache is empty it is refilled from the depot.
+  for (size_t ii = 0; ii < 2 * RxDataPool::BATCH_SIZE; ++ii)
+  {
+    pool.clone(rdata, &clones[ii]);
+  }
+  EXPECT_EQ(0, pool.depot_size());
+
+  for (size_t ii = 0; ii < 2 * RxDataPool::BATCH_SIZE; ++ii)
+  {
+    pool.free_cloned(clones[ii]);
+  }
+}
+
+/// Data passed to clone_thread.
+struct CloneThreadData
+{
+  RxDataPool* pool;
+  pjsip_rx_data* rdata;
+};
+
+/// Thread that clones and frees a message using a pool.
+static void* clone_thread(void* p)
+{
+  CloneThreadData* data = (CloneThreadData*)p;
+
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  pj_thread_register("clone_thread", desc, &thread);
+
+  pjsip_rx_data* clone;
+  data->pool->clone(data->rdata, &clone);
+  data->pool->free_cloned(clone);
+  return NULL;
+}
+
+TEST_F(RxDataPoolTest, ThreadExitReturnsCache)
+{
+  RxDataPool pool(&stack_data.cp.factory, 100, stack_data.stats_aggregator);
+  CloneThreadData data = {&pool, build_message()};
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &clone_thread, &data);
+  pthread_join(thread, NULL);
+
+  EXPECT_EQ(1, pool.depot_size());
+}
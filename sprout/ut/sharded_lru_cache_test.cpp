@@ -0,0 +1,134 @@
+/**
+ * @file sharded_lru_cache_test.cpp UT for ShardedLRUCache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "sharded_lru_cache.h"
+
+using namespace std;
+
+/// Fixture for ShardedLRUCacheTest.
+class ShardedLRUCacheTest : public BaseTest
+{
+  ShardedLRUCacheTest()
+  {
+  }
+
+  virtual ~ShardedLRUCacheTest()
+  {
+  }
+};
+
+TEST_F(ShardedLRUCacheTest, GetPutRemove)
+{
+  ShardedLRUCache<std::string> cache(100, 4);
+
+  std::string value;
+  EXPECT_FALSE(cache.get("key1", 1000, false, value));
+
+  EXPECT_FALSE(cache.put("key1", "value1"));
+  EXPECT_TRUE(cache.get("key1", 1000, false, value));
+  EXPECT_EQ("value1", value);
+  EXPECT_EQ(1, cache.size());
+
+  // Replacing an entry returns the old value if asked.
+  std::string replaced;
+  EXPECT_TRUE(cache.put("key1", "value2", &replaced));
+  EXPECT_EQ("value1", replaced);
+  EXPECT_TRUE(cache.get("key1", 1000, false, value));
+  EXPECT_EQ("value2", value);
+  EXPECT_EQ(1, cache.size());
+
+  // As does removing it.
+  std::string removed;
+  EXPECT_TRUE(cache.remove("key1", &removed));
+  EXPECT_EQ("value2", removed);
+  EXPECT_FALSE(cache.remove("key1"));
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(ShardedLRUCacheTest, Expiry)
+{
+  ShardedLRUCache<std::string> cache(100, 4);
+  cache.put("key1", "value1");
+  cache.put("key2", "value2");
+
+  cwtest_advance_time_ms(1001);
+
+  // Old entries are only removed if the caller asks.
+  std::string value;
+  EXPECT_FALSE(cache.get("key1", 1000, false, value));
+  EXPECT_EQ(2, cache.size());
+  EXPECT_TRUE(cache.get("key1", 2000, false, value));
+  EXPECT_FALSE(cache.get("key2", 1000, true, value));
+  EXPECT_EQ(1, cache.size());
+
+  // Putting an entry refreshes it.
+  cache.put("key1", "value1");
+  EXPECT_TRUE(cache.get("key1", 1000, false, value));
+}
+
+TEST_F(ShardedLRUCacheTest, EvictsLeastRecentlyUsed)
+{
+  // With a single shard, the least recently used entry is evicted once the
+  // cache is full.
+  ShardedLRUCache<int> cache(3, 1);
+  cache.put("key1", 1);
+  cache.put("key2", 2);
+  cache.put("key3", 3);
+
+  int value;
+  EXPECT_TRUE(cache.get("key1", 1000, false, value));
+  cache.put("key4", 4);
+  EXPECT_EQ(3, cache.size());
+  EXPECT_FALSE(cache.get("key2", 1000, false, value));
+  EXPECT_TRUE(cache.get("key1", 1000, false, value));
+  EXPECT_EQ(1, value);
+
+  // The maximum is divided between the shards, with at least one entry in
+  // each.
+  ShardedLRUCache<int> sharded(2, 4);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    sharded.put("key" + std::to_string(ii), ii);
+  }
+  EXPECT_EQ(4, sharded.size());
+}
@@ -0,0 +1,156 @@
+/**
+ * @file sharded_worker_pool_test.cpp UT for the sharded worker pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "sharded_worker_pool.h"
+
+using namespace std;
+
+/// Results of the work run by a test, by key.
+struct Results
+{
+  pthread_mutex_t lock;
+  map<string, vector<int> > runs;
+  int deleted;
+};
+
+/// Work that records that it has run.
+class RecordingWork : public ShardedWorkerPool::Work
+{
+public:
+  RecordingWork(Results* results, const string& key, int index) :
+    _results(results), _key(key), _index(index)
+  {}
+
+  ~RecordingWork()
+  {
+    pthread_mutex_lock(&_results->lock);
+    _results->deleted++;
+    pthread_mutex_unlock(&_results->lock);
+  }
+
+  void run()
+  {
+    pthread_mutex_lock(&_results->lock);
+    _results->runs[_key].push_back(_index);
+    pthread_mutex_unlock(&_results->lock);
+  }
+
+private:
+  Results* _results;
+  string _key;
+  int _index;
+};
+
+/// Fixture for ShardedWorkerPoolTest.
+class ShardedWorkerPoolTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  ShardedWorkerPoolTest()
+  {
+    pthread_mutex_init(&_results.lock, NULL);
+    _results.deleted = 0;
+  }
+
+  virtual ~ShardedWorkerPoolTest()
+  {
+    pthread_mutex_destroy(&_results.lock);
+  }
+
+  Results _results;
+};
+
+TEST_F(ShardedWorkerPoolTest, WorkForAKeyRunsInOrder)
+{
+  ShardedWorkerPool* pool = new ShardedWorkerPool("pool-test", 4, 8);
+  EXPECT_EQ(4, pool->num_threads());
+  EXPECT_EQ(pool->shard("key0"), pool->shard("key0"));
+  pool->start();
+
+  // Queue more work than fits on the queues, so submit has to wait.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    for (int jj = 0; jj < 5; ++jj)
+    {
+      string key = "key" + to_string(jj);
+      EXPECT_TRUE(pool->submit(key, new RecordingWork(&_results, key, ii)));
+    }
+  }
+
+  // Deleting the pool waits for the queued work to run.
+  delete pool;
+
+  EXPECT_EQ(500, _results.deleted);
+  ASSERT_EQ(5u, _results.runs.size());
+  for (map<string, vector<int> >::iterator i = _results.runs.begin();
+       i != _results.runs.end();
+       ++i)
+  {
+    ASSERT_EQ(100u, i->second.size());
+    for (int ii = 0; ii < 100; ++ii)
+    {
+      EXPECT_EQ(ii, i->second[ii]);
+    }
+  }
+}
+
+TEST_F(ShardedWorkerPoolTest, UnstartedPoolDeletesWork)
+{
+  ShardedWorkerPool* pool = new ShardedWorkerPool("pool-test", 2, 8);
+  EXPECT_TRUE(pool->submit("key", new RecordingWork(&_results, "key", 0)));
+  delete pool;
+
+  EXPECT_EQ(1, _results.deleted);
+  EXPECT_EQ(0u, _results.runs.size());
+}
@@ -0,0 +1,218 @@
+/**
+ * @file sip_msg_logger_test.cpp UT for asynchronous SIP message logging.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "siptest.hpp"
+#include "stack.h"
+#include "fakelogger.hpp"
+#include "mock_sas.h"
+#include "sproutsasevent.h"
+#include "sip_msg_logger.h"
+
+using namespace std;
+
+/// Fixture for SipMsgLoggerTest.
+class SipMsgLoggerTest : public SipTest
+{
+public:
+  FakeLogger _log;
+
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  SipMsgLoggerTest() : SipTest(NULL)
+  {
+    mock_sas_collect_messages(true);
+  }
+
+  ~SipMsgLoggerTest()
+  {
+    mock_sas_collect_messages(false);
+  }
+
+  /// Build and parse a received message.
+  pjsip_rx_data* build_message()
+  {
+    string msg = "OPTIONS sip:homedomain SIP/2.0\r\n"
+                 "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPjmo1aimuq33BAI4rjhgQgBr4sY5e9kSPI\r\n"
+                 "Max-Forwards: 68\r\n"
+                 "From: <sip:6505550000@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                 "To: <sip:homedomain>\r\n"
+                 "Call-ID: 0gQAAC8WAAACBAAALxYAAAL8P3UbW8l4mT8YBkKGRKc5SOHaJ1gMRqs\r\n"
+                 "CSeq: 16567 OPTIONS\r\n"
+                 "Content-Length: 0\r\n"
+                 "\r\n";
+    pjsip_rx_data* rdata = build_rxdata(msg);
+    parse_rxdata(rdata);
+    return rdata;
+  }
+};
+
+TEST_F(SipMsgLoggerTest, LogReceivedMessage)
+{
+  SipMsgLogger logger(16, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+  set_trail(rdata, 1234);
+
+  logger.log_rx_msg(rdata);
+  logger.flush();
+
+  MockSASMessage* event = mock_sas_find_event(SASEvent::RX_SIP_MSG);
+  ASSERT_TRUE(event != NULL);
+  EXPECT_EQ(string(rdata->msg_info.msg_buf, rdata->msg_info.len),
+            event->var_params[1]);
+}
+
+TEST_F(SipMsgLoggerTest, LogTransmittedMessage)
+{
+  SipMsgLogger logger(16, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+
+  pjsip_tx_data* tdata;
+  pjsip_endpt_create_response(stack_data.endpt, rdata, 200, NULL, &tdata);
+  tdata->tp_info.transport = rdata->tp_info.transport;
+  strcpy(tdata->tp_info.dst_name, "10.83.18.38");
+  tdata->tp_info.dst_port = 36530;
+  pjsip_tx_data_encode(tdata);
+  set_trail(tdata, 1234);
+
+  logger.log_tx_msg(tdata);
+  logger.flush();
+
+  MockSASMessage* event = mock_sas_find_event(SASEvent::TX_SIP_MSG);
+  ASSERT_TRUE(event != NULL);
+  EXPECT_EQ("10.83.18.38", event->var_params[0]);
+
+  pjsip_tx_data_dec_ref(tdata);
+}
+
+TEST_F(SipMsgLoggerTest, MessageWithNoTrail)
+{
+  SipMsgLogger logger(16, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+  set_trail(rdata, 0);
+
+  logger.log_rx_msg(rdata);
+  logger.flush();
+
+  EXPECT_TRUE(mock_sas_find_event(SASEvent::RX_SIP_MSG) == NULL);
+  EXPECT_TRUE(_log.contains("Received message with no SAS trail identifier"));
+}
+
+TEST_F(SipMsgLoggerTest, SampleWhenRingFills)
+{
+  // The ring size is rounded up to 8.
+  SipMsgLogger logger(5, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+  set_trail(rdata, 1234);
+
+  // Stop the logging thread emptying the ring.
+  pthread_mutex_lock(&logger._drain_lock);
+
+  // The first six messages fill the ring to three quarters, then one in
+  // every eight messages is logged until the ring is full.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    logger.log_rx_msg(rdata);
+  }
+
+  SipMsgLogger::Ring* ring = logger.thread_ring();
+  EXPECT_EQ(8u, ring->head - ring->tail);
+
+  pthread_mutex_unlock(&logger._drain_lock);
+  logger.flush();
+  EXPECT_EQ(0u, ring->head - ring->tail);
+}
+
+TEST_F(SipMsgLoggerTest, VerboseDetailsOnlyCopiedWhenLogging)
+{
+  SipMsgLogger logger(16, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+  set_trail(rdata, 1234);
+
+  // Stop the logging thread emptying the ring.
+  pthread_mutex_lock(&logger._drain_lock);
+
+  int log_level = Log::loggingLevel;
+  Log::setLoggingLevel(Log::VERBOSE_LEVEL - 1);
+  logger.log_rx_msg(rdata);
+  Log::setLoggingLevel(Log::VERBOSE_LEVEL);
+  logger.log_rx_msg(rdata);
+  Log::setLoggingLevel(log_level);
+
+  // Only the message and the details SAS needs are copied unless verbose
+  // logging is on.
+  SipMsgLogger::Ring* ring = logger.thread_ring();
+  EXPECT_FALSE(ring->entries[0].verbose);
+  EXPECT_EQ("", ring->entries[0].info);
+  EXPECT_EQ(string(rdata->msg_info.msg_buf, rdata->msg_info.len),
+            ring->entries[0].msg);
+  EXPECT_TRUE(ring->entries[1].verbose);
+  EXPECT_NE("", ring->entries[1].info);
+
+  pthread_mutex_unlock(&logger._drain_lock);
+  logger.flush();
+  EXPECT_TRUE(mock_sas_find_event(SASEvent::RX_SIP_MSG) != NULL);
+}
+
+TEST_F(SipMsgLoggerTest, LoggingThread)
+{
+  SipMsgLogger logger(16, stack_data.stats_aggregator);
+  pjsip_rx_data* rdata = build_message();
+  set_trail(rdata, 1234);
+
+  logger.log_rx_msg(rdata);
+
+  // The logging thread picks the message up without it being flushed.
+  SipMsgLogger::Ring* ring = logger.thread_ring();
+  for (int ii = 0; (ii < 100) && (ring->head != ring->tail); ++ii)
+  {
+    usleep(10000);
+  }
+  EXPECT_EQ(0u, ring->head - ring->tail);
+}
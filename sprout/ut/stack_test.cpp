@@ -46,9 +46,13 @@
 #include "utils.h"
 #include "sas.h"
 #include "stack.h"
+#include "pjutils.h"
+#include "load_monitor.h"
+#include "options.h"
 #include "fakelogger.hpp"
 #include "test_utils.hpp"
 #include "siptest.hpp"
+#include "test_interposer.hpp"
 
 using namespace std;
 
@@ -140,6 +144,15 @@ TEST_F(StackTest, DISABLED_SimpleLifeCycle)
                               NULL,                         // SIPResolver
                               7,                            // #PJsip threads
                               9,                            // #worker threads
+                              0,                            // Max active workers
+                              false,                        // Worker affinity
+                              0,                            // Max queue depth
+                              std::vector<int>(),           // Dispatch weights
+                              -1,                           // Queue deadline
+                              false,                        // Load control by queue wait
+                              std::vector<int>(),           // PJSIP thread CPUs
+                              std::vector<int>(),           // Worker thread CPUs
+                              0,                            // OPTIONS fast path rate
                               1,                            // RR strategy
                               60 * 10,                      // Session refresh interval
                               NULL,                         // Quiescing manager
@@ -171,3 +184,205 @@ TEST_F(StackTest, DISABLED_SimpleLifeCycle)
 
   destroy_stack();
 }
+
+
+/// Methods of the messages that reach the modules above the stack module, in
+/// the order they are processed.  Responses are recorded by status code.
+static std::vector<std::string> processed_msgs;
+
+static pj_bool_t record_rx_request(pjsip_rx_data* rdata)
+{
+  processed_msgs.push_back(PJUtils::pj_str_to_string(&rdata->msg_info.msg->line.req.method.name));
+  return PJ_TRUE;
+}
+
+static pj_bool_t record_rx_response(pjsip_rx_data* rdata)
+{
+  processed_msgs.push_back(std::to_string(rdata->msg_info.msg->line.status.code));
+  return PJ_TRUE;
+}
+
+static pjsip_module mod_recorder =
+{
+  NULL, NULL,                              /* prev, next.          */
+  pj_str("mod-recorder"),                  /* Name.                */
+  -1,                                      /* Id                   */
+  PJSIP_MOD_PRIORITY_TRANSPORT_LAYER + 2,  /* Priority             */
+  NULL,                                    /* load()               */
+  NULL,                                    /* start()              */
+  NULL,                                    /* stop()               */
+  NULL,                                    /* unload()             */
+  &record_rx_request,                      /* on_rx_request()      */
+  &record_rx_response,                     /* on_rx_response()     */
+  NULL,                                    /* on_tx_request()      */
+  NULL,                                    /* on_tx_response()     */
+  NULL,                                    /* on_tsx_state()       */
+};
+
+/// Fixture for tests that drive messages through the receive queue.  No
+/// worker threads are started - the tests take messages off the queue by
+/// hand so they can build up a backlog first.
+class StackQueueTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+    _load_monitor = new LoadMonitor(100000, 20, 10, 10);
+    pjsip_endpt_register_module(stack_data.endpt, &mod_stack);
+    pjsip_endpt_register_module(stack_data.endpt, &mod_recorder);
+  }
+
+  static void TearDownTestCase()
+  {
+    pjsip_endpt_unregister_module(stack_data.endpt, &mod_recorder);
+    pjsip_endpt_unregister_module(stack_data.endpt, &mod_stack);
+    delete _load_monitor; _load_monitor = NULL;
+    SipTest::TearDownTestCase();
+  }
+
+  StackQueueTest() : SipTest(NULL), _queue_created(false)
+  {
+    processed_msgs.clear();
+  }
+
+  ~StackQueueTest()
+  {
+    if (_queue_created)
+    {
+      destroy_rx_msg_queue();
+    }
+  }
+
+  /// Create the receive queue with a single shard, serviced in strict
+  /// priority order.
+  void create_queue(int queue_deadline_ms, int options_fast_path_rate)
+  {
+    init_rx_msg_queue(1,
+                      false,
+                      0,
+                      std::vector<int>(),
+                      queue_deadline_ms,
+                      options_fast_path_rate,
+                      _load_monitor);
+    _queue_created = true;
+  }
+
+  /// Process the specified number of messages from the receive queue.
+  void process_msgs(int count)
+  {
+    for (int ii = 0; ii < count; ++ii)
+    {
+      ASSERT_TRUE(process_next_rx_msg(0));
+    }
+  }
+
+  /// Build a request.  The To header has a tag if the request is in dialog.
+  std::string request(const std::string& method,
+                      const std::string& call_id,
+                      int cseq,
+                      bool in_dialog,
+                      const std::string& domain = "homedomain")
+  {
+    char buf[16384];
+    int n = snprintf(buf, sizeof(buf),
+                     "%1$s sip:6505550231@%5$s SIP/2.0\r\n"
+                     "Via: SIP/2.0/TCP 10.83.18.38:36530;rport;branch=z9hG4bKPj%2$s%3$d\r\n"
+                     "From: <sip:6505550232@homedomain>;tag=10.114.61.213+1+8c8b232a+5fb751cf\r\n"
+                     "To: <sip:6505550231@homedomain>%4$s\r\n"
+                     "Max-Forwards: 68\r\n"
+                     "Call-ID: %2$s\r\n"
+                     "CSeq: %3$d %1$s\r\n"
+                     "Content-Length: 0\r\n\r\n",
+                     /*  1 */ method.c_str(),
+                     /*  2 */ call_id.c_str(),
+                     /*  3 */ cseq,
+                     /*  4 */ in_dialog ? ";tag=1234" : "",
+                     /*  5 */ domain.c_str());
+    EXPECT_LT(n, (int)sizeof(buf));
+    return std::string(buf, n);
+  }
+
+  static LoadMonitor* _load_monitor;
+  bool _queue_created;
+};
+
+LoadMonitor* StackQueueTest::_load_monitor = NULL;
+
+
+// A CANCEL must not overtake the INVITE it cancels, even when there is a
+// backlog of initial requests, or the CANCEL finds no transaction to cancel.
+// In-dialog requests still overtake the backlog.
+TEST_F(StackQueueTest, CancelQueuedBehindInvite)
+{
+  create_queue(0, 0);
+
+  inject_msg(request("INVITE", "backlog1", 1, false));
+  inject_msg(request("INVITE", "backlog2", 1, false));
+  inject_msg(request("INVITE", "cancelled", 1, false));
+  inject_msg(request("CANCEL", "cancelled", 1, false));
+  inject_msg(request("BYE", "established", 2, true));
+  EXPECT_EQ(0u, processed_msgs.size());
+  EXPECT_EQ(0, txdata_count());
+
+  process_msgs(5);
+
+  ASSERT_EQ(5u, processed_msgs.size());
+  EXPECT_EQ("BYE", processed_msgs[0]);
+  EXPECT_EQ("INVITE", processed_msgs[1]);
+  EXPECT_EQ("INVITE", processed_msgs[2]);
+  EXPECT_EQ("INVITE", processed_msgs[3]);
+  EXPECT_EQ("CANCEL", processed_msgs[4]);
+}
+
+
+// An initial request that waits on the queue for longer than the deadline
+// is shed.  On a reliable transport it is rejected with a 503 so the UAC can
+// retry elsewhere, but in-dialog requests are processed however late they
+// are.
+TEST_F(StackQueueTest, StaleInviteShed)
+{
+  create_queue(100, 0);
+
+  inject_msg(request("INVITE", "stale", 1, false));
+  inject_msg(request("BYE", "established", 2, true));
+  cwtest_advance_time_ms(101);
+
+  process_msgs(2);
+
+  ASSERT_EQ(1u, processed_msgs.size());
+  EXPECT_EQ("BYE", processed_msgs[0]);
+
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(503, out->line.status.code);
+  EXPECT_EQ("INVITE", str_pj(PJSIP_MSG_CSEQ_HDR(out)->method.name));
+  free_txdata();
+}
+
+
+// OPTIONS polls for this node are answered on the transport thread, up to
+// the fast path rate.  Any others are queued to the workers as normal.
+TEST_F(StackQueueTest, LocalOptionsFastPath)
+{
+  ASSERT_EQ(PJ_SUCCESS, init_options());
+  create_queue(0, 1);
+
+  inject_msg(request("OPTIONS", "poll1", 1, false, "127.0.0.1"));
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  EXPECT_EQ("OPTIONS", str_pj(PJSIP_MSG_CSEQ_HDR(out)->method.name));
+  free_txdata();
+
+  // OPTIONS for another node, and polls over the rate, are queued.
+  inject_msg(request("OPTIONS", "poll2", 1, false, "not-us.example.org"));
+  inject_msg(request("OPTIONS", "poll3", 1, false, "127.0.0.1"));
+  EXPECT_EQ(0, txdata_count());
+  EXPECT_EQ(0u, processed_msgs.size());
+
+  process_msgs(2);
+  EXPECT_EQ(2u, processed_msgs.size());
+
+  destroy_options();
+}
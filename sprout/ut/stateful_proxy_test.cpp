@@ -362,6 +362,7 @@ public:
     _emerg_reg = emerg_reg_enabled;
     _acr_factory = new ACRFactory();
     pj_status_t ret = init_stateful_proxy(_store,
+                                          NULL,
                                           NULL,
                                           _call_services,
                                           _ifc_handler,
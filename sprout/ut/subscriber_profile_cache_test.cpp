@@ -0,0 +1,154 @@
+/**
+ * @file subscriber_profile_cache_test.cpp UT for the subscriber profile cache.
+ * the local and remote stores.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "test_interposer.hpp"
+#include "subscriber_profile_cache.h"
+
+using namespace std;
+
+/// Fixture for SubscriberProfileCacheTest.
+class SubscriberProfileCacheTest : public BaseTest
+{
+  SubscriberProfileCacheTest()
+  {
+  }
+
+  virtual ~SubscriberProfileCacheTest()
+  {
+  }
+};
+
+TEST_F(SubscriberProfileCacheTest, ServesUntilExpiry)
+{
+  SubscriberProfileCache cache(100, 30000, stack_data.stats_aggregator);
+  EXPECT_EQ(30000, cache.ttl_ms());
+
+  std::string regstate;
+  Ifcs ifcs;
+  std::vector<std::string> uris;
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+
+  std::vector<std::string> associated_uris;
+  associated_uris.push_back("sip:6505550001@homedomain");
+  associated_uris.push_back("tel:6505550001");
+  cache.put("sip:6505550001@homedomain", "REGISTERED", Ifcs(), associated_uris);
+
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::IFCS, regstate, ifcs, uris));
+  EXPECT_EQ("REGISTERED", regstate);
+  EXPECT_EQ(0u, ifcs.size());
+  ASSERT_EQ(2u, uris.size());
+  EXPECT_EQ("tel:6505550001", uris[1]);
+  EXPECT_FALSE(cache.get("sip:6505550002@homedomain", SubscriberProfileCache::ASSOCIATED_URIS, regstate, ifcs, uris));
+
+  // Refreshing the entry replaces the data.
+  cache.put("sip:6505550001@homedomain", "UNREGISTERED", Ifcs(), associated_uris);
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+  EXPECT_EQ("UNREGISTERED", regstate);
+  EXPECT_EQ(1, cache.size());
+
+  // Once the TTL has passed the data must be requested again, and the
+  // expired entry is dropped.
+  cwtest_advance_time_ms(30001);
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(SubscriberProfileCacheTest, InvalidateRemovesAssociatedUris)
+{
+  SubscriberProfileCache cache(100, 30000, stack_data.stats_aggregator);
+
+  std::vector<std::string> associated_uris;
+  associated_uris.push_back("sip:6505550001@homedomain");
+  associated_uris.push_back("tel:6505550001");
+  cache.put("sip:6505550001@homedomain", "REGISTERED", Ifcs(), associated_uris);
+  cache.put("tel:6505550001", "REGISTERED", Ifcs(), associated_uris);
+  cache.put("sip:6505550002@homedomain", "REGISTERED", Ifcs(), std::vector<std::string>());
+  EXPECT_EQ(3, cache.size());
+
+  // Invalidating one of the URIs removes the whole implicit registration set,
+  // but not other subscribers.
+  cache.invalidate("tel:6505550001");
+  cache.invalidate("sip:6505550003@homedomain");
+  EXPECT_EQ(1, cache.size());
+
+  std::string regstate;
+  Ifcs ifcs;
+  std::vector<std::string> uris;
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+  EXPECT_TRUE(cache.get("sip:6505550002@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+}
+
+TEST_F(SubscriberProfileCacheTest, EvictsLeastRecentlyUsed)
+{
+  // A single shard holding two entries.
+  SubscriberProfileCache cache(2, 30000, stack_data.stats_aggregator, 1);
+
+  std::string regstate;
+  Ifcs ifcs;
+  std::vector<std::string> uris;
+  cache.put("sip:6505550001@homedomain", "REGISTERED", Ifcs(), uris);
+  cache.put("sip:6505550002@homedomain", "REGISTERED", Ifcs(), uris);
+
+  // Use the first entry, so the second is the least recently used.
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+  cache.put("sip:6505550003@homedomain", "REGISTERED", Ifcs(), uris);
+  EXPECT_EQ(2, cache.size());
+  EXPECT_TRUE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+  EXPECT_FALSE(cache.get("sip:6505550002@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+  EXPECT_TRUE(cache.get("sip:6505550003@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+}
+
+TEST_F(SubscriberProfileCacheTest, InvalidParameters)
+{
+  // A zero TTL means entries are never served from the cache.
+  SubscriberProfileCache cache(0, -1, stack_data.stats_aggregator, 0);
+  EXPECT_EQ(0, cache.ttl_ms());
+
+  std::string regstate;
+  Ifcs ifcs;
+  std::vector<std::string> uris;
+  cache.put("sip:6505550001@homedomain", "REGISTERED", Ifcs(), uris);
+  EXPECT_EQ(1, cache.size());
+  EXPECT_FALSE(cache.get("sip:6505550001@homedomain", SubscriberProfileCache::REGSTATE, regstate, ifcs, uris));
+}
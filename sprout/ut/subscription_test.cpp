@@ -75,7 +75,7 @@ public:
     delete _analytics->_logger;
     _analytics->_logger = NULL;
     _acr_factory = new ACRFactory();
-    pj_status_t ret = init_subscription(_store, _remote_store, _hss_connection, _acr_factory, _analytics);
+    pj_status_t ret = init_subscription(_store, _remote_store, NULL, _hss_connection, _acr_factory, _analytics, 3, 0);
     ASSERT_EQ(PJ_SUCCESS, ret);
     stack_data.scscf_uri = pj_str("sip:all.the.sprout.nodes:5058;transport=TCP");
 
@@ -518,6 +518,50 @@ TEST_F(SubscriptionTest, NoNotificationsForEmergencyRegistrations)
   check_subscriptions("sip:6505550231@homedomain", 1u);
 }
 
+TEST_F(SubscriptionTest, ExpiredBindingsNotifiedTogether)
+{
+  // Get an initial empty AoR record and add two bindings that expire soon.
+  int now = time(NULL);
+
+  RegStore::AoR* aor_data1 = _store->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+
+  for (int ii = 1; ii <= 2; ++ii)
+  {
+    RegStore::AoR::Binding* b = aor_data1->get_binding("urn:uuid:00000000-0000-0000-0000-b4dd32817622:" + std::to_string(ii));
+    b->_uri = "<sip:6505550231@192.91.191.29:5993" + std::to_string(ii) + ";transport=tcp;ob>";
+    b->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+    b->_cseq = 17038;
+    b->_expires = now + 30 + ii;
+    b->_priority = 0;
+    b->_path_headers.push_back(std::string("<sip:abcdefgh@bono-1.cw-ngv.com;lr>"));
+    b->_emergency_registration = false;
+  }
+
+  _store->set_aor_data(std::string("sip:6505550231@homedomain"), aor_data1, true, 0);
+  delete aor_data1; aor_data1 = NULL;
+
+  SubscribeMessage msg;
+  inject_msg(msg.get());
+  check_OK_and_NOTIFY();
+
+  // Let both bindings expire, then rewrite the AoR.  The subscriber is told
+  // about both bindings in a single NOTIFY.
+  cwtest_advance_time_ms(60000);
+  aor_data1 = _store->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+  _store->set_aor_data(std::string("sip:6505550231@homedomain"), aor_data1, true, 0);
+  delete aor_data1; aor_data1 = NULL;
+
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ("NOTIFY", str_pj(out->line.status.reason));
+  char buf[16384];
+  int n = out->body->print_body(out->body, buf, sizeof(buf));
+  string body(buf, n);
+  EXPECT_THAT(body, HasSubstr("<sip:6505550231@192.91.191.29:59931;transport=tcp;ob>"));
+  EXPECT_THAT(body, HasSubstr("<sip:6505550231@192.91.191.29:59932;transport=tcp;ob>"));
+  inject_msg(respond_to_current_txdata(200));
+}
+
 void SubscriptionTest::check_subscriptions(std::string aor, uint32_t expected)
 {
   // Check that we registered the correct URI (0233, not 0234).
@@ -0,0 +1,182 @@
+/**
+ * @file timer_wheel_test.cpp UT for the hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <map>
+#include "gtest/gtest.h"
+
+#include "timer_wheel.h"
+
+using namespace std;
+
+/// Fixture for TimerWheelTest.
+class TimerWheelTest : public ::testing::Test
+{
+  TimerWheelTest()
+  {
+  }
+
+  virtual ~TimerWheelTest()
+  {
+  }
+};
+
+TEST_F(TimerWheelTest, PopsWhenDue)
+{
+  TimerWheel wheel(10, 1000);
+  wheel.set("a", 1055, "/timers", "A");
+  wheel.set("b", 1020, "/timers", "B");
+  EXPECT_EQ(2u, wheel.size());
+
+  // Timers pop on the first tick at or after they are due.
+  vector<TimerWheel::Timer> pops;
+  wheel.tick(1019, pops);
+  EXPECT_EQ(0u, pops.size());
+  wheel.tick(1020, pops);
+  ASSERT_EQ(1u, pops.size());
+  EXPECT_EQ("b", pops[0].id);
+  EXPECT_EQ("/timers", pops[0].callback_uri);
+  EXPECT_EQ("B", pops[0].opaque);
+  EXPECT_EQ(1020u, pops[0].due_ms);
+
+  pops.clear();
+  wheel.tick(1059, pops);
+  EXPECT_EQ(0u, pops.size());
+  wheel.tick(1060, pops);
+  ASSERT_EQ(1u, pops.size());
+  EXPECT_EQ("a", pops[0].id);
+  EXPECT_EQ(0u, wheel.size());
+}
+
+TEST_F(TimerWheelTest, SetReplacesAndRemoveCancels)
+{
+  TimerWheel wheel(1, 0);
+  wheel.set("a", 100, "/timers", "A1");
+  wheel.set("a", 50, "/timers", "A2");
+  wheel.set("b", 70, "/timers", "B");
+  EXPECT_EQ(2u, wheel.size());
+
+  EXPECT_TRUE(wheel.remove("b"));
+  EXPECT_FALSE(wheel.remove("b"));
+  EXPECT_EQ(1u, wheel.size());
+
+  vector<TimerWheel::Timer> pops;
+  wheel.tick(1000, pops);
+  ASSERT_EQ(1u, pops.size());
+  EXPECT_EQ("A2", pops[0].opaque);
+  EXPECT_EQ(50u, pops[0].due_ms);
+}
+
+TEST_F(TimerWheelTest, OverdueTimersPopOnNextTick)
+{
+  TimerWheel wheel(10, 1000);
+  wheel.set("a", 500, "/timers", "");
+
+  vector<TimerWheel::Timer> pops;
+  wheel.tick(1000, pops);
+  EXPECT_EQ(0u, pops.size());
+  wheel.tick(1010, pops);
+  EXPECT_EQ(1u, pops.size());
+}
+
+TEST_F(TimerWheelTest, LongTimersCascade)
+{
+  // Set timers that land on each of the wheels, including some on slot
+  // boundaries, and check each pops when it is due.
+  TimerWheel wheel(1, 12345);
+  uint64_t dues[] = {12346, 12345 + 255, 12345 + 256, 65536, 65537,
+                     12345 + 70000, 16777216, 16777216 + 257,
+                     12345 + 17000000};
+  int num_dues = sizeof(dues) / sizeof(dues[0]);
+  for (int ii = 0; ii < num_dues; ++ii)
+  {
+    wheel.set(to_string(ii), dues[ii], "/timers", "");
+  }
+
+  // Step through time in large strides, checking every timer has popped by
+  // the end of the stride it is due in and not before.
+  vector<TimerWheel::Timer> pops;
+  uint64_t now = 12345;
+  while (wheel.size() > 0)
+  {
+    uint64_t next = now + 997;
+    pops.clear();
+    wheel.tick(next, pops);
+    for (size_t jj = 0; jj < pops.size(); ++jj)
+    {
+      EXPECT_GT(pops[jj].due_ms, now);
+      EXPECT_LE(pops[jj].due_ms, next);
+    }
+    now = next;
+  }
+}
+
+TEST_F(TimerWheelTest, MatchesReferenceOrdering)
+{
+  // Set a mixture of timers and check the wheel pops them in the same ticks
+  // as a simple ordered map would.
+  TimerWheel wheel(1, 0);
+  multimap<uint64_t, string> reference;
+  uint64_t seed = 1;
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    uint64_t due = 1 + (seed >> 33) % ((ii % 3 == 0) ? 300 : 200000);
+    wheel.set(to_string(ii), due, "/timers", "");
+    reference.insert(make_pair(due, to_string(ii)));
+  }
+
+  vector<TimerWheel::Timer> pops;
+  for (uint64_t now = 0; now <= 200000; now += 50)
+  {
+    pops.clear();
+    wheel.tick(now, pops);
+
+    multimap<uint64_t, string>::iterator end = reference.upper_bound(now);
+    EXPECT_EQ((size_t)distance(reference.begin(), end), pops.size());
+    for (size_t jj = 0; jj < pops.size(); ++jj)
+    {
+      EXPECT_LE(pops[jj].due_ms, now);
+      EXPECT_GT(pops[jj].due_ms + 50, now);
+    }
+    reference.erase(reference.begin(), end);
+  }
+  EXPECT_EQ(0u, wheel.size());
+}
@@ -0,0 +1,133 @@
+/**
+ * @file worker_throttle_test.cpp UT for the worker thread throttle.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+///
+///----------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "worker_throttle.h"
+
+using namespace std;
+
+/// Fixture for WorkerThrottleTest.
+class WorkerThrottleTest : public ::testing::Test
+{
+  WorkerThrottleTest()
+  {
+  }
+
+  virtual ~WorkerThrottleTest()
+  {
+  }
+};
+
+/// Thread that starts and ends a unit of work.
+static void* work_thread(void* p)
+{
+  WorkerThrottle* throttle = (WorkerThrottle*)p;
+  throttle->start_work();
+  throttle->end_work();
+  return NULL;
+}
+
+TEST_F(WorkerThrottleTest, InvalidLimit)
+{
+  WorkerThrottle throttle(0);
+  EXPECT_EQ(1, throttle.max_active());
+}
+
+TEST_F(WorkerThrottleTest, BlockingCallOutsideWork)
+{
+  // A blocking call made by a thread that isn't doing throttled work has no
+  // effect.
+  WorkerThrottle throttle(1);
+  {
+    WorkerThrottle::BlockingCall blocking;
+    EXPECT_EQ(0, throttle.active());
+    EXPECT_EQ(0, throttle.blocked());
+  }
+  EXPECT_EQ(0, throttle.active());
+}
+
+TEST_F(WorkerThrottleTest, BlockingCallReleasesSlot)
+{
+  WorkerThrottle throttle(1);
+  throttle.start_work();
+  EXPECT_EQ(1, throttle.active());
+
+  {
+    WorkerThrottle::BlockingCall blocking;
+    EXPECT_EQ(0, throttle.active());
+    EXPECT_EQ(1, throttle.blocked());
+
+    // Nested blocking calls don't give up the slot again.
+    {
+      WorkerThrottle::BlockingCall nested;
+      EXPECT_EQ(0, throttle.active());
+      EXPECT_EQ(1, throttle.blocked());
+    }
+
+    // While this thread is blocked another thread can do work.
+    pthread_t thread;
+    pthread_create(&thread, NULL, &work_thread, &throttle);
+    pthread_join(thread, NULL);
+  }
+
+  EXPECT_EQ(1, throttle.active());
+  EXPECT_EQ(0, throttle.blocked());
+  throttle.end_work();
+  EXPECT_EQ(0, throttle.active());
+}
+
+TEST_F(WorkerThrottleTest, StartWaitsForSlot)
+{
+  WorkerThrottle throttle(1);
+  throttle.start_work();
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &work_thread, &throttle);
+
+  // The other thread can't start work until this one finishes.
+  usleep(10000);
+  EXPECT_EQ(1, throttle.active());
+  throttle.end_work();
+
+  pthread_join(thread, NULL);
+  EXPECT_EQ(0, throttle.active());
+}
@@ -0,0 +1,143 @@
+/**
+ * @file worker_throttle.cpp Limits the number of worker threads doing CPU work.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "worker_throttle.h"
+
+__thread WorkerThrottle* WorkerThrottle::_current = NULL;
+
+WorkerThrottle::WorkerThrottle(int max_active) :
+  _max_active((max_active > 0) ? max_active : 1),
+  _active(0),
+  _blocked(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+
+WorkerThrottle::~WorkerThrottle()
+{
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void WorkerThrottle::start_work()
+{
+  pthread_mutex_lock(&_lock);
+  while (_active >= _max_active)
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+  ++_active;
+  pthread_mutex_unlock(&_lock);
+
+  _current = this;
+}
+
+
+void WorkerThrottle::end_work()
+{
+  _current = NULL;
+
+  pthread_mutex_lock(&_lock);
+  --_active;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+int WorkerThrottle::active()
+{
+  pthread_mutex_lock(&_lock);
+  int active = _active;
+  pthread_mutex_unlock(&_lock);
+  return active;
+}
+
+
+int WorkerThrottle::blocked()
+{
+  pthread_mutex_lock(&_lock);
+  int blocked = _blocked;
+  pthread_mutex_unlock(&_lock);
+  return blocked;
+}
+
+
+void WorkerThrottle::blocking_start()
+{
+  pthread_mutex_lock(&_lock);
+  --_active;
+  ++_blocked;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void WorkerThrottle::blocking_end()
+{
+  // Take the slot back without waiting - this thread is part way through
+  // processing a message, and holding it up would just hold on to the
+  // transaction and its locks for longer.
+  pthread_mutex_lock(&_lock);
+  --_blocked;
+  ++_active;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+WorkerThrottle::BlockingCall::BlockingCall() :
+  _throttle(WorkerThrottle::_current)
+{
+  if (_throttle != NULL)
+  {
+    // Clear the current throttle while blocked, so that nested blocking
+    // calls don't give up the slot twice.
+    WorkerThrottle::_current = NULL;
+    _throttle->blocking_start();
+  }
+}
+
+
+WorkerThrottle::BlockingCall::~BlockingCall()
+{
+  if (_throttle != NULL)
+  {
+    _throttle->blocking_end();
+    WorkerThrottle::_current = _throttle;
+  }
+}
@@ -47,6 +47,7 @@
 #include "httpconnection.h"
 #include "xdmconnection.h"
 #include "accumulator.h"
+#include "worker_throttle.h"
 
 /// Main constructor.
 XDMConnection::XDMConnection(const std::string& server,
@@ -91,7 +92,11 @@ bool XDMConnection::get_simservs(const std::string& user,
 
   std::string url = "/org.etsi.ngn.simservs/users/" + Utils::url_escape(user) + "/simservs.xml";
 
-  HTTPCode http_code = _http->send_get(url, xml_data, user, trail);
+  HTTPCode http_code;
+  {
+    WorkerThrottle::BlockingCall blocking;
+    http_code = _http->send_get(url, xml_data, user, trail);
+  }
 
   unsigned long latency_us = 0;
   if (stopWatch.read(latency_us))